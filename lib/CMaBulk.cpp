@@ -0,0 +1,339 @@
+#include "lib/CMaBulk.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string_view>
+#include <type_traits>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace vm::cma::bulk {
+
+namespace {
+
+// Portable kernels: plain loops, which the compiler vectorizes for the
+// baseline of the target.
+namespace scalar {
+
+template <typename Word> auto wrap(auto value) -> Word {
+  return static_cast<Word>(static_cast<std::make_unsigned_t<Word>>(value));
+}
+
+template <typename Word> void fill(Word *dest, Word value, int count) {
+  std::fill_n(dest, std::max(count, 0), value);
+}
+
+template <typename Word> auto sum(const Word *cells, int count) -> Word {
+  std::make_unsigned_t<Word> result = 0;
+  for (int i = 0; i < count; ++i) {
+    result += static_cast<std::make_unsigned_t<Word>>(cells[i]);
+  }
+  return wrap<Word>(result);
+}
+
+template <typename Word> auto min(const Word *cells, int count) -> Word {
+  Word result = std::numeric_limits<Word>::max();
+  for (int i = 0; i < count; ++i) {
+    result = std::min(result, cells[i]);
+  }
+  return result;
+}
+
+template <typename Word> auto max(const Word *cells, int count) -> Word {
+  Word result = std::numeric_limits<Word>::min();
+  for (int i = 0; i < count; ++i) {
+    result = std::max(result, cells[i]);
+  }
+  return result;
+}
+
+template <typename Word>
+auto dot(const Word *left, const Word *right, int count) -> Word {
+  using Unsigned = std::make_unsigned_t<Word>;
+  Unsigned result = 0;
+  for (int i = 0; i < count; ++i) {
+    result += static_cast<Unsigned>(left[i]) * static_cast<Unsigned>(right[i]);
+  }
+  return wrap<Word>(result);
+}
+
+template <typename Word>
+auto find(const Word *cells, Word value, int count) -> int {
+  for (int i = 0; i < count; ++i) {
+    if (cells[i] == value) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+template <typename Word>
+auto compare(const Word *left, const Word *right, int count) -> int {
+  for (int i = 0; i < count; ++i) {
+    if (left[i] != right[i]) {
+      return left[i] < right[i] ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+} // namespace scalar
+
+/// The `int` kernels for one instruction set.
+struct Kernels {
+  std::string_view name;
+  void (*fill)(int *, int, int);
+  auto (*sum)(const int *, int) -> int;
+  auto (*min)(const int *, int) -> int;
+  auto (*max)(const int *, int) -> int;
+  auto (*dot)(const int *, const int *, int) -> int;
+  auto (*find)(const int *, int, int) -> int;
+  auto (*compare)(const int *, const int *, int) -> int;
+};
+
+constexpr Kernels portable = {
+    .name = "scalar",
+    .fill = scalar::fill<int>,
+    .sum = scalar::sum<int>,
+    .min = scalar::min<int>,
+    .max = scalar::max<int>,
+    .dot = scalar::dot<int>,
+    .find = scalar::find<int>,
+    .compare = scalar::compare<int>,
+};
+
+#if defined(__x86_64__)
+
+// Eight cells at a time; the remaining cells go to the portable kernels.
+namespace avx2 {
+
+constexpr int lanes = 8;
+
+[[gnu::target("avx2")]] auto load(const int *cells) -> __m256i {
+  return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(cells));
+}
+
+// Combine the eight lanes of a vector into its lowest one. (Lambdas would
+// not inherit the target, so there is one function per operation.)
+[[gnu::target("avx2")]] auto addLanes(__m256i v) -> int {
+  __m128i half =
+      _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+  half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4e));
+  return _mm_cvtsi128_si32(_mm_add_epi32(half, _mm_shuffle_epi32(half, 0xb1)));
+}
+
+[[gnu::target("avx2")]] auto minLanes(__m256i v) -> int {
+  __m128i half =
+      _mm_min_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+  half = _mm_min_epi32(half, _mm_shuffle_epi32(half, 0x4e));
+  return _mm_cvtsi128_si32(_mm_min_epi32(half, _mm_shuffle_epi32(half, 0xb1)));
+}
+
+[[gnu::target("avx2")]] auto maxLanes(__m256i v) -> int {
+  __m128i half =
+      _mm_max_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+  half = _mm_max_epi32(half, _mm_shuffle_epi32(half, 0x4e));
+  return _mm_cvtsi128_si32(_mm_max_epi32(half, _mm_shuffle_epi32(half, 0xb1)));
+}
+
+[[gnu::target("avx2")]] void fill(int *dest, int value, int count) {
+  __m256i v = _mm256_set1_epi32(value);
+  int i = 0;
+  for (; i + lanes <= count; i += lanes) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dest + i), v);
+  }
+  scalar::fill(dest + i, value, count - i);
+}
+
+[[gnu::target("avx2")]] auto sum(const int *cells, int count) -> int {
+  __m256i acc = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + lanes <= count; i += lanes) {
+    acc = _mm256_add_epi32(acc, load(cells + i));
+  }
+  return scalar::wrap<int>(static_cast<unsigned>(addLanes(acc)) +
+                           static_cast<unsigned>(
+                               scalar::sum(cells + i, count - i)));
+}
+
+[[gnu::target("avx2")]] auto min(const int *cells, int count) -> int {
+  __m256i acc = _mm256_set1_epi32(std::numeric_limits<int>::max());
+  int i = 0;
+  for (; i + lanes <= count; i += lanes) {
+    acc = _mm256_min_epi32(acc, load(cells + i));
+  }
+  return std::min(minLanes(acc), scalar::min(cells + i, count - i));
+}
+
+[[gnu::target("avx2")]] auto max(const int *cells, int count) -> int {
+  __m256i acc = _mm256_set1_epi32(std::numeric_limits<int>::min());
+  int i = 0;
+  for (; i + lanes <= count; i += lanes) {
+    acc = _mm256_max_epi32(acc, load(cells + i));
+  }
+  return std::max(maxLanes(acc), scalar::max(cells + i, count - i));
+}
+
+[[gnu::target("avx2")]] auto dot(const int *left, const int *right, int count)
+    -> int {
+  __m256i acc = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + lanes <= count; i += lanes) {
+    acc = _mm256_add_epi32(
+        acc, _mm256_mullo_epi32(load(left + i), load(right + i)));
+  }
+  return scalar::wrap<int>(
+      static_cast<unsigned>(addLanes(acc)) +
+      static_cast<unsigned>(scalar::dot(left + i, right + i, count - i)));
+}
+
+/// A bit for each lane where `a` and `b` are equal.
+[[gnu::target("avx2")]] auto equalLanes(__m256i a, __m256i b) -> unsigned {
+  return static_cast<unsigned>(
+      _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(a, b))));
+}
+
+[[gnu::target("avx2")]] auto find(const int *cells, int value, int count)
+    -> int {
+  __m256i v = _mm256_set1_epi32(value);
+  int i = 0;
+  for (; i + lanes <= count; i += lanes) {
+    unsigned equal = equalLanes(load(cells + i), v);
+    if (equal != 0) {
+      return i + std::countr_zero(equal);
+    }
+  }
+  int rest = scalar::find(cells + i, value, count - i);
+  return rest < 0 ? -1 : i + rest;
+}
+
+[[gnu::target("avx2")]] auto compare(const int *left, const int *right,
+                                     int count) -> int {
+  constexpr unsigned allEqual = (1U << lanes) - 1;
+  int i = 0;
+  for (; i + lanes <= count; i += lanes) {
+    unsigned equal = equalLanes(load(left + i), load(right + i));
+    if (equal != allEqual) {
+      int j = i + std::countr_one(equal);
+      return left[j] < right[j] ? -1 : 1;
+    }
+  }
+  return scalar::compare(left + i, right + i, count - i);
+}
+
+} // namespace avx2
+
+constexpr Kernels withAvx2 = {
+    .name = "avx2",
+    .fill = avx2::fill,
+    .sum = avx2::sum,
+    .min = avx2::min,
+    .max = avx2::max,
+    .dot = avx2::dot,
+    .find = avx2::find,
+    .compare = avx2::compare,
+};
+
+#endif
+
+auto chooseKernels() -> const Kernels & {
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2")) {
+    return withAvx2;
+  }
+#endif
+  return portable;
+}
+
+const Kernels &kernels = chooseKernels();
+
+} // namespace
+
+template <typename Word> void copy(Word *dest, const Word *source, int count) {
+  // The C library picks the widest copy loop for the CPU already.
+  if (count > 0) {
+    std::memmove(dest, source, static_cast<std::size_t>(count) * sizeof(Word));
+  }
+}
+
+template <typename Word> void fill(Word *dest, Word value, int count) {
+  if constexpr (std::is_same_v<Word, int>) {
+    kernels.fill(dest, value, count);
+  } else {
+    scalar::fill(dest, value, count);
+  }
+}
+
+template <typename Word> auto sum(const Word *cells, int count) -> Word {
+  if constexpr (std::is_same_v<Word, int>) {
+    return kernels.sum(cells, count);
+  } else {
+    return scalar::sum(cells, count);
+  }
+}
+
+template <typename Word> auto min(const Word *cells, int count) -> Word {
+  if constexpr (std::is_same_v<Word, int>) {
+    return kernels.min(cells, count);
+  } else {
+    return scalar::min(cells, count);
+  }
+}
+
+template <typename Word> auto max(const Word *cells, int count) -> Word {
+  if constexpr (std::is_same_v<Word, int>) {
+    return kernels.max(cells, count);
+  } else {
+    return scalar::max(cells, count);
+  }
+}
+
+template <typename Word>
+auto dot(const Word *left, const Word *right, int count) -> Word {
+  if constexpr (std::is_same_v<Word, int>) {
+    return kernels.dot(left, right, count);
+  } else {
+    return scalar::dot(left, right, count);
+  }
+}
+
+template <typename Word>
+auto find(const Word *cells, Word value, int count) -> int {
+  if constexpr (std::is_same_v<Word, int>) {
+    return kernels.find(cells, value, count);
+  } else {
+    return scalar::find(cells, value, count);
+  }
+}
+
+template <typename Word>
+auto compare(const Word *left, const Word *right, int count) -> int {
+  if constexpr (std::is_same_v<Word, int>) {
+    return kernels.compare(left, right, count);
+  } else {
+    return scalar::compare(left, right, count);
+  }
+}
+
+auto kernelName() -> std::string_view { return kernels.name; }
+
+#define CMA_BULK_INSTANTIATE(Word)                                             \
+  template void copy(Word *, const Word *, int);                               \
+  template void fill(Word *, Word, int);                                       \
+  template auto sum(const Word *, int) -> Word;                                \
+  template auto min(const Word *, int) -> Word;                                \
+  template auto max(const Word *, int) -> Word;                                \
+  template auto dot(const Word *, const Word *, int) -> Word;                  \
+  template auto find(const Word *, Word, int) -> int;                          \
+  template auto compare(const Word *, const Word *, int) -> int;
+CMA_BULK_INSTANTIATE(int)
+CMA_BULK_INSTANTIATE(std::int64_t)
+#undef CMA_BULK_INSTANTIATE
+
+} // namespace vm::cma::bulk
@@ -0,0 +1,47 @@
+#ifndef TUM_I2_VM_LIB_CMA_BULK
+#define TUM_I2_VM_LIB_CMA_BULK
+
+#include <string_view>
+
+namespace vm::cma::bulk {
+
+// The kernels behind the bulk memory instructions (`copy`, `fill`, `sum`,
+// `min`, `max`, `dot`, `find` and `cmp`), for `int` and `std::int64_t`
+// cells. Counts below one stand for empty ranges; sums and products wrap
+// around like `add` and `mul` on the host.
+//
+// For `int` cells, the kernels use AVX2 where the CPU has it, chosen once at
+// startup, and portable loops everywhere else.
+
+/// Copies `count` cells; the ranges may overlap.
+template <typename Word> void copy(Word *dest, const Word *source, int count);
+
+/// Sets `count` cells to `value`.
+template <typename Word> void fill(Word *dest, Word value, int count);
+
+template <typename Word> auto sum(const Word *cells, int count) -> Word;
+
+/// The smallest cell, or the largest `Word` for an empty range.
+template <typename Word> auto min(const Word *cells, int count) -> Word;
+
+/// The largest cell, or the smallest `Word` for an empty range.
+template <typename Word> auto max(const Word *cells, int count) -> Word;
+
+template <typename Word>
+auto dot(const Word *left, const Word *right, int count) -> Word;
+
+/// The index of the first cell equal to `value`, or -1.
+template <typename Word>
+auto find(const Word *cells, Word value, int count) -> int;
+
+/// -1, 0 or 1 as the first range is lexicographically smaller, equal or
+/// larger than the second.
+template <typename Word>
+auto compare(const Word *left, const Word *right, int count) -> int;
+
+/// The instruction set the `int` kernels use on this CPU, e.g. "avx2".
+auto kernelName() -> std::string_view;
+
+} // namespace vm::cma::bulk
+
+#endif
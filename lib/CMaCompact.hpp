@@ -0,0 +1,74 @@
+#ifndef TUM_I2_VM_LIB_CMA_COMPACT
+#define TUM_I2_VM_LIB_CMA_COMPACT
+
+#include "lib/CMachine.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace vm::cma {
+
+/**
+ * @brief CMa code as a dense byte stream, for `Engine::Compact`.
+ * @details Every instruction is one opcode byte, followed by its argument
+ * if its type has one: a single signed byte if it fits, else four bytes, in
+ * which case the opcode byte has the `wide` bit set. Most instructions take
+ * one or two bytes instead of the eight of an `Instr`.
+ *
+ * Superinstructions are stored as their base type (their other parts still
+ * follow). Static jump targets are byte offsets into the stream, while code
+ * addresses on the stack (from `loadc`, `call` and `jumpi`) stay instruction
+ * indices, as in every other engine; `call` carries the index of the next
+ * instruction as its argument, to push it as the return address. Targets
+ * outside the program lead to a `halt` appended at the end.
+ */
+class CompactCode {
+  std::vector<std::uint8_t> bytes = {};
+  /// The offset of every instruction, and of the final `halt`.
+  std::vector<std::uint32_t> offsets = {};
+
+public:
+  /// Set in the opcode byte if the argument takes four bytes.
+  static constexpr std::uint8_t wide = 0x80;
+  static_assert(Instr::typeCount <= wide, "Opcodes must leave the wide bit");
+
+  explicit CompactCode(std::span<const Instr> instructions);
+
+  /// Whether instructions of type `t` have an argument in the stream.
+  static auto hasArgument(Instr::Type t) -> bool;
+
+  /// The encoded program. A few zero bytes follow the end, so that the
+  /// argument of the last instruction can be read unconditionally.
+  [[nodiscard]] auto data() const -> const std::uint8_t * {
+    return bytes.data();
+  }
+
+  /// The size of the encoded program in bytes, including the final `halt`.
+  [[nodiscard]] auto byteSize() const -> std::size_t {
+    return offsets.back() + 1;
+  }
+
+  /// The number of instructions, without the final `halt`.
+  [[nodiscard]] auto size() const -> std::size_t { return offsets.size() - 1; }
+
+  /// The offset of the instruction at a code address; addresses outside the
+  /// program lead to the final `halt`.
+  [[nodiscard]] auto offsetOf(std::int64_t address) const -> std::uint32_t {
+    bool isInProgram = 0 <= address && static_cast<std::size_t>(address) <
+                                           size();
+    return offsets[isInProgram ? static_cast<std::size_t>(address) : size()];
+  }
+
+  /// The code address of the instruction at `offset`.
+  [[nodiscard]] auto addressOf(std::uint32_t offset) const -> int;
+
+  /// Decodes the instruction at `offset`. Jump targets are code addresses
+  /// again.
+  [[nodiscard]] auto decode(std::uint32_t offset) const -> Instr;
+};
+
+} // namespace vm::cma
+
+#endif
@@ -0,0 +1,183 @@
+#ifndef TUM_I2_VM_LIB_CMA_CONSTANT
+#define TUM_I2_VM_LIB_CMA_CONSTANT
+
+#include "lib/CMaCore.hpp"
+#include "lib/CMaHeap.hpp"
+#include "lib/CMaParser.hpp"
+#include "lib/CMachine.hpp"
+#include "lib/Error.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <vector>
+
+namespace vm::cma {
+
+// CMa programs that are evaluated by the C++ compiler: a program text
+// becomes a `std::array<Instr, N>` with `constantProgram`, and a
+// `ConstantCMa` runs it in constant evaluation, so that a binary that embeds
+// a fixed table or configuration computed by a CMa program neither parses
+// nor runs anything at startup:
+//
+//   constexpr auto program = constantProgram<"loadc 6 loadc 7 mul ...">();
+//   constexpr int answer = [] { return ConstantCMa<>(program).run(); }();
+//
+// Errors in the text and in the program (out of bounds accesses, unknown
+// labels, instructions a `ConstantCMa` does not have) fail the compilation.
+
+/**
+ * @brief The text of a program as a template argument.
+ */
+template <std::size_t Size> struct ProgramText {
+  std::array<char, Size> chars = {};
+
+  // Not explicit: made from string literals.
+  consteval ProgramText(const char (&text)[Size]) {
+    std::ranges::copy(text, chars.begin());
+  }
+
+  [[nodiscard]] constexpr auto view() const -> std::string_view {
+    return {chars.data(), Size - 1};
+  }
+};
+
+/**
+ * @brief Parses a program at compile time, as `CMa::loadInstructions` does
+ * at runtime.
+ * @tparam Text The program as a string literal.
+ */
+template <ProgramText Text> consteval auto constantProgram() {
+  constexpr std::size_t size = ProgramParser(Text.view()).parse().size();
+  std::vector<Instr> instructions = ProgramParser(Text.view()).parse();
+  std::array<Instr, size> program = {};
+  std::ranges::copy(instructions, program.begin());
+  return program;
+}
+
+/**
+ * @brief A CMa whose memory is part of the object, so that it can run in
+ * constant evaluation.
+ * @details It runs the plain instructions with the semantics of
+ * `CMa::execute`, which it shares (see `CMaCore`), one bounds check per
+ * memory access, and `new` and `free` with the same allocator. The stack
+ * grows up from 0 and the heap down from the top. `print`, `debug`,
+ * `spawn`, `join`, `callnative` and breakpoints need a `CMa` at runtime.
+ * Compilers bound the steps of a constant evaluation, so this is for short
+ * programs.
+ * @tparam StackCells The size of the stack region.
+ * @tparam HeapCells The size of the heap region.
+ * @tparam WordType The type of a memory cell.
+ */
+template <std::size_t StackCells = 1024, std::size_t HeapCells = 1024,
+          typename WordType = int>
+class ConstantCMa {
+public:
+  using Word = WordType;
+  static constexpr std::size_t cellCount = StackCells + HeapCells;
+
+private:
+  std::span<const Instr> instructions;
+  int programCounter = 0;
+
+  std::array<Word, cellCount> memory = {};
+  int stackPointer = -1;
+  int framePointer = -1;
+  int extremePointer = -1;
+  int newPointer = static_cast<int>(cellCount) - 1;
+  BasicHeap<Word> heap = BasicHeap<Word>(
+      memory.data(), static_cast<int>(StackCells), static_cast<int>(cellCount));
+
+  friend CMaCore;
+
+  constexpr auto cell(std::int64_t address,
+                      [[maybe_unused]] Access access = Access::Read)
+      -> Word & {
+    if (address < 0 || address >= std::ssize(memory)) [[unlikely]] {
+      dbg_fail("Out of bounds memory access", address, programCounter - 1);
+    }
+    return memory[address];
+  }
+
+  constexpr auto cells(std::int64_t address, Word count,
+                       [[maybe_unused]] Access access = Access::Read)
+      -> Word * {
+    if (count <= 0) {
+      return memory.data();
+    }
+    if (address < 0 || count > std::ssize(memory) - address) [[unlikely]] {
+      dbg_fail("Out of bounds memory access", address, count,
+               programCounter - 1);
+    }
+    return memory.data() + address;
+  }
+
+  /// The stack has no guard pages; like those of the threads of a `CMa`.
+  constexpr void checkStack(int pointer) {
+    if (pointer >= static_cast<int>(StackCells)) [[unlikely]] {
+      dbg_fail("Stack overflow", pointer, programCounter - 1);
+    }
+  }
+
+public:
+  constexpr explicit ConstantCMa(std::span<const Instr> instructions)
+      : instructions{instructions} {}
+
+  // The heap points into the memory of this machine.
+  ConstantCMa(const ConstantCMa &) = delete;
+  auto operator=(const ConstantCMa &) -> ConstantCMa & = delete;
+
+  [[nodiscard]] constexpr auto getMemory() const
+      -> const std::array<Word, cellCount> & {
+    return memory;
+  }
+
+  [[nodiscard]] constexpr auto getHeapStats() const -> const HeapStats & {
+    return heap.getStats();
+  }
+
+  [[nodiscard]] constexpr auto getRegisters() const -> Registers {
+    return {.programCounter = programCounter,
+            .stackPointer = stackPointer,
+            .framePointer = framePointer,
+            .extremePointer = extremePointer,
+            .newPointer = newPointer};
+  }
+
+  /**
+   * @brief Executes a single instruction and advances the program counter.
+   */
+  constexpr void step() {
+    Instr instruction = instructions[programCounter];
+    programCounter += 1;
+    execute(instruction);
+  }
+
+  /**
+   * @brief Runs the program until it ends.
+   * @return The first cell of memory, like `CMa::run`.
+   */
+  constexpr auto run() -> int {
+    while (programCounter < std::ssize(instructions)) {
+      step();
+    }
+    return static_cast<int>(memory[0]);
+  }
+
+  /**
+   * @brief Executes a single instruction, as `CMa::execute` does.
+   */
+  constexpr void execute(Instr instruction) {
+    if (!CMaCore::execute(*this, instruction)) {
+      dbg_fail("Not available in a ConstantCMa", instruction.type,
+               instruction.arg);
+    }
+  }
+};
+
+} // namespace vm::cma
+
+#endif
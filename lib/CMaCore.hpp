@@ -0,0 +1,555 @@
+#ifndef TUM_I2_VM_LIB_CMA_CORE
+#define TUM_I2_VM_LIB_CMA_CORE
+
+#include "lib/CMaBulk.hpp"
+#include "lib/CMaLocality.hpp"
+#include "lib/CMachine.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <type_traits>
+
+namespace vm::cma {
+
+/**
+ * @brief The semantics of the instructions that need nothing but the
+ * registers, the memory and the heap of a machine, shared by `CMa::execute`
+ * and `ConstantCMa`.
+ * @details A machine makes this a friend and has
+ * - the registers `programCounter`, `stackPointer`, `framePointer`,
+ *   `extremePointer` and `newPointer`, and a `heap`,
+ * - `cell(address, access)`, the cell at `address`,
+ * - `cells(address, count, access)`, a pointer to the first of `count`
+ *   cells, and
+ * - `checkStack(pointer)`, which fails if `pointer` is past the stack.
+ *
+ * A machine that runs at runtime also has `print(value)`, `debug()`,
+ * `spawn(function, argument, newPointer)`, `join(thread)`,
+ * `callNative(index, stackPointer, framePointer)` and `trap()`, so that a
+ * single switch dispatches every instruction (see `isRuntime`).
+ *
+ * Arithmetic wraps around on overflow, as in the other engines. In constant
+ * evaluation, the bulk memory instructions run plain loops instead of the
+ * kernels of lib/CMaBulk.hpp, and the atomics plain reads and writes.
+ */
+struct CMaCore {
+  /**
+   * @brief Executes `instruction`, with the program counter already past it.
+   * @return Whether it is one of the instructions here; the machine executes
+   * the others itself.
+   */
+  template <typename Machine, typename Instruction>
+  [[gnu::always_inline]] static constexpr auto execute(Machine &vm,
+                                                       Instruction instruction)
+      -> bool {
+    using Word = typename Machine::Word;
+    // Addresses and code addresses taken from the stack.
+    auto address = [](Word value) { return static_cast<std::int64_t>(value); };
+    auto codeAddress = [](Word value) { return static_cast<int>(value); };
+    auto cell = [&vm](std::int64_t at, Access access = Access::Read)
+        -> Word & { return vm.cell(at, access); };
+    auto cells = [&vm](std::int64_t at, Word count,
+                       Access access = Access::Read) -> Word * {
+      return vm.cells(at, count, access);
+    };
+    int &programCounter = vm.programCounter;
+    int &stackPointer = vm.stackPointer;
+    int &framePointer = vm.framePointer;
+    int &extremePointer = vm.extremePointer;
+    int &newPointer = vm.newPointer;
+
+    // Superinstructions go around again with their first part.
+    for (;;) {
+      switch (instruction.type) {
+      case Instr::Loadc: {
+        stackPointer += 1;
+        cell(stackPointer, Access::Write) = instruction.arg;
+      } break;
+
+      case Instr::Add: {
+        stackPointer -= 1;
+        cell(stackPointer, Access::Write) = static_cast<Word>(
+            wrapping(cell(stackPointer)) + wrapping(cell(stackPointer + 1)));
+      } break;
+
+      case Instr::Sub: {
+        stackPointer -= 1;
+        cell(stackPointer, Access::Write) = static_cast<Word>(
+            wrapping(cell(stackPointer)) - wrapping(cell(stackPointer + 1)));
+      } break;
+
+      case Instr::Mul: {
+        stackPointer -= 1;
+        cell(stackPointer, Access::Write) = static_cast<Word>(
+            wrapping(cell(stackPointer)) * wrapping(cell(stackPointer + 1)));
+      } break;
+
+      case Instr::Div: {
+        stackPointer -= 1;
+        cell(stackPointer, Access::Write) /= cell(stackPointer + 1);
+      } break;
+
+      case Instr::Mod: {
+        stackPointer -= 1;
+        cell(stackPointer, Access::Write) %= cell(stackPointer + 1);
+      } break;
+
+      case Instr::And: {
+        stackPointer -= 1;
+        cell(stackPointer, Access::Write) =
+            cell(stackPointer) && cell(stackPointer + 1);
+      } break;
+
+      case Instr::Or: {
+        stackPointer -= 1;
+        cell(stackPointer, Access::Write) =
+            cell(stackPointer) || cell(stackPointer + 1);
+      } break;
+
+      case Instr::Xor: {
+        stackPointer -= 1;
+        // Weird non-C semantics: logical exclusive or.
+        cell(stackPointer, Access::Write) =
+            (cell(stackPointer) != 0) ^ (cell(stackPointer + 1) != 0);
+      } break;
+
+      case Instr::Eq: {
+        stackPointer -= 1;
+        cell(stackPointer, Access::Write) =
+            cell(stackPointer) == cell(stackPointer + 1);
+      } break;
+
+      case Instr::Neq: {
+        stackPointer -= 1;
+        cell(stackPointer, Access::Write) =
+            cell(stackPointer) != cell(stackPointer + 1);
+      } break;
+
+      case Instr::Gr: {
+        stackPointer -= 1;
+        cell(stackPointer, Access::Write) =
+            cell(stackPointer) > cell(stackPointer + 1);
+      } break;
+
+      case Instr::Geq: {
+        stackPointer -= 1;
+        cell(stackPointer, Access::Write) =
+            cell(stackPointer) >= cell(stackPointer + 1);
+      } break;
+
+      case Instr::Le: {
+        stackPointer -= 1;
+        cell(stackPointer, Access::Write) =
+            cell(stackPointer) < cell(stackPointer + 1);
+      } break;
+
+      case Instr::Leq: {
+        stackPointer -= 1;
+        cell(stackPointer, Access::Write) =
+            cell(stackPointer) <= cell(stackPointer + 1);
+      } break;
+
+      case Instr::Neg: {
+        cell(stackPointer, Access::Write) =
+            static_cast<Word>(-wrapping(cell(stackPointer)));
+      } break;
+
+      case Instr::Not: {
+        cell(stackPointer, Access::Write) = !cell(stackPointer);
+      } break;
+
+      case Instr::Load: {
+        std::int64_t source = address(cell(stackPointer));
+        int count = static_cast<int>(instruction.arg);
+        for (int i = 0; i < count; ++i) {
+          cell(stackPointer + i, Access::Write) = cell(source + i);
+        }
+        stackPointer += count - 1;
+      } break;
+
+      case Instr::Store: {
+        std::int64_t dest = address(cell(stackPointer));
+        int count = static_cast<int>(instruction.arg);
+        for (int i = 0; i < count; ++i) {
+          cell(dest + i, Access::Write) = cell(stackPointer - count + i);
+        }
+        stackPointer -= 1;
+      } break;
+
+      case Instr::Loada: {
+        stackPointer += 1;
+        cell(stackPointer, Access::Write) = cell(instruction.arg);
+      } break;
+
+      case Instr::Storea: {
+        cell(instruction.arg, Access::Write) = cell(stackPointer);
+      } break;
+
+      case Instr::Pop: {
+        stackPointer -= instruction.arg;
+      } break;
+
+      case Instr::Dup: {
+        stackPointer += 1;
+        cell(stackPointer, Access::Write) = cell(stackPointer - 1);
+      } break;
+
+      case Instr::Jump: {
+        programCounter = instruction.arg;
+      } break;
+
+      case Instr::Jumpz: {
+        if (cell(stackPointer) == 0) {
+          programCounter = instruction.arg;
+        }
+        stackPointer -= 1;
+      } break;
+
+      case Instr::Jumpi: {
+        programCounter = instruction.arg + codeAddress(cell(stackPointer));
+        stackPointer -= 1;
+      } break;
+
+      case Instr::Alloc: {
+        // Moves the stack pointer without touching memory, so it could jump
+        // over the guard pages.
+        stackPointer += instruction.arg;
+        vm.checkStack(stackPointer);
+      } break;
+
+      case Instr::New: {
+        cell(stackPointer, Access::Write) =
+            vm.heap.allocate(newPointer, cell(stackPointer));
+      } break;
+
+      case Instr::Free: {
+        vm.heap.release(newPointer, cell(stackPointer));
+        stackPointer--;
+      } break;
+
+      case Instr::Mark: {
+        cell(stackPointer + 1, Access::Write) = extremePointer;
+        cell(stackPointer + 2, Access::Write) = framePointer;
+        stackPointer += 2;
+      } break;
+
+      case Instr::Call: {
+        int returnAddr = codeAddress(cell(stackPointer));
+        cell(stackPointer, Access::Write) = programCounter;
+        framePointer = stackPointer;
+        programCounter = returnAddr;
+      } break;
+
+      case Instr::Slide: {
+        Word returnValue = cell(stackPointer);
+        stackPointer -= instruction.arg;
+        cell(stackPointer, Access::Write) = returnValue;
+      } break;
+
+      case Instr::Enter: {
+        // Only the stack of the main thread has guard pages; those of spawned
+        // threads are blocks of the heap, next to other blocks.
+        extremePointer = stackPointer + instruction.arg;
+        vm.checkStack(extremePointer);
+      } break;
+
+      case Instr::Loadrc: {
+        stackPointer += 1;
+        cell(stackPointer, Access::Write) = framePointer + instruction.arg;
+      } break;
+
+      case Instr::Loadr: {
+        int addr = framePointer + instruction.arg;
+        stackPointer += 1;
+        cell(stackPointer, Access::Write) = cell(addr);
+      } break;
+
+      case Instr::Storer: {
+        int addr = framePointer + instruction.arg;
+        cell(addr, Access::Write) = cell(stackPointer);
+      } break;
+
+      case Instr::Return: {
+        programCounter = codeAddress(cell(framePointer));
+        extremePointer = codeAddress(cell(framePointer - 2));
+        stackPointer = framePointer - 3;
+        framePointer = codeAddress(cell(stackPointer + 2));
+      } break;
+
+      case Instr::TailCall: {
+        int target = codeAddress(cell(stackPointer));
+        // The arguments replace those of the current frame, whose saved
+        // registers stay: the callee returns to our caller.
+        int count = static_cast<int>(instruction.arg);
+        for (int i = 1; i <= count; ++i) {
+          cell(framePointer - 3 - count + i, Access::Write) =
+              cell(stackPointer - 1 - count + i);
+        }
+        stackPointer = framePointer;
+        programCounter = target;
+      } break;
+
+      case Instr::Copy: {
+        Word count = cell(stackPointer);
+        Word *source = cells(address(cell(stackPointer - 1)), count);
+        Word *dest =
+            cells(address(cell(stackPointer - 2)), count, Access::Write);
+        if consteval {
+          if (dest < source) {
+            std::copy(source, source + std::max(count, Word{0}), dest);
+          } else {
+            std::copy_backward(source, source + std::max(count, Word{0}),
+                               dest + std::max(count, Word{0}));
+          }
+        } else {
+          bulk::copy(dest, source, static_cast<int>(count));
+        }
+        stackPointer -= 3;
+      } break;
+
+      case Instr::Fill: {
+        Word count = cell(stackPointer);
+        Word *dest =
+            cells(address(cell(stackPointer - 2)), count, Access::Write);
+        Word value = cell(stackPointer - 1);
+        if consteval {
+          std::fill(dest, dest + std::max(count, Word{0}), value);
+        } else {
+          bulk::fill(dest, value, static_cast<int>(count));
+        }
+        stackPointer -= 3;
+      } break;
+
+      case Instr::Sum:
+      case Instr::Min:
+      case Instr::Max: {
+        auto count = static_cast<int>(cell(stackPointer));
+        Word *range = cells(address(cell(stackPointer - 1)), count);
+        stackPointer -= 1;
+        Word result = 0;
+        if consteval {
+          if (instruction.type == Instr::Min) {
+            result = std::numeric_limits<Word>::max();
+          } else if (instruction.type == Instr::Max) {
+            result = std::numeric_limits<Word>::min();
+          }
+          for (Word value : std::span(range, std::max(count, 0))) {
+            result = instruction.type == Instr::Sum
+                         ? static_cast<Word>(wrapping(result) + wrapping(value))
+                     : instruction.type == Instr::Min ? std::min(result, value)
+                                                      : std::max(result, value);
+          }
+        } else {
+          result = instruction.type == Instr::Sum   ? bulk::sum(range, count)
+                   : instruction.type == Instr::Min ? bulk::min(range, count)
+                                                    : bulk::max(range, count);
+        }
+        cell(stackPointer, Access::Write) = result;
+      } break;
+
+      case Instr::Dot:
+      case Instr::Cmp: {
+        auto count = static_cast<int>(cell(stackPointer));
+        Word *right = cells(address(cell(stackPointer - 1)), count);
+        Word *left = cells(address(cell(stackPointer - 2)), count);
+        stackPointer -= 2;
+        Word result = 0;
+        if consteval {
+          for (int i = 0; i < count && instruction.type == Instr::Dot; ++i) {
+            result = static_cast<Word>(wrapping(result) +
+                                       wrapping(left[i]) * wrapping(right[i]));
+          }
+          for (int i = 0; i < count && instruction.type == Instr::Cmp; ++i) {
+            if (left[i] != right[i]) {
+              result = left[i] < right[i] ? -1 : 1;
+              break;
+            }
+          }
+        } else {
+          result = instruction.type == Instr::Dot
+                       ? bulk::dot(left, right, count)
+                       : bulk::compare(left, right, count);
+        }
+        cell(stackPointer, Access::Write) = result;
+      } break;
+
+      case Instr::Find: {
+        auto count = static_cast<int>(cell(stackPointer));
+        Word *range = cells(address(cell(stackPointer - 2)), count);
+        Word value = cell(stackPointer - 1);
+        stackPointer -= 2;
+        Word result = -1;
+        if consteval {
+          for (int i = 0; i < count; ++i) {
+            if (range[i] == value) {
+              result = i;
+              break;
+            }
+          }
+        } else {
+          result = bulk::find(range, value, count);
+        }
+        cell(stackPointer, Access::Write) = result;
+      } break;
+
+      case Instr::Cas: {
+        Word desired = cell(stackPointer);
+        Word expected = cell(stackPointer - 1);
+        stackPointer -= 2;
+        Word &target = cell(address(cell(stackPointer)), Access::Write);
+        if consteval {
+          // A single thread.
+          Word old = target;
+          if (old == expected) {
+            target = desired;
+          }
+          expected = old;
+        } else {
+          std::atomic_ref<Word>(target).compare_exchange_strong(expected,
+                                                                desired);
+        }
+        // On failure, `expected` is what was there instead.
+        cell(stackPointer, Access::Write) = expected;
+      } break;
+
+      case Instr::FetchAdd: {
+        Word value = cell(stackPointer);
+        stackPointer -= 1;
+        Word &target = cell(address(cell(stackPointer)), Access::Write);
+        Word old = 0;
+        if consteval {
+          old = target;
+          target = static_cast<Word>(wrapping(old) + wrapping(value));
+        } else {
+          old = std::atomic_ref<Word>(target).fetch_add(value);
+        }
+        cell(stackPointer, Access::Write) = old;
+      } break;
+
+      case Instr::Halt: {
+        programCounter = std::numeric_limits<int>::max();
+      } break;
+
+      case Instr::Print: {
+        if constexpr (!isRuntime<Machine>) {
+          return false;
+        } else {
+          Word x = cell(stackPointer);
+          stackPointer -= 1;
+          vm.print(x);
+        }
+      } break;
+
+      case Instr::Debug: {
+        if constexpr (!isRuntime<Machine>) {
+          return false;
+        } else {
+          vm.debug();
+        }
+      } break;
+
+      case Instr::Spawn: {
+        if constexpr (!isRuntime<Machine>) {
+          return false;
+        } else {
+          Word function = cell(stackPointer);
+          stackPointer -= 1;
+          cell(stackPointer, Access::Write) =
+              vm.spawn(function, cell(stackPointer), newPointer);
+        }
+      } break;
+
+      case Instr::Join: {
+        if constexpr (!isRuntime<Machine>) {
+          return false;
+        } else {
+          cell(stackPointer, Access::Write) = vm.join(cell(stackPointer));
+        }
+      } break;
+
+      case Instr::CallNative: {
+        if constexpr (!isRuntime<Machine>) {
+          return false;
+        } else {
+          vm.callNative(instruction.arg, stackPointer, framePointer);
+        }
+      } break;
+
+      case Instr::Trap: {
+        if constexpr (!isRuntime<Machine>) {
+          return false;
+        } else {
+          vm.trap();
+        }
+      } break;
+
+#define CMA_SUPERINSTRUCTION(name, ...) case Instr::name:
+#include "lib/CMaSuperinstructions.inc"
+#undef CMA_SUPERINSTRUCTION
+        // The other parts follow in the next slots.
+        instruction.type = Instr::baseType(instruction.type);
+        continue;
+
+#define CMA_QUICKENED(name, base, arg)                                         \
+    case Instr::name: executeQuickened<Instr::base, arg>(vm); break;
+#include "lib/CMaQuickened.inc"
+#undef CMA_QUICKENED
+
+      default: return false;
+      }
+      return true;
+    }
+  }
+
+  /// Whether `Machine` has the instructions that only run at runtime.
+  template <typename Machine>
+  static constexpr bool isRuntime = requires(Machine &vm) { vm.trap(); };
+
+private:
+  /**
+   * @brief Executes the quickened form of `T` with the argument `Arg`, as
+   * `execute` does `T`, but with loops of a known count.
+   */
+  template <Instr::Type T, int Arg, typename Machine>
+  static constexpr void executeQuickened(Machine &vm) {
+    int &stackPointer = vm.stackPointer;
+    int &framePointer = vm.framePointer;
+    auto cell = [&vm](std::int64_t at, Access access = Access::Read)
+        -> auto & { return vm.cell(at, access); };
+    if constexpr (T == Instr::Load) {
+      auto source = static_cast<std::int64_t>(cell(stackPointer));
+      for (int i = 0; i < Arg; ++i) {
+        cell(stackPointer + i, Access::Write) = cell(source + i);
+      }
+      stackPointer += Arg - 1;
+    } else if constexpr (T == Instr::Store) {
+      auto dest = static_cast<std::int64_t>(cell(stackPointer));
+      for (int i = 0; i < Arg; ++i) {
+        cell(dest + i, Access::Write) = cell(stackPointer - Arg + i);
+      }
+      stackPointer -= 1;
+    } else if constexpr (T == Instr::Pop) {
+      stackPointer -= Arg;
+    } else if constexpr (T == Instr::Loadr) {
+      stackPointer += 1;
+      cell(stackPointer, Access::Write) = cell(framePointer + Arg);
+    } else if constexpr (T == Instr::Storer) {
+      cell(framePointer + Arg, Access::Write) = cell(stackPointer);
+    } else {
+      static_assert(T != T, "No quickened form of this instruction");
+    }
+  }
+
+  /// Unsigned, so that overflow wraps as on the host rather than being
+  /// undefined, which constant evaluation rejects.
+  template <typename Word> static constexpr auto wrapping(Word value) {
+    return static_cast<std::make_unsigned_t<Word>>(value);
+  }
+};
+
+} // namespace vm::cma
+
+#endif
@@ -0,0 +1,23 @@
+#include "lib/CMaHeap.hpp"
+#include "lib/Error.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <print>
+
+namespace vm::cma {
+
+void HeapStats::print(FILE *out) const {
+  std::println(out, "Heap: {} live blocks, {} live bytes (peak {})",
+               liveBlocks, liveBytes, peakLiveBytes);
+  std::println(out,
+               "      {} bytes used, {} bytes free ({:.1f}% fragmentation)",
+               usedBytes(), freeBytes, 100.0 * fragmentation());
+}
+
+void HeapClasses::invalidFree(std::int64_t address) {
+  dbg_fail("free of an address that new did not return or that is free",
+           address);
+}
+
+} // namespace vm::cma
@@ -0,0 +1,293 @@
+#ifndef TUM_I2_VM_LIB_CMA_HEAP
+#define TUM_I2_VM_LIB_CMA_HEAP
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+namespace vm::cma {
+
+/**
+ * @brief Counters of a `Heap`, in bytes of CMa memory.
+ */
+struct HeapStats {
+  /// Blocks allocated by `new` and not yet freed.
+  std::size_t liveBlocks = 0;
+  /// Size of the live blocks, including their headers and rounding.
+  std::size_t liveBytes = 0;
+  /// Size of the freed blocks that wait in a free list for reuse.
+  std::size_t freeBytes = 0;
+  /// The highest `liveBytes` so far.
+  std::size_t peakLiveBytes = 0;
+
+  /// Memory taken from the heap region so far; it is never given back.
+  [[nodiscard]] auto usedBytes() const -> std::size_t {
+    return liveBytes + freeBytes;
+  }
+
+  /// The share of the used memory that sits unused in free lists.
+  [[nodiscard]] auto fragmentation() const -> double {
+    std::size_t used = usedBytes();
+    return used == 0
+               ? 0.0
+               : static_cast<double>(freeBytes) / static_cast<double>(used);
+  }
+
+  void print(FILE *out) const;
+};
+
+/**
+ * @brief The size classes of a `BasicHeap`, independent of its word type.
+ */
+class HeapClasses {
+public:
+  static constexpr int smallCells = 32;
+  /// Blocks are at most 2^`maxLog` cells.
+  static constexpr int maxLog = 30;
+  static constexpr int classCount =
+      smallCells + 1 + maxLog - std::bit_width(unsigned{smallCells - 1});
+
+protected:
+  /// The size in cells of the block for `size` cells of payload, or 0 if
+  /// there is none.
+  template <typename Word>
+  static constexpr auto blockCells(Word size) -> int {
+    if (size < 0 || size >= (Word{1} << maxLog)) {
+      return 0;
+    }
+    // At least one cell for the link while the block is free.
+    int cells = size < 1 ? 2 : static_cast<int>(size) + 1;
+    if (cells <= smallCells) {
+      return cells;
+    }
+    return static_cast<int>(std::bit_ceil(static_cast<unsigned>(cells)));
+  }
+
+  static constexpr auto classOf(int cells) -> int {
+    if (cells <= smallCells) {
+      return cells;
+    }
+    return smallCells + std::bit_width(static_cast<unsigned>(cells - 1)) -
+           std::bit_width(unsigned{smallCells - 1});
+  }
+
+  /// Fails with a message: `address` was not returned by `new` or is free.
+  [[noreturn]] static void invalidFree(std::int64_t address);
+};
+
+/**
+ * @brief The allocator behind `new` and `free`, living in the heap region of
+ * the CMa memory.
+ * @details Every block starts with a header cell that holds its size in
+ * cells (negated while the block is free); `new` returns the address after
+ * the header. Blocks of up to `smallCells` cells have a size class of their
+ * own, larger blocks are rounded up to a power of two. Each class has a free
+ * list, linked through the first cell after the header, so that both `new`
+ * and `free` are O(1). Only when its list is empty does `new` take fresh
+ * memory from the new pointer, which grows down from the top as before.
+ * Blocks are neither split nor coalesced. A bitmap outside of the memory
+ * marks the headers of the live blocks, so that `free` rejects any address
+ * that `new` did not return or that is already free, whatever the program
+ * wrote into the heap.
+ *
+ * Once `share` was called, e.g. because the program started a thread, both
+ * take a lock, and the threads share one new pointer. Until then, both work
+ * in constant evaluation too.
+ */
+template <typename Word> class BasicHeap : public HeapClasses {
+  Word *memory;
+  /// The addresses blocks may occupy.
+  int start;
+  int end;
+  /// The lowest address of a free block of each class, or 0.
+  std::array<int, classCount> freeLists = {};
+  /// One bit for each header of a live block, counted down from `end` so
+  /// that it grows with the heap.
+  std::vector<std::uint64_t> liveHeaders = {};
+  HeapStats stats = {};
+  bool isShared = false;
+  std::mutex mutex = {};
+  /// The new pointer of all threads, while shared.
+  int sharedNewPointer = 0;
+
+  static constexpr auto bytesOf(int cells) -> std::size_t {
+    return static_cast<std::size_t>(cells) * sizeof(Word);
+  }
+
+  [[nodiscard]] constexpr auto isLive(int block) const -> bool {
+    auto bit = static_cast<std::size_t>(end - 1 - block);
+    return bit / 64 < liveHeaders.size() &&
+           ((liveHeaders[bit / 64] >> (bit % 64)) & 1) != 0;
+  }
+
+  constexpr void setLive(int block, bool isLive) {
+    auto bit = static_cast<std::size_t>(end - 1 - block);
+    if (bit / 64 >= liveHeaders.size()) {
+      liveHeaders.resize(bit / 64 + 1);
+    }
+    std::uint64_t mask = std::uint64_t{1} << (bit % 64);
+    liveHeaders[bit / 64] =
+        isLive ? liveHeaders[bit / 64] | mask : liveHeaders[bit / 64] & ~mask;
+  }
+
+public:
+  constexpr BasicHeap(Word *memory, int start, int end)
+      : memory{memory}, start{start}, end{end} {}
+
+  /**
+   * @brief Makes `allocate` and `release` safe to call from several threads.
+   * @param newPointer The new pointer of the only thread so far.
+   */
+  void share(int newPointer) {
+    if (!isShared) {
+      sharedNewPointer = newPointer;
+      isShared = true;
+    }
+  }
+
+  /**
+   * @brief Allocates `size` cells.
+   * @param newPointer The new pointer of the machine, lowered if the block
+   * is taken from fresh memory.
+   * @return The address of the first cell, or 0 if the heap is exhausted.
+   */
+  constexpr auto allocate(int &newPointer, Word size) -> int {
+    if (isShared) [[unlikely]] {
+      std::scoped_lock lock(mutex);
+      int block = allocateBlock(sharedNewPointer, size);
+      newPointer = sharedNewPointer;
+      return block;
+    }
+    return allocateBlock(newPointer, size);
+  }
+
+  /**
+   * @brief Returns a block to its free list; `free 0` does nothing.
+   * @param newPointer The new pointer of the machine, for validation.
+   * @param address An address returned by `allocate`.
+   */
+  constexpr void release(int newPointer, Word address) {
+    if (isShared) [[unlikely]] {
+      std::scoped_lock lock(mutex);
+      releaseBlock(sharedNewPointer, address);
+      return;
+    }
+    releaseBlock(newPointer, address);
+  }
+
+  [[nodiscard]] constexpr auto getStats() const -> const HeapStats & {
+    return stats;
+  }
+
+  /// What the heap keeps outside of the memory, e.g. for a checkpoint.
+  struct State {
+    std::array<int, classCount> freeLists;
+    HeapStats stats;
+  };
+
+  [[nodiscard]] auto getState() const -> State {
+    return {.freeLists = freeLists, .stats = stats};
+  }
+
+  /**
+   * @brief Continues with the blocks of another heap, whose cells were
+   * copied.
+   * @param newPointer The new pointer of the other heap: the blocks lie
+   * next to each other from there up to the cell below `end`, where the new
+   * pointer starts.
+   */
+  void setState(const State &state, int newPointer) {
+    freeLists = state.freeLists;
+    stats = state.stats;
+    liveHeaders.clear();
+    for (int block = newPointer; block < end - 1;) {
+      auto cells = static_cast<int>(memory[block] < 0 ? -memory[block]
+                                                      : memory[block]);
+      if (cells < 2 || cells > end - 1 - block) {
+        invalidFree(block + 1);
+      }
+      if (memory[block] > 0) {
+        setLive(block, true);
+      }
+      block += cells;
+    }
+  }
+
+  /**
+   * @brief The lowest address any block was taken from: memory is never
+   * given back, so this is the high-water mark of the heap.
+   * @param newPointer The new pointer of the machine.
+   */
+  [[nodiscard]] auto lowestBlock(int newPointer) const -> int {
+    return isShared ? sharedNewPointer : newPointer;
+  }
+
+  /**
+   * @brief Forgets all blocks, for a machine that starts over; the caller
+   * resets the new pointer and clears the memory.
+   */
+  void reset() {
+    freeLists = {};
+    liveHeaders.clear();
+    stats = {};
+    isShared = false;
+    sharedNewPointer = 0;
+  }
+
+private:
+  constexpr auto allocateBlock(int &newPointer, Word size) -> int {
+    int cells = blockCells(size);
+    if (cells == 0) {
+      return 0;
+    }
+    int sizeClass = classOf(cells);
+    int block = freeLists[sizeClass];
+    if (block != 0) {
+      freeLists[sizeClass] = static_cast<int>(memory[block + 1]);
+      stats.freeBytes -= bytesOf(cells);
+    } else {
+      if (newPointer - cells < start) {
+        return 0;
+      }
+      newPointer -= cells;
+      block = newPointer;
+    }
+    memory[block] = cells;
+    setLive(block, true);
+    stats.liveBlocks += 1;
+    stats.liveBytes += bytesOf(cells);
+    stats.peakLiveBytes = std::max(stats.peakLiveBytes, stats.liveBytes);
+    return block + 1;
+  }
+
+  constexpr void releaseBlock(int newPointer, Word address) {
+    if (address == 0) {
+      return;
+    }
+    Word block = address - 1;
+    if (block < newPointer || block < start || block >= end ||
+        !isLive(static_cast<int>(block))) {
+      invalidFree(address);
+    }
+    auto cells = static_cast<int>(memory[block]);
+    int sizeClass = classOf(cells);
+    memory[block] = -cells;
+    setLive(static_cast<int>(block), false);
+    memory[address] = freeLists[sizeClass];
+    freeLists[sizeClass] = static_cast<int>(block);
+    stats.liveBlocks -= 1;
+    stats.liveBytes -= bytesOf(cells);
+    stats.freeBytes += bytesOf(cells);
+  }
+};
+
+using Heap = BasicHeap<int>;
+
+} // namespace vm::cma
+
+#endif
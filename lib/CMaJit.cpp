@@ -0,0 +1,718 @@
+#include "lib/CMachine.hpp"
+#include "lib/Error.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <limits>
+#include <span>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <sys/mman.h>
+#endif
+
+// A baseline template JIT for the CMa on x86-64.
+//
+// Every instruction is translated on its own into a fixed sequence of machine
+// code. The machine state lives in callee-saved registers:
+//
+//   rbx  base address of `memory`
+//   r12  stack pointer (as a sign-extended cell index)
+//   r13  frame pointer (as a sign-extended cell index)
+//   r14  the `JitContext`, which holds EP, NP and the spilled registers
+//   r15  the table of native addresses of all instructions
+//
+// Static jumps become native jumps. `call`, `return` and `jumpi` compute their
+// target at runtime and jump through the table. Instructions that need the
+// C++ runtime (`print`, `debug`, `new`, `load`/`store` of more than one cell
+// and an `alloc` or `enter` that overflows the stack) spill the registers
+// into the context and call `CMa::execute` for that single instruction.
+
+namespace vm::cma {
+
+#if defined(__x86_64__)
+
+namespace {
+
+struct JitContext {
+  std::int64_t stackPointer;
+  std::int64_t framePointer;
+  std::int32_t extremePointer;
+  std::int32_t newPointer;
+  std::int32_t programCounter;
+  CMa *virtualMachine;
+  const Instr *instructions;
+  const void *const *addresses;
+};
+
+enum Reg : std::uint8_t {
+  Rax = 0,
+  Rcx = 1,
+  Rdx = 2,
+  Rbx = 3,
+  Rsp = 4,
+  Rbp = 5,
+  Rsi = 6,
+  Rdi = 7,
+  R8 = 8,
+  R12 = 12,
+  R13 = 13,
+  R14 = 14,
+  R15 = 15,
+};
+
+enum Cond : std::uint8_t {
+  Above = 0x7,
+  Equal = 0x4,
+  NotEqual = 0x5,
+  Less = 0xC,
+  GreaterEqual = 0xD,
+  LessEqual = 0xE,
+  Greater = 0xF,
+};
+
+/// A memory operand `[base + index * 2^scale + disp]`.
+struct Mem {
+  Reg base;
+  int index = -1;
+  std::uint8_t scale = 0;
+  std::int32_t disp = 0;
+};
+
+constexpr auto ctxField(std::size_t offset) -> Mem {
+  return {.base = R14, .disp = static_cast<std::int32_t>(offset)};
+}
+
+/// Whether the cell `k` cells away from a register is in reach of a 32-bit
+/// displacement.
+constexpr auto isInReach(std::int64_t k) -> bool {
+  return std::numeric_limits<std::int32_t>::min() / 4 <= k &&
+         k <= std::numeric_limits<std::int32_t>::max() / 4;
+}
+
+/// The cell at `sp + k`.
+constexpr auto stackCell(int k) -> Mem {
+  return {.base = Rbx, .index = R12, .scale = 2, .disp = 4 * k};
+}
+
+/// The cell at `fp + k`.
+constexpr auto frameCell(int k) -> Mem {
+  return {.base = Rbx, .index = R13, .scale = 2, .disp = 4 * k};
+}
+
+/// The cell at address `k`.
+constexpr auto globalCell(int k) -> Mem { return {.base = Rbx, .disp = 4 * k}; }
+
+/// The cell at the address in `rax`.
+constexpr auto addressedCell() -> Mem {
+  return {.base = Rbx, .index = Rax, .scale = 2};
+}
+
+/**
+ * @brief Emits the handful of x86-64 instructions the templates need.
+ */
+class Assembler {
+  std::vector<std::uint8_t> code = {};
+  std::vector<std::int64_t> labels = {};
+  std::vector<std::pair<std::size_t, std::size_t>> fixups = {};
+
+  void byte(std::uint8_t b) { code.push_back(b); }
+
+  void imm32(std::int32_t value) {
+    std::uint8_t bytes[sizeof(value)];
+    std::memcpy(bytes, &value, sizeof(value));
+    code.insert(code.end(), std::begin(bytes), std::end(bytes));
+  }
+
+  void imm64(std::int64_t value) {
+    std::uint8_t bytes[sizeof(value)];
+    std::memcpy(bytes, &value, sizeof(value));
+    code.insert(code.end(), std::begin(bytes), std::end(bytes));
+  }
+
+  void rex(bool wide, int reg, int index, int base) {
+    std::uint8_t prefix = 0x40;
+    prefix |= wide ? 0x08 : 0;
+    prefix |= (reg & 8) != 0 ? 0x04 : 0;
+    prefix |= index >= 0 && (index & 8) != 0 ? 0x02 : 0;
+    prefix |= (base & 8) != 0 ? 0x01 : 0;
+    if (prefix != 0x40) {
+      byte(prefix);
+    }
+  }
+
+public:
+  /// An instruction with a memory operand, always encoded with a disp32.
+  void memOp(std::initializer_list<std::uint8_t> opcode, int reg, Mem m,
+             bool wide = false) {
+    rex(wide, reg, m.index, m.base);
+    code.insert(code.end(), opcode);
+    if (m.index < 0 && (m.base & 7) != Rsp) {
+      byte(0x80 | ((reg & 7) << 3) | (m.base & 7));
+    } else {
+      int index = m.index < 0 ? Rsp : m.index;
+      byte(0x80 | ((reg & 7) << 3) | Rsp);
+      byte((m.scale << 6) | ((index & 7) << 3) | (m.base & 7));
+    }
+    imm32(m.disp);
+  }
+
+  /// An instruction with two register operands.
+  void regOp(std::initializer_list<std::uint8_t> opcode, int reg, int rm,
+             bool wide = false) {
+    rex(wide, reg, -1, rm);
+    code.insert(code.end(), opcode);
+    byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+  }
+
+  void load32(Reg dst, Mem src) { memOp({0x8B}, dst, src); }
+  void store32(Mem dst, Reg src) { memOp({0x89}, src, dst); }
+  void load64(Reg dst, Mem src) { memOp({0x8B}, dst, src, true); }
+  void store64(Mem dst, Reg src) { memOp({0x89}, src, dst, true); }
+  /// Sign-extending 32 to 64 bit load.
+  void loadSigned(Reg dst, Mem src) { memOp({0x63}, dst, src, true); }
+
+  void storeImm32(Mem dst, std::int32_t value) {
+    memOp({0xC7}, 0, dst);
+    imm32(value);
+  }
+
+  void add32(Reg dst, Mem src) { memOp({0x03}, dst, src); }
+  void sub32(Reg dst, Mem src) { memOp({0x2B}, dst, src); }
+  void cmp32(Reg dst, Mem src) { memOp({0x3B}, dst, src); }
+  void imul32(Reg dst, Mem src) { memOp({0x0F, 0xAF}, dst, src); }
+  void idiv32(Mem divisor) { memOp({0xF7}, 7, divisor); }
+  void neg32(Mem m) { memOp({0xF7}, 3, m); }
+
+  void addImm64(Reg dst, std::int32_t value) {
+    if (value == 0) {
+      return;
+    }
+    regOp({0x81}, 0, dst, true);
+    imm32(value);
+  }
+
+  void cmpImm64(Reg dst, std::int32_t value) {
+    regOp({0x81}, 7, dst, true);
+    imm32(value);
+  }
+
+  void mov64(Reg dst, Reg src) { regOp({0x89}, src, dst, true); }
+  void test32(Reg a, Reg b) { regOp({0x85}, b, a); }
+  void cmova64(Reg dst, Reg src) { regOp({0x0F, 0x47}, dst, src, true); }
+
+  void movImm32(Reg dst, std::int32_t value) {
+    rex(false, 0, -1, dst);
+    byte(0xB8 + (dst & 7));
+    imm32(value);
+  }
+
+  void movImm64(Reg dst, std::int64_t value) {
+    rex(true, 0, -1, dst);
+    byte(0xB8 + (dst & 7));
+    imm64(value);
+  }
+
+  void cdq() { byte(0x99); }
+
+  /// `setcc` into `al` or `cl`.
+  void setcc(Cond c, Reg dst) { regOp({0x0F, std::uint8_t(0x90 | c)}, 0, dst); }
+  /// `op al, cl` for the byte-sized `and` (0x20), `or` (0x08), `xor` (0x30).
+  void byteOpAlCl(std::uint8_t opcode) { regOp({opcode}, Rcx, Rax); }
+  void movzxAl() { regOp({0x0F, 0xB6}, Rax, Rax); }
+
+  void push(Reg r) {
+    rex(false, 0, -1, r);
+    byte(0x50 + (r & 7));
+  }
+
+  void pop(Reg r) {
+    rex(false, 0, -1, r);
+    byte(0x58 + (r & 7));
+  }
+
+  void callReg(Reg r) { regOp({0xFF}, 2, r); }
+  void jmpReg(Reg r) { regOp({0xFF}, 4, r); }
+  void jmpMem(Mem m) { memOp({0xFF}, 4, m); }
+  void ret() { byte(0xC3); }
+
+  auto newLabel() -> std::size_t {
+    labels.push_back(-1);
+    return labels.size() - 1;
+  }
+
+  void bind(std::size_t label) {
+    labels[label] = static_cast<std::int64_t>(code.size());
+  }
+
+  void jmp(std::size_t label) {
+    byte(0xE9);
+    fixups.emplace_back(code.size(), label);
+    imm32(0);
+  }
+
+  void jcc(Cond c, std::size_t label) {
+    byte(0x0F);
+    byte(0x80 | c);
+    fixups.emplace_back(code.size(), label);
+    imm32(0);
+  }
+
+  auto offsetOf(std::size_t label) const -> std::size_t {
+    dbg_assert(labels[label] >= 0, "unbound label", label);
+    return static_cast<std::size_t>(labels[label]);
+  }
+
+  /// Resolves all jumps and returns the finished code.
+  auto finish() -> std::vector<std::uint8_t> {
+    for (auto [position, label] : fixups) {
+      auto target = static_cast<std::int64_t>(offsetOf(label));
+      auto next = static_cast<std::int64_t>(position + sizeof(std::int32_t));
+      auto rel = static_cast<std::int32_t>(target - next);
+      std::memcpy(code.data() + position, &rel, sizeof(rel));
+    }
+    return std::move(code);
+  }
+};
+
+/**
+ * @brief Executes one instruction on the reference interpreter.
+ * @details This is the only way the native code calls back into C++.
+ */
+void runtimeExecute(JitContext *ctx, int index) {
+  CMa &vm = *ctx->virtualMachine;
+  vm.setRegisters({.programCounter = index + 1,
+                   .stackPointer = static_cast<int>(ctx->stackPointer),
+                   .framePointer = static_cast<int>(ctx->framePointer),
+                   .extremePointer = ctx->extremePointer,
+                   .newPointer = ctx->newPointer});
+  vm.execute(ctx->instructions[index]);
+  Registers r = vm.getRegisters();
+  ctx->stackPointer = r.stackPointer;
+  ctx->framePointer = r.framePointer;
+  ctx->extremePointer = r.extremePointer;
+  ctx->newPointer = r.newPointer;
+}
+
+class Compiler {
+  std::span<const Instr> instructions;
+  Assembler a = {};
+  std::vector<std::size_t> instructionLabels = {};
+  std::size_t exitLabel = 0;
+  /// One past the end of the stack of the machine.
+  int stackEnd;
+
+  auto end() const -> int { return static_cast<int>(instructions.size()); }
+
+  auto labelOf(int target) const -> std::size_t {
+    bool inProgram = 0 <= target && target < end();
+    return instructionLabels[inProgram ? target : end()];
+  }
+
+  void spill() {
+    a.store64(ctxField(offsetof(JitContext, stackPointer)), R12);
+    a.store64(ctxField(offsetof(JitContext, framePointer)), R13);
+  }
+
+  void reload() {
+    a.load64(R12, ctxField(offsetof(JitContext, stackPointer)));
+    a.load64(R13, ctxField(offsetof(JitContext, framePointer)));
+  }
+
+  void callRuntime(int index) {
+    spill();
+    a.mov64(Rdi, R14);
+    a.movImm32(Rsi, index);
+    a.movImm64(Rax, reinterpret_cast<std::int64_t>(&runtimeExecute));
+    a.callReg(Rax);
+    reload();
+  }
+
+  /// Jumps to the instruction whose index is in `rax`, or leaves.
+  void jumpToRax() {
+    a.movImm32(Rcx, end());
+    a.cmpImm64(Rax, end());
+    a.cmova64(Rax, Rcx);
+    a.jmpMem({.base = R15, .index = Rax, .scale = 3});
+  }
+
+  void binaryArithmetic(Instr::Type t) {
+    a.load32(Rax, stackCell(-1));
+    switch (t) {
+    case Instr::Add: a.add32(Rax, stackCell(0)); break;
+    case Instr::Sub: a.sub32(Rax, stackCell(0)); break;
+    case Instr::Mul: a.imul32(Rax, stackCell(0)); break;
+    case Instr::Div:
+    case Instr::Mod: {
+      a.cdq();
+      a.idiv32(stackCell(0));
+      if (t == Instr::Mod) {
+        a.mov64(Rax, Rdx);
+      }
+    } break;
+    default: dbg_fail("not an arithmetic instruction", t);
+    }
+    a.store32(stackCell(-1), Rax);
+    a.addImm64(R12, -1);
+  }
+
+  void comparison(Cond c) {
+    a.load32(Rax, stackCell(-1));
+    a.cmp32(Rax, stackCell(0));
+    a.setcc(c, Rax);
+    a.movzxAl();
+    a.store32(stackCell(-1), Rax);
+    a.addImm64(R12, -1);
+  }
+
+  /// The logical `and`, `or` and `xor` of the CMa.
+  void logical(std::uint8_t byteOpcode) {
+    a.load32(Rax, stackCell(-1));
+    a.test32(Rax, Rax);
+    a.setcc(NotEqual, Rax);
+    a.load32(Rcx, stackCell(0));
+    a.test32(Rcx, Rcx);
+    a.setcc(NotEqual, Rcx);
+    a.byteOpAlCl(byteOpcode);
+    a.movzxAl();
+    a.store32(stackCell(-1), Rax);
+    a.addImm64(R12, -1);
+  }
+
+  void compile(int index, Instr instruction) {
+    int arg = instruction.arg;
+    Instr::Type type = Instr::baseType(instruction.type);
+    // Cells too far away for a displacement are left to the interpreter.
+    bool hasOffset = type == Instr::Loada || type == Instr::Storea ||
+                     type == Instr::Loadr || type == Instr::Storer ||
+                     type == Instr::TailCall;
+    if (hasOffset && !isInReach(static_cast<std::int64_t>(arg) +
+                                (type == Instr::TailCall ? 3 : 0))) {
+      callRuntime(index);
+      return;
+    }
+    switch (type) {
+    case Instr::Loadc: {
+      a.storeImm32(stackCell(1), arg);
+      a.addImm64(R12, 1);
+    } break;
+
+    case Instr::Add:
+    case Instr::Sub:
+    case Instr::Mul:
+    case Instr::Div:
+    case Instr::Mod: binaryArithmetic(Instr::baseType(instruction.type)); break;
+
+    case Instr::And: logical(0x20); break;
+    case Instr::Or: logical(0x08); break;
+    case Instr::Xor: logical(0x30); break;
+
+    case Instr::Eq: comparison(Equal); break;
+    case Instr::Neq: comparison(NotEqual); break;
+    case Instr::Le: comparison(Less); break;
+    case Instr::Leq: comparison(LessEqual); break;
+    case Instr::Gr: comparison(Greater); break;
+    case Instr::Geq: comparison(GreaterEqual); break;
+
+    case Instr::Not: {
+      a.load32(Rax, stackCell(0));
+      a.test32(Rax, Rax);
+      a.setcc(Equal, Rax);
+      a.movzxAl();
+      a.store32(stackCell(0), Rax);
+    } break;
+
+    case Instr::Neg: a.neg32(stackCell(0)); break;
+
+    case Instr::Load: {
+      if (arg != 1) {
+        callRuntime(index);
+        break;
+      }
+      a.loadSigned(Rax, stackCell(0));
+      a.load32(Rax, addressedCell());
+      a.store32(stackCell(0), Rax);
+    } break;
+
+    case Instr::Store: {
+      if (arg != 1) {
+        callRuntime(index);
+        break;
+      }
+      a.loadSigned(Rax, stackCell(0));
+      a.load32(Rcx, stackCell(-1));
+      a.store32(addressedCell(), Rcx);
+      a.addImm64(R12, -1);
+    } break;
+
+    case Instr::Loada: {
+      a.load32(Rax, globalCell(arg));
+      a.store32(stackCell(1), Rax);
+      a.addImm64(R12, 1);
+    } break;
+
+    case Instr::Storea: {
+      a.load32(Rax, stackCell(0));
+      a.store32(globalCell(arg), Rax);
+    } break;
+
+    case Instr::Pop: a.addImm64(R12, -arg); break;
+
+    case Instr::Dup: {
+      a.load32(Rax, stackCell(0));
+      a.store32(stackCell(1), Rax);
+      a.addImm64(R12, 1);
+    } break;
+
+    case Instr::Jump: a.jmp(labelOf(arg)); break;
+
+    case Instr::Jumpz: {
+      a.load32(Rax, stackCell(0));
+      a.addImm64(R12, -1);
+      a.test32(Rax, Rax);
+      a.jcc(Equal, labelOf(arg));
+    } break;
+
+    case Instr::Jumpi: {
+      a.loadSigned(Rax, stackCell(0));
+      a.addImm64(R12, -1);
+      a.addImm64(Rax, arg);
+      jumpToRax();
+    } break;
+
+    case Instr::Alloc: {
+      // Moves the stack pointer without touching memory, so it could jump
+      // over the guard pages: the reference interpreter reports it.
+      std::size_t fits = a.newLabel();
+      a.addImm64(R12, arg);
+      a.cmpImm64(R12, stackEnd);
+      a.jcc(Less, fits);
+      a.addImm64(R12, -arg);
+      callRuntime(index);
+      a.bind(fits);
+    } break;
+
+    case Instr::Mark: {
+      a.load32(Rax, ctxField(offsetof(JitContext, extremePointer)));
+      a.store32(stackCell(1), Rax);
+      a.store32(stackCell(2), R13);
+      a.addImm64(R12, 2);
+    } break;
+
+    case Instr::Call: {
+      a.loadSigned(Rax, stackCell(0));
+      a.storeImm32(stackCell(0), index + 1);
+      a.mov64(R13, R12);
+      jumpToRax();
+    } break;
+
+    case Instr::Slide: {
+      if (arg == 0) {
+        break;
+      }
+      a.load32(Rax, stackCell(0));
+      a.addImm64(R12, -arg);
+      a.store32(stackCell(0), Rax);
+    } break;
+
+    case Instr::Enter: {
+      // The stacks of spawned threads have no guard pages.
+      std::size_t fits = a.newLabel();
+      a.mov64(Rax, R12);
+      a.addImm64(Rax, arg);
+      a.store32(ctxField(offsetof(JitContext, extremePointer)), Rax);
+      a.cmpImm64(Rax, stackEnd);
+      a.jcc(Less, fits);
+      callRuntime(index);
+      a.bind(fits);
+    } break;
+
+    case Instr::Return: {
+      a.load32(Rcx, frameCell(-2));
+      a.store32(ctxField(offsetof(JitContext, extremePointer)), Rcx);
+      a.loadSigned(Rax, frameCell(0));
+      a.mov64(R12, R13);
+      a.addImm64(R12, -3);
+      a.loadSigned(R13, stackCell(2));
+      jumpToRax();
+    } break;
+
+    case Instr::TailCall: {
+      a.loadSigned(Rax, stackCell(0));
+      for (int i = 0; i < arg; ++i) {
+        a.load32(Rcx, stackCell(i - arg));
+        a.store32(frameCell(i - 2 - arg), Rcx);
+      }
+      a.mov64(R12, R13);
+      jumpToRax();
+    } break;
+
+    case Instr::Loadrc: {
+      a.mov64(Rax, R13);
+      a.addImm64(Rax, arg);
+      a.store32(stackCell(1), Rax);
+      a.addImm64(R12, 1);
+    } break;
+
+    case Instr::Loadr: {
+      a.load32(Rax, frameCell(arg));
+      a.store32(stackCell(1), Rax);
+      a.addImm64(R12, 1);
+    } break;
+
+    case Instr::Storer: {
+      a.load32(Rax, stackCell(0));
+      a.store32(frameCell(arg), Rax);
+    } break;
+
+    case Instr::Trap: {
+      callRuntime(index);
+      a.storeImm32(ctxField(offsetof(JitContext, programCounter)),
+                   std::numeric_limits<int>::max());
+      a.jmp(exitLabel);
+    } break;
+
+    case Instr::Halt: {
+      a.storeImm32(ctxField(offsetof(JitContext, programCounter)),
+                   std::numeric_limits<int>::max());
+      a.jmp(exitLabel);
+    } break;
+
+    default: callRuntime(index);
+    }
+  }
+
+  /// `int entry(JitContext *, int *memory, int64 sp, int64 fp, void *start)`
+  void prologue() {
+    for (Reg r : {Rbx, Rbp, R12, R13, R14, R15}) {
+      a.push(r);
+    }
+    a.addImm64(Rsp, -8); // keeps calls 16-byte aligned
+    a.mov64(R14, Rdi);
+    a.mov64(Rbx, Rsi);
+    a.mov64(R12, Rdx);
+    a.mov64(R13, Rcx);
+    a.load64(R15, ctxField(offsetof(JitContext, addresses)));
+    a.jmpReg(R8);
+  }
+
+  void epilogue() {
+    a.bind(exitLabel);
+    spill();
+    a.load32(Rax, globalCell(0));
+    a.addImm64(Rsp, 8);
+    for (Reg r : {R15, R14, R13, R12, Rbp, Rbx}) {
+      a.pop(r);
+    }
+    a.ret();
+  }
+
+public:
+  Compiler(std::span<const Instr> instructions, int stackEnd)
+      : instructions{instructions}, stackEnd{stackEnd} {}
+
+  /// Compiles the program; `offsets` receives the start of each instruction.
+  auto compile(std::vector<std::size_t> &offsets) -> std::vector<std::uint8_t> {
+    exitLabel = a.newLabel();
+    for (int i = 0; i <= end(); ++i) {
+      instructionLabels.push_back(a.newLabel());
+    }
+
+    prologue();
+    for (int i = 0; i < end(); ++i) {
+      a.bind(instructionLabels[i]);
+      compile(i, instructions[i]);
+    }
+    // Running off the end of the program.
+    a.bind(instructionLabels[end()]);
+    a.storeImm32(ctxField(offsetof(JitContext, programCounter)), end());
+    a.jmp(exitLabel);
+    epilogue();
+
+    for (std::size_t label : instructionLabels) {
+      offsets.push_back(a.offsetOf(label));
+    }
+    return a.finish();
+  }
+};
+
+/**
+ * @brief A mapping of code that is writable first and executable after
+ * `seal()`, but never both.
+ */
+class ExecutableMemory {
+  void *start = nullptr;
+  std::size_t size = 0;
+
+public:
+  explicit ExecutableMemory(std::span<const std::uint8_t> code)
+      : size{code.size()} {
+    start = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    dbg_assert_neq(start, MAP_FAILED, "Cannot map memory for the JIT", size);
+    std::memcpy(start, code.data(), size);
+    int result = mprotect(start, size, PROT_READ | PROT_EXEC);
+    dbg_assert_eq(result, 0, "Cannot make JIT code executable", size);
+  }
+
+  ExecutableMemory(const ExecutableMemory &) = delete;
+  auto operator=(const ExecutableMemory &) -> ExecutableMemory & = delete;
+
+  ~ExecutableMemory() { munmap(start, size); }
+
+  [[nodiscard]] auto at(std::size_t offset) const -> const void * {
+    return static_cast<const std::uint8_t *>(start) + offset;
+  }
+};
+
+using Entry = int(JitContext *ctx, int *memory, std::int64_t sp,
+                  std::int64_t fp, const void *start);
+
+} // namespace
+
+template <> auto CMa::runJit() -> int {
+  std::vector<std::size_t> offsets = {};
+  std::vector code = Compiler(instructions, stackEnd).compile(offsets);
+  ExecutableMemory executable(code);
+
+  std::vector<const void *> addresses = {};
+  addresses.reserve(offsets.size());
+  for (std::size_t offset : offsets) {
+    addresses.push_back(executable.at(offset));
+  }
+
+  JitContext ctx = {
+      .stackPointer = stackPointer,
+      .framePointer = framePointer,
+      .extremePointer = extremePointer,
+      .newPointer = newPointer,
+      .programCounter = programCounter,
+      .virtualMachine = this,
+      .instructions = instructions.data(),
+      .addresses = addresses.data(),
+  };
+
+  auto start = static_cast<std::size_t>(programCounter);
+  const void *startAddress = addresses[std::min(start, instructions.size())];
+  auto *entry = reinterpret_cast<Entry *>(const_cast<void *>(executable.at(0)));
+  int exitCode = entry(&ctx, memory.data(), stackPointer, framePointer,
+                       startAddress);
+
+  setRegisters({.programCounter = ctx.programCounter,
+                .stackPointer = static_cast<int>(ctx.stackPointer),
+                .framePointer = static_cast<int>(ctx.framePointer),
+                .extremePointer = ctx.extremePointer,
+                .newPointer = ctx.newPointer});
+  return exitCode;
+}
+
+#else
+
+// No native code generator for this architecture.
+template <> auto CMa::runJit() -> int { return runThreaded(); }
+
+#endif
+
+} // namespace vm::cma
@@ -0,0 +1,314 @@
+#include "lib/CMaLocality.hpp"
+#include "lib/Common.hpp"
+#include "lib/Error.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <format>
+#include <functional>
+#include <map>
+#include <print>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace vm::cma {
+
+namespace {
+
+constexpr std::array<char, 4> magic = {'C', 'M', 'A', 'L'};
+constexpr std::uint32_t version = 1;
+
+struct Header {
+  std::array<char, 4> magic;
+  std::uint32_t version;
+  std::uint32_t cellSize;
+  std::uint32_t capacity;
+  std::uint64_t total;
+  std::int64_t globalsEnd;
+  std::int64_t heapStart;
+};
+
+/**
+ * @brief A set-associative cache with LRU replacement, of which only the
+ * tags are simulated.
+ */
+class Cache {
+  std::size_t ways;
+  std::size_t sets;
+  std::vector<std::uint64_t> tags;
+  /// When each way was last used; 0 for empty ways.
+  std::vector<std::uint64_t> lastUse;
+  std::uint64_t now = 0;
+
+public:
+  explicit Cache(CacheConfig config)
+      : ways{config.ways},
+        sets{std::max<std::size_t>(
+            1, config.bytes / config.lineBytes / config.ways)},
+        tags(sets * ways), lastUse(sets * ways) {}
+
+  /// Accesses the cache line `line`, and tells whether it was cached.
+  auto access(std::uint64_t line) -> bool {
+    now += 1;
+    std::size_t first = (line % sets) * ways;
+    std::size_t victim = first;
+    for (std::size_t way = first; way < first + ways; ++way) {
+      if (lastUse[way] != 0 && tags[way] == line) {
+        lastUse[way] = now;
+        return true;
+      }
+      if (lastUse[way] < lastUse[victim]) {
+        victim = way;
+      }
+    }
+    tags[victim] = line;
+    lastUse[victim] = now;
+    return false;
+  }
+};
+
+/**
+ * @brief Counts marked positions in prefixes of a sequence (a Fenwick tree).
+ */
+class PrefixCounts {
+  std::vector<std::int64_t> tree;
+
+public:
+  explicit PrefixCounts(std::size_t size) : tree(size + 1) {}
+
+  void add(std::size_t position, std::int64_t delta) {
+    for (std::size_t i = position + 1; i < tree.size(); i += i & -i) {
+      tree[i] += delta;
+    }
+  }
+
+  /// The sum over the positions before `end`.
+  [[nodiscard]] auto before(std::size_t end) const -> std::int64_t {
+    std::int64_t sum = 0;
+    for (std::size_t i = end; i > 0; i -= i & -i) {
+      sum += tree[i];
+    }
+    return sum;
+  }
+};
+
+void count(LocalityReport::Counts &counts, const MemoryAccess &access,
+           bool isL1Miss, bool isL2Miss) {
+  counts.accesses += 1;
+  counts.writes += access.isWrite() ? 1 : 0;
+  counts.l1Misses += isL1Miss ? 1 : 0;
+  counts.l2Misses += isL2Miss ? 1 : 0;
+}
+
+auto percent(std::uint64_t part, std::uint64_t whole) -> double {
+  return whole == 0 ? 0.0
+                    : 100.0 * static_cast<double>(part) /
+                          static_cast<double>(whole);
+}
+
+} // namespace
+
+AccessLog::AccessLog(std::uint32_t cellSize, std::int64_t globalsEnd,
+                     std::int64_t heapStart, std::size_t capacity)
+    : ring(capacity), cellSize{cellSize}, globalsEnd{globalsEnd},
+      heapStart{heapStart} {
+  dbg_assert(std::has_single_bit(capacity),
+             "The capacity of an access log must be a power of two",
+             capacity);
+}
+
+void AccessLog::clear(std::int64_t globalsEnd) {
+  total = 0;
+  site = 0;
+  this->globalsEnd = globalsEnd;
+}
+
+auto AccessLog::accesses() const -> std::vector<MemoryAccess> {
+  if (total <= ring.size()) {
+    return {ring.begin(), ring.begin() + static_cast<std::ptrdiff_t>(total)};
+  }
+  // The oldest access is the one the next would overwrite.
+  auto oldest = static_cast<std::ptrdiff_t>(total & (ring.size() - 1));
+  std::vector<MemoryAccess> ordered(ring.begin() + oldest, ring.end());
+  ordered.insert(ordered.end(), ring.begin(), ring.begin() + oldest);
+  return ordered;
+}
+
+void AccessLog::save(FILE *out) const {
+  Header header = {.magic = magic,
+                   .version = version,
+                   .cellSize = cellSize,
+                   .capacity = static_cast<std::uint32_t>(ring.size()),
+                   .total = total,
+                   .globalsEnd = globalsEnd,
+                   .heapStart = heapStart};
+  std::vector<MemoryAccess> ordered = accesses();
+  bool isWritten =
+      std::fwrite(&header, sizeof(header), 1, out) == 1 &&
+      std::fwrite(ordered.data(), sizeof(MemoryAccess), ordered.size(),
+                  out) == ordered.size();
+  dbg_assert(isWritten, "Cannot write access log");
+}
+
+auto AccessLog::load(std::string_view path) -> AccessLog {
+  FILE *in = std::fopen(std::string(path).c_str(), "rb");
+  if (in == nullptr) {
+    std::println(stderr, "Cannot open file: {}", path);
+    std::exit(EXIT_FAILURE);
+  }
+  Header header = {};
+  bool isLog = std::fread(&header, sizeof(header), 1, in) == 1 &&
+               header.magic == magic;
+  dbg_assert(isLog, "Not an access log", path);
+  dbg_assert_eq(header.version, version, "Unsupported access log version",
+                path);
+
+  AccessLog log(header.cellSize, header.globalsEnd, header.heapStart,
+                header.capacity);
+  log.total = header.total;
+  std::size_t kept = std::min<std::uint64_t>(header.total, header.capacity);
+  // Saved oldest first, into the slots they had in the ring.
+  std::vector<MemoryAccess> ordered(kept);
+  bool isComplete = std::fread(ordered.data(), sizeof(MemoryAccess), kept,
+                               in) == kept;
+  std::fclose(in);
+  dbg_assert(isComplete, "Truncated access log", path);
+  std::size_t oldest = log.total <= header.capacity
+                           ? 0
+                           : log.total & (header.capacity - 1);
+  for (std::size_t i = 0; i < kept; ++i) {
+    log.ring[(oldest + i) & (header.capacity - 1)] = ordered[i];
+  }
+  return log;
+}
+
+auto analyzeLocality(const AccessLog &log,
+                     std::span<const common::Symbol> functions,
+                     CacheConfig l1, CacheConfig l2,
+                     std::size_t hotRangesPerFunction) -> LocalityReport {
+  std::vector<MemoryAccess> accesses = log.accesses();
+  LocalityReport report = {.recorded = log.recorded()};
+
+  std::size_t cellSize = log.getCellSize();
+  std::size_t cellsPerRange = std::max<std::size_t>(1, 4096 / cellSize);
+  auto lineOf = [&](const MemoryAccess &access) {
+    return static_cast<std::uint64_t>(access.address) * cellSize /
+           l1.lineBytes;
+  };
+  auto functionOf = [&](int instruction) -> std::size_t {
+    auto next = std::ranges::upper_bound(
+        functions, static_cast<std::size_t>(instruction), {},
+        &common::Symbol::address);
+    // 0 is `<start>`, then the functions.
+    return static_cast<std::size_t>(next - functions.begin());
+  };
+
+  Cache level1(l1);
+  Cache level2(l2);
+  PrefixCounts isLastUse(accesses.size());
+  std::unordered_map<std::uint64_t, std::size_t> lastUse = {};
+  std::map<std::pair<std::size_t, std::uint32_t>, LocalityReport::Counts>
+      ranges = {};
+
+  for (std::size_t now = 0; now < accesses.size(); ++now) {
+    const MemoryAccess &access = accesses[now];
+    std::uint64_t line = lineOf(access);
+
+    // The reuse distance: the lines whose last use is after this one's.
+    auto [previous, isNew] = lastUse.try_emplace(line, now);
+    if (isNew) {
+      report.coldAccesses += 1;
+    } else {
+      auto distance = static_cast<std::uint64_t>(
+          isLastUse.before(now) - isLastUse.before(previous->second + 1));
+      std::size_t bucket = std::bit_width(distance);
+      if (report.reuseDistances.size() <= bucket) {
+        report.reuseDistances.resize(bucket + 1);
+      }
+      report.reuseDistances[bucket] += 1;
+      isLastUse.add(previous->second, -1);
+      previous->second = now;
+    }
+    isLastUse.add(now, 1);
+
+    bool isL1Miss = !level1.access(line);
+    bool isL2Miss = isL1Miss && !level2.access(line);
+    count(report.all, access, isL1Miss, isL2Miss);
+    count(report.regions[static_cast<std::size_t>(access.region())], access,
+          isL1Miss, isL2Miss);
+    auto range = static_cast<std::uint32_t>(access.address / cellsPerRange);
+    count(ranges[{functionOf(access.instruction()), range}], access, isL1Miss,
+          isL2Miss);
+  }
+
+  // The hottest ranges of each function, which `ranges` has in order.
+  for (auto first = ranges.begin(); first != ranges.end();) {
+    std::size_t function = first->first.first;
+    std::vector<LocalityReport::HotRange> hot = {};
+    for (; first != ranges.end() && first->first.first == function; ++first) {
+      auto start = static_cast<std::uint32_t>(first->first.second *
+                                              cellsPerRange);
+      hot.push_back({.function = function == 0
+                                     ? std::string_view("<start>")
+                                     : functions[function - 1].name,
+                     .start = start,
+                     .end = static_cast<std::uint32_t>(start + cellsPerRange),
+                     .counts = first->second});
+    }
+    std::ranges::stable_sort(hot, std::greater{}, [](const auto &range) {
+      return range.counts.accesses;
+    });
+    hot.resize(std::min(hot.size(), hotRangesPerFunction));
+    report.hotRanges.insert(report.hotRanges.end(), hot.begin(), hot.end());
+  }
+  return report;
+}
+
+void LocalityReport::print(FILE *out) const {
+  std::println(out, "{} accesses recorded, the last {} analyzed", recorded,
+               all.accesses);
+  auto printCounts = [&](std::string_view name, const Counts &c) {
+    std::println(out,
+                 "{:<8} {:>12} accesses {:>5.1f}% writes  L1 misses "
+                 "{:>5.1f}%  L2 misses {:>5.1f}%",
+                 name, c.accesses, percent(c.writes, c.accesses),
+                 percent(c.l1Misses, c.accesses),
+                 percent(c.l2Misses, c.accesses));
+  };
+  printCounts("all", all);
+  printCounts("stack", regions[static_cast<std::size_t>(Region::Stack)]);
+  printCounts("globals", regions[static_cast<std::size_t>(Region::Global)]);
+  printCounts("heap", regions[static_cast<std::size_t>(Region::Heap)]);
+
+  std::println(out, "Reuse distance (cache lines):");
+  std::println(out, "{:>12}  {:>12} {:>5.1f}%", "cold", coldAccesses,
+               percent(coldAccesses, all.accesses));
+  for (std::size_t bucket = 0; bucket < reuseDistances.size(); ++bucket) {
+    std::string bound =
+        bucket == 0 ? "0" : std::format("< {}", std::uint64_t{1} << bucket);
+    std::println(out, "{:>12}  {:>12} {:>5.1f}%", bound, reuseDistances[bucket],
+                 percent(reuseDistances[bucket], all.accesses));
+  }
+
+  std::println(out, "Hottest ranges (cells) per function:");
+  for (const HotRange &range : hotRanges) {
+    std::println(out,
+                 "{:<16} [{}, {}) {:>12} accesses  L1 misses {:>5.1f}%  "
+                 "L2 misses {:>5.1f}%",
+                 range.function, range.start, range.end,
+                 range.counts.accesses,
+                 percent(range.counts.l1Misses, range.counts.accesses),
+                 percent(range.counts.l2Misses, range.counts.accesses));
+  }
+}
+
+} // namespace vm::cma
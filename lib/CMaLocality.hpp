@@ -0,0 +1,163 @@
+#ifndef TUM_I2_VM_LIB_CMA_LOCALITY
+#define TUM_I2_VM_LIB_CMA_LOCALITY
+
+#include "lib/Common.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <span>
+#include <string_view>
+#include <vector>
+
+namespace vm::cma {
+
+/**
+ * @brief The part of the memory a cell belongs to.
+ */
+enum class Region : std::uint8_t {
+  /// The frames, and everything else in the stack region.
+  Stack,
+  /// The cells of the stack region that `loada` and `storea` address.
+  Global,
+  /// The cells `new` hands out.
+  Heap,
+};
+
+enum class Access : std::uint8_t { Read, Write };
+
+/**
+ * @brief One read or write of a memory cell, as 8 bytes.
+ */
+struct MemoryAccess {
+  std::uint32_t address;
+  /// The address of the instruction, then the region and the kind.
+  std::uint32_t site;
+
+  [[nodiscard]] auto instruction() const -> int {
+    return static_cast<int>(site >> 3);
+  }
+  [[nodiscard]] auto region() const -> Region {
+    return static_cast<Region>((site >> 1) & 3);
+  }
+  [[nodiscard]] auto isWrite() const -> bool { return (site & 1) != 0; }
+};
+
+/**
+ * @brief The last memory accesses of a program, in a ring buffer (see
+ * `CMaPolicy::recorded`).
+ * @details Only the accesses of the thread that runs the program are
+ * recorded. `save` writes the log for the analyzer, `cma-locality`.
+ */
+class AccessLog {
+  std::vector<MemoryAccess> ring;
+  std::uint64_t total = 0;
+  std::uint32_t site = 0;
+  std::uint32_t cellSize;
+  std::int64_t globalsEnd;
+  std::int64_t heapStart;
+
+public:
+  /// The number of accesses the log keeps by default.
+  static constexpr std::size_t defaultCapacity = std::size_t{1} << 22;
+
+  /**
+   * @param globalsEnd One past the highest cell that `loada` or `storea`
+   * address.
+   * @param capacity The number of accesses to keep, a power of two.
+   */
+  AccessLog(std::uint32_t cellSize, std::int64_t globalsEnd,
+            std::int64_t heapStart, std::size_t capacity = defaultCapacity);
+
+  /// Sets the instruction that the next accesses belong to.
+  void enter(int instruction) {
+    site = static_cast<std::uint32_t>(instruction) << 3;
+  }
+
+  void record(std::int64_t address, Access access) {
+    Region region = address >= heapStart    ? Region::Heap
+                    : address < globalsEnd ? Region::Global
+                                            : Region::Stack;
+    ring[total & (ring.size() - 1)] = {
+        .address = static_cast<std::uint32_t>(address),
+        .site = site | static_cast<std::uint32_t>(region) << 1 |
+                static_cast<std::uint32_t>(access)};
+    total += 1;
+  }
+
+  /// Forgets all accesses, e.g. for another program.
+  void clear(std::int64_t globalsEnd);
+
+  /// The number of accesses recorded, including the ones overwritten.
+  [[nodiscard]] auto recorded() const -> std::uint64_t { return total; }
+  [[nodiscard]] auto getCellSize() const -> std::uint32_t { return cellSize; }
+
+  /// The accesses still in the log, oldest first.
+  [[nodiscard]] auto accesses() const -> std::vector<MemoryAccess>;
+
+  /// Writes the log in a binary format of its own.
+  void save(FILE *out) const;
+
+  /// Reads a log written by `save`.
+  static auto load(std::string_view path) -> AccessLog;
+};
+
+/**
+ * @brief The geometry of a simulated set-associative LRU cache.
+ */
+struct CacheConfig {
+  std::size_t bytes;
+  std::size_t ways;
+  std::size_t lineBytes = 64;
+};
+
+/**
+ * @brief Where a program's memory accesses hit, from `analyzeLocality`.
+ */
+struct LocalityReport {
+  struct Counts {
+    std::uint64_t accesses = 0;
+    std::uint64_t writes = 0;
+    std::uint64_t l1Misses = 0;
+    std::uint64_t l2Misses = 0;
+  };
+
+  /// A range of cells that one function accessed often.
+  struct HotRange {
+    std::string_view function;
+    std::uint32_t start;
+    std::uint32_t end;
+    Counts counts;
+  };
+
+  std::uint64_t recorded = 0;
+  Counts all = {};
+  std::array<Counts, 3> regions = {};
+  /// How many other cache lines were accessed since the same line was last
+  /// accessed: bucket 0 counts distance 0, bucket k distances in [2^(k-1),
+  /// 2^k); first accesses are `coldAccesses`.
+  std::vector<std::uint64_t> reuseDistances = {};
+  std::uint64_t coldAccesses = 0;
+  /// The most accessed ranges of each function, by function.
+  std::vector<HotRange> hotRanges = {};
+
+  void print(FILE *out) const;
+};
+
+/**
+ * @brief Analyzes the locality of the accesses in a log.
+ * @param functions The entries of the functions, by address, to attribute
+ * the accesses to; the instructions before the first one are `<start>`.
+ * @param hotRangesPerFunction The number of hot ranges to report per
+ * function; a range is a page (4 KiB) of cells.
+ */
+auto analyzeLocality(const AccessLog &log,
+                     std::span<const common::Symbol> functions,
+                     CacheConfig l1 = {.bytes = 32 << 10, .ways = 8},
+                     CacheConfig l2 = {.bytes = 1 << 20, .ways = 16},
+                     std::size_t hotRangesPerFunction = 3) -> LocalityReport;
+
+} // namespace vm::cma
+
+#endif
@@ -0,0 +1,288 @@
+#include "lib/CMaMemory.hpp"
+#include "lib/Error.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <climits>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <print>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace vm::cma {
+
+namespace {
+
+/**
+ * @brief The address ranges of all live memories, for the SIGSEGV handler.
+ * @details The handler may not take locks, so this is a fixed table of
+ * atomics. A slot is free while its `begin` is 0.
+ */
+struct GuardedRange {
+  std::atomic<std::uintptr_t> begin = 0;
+  std::atomic<std::uintptr_t> end = 0;
+  /// The guard between stack and heap.
+  std::atomic<std::uintptr_t> guardBegin = 0;
+  std::atomic<std::uintptr_t> guardEnd = 0;
+};
+
+constexpr std::size_t maxGuardedRanges = 256;
+std::array<GuardedRange, maxGuardedRanges> guardedRanges = {};
+struct sigaction previousAction = {};
+
+void report(std::string_view message) {
+  // Only async-signal-safe calls from here on.
+  [[maybe_unused]] auto written =
+      write(STDERR_FILENO, message.data(), message.size());
+  _exit(EXIT_FAILURE);
+}
+
+void onSegmentationFault(int signal, siginfo_t *info, void *context) {
+  auto address = reinterpret_cast<std::uintptr_t>(info->si_addr);
+  for (GuardedRange &range : guardedRanges) {
+    std::uintptr_t begin = range.begin.load();
+    if (begin == 0 || address < begin || address >= range.end.load()) {
+      continue;
+    }
+    // Only the guards of a memory are inaccessible.
+    if (range.guardBegin.load() <= address && address < range.guardEnd.load()) {
+      report("Stack overflow\n");
+    }
+    report("Memory access out of bounds\n");
+  }
+
+  // Not ours: let the previous handler (e.g. the stack trace printer) or the
+  // default action deal with it.
+  if ((previousAction.sa_flags & SA_SIGINFO) != 0) {
+    previousAction.sa_sigaction(signal, info, context);
+  } else if (previousAction.sa_handler != SIG_DFL &&
+             previousAction.sa_handler != SIG_IGN) {
+    previousAction.sa_handler(signal);
+  } else {
+    sigaction(SIGSEGV, &previousAction, nullptr);
+  }
+}
+
+auto installHandler() -> bool {
+  struct sigaction action = {};
+  action.sa_sigaction = onSegmentationFault;
+  action.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sigemptyset(&action.sa_mask);
+  return sigaction(SIGSEGV, &action, &previousAction) == 0;
+}
+
+void registerRange(std::uintptr_t begin, std::uintptr_t end,
+                   std::uintptr_t guardBegin, std::uintptr_t guardEnd) {
+  static const bool isInstalled = installHandler();
+  dbg_assert(isInstalled, "Cannot install the SIGSEGV handler");
+  for (GuardedRange &range : guardedRanges) {
+    std::uintptr_t expected = 0;
+    // Claim the slot with a dummy value, publish `begin` last.
+    if (range.begin.compare_exchange_strong(expected, UINTPTR_MAX)) {
+      range.end = end;
+      range.guardBegin = guardBegin;
+      range.guardEnd = guardEnd;
+      range.begin = begin;
+      return;
+    }
+  }
+  dbg_fail("Too many CMa memories at once", maxGuardedRanges);
+}
+
+void unregisterRange(std::uintptr_t begin) {
+  for (GuardedRange &range : guardedRanges) {
+    std::uintptr_t expected = begin;
+    if (range.begin.compare_exchange_strong(expected, 0)) {
+      return;
+    }
+  }
+}
+
+auto roundUp(std::size_t value, std::size_t multiple) -> std::size_t {
+  return (value + multiple - 1) / multiple * multiple;
+}
+
+} // namespace
+
+MemoryMapping::MemoryMapping(MemoryLayout requested, std::size_t cellSize)
+    : cellSize{cellSize} {
+  auto pageSize = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+  std::size_t pageCells = pageSize / cellSize;
+  layout = {.stackCells = roundUp(requested.stackCells, pageCells),
+            .guardCells = roundUp(requested.guardCells, pageCells),
+            .heapCells = roundUp(requested.heapCells, pageCells)};
+  dbg_assert(layout.size() <= static_cast<std::size_t>(INT_MAX),
+             "CMa memory too large for int addresses", layout.size());
+  auto bytes = [&](std::size_t count) { return count * cellSize; };
+
+  // A guard below address 0 and a page above the top of the heap.
+  std::size_t guardSize = bytes(layout.guardCells);
+  mappingSize = guardSize + bytes(layout.size()) + pageSize;
+  void *start = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  dbg_assert_neq(start, MAP_FAILED, "Cannot map CMa memory", mappingSize);
+  mapping = static_cast<std::byte *>(start);
+  cells = mapping + guardSize;
+
+  std::byte *guard = cells + bytes(layout.stackCells);
+  std::byte *heap = cells + bytes(layout.heapStart());
+  std::byte *top = cells + bytes(layout.size());
+  mprotect(mapping, guardSize, PROT_NONE);
+  mprotect(guard, guardSize, PROT_NONE);
+  mprotect(top, pageSize, PROT_NONE);
+  // Only a hint: not every kernel has transparent huge pages.
+  madvise(cells, bytes(layout.stackCells), MADV_HUGEPAGE);
+  madvise(heap, bytes(layout.heapCells), MADV_HUGEPAGE);
+
+  registerRange(reinterpret_cast<std::uintptr_t>(mapping),
+                reinterpret_cast<std::uintptr_t>(mapping + mappingSize),
+                reinterpret_cast<std::uintptr_t>(guard),
+                reinterpret_cast<std::uintptr_t>(heap));
+}
+
+auto MemoryMapping::share() const -> MemoryMapping {
+  MemoryMapping shared;
+  shared.layout = layout;
+  shared.cellSize = cellSize;
+  shared.cells = cells;
+  return shared;
+}
+
+auto MemoryMapping::touchedStackBytes() const -> std::size_t {
+  auto pageSize = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+  std::size_t stackBytes = layout.stackCells * cellSize;
+  // One entry per page; `mincore` would miss the pages that are swapped out.
+  constexpr std::uint64_t isPresent = std::uint64_t{1} << 63;
+  constexpr std::uint64_t isSwapped = std::uint64_t{1} << 62;
+  std::vector<std::uint64_t> pages(stackBytes / pageSize);
+  int fd = open("/proc/self/pagemap", O_RDONLY);
+  if (fd < 0) {
+    return stackBytes;
+  }
+  auto offset = static_cast<off_t>(reinterpret_cast<std::uintptr_t>(cells) /
+                                   pageSize * sizeof(std::uint64_t));
+  std::size_t bytes = pages.size() * sizeof(std::uint64_t);
+  ssize_t count = pread(fd, pages.data(), bytes, offset);
+  close(fd);
+  if (count != static_cast<ssize_t>(bytes)) {
+    return stackBytes;
+  }
+  auto last =
+      std::find_if(pages.rbegin(), pages.rend(), [](std::uint64_t page) {
+        return (page & (isPresent | isSwapped)) != 0;
+      });
+  return static_cast<std::size_t>(pages.rend() - last) * pageSize;
+}
+
+void MemoryMapping::clearStack() {
+  auto pageSize = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+  std::size_t stackBytes = layout.stackCells * cellSize;
+  std::vector<unsigned char> isResident(stackBytes / pageSize);
+  int status = mincore(cells, stackBytes, isResident.data());
+  dbg_assert_eq(status, 0, "Cannot query the pages of CMa memory");
+  auto last = std::find_if(isResident.rbegin(), isResident.rend(),
+                           [](unsigned char page) { return (page & 1) != 0; });
+  auto residentBytes =
+      static_cast<std::size_t>(isResident.rend() - last) * pageSize;
+  std::memset(cells, 0, residentBytes);
+  // Pages above may still be swapped out; cheap where nothing is mapped.
+  madvise(cells + residentBytes, stackBytes - residentBytes, MADV_DONTNEED);
+}
+
+void MemoryMapping::discard() {
+  madvise(cells, layout.stackCells * cellSize, MADV_DONTNEED);
+  madvise(cells + layout.heapStart() * cellSize, layout.heapCells * cellSize,
+          MADV_DONTNEED);
+}
+
+auto MemoryMapping::mapFile(std::string_view path, std::size_t address,
+                            bool isWritable) -> std::size_t {
+  std::string name(path);
+  int fd = open(name.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::println(stderr, "Cannot open file: {}", path);
+    std::exit(EXIT_FAILURE);
+  }
+  struct stat info = {};
+  dbg_assert_eq(fstat(fd, &info), 0, "Cannot stat file", path);
+  auto size = static_cast<std::size_t>(info.st_size);
+  std::size_t count = size / cellSize;
+  dbg_assert_eq(size % cellSize, 0, "Data file does not hold whole cells",
+                path, size, cellSize);
+
+  auto pageSize = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+  std::size_t offset = address * cellSize;
+  bool isInStack = address + count <= layout.stackCells;
+  bool isInHeap =
+      address >= layout.heapStart() && address + count <= layout.size();
+  dbg_assert(isInStack || isInHeap,
+             "Data must lie in the stack or the heap region", path, address,
+             count);
+  dbg_assert_eq(offset % pageSize, 0, "Data must start at a page", path,
+                address, pageSize / cellSize);
+
+  if (size > 0) {
+    int protection = isWritable ? PROT_READ | PROT_WRITE : PROT_READ;
+    void *start = mmap(cells + offset, size, protection,
+                       MAP_PRIVATE | MAP_FIXED, fd, 0);
+    dbg_assert_neq(start, MAP_FAILED, "Cannot map file", path);
+    files.emplace_back(offset, roundUp(size, pageSize));
+  }
+  close(fd);
+  return count;
+}
+
+void MemoryMapping::unmapFiles() {
+  for (auto [offset, size] : files) {
+    void *start = mmap(cells + offset, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+                       -1, 0);
+    dbg_assert_neq(start, MAP_FAILED, "Cannot unmap data file", offset, size);
+  }
+  files.clear();
+}
+
+MemoryMapping::MemoryMapping(MemoryMapping &&other) noexcept
+    : layout{other.layout}, cellSize{other.cellSize},
+      mapping{std::exchange(other.mapping, nullptr)},
+      mappingSize{std::exchange(other.mappingSize, 0)},
+      cells{std::exchange(other.cells, nullptr)},
+      files{std::move(other.files)} {}
+
+auto MemoryMapping::operator=(MemoryMapping &&other) noexcept
+    -> MemoryMapping & {
+  if (this != &other) {
+    release();
+    layout = other.layout;
+    cellSize = other.cellSize;
+    mapping = std::exchange(other.mapping, nullptr);
+    mappingSize = std::exchange(other.mappingSize, 0);
+    cells = std::exchange(other.cells, nullptr);
+    files = std::move(other.files);
+  }
+  return *this;
+}
+
+MemoryMapping::~MemoryMapping() { release(); }
+
+void MemoryMapping::release() {
+  if (mapping != nullptr) {
+    unregisterRange(reinterpret_cast<std::uintptr_t>(mapping));
+    munmap(mapping, mappingSize);
+    mapping = nullptr;
+  }
+}
+
+} // namespace vm::cma
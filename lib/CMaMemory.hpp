@@ -0,0 +1,185 @@
+#ifndef TUM_I2_VM_LIB_CMA_MEMORY
+#define TUM_I2_VM_LIB_CMA_MEMORY
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace vm::cma {
+
+/**
+ * @brief How the address space of a CMa is divided, in cells.
+ * @details The stack grows up from address 0, the heap (`new`) grows down
+ * from the top. Between them lie guard pages, so that a stack that runs into
+ * them traps instead of overwriting the heap; the same guard lies below
+ * address 0. Guards only cost address space. They only catch a stack that
+ * touches them: a program must not have instructions that reach farther than
+ * the guard (see `CMa::run`), and `alloc`, which moves the stack pointer up
+ * without touching memory, checks it against the end of the stack. Repeated
+ * `pop`s can still move it below the guard under address 0 unnoticed, so
+ * that the next push lands outside of the memory; only the bounds checked
+ * machines catch that. All sizes are rounded up to whole pages.
+ */
+struct MemoryLayout {
+  std::size_t stackCells = std::size_t{1} << 26;
+  std::size_t guardCells = std::size_t{1} << 28;
+  std::size_t heapCells = std::size_t{1} << 26;
+
+  /// The lowest address of the heap.
+  [[nodiscard]] auto heapStart() const -> std::size_t {
+    return stackCells + guardCells;
+  }
+
+  /// The number of addressable cells.
+  [[nodiscard]] auto size() const -> std::size_t {
+    return heapStart() + heapCells;
+  }
+};
+
+/**
+ * @brief The pages behind a CMa memory: a lazily populated anonymous mapping.
+ * @details The mapping reserves no swap and no memory up front (its pages are
+ * zero until first touched) and asks for transparent huge pages. Below
+ * address 0, between stack and heap and above the top of the heap, pages are
+ * inaccessible. Touching them ends the program with
+ * "Stack overflow" or "Memory access out of bounds".
+ */
+class MemoryMapping {
+  MemoryLayout layout;
+  std::size_t cellSize = 0;
+  std::byte *mapping = nullptr;
+  std::size_t mappingSize = 0;
+  std::byte *cells = nullptr;
+  /// The files mapped over the cells, as ranges of bytes from address 0.
+  std::vector<std::pair<std::size_t, std::size_t>> files = {};
+
+  MemoryMapping() = default;
+  void release();
+
+public:
+  MemoryMapping(MemoryLayout layout, std::size_t cellSize);
+  MemoryMapping(const MemoryMapping &) = delete;
+  auto operator=(const MemoryMapping &) -> MemoryMapping & = delete;
+  MemoryMapping(MemoryMapping &&other) noexcept;
+  auto operator=(MemoryMapping &&other) noexcept -> MemoryMapping &;
+  ~MemoryMapping();
+
+  /// The layout, with all sizes rounded up to whole pages.
+  [[nodiscard]] auto getLayout() const -> const MemoryLayout & {
+    return layout;
+  }
+
+  /// The cell at address 0.
+  [[nodiscard]] auto base() const -> std::byte * { return cells; }
+
+  /// The same pages, without unmapping them on destruction: e.g. for the
+  /// threads of a CMa. The original must outlive the share.
+  [[nodiscard]] auto share() const -> MemoryMapping;
+
+  /// The size in bytes of the stack pages up to the last one that was
+  /// touched, whether it is in memory or swapped out: the high-water mark of
+  /// the stack, as the kernel keeps it. Without `/proc/self/pagemap`, the
+  /// whole stack.
+  [[nodiscard]] auto touchedStackBytes() const -> std::size_t;
+
+  /// Zeroes the stack: the pages in memory up to the last of them are
+  /// overwritten, so they stay warm; those above are given back.
+  void clearStack();
+
+  /// Gives the pages of stack and heap back to the kernel; they read as zero
+  /// again.
+  void discard();
+
+  /**
+   * @brief Maps a file over the cells from `address` on, so that they read
+   * its contents; pages are only read from disk when touched.
+   * @details The file must hold whole cells, and the cells must lie in the
+   * stack or the heap region, starting at a page. Unless `isWritable`, the
+   * cells are read-only, and a write ends the program like an access out of
+   * bounds; otherwise writes go to private copies of the pages.
+   * @return The number of cells mapped.
+   */
+  auto mapFile(std::string_view path, std::size_t address, bool isWritable)
+      -> std::size_t;
+
+  /// Puts zeroed, writable pages back where files were mapped.
+  void unmapFiles();
+
+  [[nodiscard]] auto hasFiles() const -> bool { return !files.empty(); }
+};
+
+/**
+ * @brief The memory of a CMa, made of cells of type `Word`.
+ */
+template <typename Word> class BasicMemory {
+  MemoryMapping mapping;
+  Word *cells;
+
+  explicit BasicMemory(MemoryMapping shared)
+      : mapping{std::move(shared)},
+        cells{reinterpret_cast<Word *>(mapping.base())} {}
+
+public:
+  explicit BasicMemory(MemoryLayout layout = {})
+      : mapping{layout, sizeof(Word)},
+        cells{reinterpret_cast<Word *>(mapping.base())} {}
+
+  /// The same cells (see `MemoryMapping::share`).
+  [[nodiscard]] auto share() const -> BasicMemory {
+    return BasicMemory(mapping.share());
+  }
+
+  /// The layout, with all sizes rounded up to whole pages.
+  [[nodiscard]] auto getLayout() const -> const MemoryLayout & {
+    return mapping.getLayout();
+  }
+
+  /**
+   * @brief Zeroes the cells a program may have written, keeping their pages.
+   * @param heapBottom The high-water mark of the heap; the stack's is asked
+   * from the kernel.
+   */
+  void clear(std::size_t heapBottom) {
+    mapping.clearStack();
+    std::fill(cells + heapBottom, cells + size(), Word{0});
+  }
+
+  /// Zeroes all cells by giving their pages back (see
+  /// `MemoryMapping::discard`).
+  void discard() { mapping.discard(); }
+
+  /// See `MemoryMapping::mapFile`.
+  auto mapFile(std::string_view path, std::size_t address, bool isWritable)
+      -> std::size_t {
+    return mapping.mapFile(path, address, isWritable);
+  }
+
+  /// See `MemoryMapping::unmapFiles`.
+  void unmapFiles() { mapping.unmapFiles(); }
+
+  /// Whether `mapFile` mapped files that are still there.
+  [[nodiscard]] auto hasFiles() const -> bool { return mapping.hasFiles(); }
+
+  /// See `MemoryMapping::touchedStackBytes`.
+  [[nodiscard]] auto touchedStackCells() const -> std::size_t {
+    return mapping.touchedStackBytes() / sizeof(Word);
+  }
+
+  [[nodiscard]] auto size() const -> std::size_t { return getLayout().size(); }
+  [[nodiscard]] auto data() -> Word * { return cells; }
+  [[nodiscard]] auto data() const -> const Word * { return cells; }
+
+  auto operator[](std::ptrdiff_t address) -> Word & { return cells[address]; }
+  auto operator[](std::ptrdiff_t address) const -> const Word & {
+    return cells[address];
+  }
+};
+
+using Memory = BasicMemory<int>;
+
+} // namespace vm::cma
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef TUM_I2_VM_LIB_CMA_NATIVES
+#define TUM_I2_VM_LIB_CMA_NATIVES
+
+#include "lib/CMachine.hpp"
+#include "lib/Error.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace vm::cma {
+
+/**
+ * @brief The cells `[address, address + count)` of `memory`, after checking
+ * that they are in it.
+ */
+template <typename Word>
+auto nativeRange(std::span<Word> memory, Word address, Word count)
+    -> std::span<Word> {
+  bool isInMemory = 0 <= address && 0 <= count &&
+                    static_cast<std::size_t>(address) <= memory.size() &&
+                    static_cast<std::size_t>(count) <=
+                        memory.size() - static_cast<std::size_t>(address);
+  dbg_assert(isInMemory, "Native function outside of memory", address, count);
+  return memory.subspan(static_cast<std::size_t>(address),
+                        static_cast<std::size_t>(count));
+}
+
+/**
+ * @brief The host functions that `cma` registers, by number:
+ *
+ *  0. `sort`: pops a count and below it an address, and sorts that many
+ *     cells from the address on in ascending order.
+ *  1. `hash`: pops a count and an address like `sort`, and pushes the FNV-1a
+ *     hash of the cells.
+ *  2. `parse`: pops a count and an address like `sort`, and pushes the
+ *     decimal number written in the cells, one character code per cell.
+ */
+template <typename Word>
+auto standardNatives() -> std::vector<NativeFunction<Word>> {
+  auto sort = [](std::span<Word> memory, int &sp, int /*fp*/) {
+    std::ranges::sort(nativeRange(memory, memory[sp - 1], memory[sp]));
+    sp -= 2;
+  };
+  auto hash = [](std::span<Word> memory, int &sp, int /*fp*/) {
+    std::uint64_t hash = 14695981039346656037U;
+    for (Word cell : nativeRange(memory, memory[sp - 1], memory[sp])) {
+      hash = (hash ^ static_cast<std::uint64_t>(cell)) * 1099511628211U;
+    }
+    sp -= 1;
+    memory[sp] = static_cast<Word>(hash);
+  };
+  auto parse = [](std::span<Word> memory, int &sp, int /*fp*/) {
+    auto text = nativeRange(memory, memory[sp - 1], memory[sp]);
+    bool isNegative = !text.empty() && text.front() == '-';
+    // Summed up in unsigned arithmetic, so that overlong numbers wrap like
+    // the arithmetic of the machine.
+    std::uint64_t value = 0;
+    for (Word c : text.subspan(isNegative ? 1 : 0)) {
+      dbg_assert('0' <= c && c <= '9', "parse of a non-digit", c);
+      value = value * 10 + static_cast<std::uint64_t>(c - '0');
+    }
+    sp -= 1;
+    memory[sp] = static_cast<Word>(isNegative ? 0 - value : value);
+  };
+  return {{.function = sort, .effect = {.pops = 2, .pushes = 0}},
+          {.function = hash, .effect = {.pops = 2, .pushes = 1}},
+          {.function = parse, .effect = {.pops = 2, .pushes = 1}}};
+}
+
+} // namespace vm::cma
+
+#endif
@@ -0,0 +1,816 @@
+#include "lib/CMaOptimizer.hpp"
+#include "lib/CMaVerifier.hpp"
+#include "lib/CMachine.hpp"
+#include "lib/Error.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <optional>
+#include <print>
+#include <vector>
+
+namespace vm::cma {
+
+namespace {
+
+/**
+ * @brief The basic blocks of a program and the edges between them.
+ * @details Besides jumps, calls and returns, blocks start at every code
+ * address that a `loadc` pushes (functions) and at every entry of a `jumpi`
+ * table. Table entries are also *pinned*: `jumpi` selects them by position,
+ * so none of them may be removed.
+ */
+struct ControlFlowGraph {
+  struct Block {
+    int start;
+    int end;
+    std::vector<int> successors;
+  };
+
+  std::vector<bool> isLeader;
+  std::vector<bool> isPinned;
+  std::vector<Block> blocks = {};
+  std::vector<int> blockOf;
+
+  ControlFlowGraph(const std::vector<Instr> &code,
+                   const std::vector<bool> &isCodeAddress)
+      : isLeader(code.size() + 1), isPinned(code.size() + 1),
+        blockOf(code.size() + 1) {
+    int n = static_cast<int>(code.size());
+    auto isInProgram = [&](int target) { return 0 <= target && target < n; };
+    auto lead = [&](int target) {
+      if (isInProgram(target)) {
+        isLeader[target] = true;
+      }
+    };
+
+    lead(0);
+    for (int i = 0; i < n; ++i) {
+      Instr instruction = code[i];
+      switch (instruction.type) {
+      case Instr::Jump:
+      case Instr::Jumpz:
+        lead(instruction.arg);
+        lead(i + 1);
+        break;
+      case Instr::Jumpi:
+        for (int t = instruction.arg; isInProgram(t); ++t) {
+          isLeader[t] = true;
+          isPinned[t] = true;
+          if (code[t].type != Instr::Jump) {
+            break;
+          }
+        }
+        lead(i + 1);
+        break;
+      case Instr::Call:
+      case Instr::Return:
+      case Instr::TailCall:
+      case Instr::Halt: lead(i + 1); break;
+      case Instr::Loadc:
+        if (isCodeAddress[i]) {
+          lead(instruction.arg);
+        }
+        break;
+      default: break;
+      }
+    }
+
+    for (int i = 0; i < n; ++i) {
+      if (isLeader[i]) {
+        blocks.push_back({.start = i, .end = i + 1, .successors = {}});
+      } else {
+        blocks.back().end = i + 1;
+      }
+      blockOf[i] = static_cast<int>(blocks.size()) - 1;
+    }
+
+    for (Block &block : blocks) {
+      auto edge = [&](int target) {
+        if (isInProgram(target)) {
+          block.successors.push_back(blockOf[target]);
+        }
+      };
+      for (int i = block.start; i < block.end; ++i) {
+        if (code[i].type == Instr::Loadc && isCodeAddress[i]) {
+          edge(code[i].arg);
+        }
+      }
+      Instr last = code[block.end - 1];
+      switch (last.type) {
+      case Instr::Jump: edge(last.arg); break;
+      case Instr::Jumpz:
+        edge(last.arg);
+        edge(block.end);
+        break;
+      case Instr::Jumpi:
+        for (int t = last.arg; isInProgram(t) && isPinned[t]; ++t) {
+          edge(t);
+          if (code[t].type != Instr::Jump) {
+            break;
+          }
+        }
+        break;
+      case Instr::Return:
+      case Instr::TailCall:
+      case Instr::Halt: break;
+      // `call` comes back to the next instruction.
+      default: edge(block.end); break;
+      }
+    }
+  }
+};
+
+auto isFoldable(Instr::Type t) -> bool {
+  switch (t) {
+  case Instr::Add:
+  case Instr::Sub:
+  case Instr::Mul:
+  case Instr::Div:
+  case Instr::Mod:
+  case Instr::And:
+  case Instr::Or:
+  case Instr::Xor:
+  case Instr::Eq:
+  case Instr::Neq:
+  case Instr::Le:
+  case Instr::Leq:
+  case Instr::Gr:
+  case Instr::Geq: return true;
+  default: return false;
+  }
+}
+
+/// `a t b` as `CMa::execute` computes it, if that is defined.
+auto fold(Instr::Type t, int a, int b) -> std::optional<int> {
+  auto wrap = [](long long value) {
+    return static_cast<int>(static_cast<unsigned>(value));
+  };
+  switch (t) {
+  case Instr::Add: return wrap(static_cast<long long>(a) + b);
+  case Instr::Sub: return wrap(static_cast<long long>(a) - b);
+  case Instr::Mul: return wrap(static_cast<long long>(a) * b);
+  case Instr::Div:
+  case Instr::Mod:
+    if (b == 0 || (a == INT_MIN && b == -1)) {
+      return std::nullopt;
+    }
+    return t == Instr::Div ? a / b : a % b;
+  case Instr::And: return a != 0 && b != 0;
+  case Instr::Or: return a != 0 || b != 0;
+  case Instr::Xor: return (a != 0) ^ (b != 0);
+  case Instr::Eq: return a == b;
+  case Instr::Neq: return a != b;
+  case Instr::Le: return a < b;
+  case Instr::Leq: return a <= b;
+  case Instr::Gr: return a > b;
+  case Instr::Geq: return a >= b;
+  default: return std::nullopt;
+  }
+}
+
+/**
+ * @brief An instruction of a rebuilt program.
+ */
+struct Rewritten {
+  /// What the argument is relative to.
+  enum Target : std::uint8_t {
+    /// Not a code address.
+    None,
+    /// An address in the program before it was rebuilt.
+    Old,
+    /// An offset from the start of the replacement it is part of.
+    Local,
+  };
+
+  Instr instruction;
+  bool isCodeAddress = false;
+  Target target = None;
+};
+
+/**
+ * @brief A function that can be spliced into its callers: it calls nothing,
+ * does not use `jumpi` and its body is the contiguous range after its
+ * `enter`.
+ */
+struct LeafFunction {
+  /// The address of the `enter`.
+  int entry;
+  /// One past the last instruction of the body.
+  int end;
+  /// The argument of the `enter`.
+  int frame;
+};
+
+class Optimizer {
+  std::vector<Instr> &code;
+  std::vector<bool> isCodeAddress;
+  OptimizationReport &report;
+  std::vector<bool> removed = {};
+
+  auto size() const -> int { return static_cast<int>(code.size()); }
+
+  /// The next instruction after `i` in its block that is still there.
+  auto next(const ControlFlowGraph &cfg, int i) const -> std::optional<int> {
+    int end = cfg.blocks[cfg.blockOf[i]].end;
+    for (int j = i + 1; j < end; ++j) {
+      if (!removed[j]) {
+        return j;
+      }
+    }
+    return std::nullopt;
+  }
+
+  auto isConstant(int i) const -> bool {
+    return code[i].type == Instr::Loadc && !isCodeAddress[i];
+  }
+
+  void remove(int i, std::size_t &counter) {
+    removed[i] = true;
+    counter += 1;
+  }
+
+  /**
+   * @brief Replaces every instruction `i` with `replacements[i]` and remaps
+   * all code addresses.
+   * @details An old address maps to the start of its replacement, so an
+   * empty replacement maps to what follows it.
+   */
+  void rebuild(const std::vector<std::vector<Rewritten>> &replacements) {
+    int n = size();
+    std::vector<int> newAddress(n + 1);
+    int length = 0;
+    for (int i = 0; i < n; ++i) {
+      newAddress[i] = length;
+      length += static_cast<int>(replacements[i].size());
+    }
+    newAddress[n] = length;
+
+    // Addresses behind the end of the program still leave it.
+    auto remap = [&](int address) {
+      if (address < 0) {
+        return address;
+      }
+      return address <= n ? newAddress[address] : address - n + length;
+    };
+    std::vector<Instr> rebuilt = {};
+    std::vector<bool> rebuiltIsCodeAddress = {};
+    for (int i = 0; i < n; ++i) {
+      for (Rewritten r : replacements[i]) {
+        if (r.target == Rewritten::Old) {
+          r.instruction.arg = remap(r.instruction.arg);
+        } else if (r.target == Rewritten::Local) {
+          r.instruction.arg += newAddress[i];
+        }
+        rebuilt.push_back(r.instruction);
+        rebuiltIsCodeAddress.push_back(r.isCodeAddress);
+      }
+    }
+    for (int &address : report.addressMap) {
+      address = remap(address);
+    }
+    code = std::move(rebuilt);
+    isCodeAddress = std::move(rebuiltIsCodeAddress);
+  }
+
+  /// Instruction `i` as it is, as a replacement.
+  auto unchanged(int i) const -> Rewritten {
+    Instr instruction = code[i];
+    bool isJump = instruction.type == Instr::Jump ||
+                  instruction.type == Instr::Jumpz ||
+                  instruction.type == Instr::Jumpi;
+    return {.instruction = instruction,
+            .isCodeAddress = isCodeAddress[i],
+            .target = isJump || isCodeAddress[i] ? Rewritten::Old
+                                                 : Rewritten::None};
+  }
+
+  /// Removes the marked instructions and remaps all code addresses.
+  auto compact() -> bool {
+    int n = size();
+    std::vector<std::vector<Rewritten>> replacements(n);
+    bool isChanged = false;
+    for (int i = 0; i < n; ++i) {
+      if (removed[i]) {
+        isChanged = true;
+      } else {
+        replacements[i].push_back(unchanged(i));
+      }
+    }
+    if (isChanged) {
+      rebuild(replacements);
+    }
+    return isChanged;
+  }
+
+  void threadJumps(const ControlFlowGraph &cfg) {
+    int n = size();
+    for (int i = 0; i < n; ++i) {
+      Instr &instruction = code[i];
+      if (instruction.type != Instr::Jump && instruction.type != Instr::Jumpz) {
+        continue;
+      }
+      int target = instruction.arg;
+      int steps = 0;
+      for (; steps < n && 0 <= target && target < n &&
+             code[target].type == Instr::Jump;
+           ++steps) {
+        target = code[target].arg;
+      }
+      if (steps == n) {
+        // The jumps form a cycle: leave them alone.
+        target = instruction.arg;
+      }
+      if (target != instruction.arg) {
+        instruction.arg = target;
+        report.threaded += 1;
+      }
+      if (target == i + 1 && !cfg.isPinned[i]) {
+        if (instruction.type == Instr::Jump) {
+          remove(i, report.threaded);
+        } else {
+          // The condition still has to go.
+          instruction = {Instr::Pop, 1};
+          report.threaded += 1;
+        }
+      }
+    }
+  }
+
+  void foldConstants(const ControlFlowGraph &cfg) {
+    for (int i = 0; i < size(); ++i) {
+      if (removed[i] || !isConstant(i)) {
+        continue;
+      }
+      auto j = next(cfg, i);
+      if (!j) {
+        continue;
+      }
+      Instr::Type t = code[*j].type;
+      if (t == Instr::Neg || t == Instr::Not) {
+        int a = code[i].arg;
+        code[i].arg = t == Instr::Neg
+                          ? static_cast<int>(0U - static_cast<unsigned>(a))
+                          : static_cast<int>(a == 0);
+        remove(*j, report.folded);
+        i -= 1; // The result may fold further.
+      } else if (t == Instr::Jumpz && !cfg.isPinned[i]) {
+        if (code[i].arg == 0) {
+          code[*j].type = Instr::Jump;
+        } else {
+          remove(*j, report.folded);
+        }
+        remove(i, report.folded);
+      } else if (isConstant(*j)) {
+        auto k = next(cfg, *j);
+        if (!k || !isFoldable(code[*k].type)) {
+          continue;
+        }
+        auto result = fold(code[*k].type, code[i].arg, code[*j].arg);
+        if (result) {
+          code[i].arg = *result;
+          remove(*j, report.folded);
+          remove(*k, report.folded);
+          i -= 1;
+        }
+      }
+    }
+  }
+
+  void cancelPops(const ControlFlowGraph &cfg) {
+    for (int i = 0; i < size(); ++i) {
+      if (removed[i] || cfg.isPinned[i]) {
+        continue;
+      }
+      Instr &instruction = code[i];
+      bool isEmpty = (instruction.type == Instr::Pop ||
+                      instruction.type == Instr::Alloc) &&
+                     instruction.arg == 0;
+      if (isEmpty) {
+        remove(i, report.cancelled);
+        continue;
+      }
+      auto j = next(cfg, i);
+      if (!j || code[*j].type != Instr::Pop || code[*j].arg < 1) {
+        continue;
+      }
+      if (instruction.type == Instr::Dup || instruction.type == Instr::Loadc) {
+        // The pushed value is popped right away.
+        remove(i, report.cancelled);
+        code[*j].arg -= 1;
+        if (code[*j].arg == 0) {
+          remove(*j, report.cancelled);
+        }
+      } else if (instruction.type == Instr::Pop && instruction.arg > 0) {
+        instruction.arg += code[*j].arg;
+        remove(*j, report.cancelled);
+        i -= 1;
+      }
+    }
+  }
+
+  void removeUnreachable(const ControlFlowGraph &cfg) {
+    std::vector<bool> isReachable(cfg.blocks.size());
+    std::vector<int> worklist = {};
+    if (!cfg.blocks.empty()) {
+      isReachable[0] = true;
+      worklist.push_back(0);
+    }
+    while (!worklist.empty()) {
+      int block = worklist.back();
+      worklist.pop_back();
+      for (int successor : cfg.blocks[block].successors) {
+        if (!isReachable[successor]) {
+          isReachable[successor] = true;
+          worklist.push_back(successor);
+        }
+      }
+    }
+    for (std::size_t b = 0; b < cfg.blocks.size(); ++b) {
+      if (!isReachable[b]) {
+        for (int i = cfg.blocks[b].start; i < cfg.blocks[b].end; ++i) {
+          remove(i, report.unreachable);
+        }
+      }
+    }
+  }
+
+  /// For each instruction, the `enter` that dominates it, -1 if there is
+  /// none and -2 if there are several.
+  auto dominatingEnters() const -> std::vector<int> {
+    int n = size();
+    std::vector<int> enterOf(n, -1);
+    std::vector<int> worklist = {};
+    for (int i = 0; i < n; ++i) {
+      if (code[i].type == Instr::Enter) {
+        enterOf[i] = i;
+        worklist.push_back(i);
+      }
+    }
+    auto reach = [&](int target, int enter) {
+      if (target < 0 || target >= n || code[target].type == Instr::Enter ||
+          enterOf[target] == enter || enterOf[target] == -2) {
+        return;
+      }
+      enterOf[target] = enterOf[target] == -1 ? enter : -2;
+      worklist.push_back(target);
+    };
+    while (!worklist.empty()) {
+      int i = worklist.back();
+      worklist.pop_back();
+      Instr instruction = code[i];
+      switch (instruction.type) {
+      case Instr::Jump: reach(instruction.arg, enterOf[i]); break;
+      case Instr::Jumpz:
+        reach(instruction.arg, enterOf[i]);
+        reach(i + 1, enterOf[i]);
+        break;
+      case Instr::Jumpi:
+        for (int t = instruction.arg; 0 <= t && t < n; ++t) {
+          reach(t, enterOf[i]);
+          if (code[t].type != Instr::Jump) {
+            break;
+          }
+        }
+        break;
+      case Instr::Return:
+      case Instr::TailCall:
+      case Instr::Halt: break;
+      // The callee has an `enter` of its own.
+      default: reach(i + 1, enterOf[i]); break;
+      }
+    }
+    return enterOf;
+  }
+
+  /// The function at `entry`, if it can be inlined.
+  auto leafFunction(int entry, const Verification &verification) const
+      -> std::optional<LeafFunction> {
+    int n = size();
+    if (entry < 0 || entry >= n || code[entry].type != Instr::Enter) {
+      return std::nullopt;
+    }
+    std::vector<bool> isInBody(n);
+    std::vector<int> worklist = {entry + 1};
+    int end = entry + 1;
+    while (!worklist.empty()) {
+      int i = worklist.back();
+      worklist.pop_back();
+      // Jumping back to the `enter` is jumping to the body.
+      i = i == entry ? entry + 1 : i;
+      if (i <= entry || i >= n) {
+        return std::nullopt;
+      }
+      if (isInBody[i]) {
+        continue;
+      }
+      isInBody[i] = true;
+      end = std::max(end, i + 1);
+      if (end - entry - 1 > static_cast<int>(maxInlinedSize)) {
+        return std::nullopt;
+      }
+      Instr instruction = code[i];
+      switch (instruction.type) {
+      case Instr::Debug:
+      case Instr::Jumpi:
+      case Instr::Mark:
+      case Instr::Call:
+      case Instr::TailCall:
+      case Instr::Enter: return std::nullopt;
+      case Instr::Loadr:
+      case Instr::Storer:
+      case Instr::Loadrc:
+        // The saved registers do not exist once the call is gone.
+        if (-3 < instruction.arg && instruction.arg < 1) {
+          return std::nullopt;
+        }
+        worklist.push_back(i + 1);
+        break;
+      case Instr::Jump: worklist.push_back(instruction.arg); break;
+      case Instr::Jumpz:
+        worklist.push_back(instruction.arg);
+        worklist.push_back(i + 1);
+        break;
+      case Instr::Return:
+        if (!verification.states[i]) {
+          return std::nullopt;
+        }
+        break;
+      case Instr::Halt: break;
+      default: worklist.push_back(i + 1); break;
+      }
+    }
+    for (int i = entry + 1; i < end; ++i) {
+      if (!isInBody[i]) {
+        return std::nullopt;
+      }
+    }
+    return LeafFunction{
+        .entry = entry, .end = end, .frame = code[entry].arg};
+  }
+
+  /**
+   * @brief The body of `leaf` for the call site at `site`, whose `mark`
+   * finds the stack at `height` above the caller's frame.
+   * @details Without `mark` and `call`, the callee's stack starts right
+   * above the arguments, so its locals move down by 3 cells while its
+   * arguments stay where they are. A `return` pops down to the arguments
+   * and jumps behind the `call`.
+   */
+  auto inlinedBody(int site, int height, LeafFunction leaf,
+                   const Verification &verification) const
+      -> std::vector<Rewritten> {
+    auto lengthOf = [&](int i) {
+      if (code[i].type != Instr::Return) {
+        return 1;
+      }
+      return (verification.states[i]->height > 0 ? 1 : 0) +
+             (i + 1 < leaf.end ? 1 : 0);
+    };
+    std::vector<int> offset(leaf.end - leaf.entry);
+    for (int i = leaf.entry + 1; i + 1 < leaf.end; ++i) {
+      offset[i + 1 - leaf.entry] = offset[i - leaf.entry] + lengthOf(i);
+    }
+    auto frameOffset = [&](int arg) {
+      return arg < 0 ? height + 3 + arg : height + arg;
+    };
+
+    std::vector<Rewritten> body = {};
+    for (int i = leaf.entry + 1; i < leaf.end; ++i) {
+      Instr instruction = code[i];
+      switch (instruction.type) {
+      case Instr::Loadr:
+      case Instr::Storer:
+      case Instr::Loadrc:
+        body.push_back(
+            {.instruction = {instruction.type, frameOffset(instruction.arg)}});
+        break;
+      case Instr::Jump:
+      case Instr::Jumpz:
+        body.push_back({.instruction = {instruction.type,
+                                        offset[instruction.arg - leaf.entry]},
+                        .target = Rewritten::Local});
+        break;
+      case Instr::Return: {
+        int returnHeight = verification.states[i]->height;
+        if (returnHeight > 0) {
+          body.push_back({.instruction = {Instr::Pop, returnHeight}});
+        }
+        if (i + 1 < leaf.end) {
+          body.push_back({.instruction = {Instr::Jump, site + 3},
+                          .target = Rewritten::Old});
+        }
+      } break;
+      default: body.push_back(unchanged(i)); break;
+      }
+    }
+    return body;
+  }
+
+  /// Splices small leaf functions into their call sites.
+  auto inlineLeafFunctions() -> bool {
+    auto verification = verify(code, SIZE_MAX);
+    if (!verification.isVerified()) {
+      return false;
+    }
+    int n = size();
+    ControlFlowGraph cfg(code, isCodeAddress);
+    std::vector<int> enterOf = dominatingEnters();
+    std::map<int, std::optional<LeafFunction>> leaves = {};
+    std::map<int, std::pair<int, LeafFunction>> sites = {};
+    for (int i = 0; i + 2 < n; ++i) {
+      bool isCallSite = code[i].type == Instr::Mark &&
+                        code[i + 1].type == Instr::Loadc &&
+                        isCodeAddress[i + 1] &&
+                        code[i + 2].type == Instr::Call &&
+                        !cfg.isLeader[i + 1] && !cfg.isLeader[i + 2];
+      if (!isCallSite || !verification.states[i] || enterOf[i] < 0) {
+        continue;
+      }
+      int callee = code[i + 1].arg;
+      if (!leaves.contains(callee)) {
+        leaves[callee] = leafFunction(callee, verification);
+      }
+      if (!leaves[callee]) {
+        continue;
+      }
+      // The callee's frame now lies in the caller's.
+      int height = verification.states[i]->height;
+      Instr &enter = code[enterOf[i]];
+      enter.arg = std::max(enter.arg, height + leaves[callee]->frame);
+      sites[i] = {height, *leaves[callee]};
+    }
+    if (sites.empty()) {
+      return false;
+    }
+
+    std::vector<std::vector<Rewritten>> replacements(n);
+    for (int i = 0; i < n; ++i) {
+      if (auto site = sites.find(i); site != sites.end()) {
+        auto [height, leaf] = site->second;
+        replacements[i] = inlinedBody(i, height, leaf, verification);
+        // The `loadc` and `call` are gone.
+        i += 2;
+      } else {
+        replacements[i].push_back(unchanged(i));
+      }
+    }
+    report.inlined += sites.size();
+    rebuild(replacements);
+    return true;
+  }
+
+  /**
+   * @brief Turns `mark; loadc f; call; slide k; storer -3; return` inside
+   * `f` itself into `loadc f; tailcall k+1`.
+   * @details Only self calls qualify: then the callee has as many arguments
+   * as the frame it replaces, and its result lands where the `storer -3`
+   * would have put it.
+   */
+  void eliminateTailCalls(const ControlFlowGraph &cfg) {
+    std::vector<int> enterOf = dominatingEnters();
+    // Leaders, but without those that only follow a `call`.
+    std::vector<bool> isTarget(cfg.isPinned);
+    for (int i = 0; i < size(); ++i) {
+      bool isJump = code[i].type == Instr::Jump || code[i].type == Instr::Jumpz;
+      int target = code[i].arg;
+      if ((isJump || isCodeAddress[i]) && 0 <= target && target < size()) {
+        isTarget[target] = true;
+      }
+    }
+    for (int i = 0; i + 5 < size(); ++i) {
+      bool isTailCall =
+          code[i].type == Instr::Mark && code[i + 1].type == Instr::Loadc &&
+          isCodeAddress[i + 1] && code[i + 2].type == Instr::Call &&
+          code[i + 3].type == Instr::Slide && code[i + 3].arg >= 0 &&
+          code[i + 4].type == Instr::Storer && code[i + 4].arg == -3 &&
+          code[i + 5].type == Instr::Return;
+      if (!isTailCall || code[i + 1].arg != enterOf[i]) {
+        continue;
+      }
+      bool isEnteredInside = false;
+      for (int j = i + 1; j <= i + 5; ++j) {
+        isEnteredInside |= isTarget[j];
+      }
+      if (isEnteredInside) {
+        continue;
+      }
+      removed[i] = true;
+      code[i + 2] = {Instr::TailCall, code[i + 3].arg + 1};
+      for (int j = i + 3; j <= i + 5; ++j) {
+        removed[j] = true;
+      }
+      report.tailCalls += 1;
+    }
+  }
+
+  /// Runs a pass on a fresh control flow graph and removes what it marked.
+  template <typename Pass> auto run(Pass pass) -> bool {
+    removed.assign(code.size(), false);
+    OptimizationReport before = report;
+    pass(ControlFlowGraph(code, isCodeAddress));
+    bool changed = compact();
+    return changed || before.folded != report.folded ||
+           before.threaded != report.threaded;
+  }
+
+public:
+  Optimizer(std::vector<Instr> &code, std::vector<bool> isCodeAddress,
+            OptimizationReport &report)
+      : code{code}, isCodeAddress{std::move(isCodeAddress)}, report{report} {
+    dbg_assert_eq(code.size(), this->isCodeAddress.size(),
+                  "Every instruction needs its isCodeAddress flag");
+    for (Instr instruction : code) {
+      dbg_assert_eq(instruction.type, Instr::baseType(instruction.type),
+                    "Superinstructions cannot be optimized");
+    }
+  }
+
+  void optimize() {
+    // Every pass shrinks the program, retargets a jump closer to its final
+    // destination or removes a call, so this terminates; the bound is a
+    // safeguard.
+    for (int round = 0; round < size() + 1; ++round) {
+      bool changed = inlineLeafFunctions();
+      changed |= run([&](const auto &cfg) { eliminateTailCalls(cfg); });
+      changed |= run([&](const auto &cfg) { threadJumps(cfg); });
+      changed |= run([&](const auto &cfg) { foldConstants(cfg); });
+      changed |= run([&](const auto &cfg) { cancelPops(cfg); });
+      changed |= run([&](const auto &cfg) { removeUnreachable(cfg); });
+      if (!changed) {
+        break;
+      }
+    }
+  }
+};
+
+/**
+ * @brief Marks the numeric `loadc` right before a `call` or `tailcall` as a
+ * code address, so that it is remapped like a label.
+ * @return The first call whose target comes from anywhere else (or that is
+ * jumped to), which the optimizer cannot follow.
+ */
+auto markCallTargets(const std::vector<Instr> &code,
+                     std::vector<bool> &isCodeAddress) -> std::optional<int> {
+  int n = static_cast<int>(code.size());
+  for (int i = 0; i < n; ++i) {
+    bool isConstant = i > 0 && code[i - 1].type == Instr::Loadc &&
+                      0 <= code[i - 1].arg && code[i - 1].arg <= n;
+    if ((code[i].type == Instr::Call || code[i].type == Instr::TailCall) &&
+        isConstant) {
+      isCodeAddress[i - 1] = true;
+    }
+  }
+  ControlFlowGraph cfg(code, isCodeAddress);
+  for (int i = 0; i < n; ++i) {
+    bool isCall =
+        code[i].type == Instr::Call || code[i].type == Instr::TailCall;
+    if (isCall && (i == 0 || !isCodeAddress[i - 1] || cfg.isLeader[i])) {
+      return i;
+    }
+  }
+  return std::nullopt;
+}
+
+} // namespace
+
+void OptimizationReport::print(FILE *out) const {
+  double reduction =
+      before == 0 ? 0.0
+                  : 100.0 * static_cast<double>(before - after) /
+                        static_cast<double>(before);
+  std::println(out, "Optimized {} to {} instructions (-{:.1f}%)", before,
+               after, reduction);
+  if (computedCall) {
+    std::println(out, "    not optimized: the target of the call at {} is "
+                      "not a constant",
+                 *computedCall);
+    return;
+  }
+  std::println(
+      out,
+      "    {} inlined, {} tail calls, {} folded, {} threaded, {} unreachable, "
+      "{} cancelled",
+      inlined, tailCalls, folded, threaded, unreachable, cancelled);
+}
+
+auto optimize(std::vector<Instr> &instructions,
+              std::vector<bool> isCodeAddress) -> OptimizationReport {
+  OptimizationReport report = {.before = instructions.size()};
+  report.addressMap.resize(instructions.size() + 1);
+  for (std::size_t i = 0; i < report.addressMap.size(); ++i) {
+    report.addressMap[i] = static_cast<int>(i);
+  }
+  report.computedCall = markCallTargets(instructions, isCodeAddress);
+  if (!report.computedCall) {
+    Optimizer(instructions, std::move(isCodeAddress), report).optimize();
+  }
+  report.after = instructions.size();
+  return report;
+}
+
+} // namespace vm::cma
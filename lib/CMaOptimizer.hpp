@@ -0,0 +1,70 @@
+#ifndef TUM_I2_VM_LIB_CMA_OPTIMIZER
+#define TUM_I2_VM_LIB_CMA_OPTIMIZER
+
+#include "lib/CMachine.hpp"
+
+#include <cstddef>
+#include <cstdio>
+#include <optional>
+#include <vector>
+
+namespace vm::cma {
+
+/// Leaf functions with at most this many instructions (besides their
+/// `enter`) are inlined.
+constexpr std::size_t maxInlinedSize = 16;
+
+/**
+ * @brief What `optimize` did to a program.
+ */
+struct OptimizationReport {
+  std::size_t before = 0;
+  std::size_t after = 0;
+  /// Call sites replaced with the body of the function they called.
+  std::size_t inlined = 0;
+  /// Self calls in tail position turned into `tailcall`.
+  std::size_t tailCalls = 0;
+  /// Constant expressions and conditional jumps on constants.
+  std::size_t folded = 0;
+  /// Jumps retargeted past other jumps or removed as jumps to the next
+  /// instruction.
+  std::size_t threaded = 0;
+  /// Instructions removed as unreachable.
+  std::size_t unreachable = 0;
+  /// Pushes cancelled by the `pop` that follows them, and empty pops.
+  std::size_t cancelled = 0;
+  /// The new address of every old instruction, and of the end of the
+  /// program. Removed instructions map to their next surviving successor.
+  std::vector<int> addressMap = {};
+  /// The first `call` whose target is not a constant, if the program was
+  /// therefore left as it is.
+  std::optional<int> computedCall = {};
+
+  void print(FILE *out) const;
+};
+
+/**
+ * @brief Shrinks a program without changing what it does.
+ * @details Builds the control flow graph and runs inlining, tail-call
+ * elimination, constant folding, jump threading, dead-code elimination and
+ * `dup`/`pop` cancellation until none of them finds anything more. Only
+ * functions that call nothing (and hence are not recursive) and have at most
+ * `maxInlinedSize` instructions are inlined, and only into programs that
+ * `verify` accepts: the verifier knows the stack height at every call site,
+ * which is what the callee's frame offsets are rewritten with. Instructions
+ * are removed, so every code address is remapped: jump targets, `jumpi`
+ * tables, the `loadc` immediates in `isCodeAddress` and numeric `loadc`
+ * constants right before a `call` or `tailcall`. Programs that call any
+ * other address (e.g. one loaded from memory or computed from a label) are
+ * left as they are, with `computedCall` set. The instructions must not be
+ * fused into superinstructions yet.
+ * @param instructions The program, rewritten in place.
+ * @param isCodeAddress For each instruction, whether its argument is a code
+ * address (a label), as collected by the parser.
+ */
+auto optimize(std::vector<Instr> &instructions,
+              std::vector<bool> isCodeAddress) -> OptimizationReport;
+
+} // namespace vm::cma
+
+#endif
@@ -0,0 +1,275 @@
+#ifndef TUM_I2_VM_LIB_CMA_PARSER
+#define TUM_I2_VM_LIB_CMA_PARSER
+
+#include "lib/CMachine.hpp"
+#include "lib/Common.hpp"
+#include "lib/Error.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace vm::cma {
+
+/**
+ * @brief The parser of the textual CMa programs, behind
+ * `ProgramLoader::loadInstructions`.
+ * @details Everything is `constexpr`, so that programs can also be parsed in
+ * constant evaluation (see lib/CMaConstant.hpp). The text is walked twice:
+ * once to find the labels, once to emit the instructions.
+ * @tparam Arg The type of the arguments, i.e. the range of numbers in the
+ * text.
+ */
+template <typename Arg> class BasicProgramParser {
+  using Label = std::pair<std::string_view, std::int32_t>;
+  using Instruction = InstrFor<Arg>;
+
+  std::string_view text;
+  std::size_t position = 0;
+  std::int32_t instr_number = 0;
+  std::vector<Instruction> instructions = {};
+  /// Whether the argument of each instruction was given as a label.
+  std::vector<bool> hasLabelArg = {};
+  /// Sorted by name and then address, so the first definition of a label
+  /// comes first.
+  std::vector<Label> jumpLabels = {};
+
+  enum class Mode : std::uint8_t { GatherLabels, EmitInstructions };
+  Mode mode = Mode::GatherLabels;
+
+  constexpr auto atEnd() -> bool { return position >= text.size(); }
+  constexpr auto peek() -> char { return atEnd() ? '\0' : text[position]; }
+
+  constexpr auto advance() -> char {
+    char c = peek();
+    position++;
+    return c;
+  }
+
+  constexpr void consume(char c) {
+    if (peek() != c) {
+      dbg_fail("Expected different char", peek());
+    }
+    advance();
+  }
+
+  constexpr void skipComments() {
+    consume('/');
+    consume('/');
+    while (peek() != '\n' && !atEnd()) {
+      advance();
+    }
+    consume('\n');
+  }
+
+  constexpr auto isBlank(char c) -> bool {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+  }
+
+  constexpr auto isNumeric(char c) -> bool {
+    return ('0' <= c && c <= '9') || c == '-';
+  }
+
+  constexpr auto isIdentStart(char c) -> bool {
+    return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_';
+  }
+
+  constexpr auto isIdentPart(char c) -> bool {
+    return isIdentStart(c) || isNumeric(c);
+  }
+
+  constexpr void skipWhiteSpace() {
+    while (isBlank(peek()) && !atEnd()) {
+      advance();
+    }
+  }
+
+  constexpr void skip() {
+    while (!atEnd()) {
+      if (peek() == '/') {
+        skipComments();
+      } else if (isBlank(peek())) {
+        skipWhiteSpace();
+      } else {
+        break;
+      }
+    }
+  }
+
+  constexpr auto consumeColon() -> bool {
+    skip();
+    bool hasColon = peek() == ':';
+    if (hasColon) {
+      consume(':');
+    }
+    skip();
+    return hasColon;
+  }
+
+  constexpr auto readWord() -> std::string_view {
+    skip();
+    std::size_t start = position;
+    while (isIdentPart(peek()) && !atEnd()) {
+      advance();
+    }
+    auto w = text.substr(start, position - start);
+    skip();
+    return w;
+  }
+
+  /// Like `std::from_chars`, which is not `constexpr` everywhere yet.
+  static constexpr auto parseNumber(std::string_view literal) -> Arg {
+    constexpr Arg min = std::numeric_limits<Arg>::min();
+    bool isNegative = literal.starts_with('-');
+    std::string_view digits = literal.substr(isNegative ? 1 : 0);
+    // Summed up negatively, so that the smallest `Arg` fits as well.
+    Arg value = 0;
+    bool isValid = !digits.empty();
+    for (char c : digits) {
+      int digit = c - '0';
+      isValid = isValid && 0 <= digit && digit <= 9 &&
+                value >= (min + digit) / 10;
+      if (!isValid) {
+        break;
+      }
+      value = static_cast<Arg>(value * 10 - digit);
+    }
+    isValid = isValid && (isNegative || value != min);
+    dbg_assert(isValid, "Could not parse full number", literal);
+    return isNegative ? value : static_cast<Arg>(-value);
+  }
+
+  constexpr auto readNumber() -> Arg {
+    skip();
+    std::size_t start = position;
+    if (peek() == '-' || peek() == '+') {
+      advance();
+    }
+    while (isNumeric(peek()) && !atEnd()) {
+      advance();
+    }
+    auto literal = text.substr(start, position - start);
+    skip();
+    return parseNumber(literal);
+  }
+
+  constexpr void registerLabel(std::string_view name) {
+    if (mode == Mode::GatherLabels) {
+      jumpLabels.emplace_back(name, instr_number);
+    }
+  }
+
+  constexpr auto labelAddress(std::string_view name) -> std::int32_t {
+    auto label = std::ranges::lower_bound(jumpLabels, name, {}, &Label::first);
+    dbg_assert(label != jumpLabels.end() && label->first == name,
+               "Unknown label", name);
+    return label->second;
+  }
+
+  constexpr void handleInstruction(Instr::Type t, Arg arg = 1) {
+    if (mode == Mode::EmitInstructions) {
+      instructions.push_back({t, arg});
+      hasLabelArg.push_back(false);
+    }
+    instr_number += 1;
+  }
+
+  constexpr void handleInstruction(Instr::Type t, std::string_view label) {
+    if (mode == Mode::EmitInstructions) {
+      instructions.push_back({t, labelAddress(label)});
+      hasLabelArg.push_back(true);
+    }
+    instr_number += 1;
+  }
+
+  constexpr void parseInstruction(std::string_view word) {
+    Instr::Type instructionType = Instr::fromString(word);
+
+    if (Instr::hasMandatoryArg(instructionType)) {
+      if (isIdentStart(peek())) {
+        handleInstruction(instructionType, readWord());
+      } else if (isNumeric(peek())) {
+        handleInstruction(instructionType, readNumber());
+      } else {
+        dbg_fail("bad char", peek());
+      }
+    } else if (Instr::hasOptionalArg(instructionType)) {
+      if (isNumeric(peek())) {
+        handleInstruction(instructionType, readNumber());
+      } else {
+        handleInstruction(instructionType);
+      }
+    } else {
+      handleInstruction(instructionType);
+    }
+  }
+
+  constexpr void consumeWord() {
+    auto word = readWord();
+    if (consumeColon()) {
+      registerLabel(word);
+    } else {
+      parseInstruction(word);
+    }
+  }
+
+  constexpr void walk(Mode m) {
+    mode = m;
+    position = 0;
+    instr_number = 0;
+    instructions.clear();
+    hasLabelArg.clear();
+    if (mode == Mode::GatherLabels) {
+      jumpLabels.clear();
+    }
+
+    for (skip(); !atEnd(); skip()) {
+      consumeWord();
+    }
+    if (mode == Mode::GatherLabels) {
+      std::ranges::sort(jumpLabels);
+    }
+  }
+
+public:
+  constexpr explicit BasicProgramParser(std::string_view text)
+      : text{text} {}
+
+  constexpr auto parse() -> std::vector<Instruction> {
+    walk(Mode::GatherLabels);
+    walk(Mode::EmitInstructions);
+
+    return std::move(instructions);
+  }
+
+  /// After `parse`: which arguments were labels, i.e. code addresses.
+  constexpr auto labelArguments() -> std::vector<bool> {
+    return std::move(hasLabelArg);
+  }
+
+  /// The labels, in the order of their names; a label defined twice stands
+  /// for its first definition.
+  constexpr auto symbols() -> std::vector<common::Symbol> {
+    walk(Mode::GatherLabels);
+
+    std::vector<common::Symbol> symbols = {};
+    for (auto [name, address] : jumpLabels) {
+      if (symbols.empty() || symbols.back().name != name) {
+        symbols.push_back(
+            {.name = name, .address = static_cast<std::size_t>(address)});
+      }
+    }
+    return symbols;
+  }
+};
+
+/// The parser for `Instr`.
+using ProgramParser = BasicProgramParser<int>;
+
+} // namespace vm::cma
+
+#endif
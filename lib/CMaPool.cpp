@@ -0,0 +1,42 @@
+#include "lib/CMaPool.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <utility>
+
+namespace vm::cma {
+
+auto CMaPool::acquire(std::span<Instr> program) -> Lease {
+  std::unique_ptr<CMa> machine = nullptr;
+  {
+    std::scoped_lock lock(mutex);
+    if (!idle.empty()) {
+      machine = std::move(idle.back());
+      idle.pop_back();
+    }
+  }
+  if (machine == nullptr) {
+    machine = std::make_unique<CMa>(program, out, engine, layout);
+  } else {
+    machine->reset(program);
+  }
+  return {*this, std::move(machine)};
+}
+
+void CMaPool::giveBack(std::unique_ptr<CMa> machine) {
+  // Outside the lock, like the `reset` in `acquire`.
+  if (releasesIdle) {
+    machine->releaseMemory();
+  }
+  std::scoped_lock lock(mutex);
+  idle.push_back(std::move(machine));
+}
+
+auto CMaPool::idleCount() -> std::size_t {
+  std::scoped_lock lock(mutex);
+  return idle.size();
+}
+
+} // namespace vm::cma
@@ -0,0 +1,89 @@
+#ifndef TUM_I2_VM_LIB_CMA_POOL
+#define TUM_I2_VM_LIB_CMA_POOL
+
+#include "lib/CMaMemory.hpp"
+#include "lib/CMachine.hpp"
+
+#include <cstddef>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <utility>
+#include <vector>
+
+namespace vm::cma {
+
+/**
+ * @brief Warm CMa instances for programs that run in large numbers and only
+ * briefly.
+ * @details A new `CMa` maps its memory and faults in every page it touches;
+ * a machine from the pool was `reset` instead, so it keeps both. Any thread
+ * may acquire and return machines.
+ */
+class CMaPool {
+  FILE *out;
+  Engine engine;
+  MemoryLayout layout;
+  bool releasesIdle;
+  std::mutex mutex = {};
+  std::vector<std::unique_ptr<CMa>> idle = {};
+
+  void giveBack(std::unique_ptr<CMa> machine);
+
+public:
+  /**
+   * @brief A machine of the pool, which goes back to it when the lease
+   * ends.
+   */
+  class Lease {
+    CMaPool *pool;
+    std::unique_ptr<CMa> machine;
+
+    void release() {
+      if (machine != nullptr) {
+        pool->giveBack(std::move(machine));
+      }
+    }
+
+  public:
+    Lease(CMaPool &pool, std::unique_ptr<CMa> machine)
+        : pool{&pool}, machine{std::move(machine)} {}
+    Lease(Lease &&) noexcept = default;
+    /// Returns the machine held so far to its pool, then takes `other`'s.
+    auto operator=(Lease &&other) noexcept -> Lease & {
+      if (this != &other) {
+        release();
+        pool = other.pool;
+        machine = std::move(other.machine);
+      }
+      return *this;
+    }
+    ~Lease() { release(); }
+
+    auto operator*() const -> CMa & { return *machine; }
+    auto operator->() const -> CMa * { return machine.get(); }
+  };
+
+  /**
+   * @param releasesIdle Whether returned machines give their pages back to
+   * the kernel (see `CMa::releaseMemory`) rather than keep them until they
+   * are needed again.
+   */
+  CMaPool(FILE *out, Engine engine, MemoryLayout layout = {},
+          bool releasesIdle = false)
+      : out{out}, engine{engine}, layout{layout}, releasesIdle{releasesIdle} {}
+
+  /**
+   * @brief A machine ready to run `program`: an idle one if there is one,
+   * else a new one.
+   */
+  auto acquire(std::span<Instr> program) -> Lease;
+
+  /// The number of machines waiting in the pool.
+  auto idleCount() -> std::size_t;
+};
+
+} // namespace vm::cma
+
+#endif
@@ -0,0 +1,681 @@
+#include "lib/CMaBulk.hpp"
+#include "lib/CMachine.hpp"
+#include "lib/Common.hpp"
+#include "lib/Error.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <print>
+#include <vector>
+
+// The direct-threaded CMa engine.
+//
+// The program is translated once into an array of `Op`s that carry the
+// address of their handler instead of an opcode. Every handler executes its
+// instruction and then tail-calls the handler of the next `Op` itself, so
+// each opcode gets its own indirect branch (which the branch predictor can
+// learn independently) instead of all of them sharing the one in the `switch`
+// of `CMa::execute`.
+//
+// As in lib/MaMachine.cpp, the machine registers are threaded through the
+// handlers. Unlike there, they are passed as separate scalar arguments: a
+// `RegisterBank` larger than 16 bytes would be passed in memory by the
+// System V calling convention, whereas the first six integer arguments live
+// in registers for the whole run.
+
+namespace vm::cma {
+
+namespace {
+
+struct Op;
+struct Context;
+
+using Handler = auto(const Op *pc, int *memory, int sp, int fp, int ep, int np,
+                     Context &ctx) -> int;
+
+struct Op {
+  Handler *handler;
+  int arg;
+};
+
+struct Context {
+  CMa &virtualMachine;
+  const Op *code;
+  std::size_t size;
+  Heap &heap;
+  /// One past the end of the stack of the running thread.
+  int stackEnd;
+  /// Set when the threaded code hands back to the interpreter of the tiered
+  /// engine, rather than halting.
+  bool hasLeft = false;
+
+  /// Resolves a dynamic jump target, leaving the program on overrun.
+  [[nodiscard]] auto at(int address) const -> const Op * {
+    auto index = static_cast<std::size_t>(address);
+    return code + (index < size ? index : size);
+  }
+
+  [[nodiscard]] auto addressOf(const Op *pc) const -> int {
+    return static_cast<int>(pc - code);
+  }
+};
+
+/// The registers as seen by the body of a single instruction.
+struct Registers {
+  const Op *pc;
+  int *memory;
+  int sp;
+  int fp;
+  int ep;
+  int np;
+
+  /// Writes the registers back into the machine, e.g. before `debug()`.
+  void sync(Context &ctx) const {
+    ctx.virtualMachine.setRegisters({.programCounter = ctx.addressOf(pc) + 1,
+                                     .stackPointer = sp,
+                                     .framePointer = fp,
+                                     .extremePointer = ep,
+                                     .newPointer = np});
+  }
+};
+
+constexpr auto transfersControl(Instr::Type t) -> bool {
+  return t == Instr::Jump || t == Instr::Jumpz || t == Instr::Jumpi ||
+         t == Instr::Call || t == Instr::Return || t == Instr::TailCall;
+}
+
+/**
+ * @brief The semantics of a single instruction.
+ * @details On entry `r.pc` points at the instruction. Instructions that
+ * transfer control leave the next `Op` in `r.pc`, all others are advanced by
+ * `step()`.
+ */
+template <Instr::Type T> void apply(Registers &r, Context &ctx);
+
+#define OP(name)                                                               \
+  template <>                                                                  \
+  [[gnu::always_inline]] inline void apply<Instr::name>(                       \
+      [[maybe_unused]] Registers & r, [[maybe_unused]] Context & ctx)
+
+#define BIN_OP(expr)                                                           \
+  {                                                                            \
+    int b = r.memory[r.sp];                                                    \
+    r.sp -= 1;                                                                 \
+    int a = r.memory[r.sp];                                                    \
+    r.memory[r.sp] = (expr);                                                   \
+  }
+
+OP(Debug) {
+  r.sync(ctx);
+  ctx.virtualMachine.debug();
+}
+
+OP(Loadc) {
+  r.sp += 1;
+  r.memory[r.sp] = r.pc->arg;
+}
+
+// Unsigned, so that overflow wraps as in `CMa::execute` instead of being
+// undefined.
+#define WRAPPING_OP(op)                                                        \
+  BIN_OP(static_cast<int>(static_cast<unsigned>(a) op static_cast<unsigned>(b)))
+
+OP(Add) WRAPPING_OP(+)
+OP(Sub) WRAPPING_OP(-)
+OP(Mul) WRAPPING_OP(*)
+OP(Div) BIN_OP(a / b)
+OP(Mod) BIN_OP(a % b)
+OP(And) BIN_OP(a && b)
+OP(Or) BIN_OP(a || b)
+// Weird non-C semantics: logical exclusive or.
+OP(Xor) BIN_OP((a != 0) ^ (b != 0))
+OP(Eq) BIN_OP(a == b)
+OP(Neq) BIN_OP(a != b)
+OP(Le) BIN_OP(a < b)
+OP(Leq) BIN_OP(a <= b)
+OP(Gr) BIN_OP(a > b)
+OP(Geq) BIN_OP(a >= b)
+
+#undef WRAPPING_OP
+#undef BIN_OP
+
+OP(Not) { r.memory[r.sp] = !r.memory[r.sp]; }
+OP(Neg) {
+  r.memory[r.sp] = static_cast<int>(0U - static_cast<unsigned>(r.memory[r.sp]));
+}
+
+OP(Load) {
+  int dest = r.memory[r.sp];
+  int count = r.pc->arg;
+  for (int i = 0; i < count; ++i) {
+    r.memory[r.sp + i] = r.memory[dest + i];
+  }
+  r.sp += count - 1;
+}
+
+OP(Store) {
+  int dest = r.memory[r.sp];
+  int count = r.pc->arg;
+  for (int i = 0; i < count; ++i) {
+    r.memory[dest + i] = r.memory[r.sp - count + i];
+  }
+  r.sp -= 1;
+}
+
+OP(Loada) {
+  r.sp += 1;
+  r.memory[r.sp] = r.memory[r.pc->arg];
+}
+
+OP(Storea) { r.memory[r.pc->arg] = r.memory[r.sp]; }
+OP(Pop) { r.sp -= r.pc->arg; }
+
+OP(Jump) { r.pc = ctx.code + r.pc->arg; }
+
+OP(Jumpz) {
+  bool isZero = r.memory[r.sp] == 0;
+  r.sp -= 1;
+  r.pc = isZero ? ctx.code + r.pc->arg : r.pc + 1;
+}
+
+OP(Jumpi) {
+  int target = r.pc->arg + r.memory[r.sp];
+  r.sp -= 1;
+  r.pc = ctx.at(target);
+}
+
+OP(Dup) {
+  r.sp += 1;
+  r.memory[r.sp] = r.memory[r.sp - 1];
+}
+
+OP(Alloc) {
+  r.sp += r.pc->arg;
+  // See `CMa::execute`: the only instruction that moves the stack up without
+  // touching it.
+  if (r.sp >= ctx.stackEnd) [[unlikely]] {
+    r.sync(ctx);
+    ctx.virtualMachine.debug();
+    dbg_fail("Stack overflow", r.sp);
+  }
+}
+
+OP(New) { r.memory[r.sp] = ctx.heap.allocate(r.np, r.memory[r.sp]); }
+
+OP(Free) {
+  ctx.heap.release(r.np, r.memory[r.sp]);
+  r.sp -= 1;
+}
+
+OP(Mark) {
+  r.memory[r.sp + 1] = r.ep;
+  r.memory[r.sp + 2] = r.fp;
+  r.sp += 2;
+}
+
+OP(Call) {
+  int target = r.memory[r.sp];
+  r.memory[r.sp] = ctx.addressOf(r.pc) + 1;
+  r.fp = r.sp;
+  r.pc = ctx.at(target);
+}
+
+OP(Slide) {
+  int returnValue = r.memory[r.sp];
+  r.sp -= r.pc->arg;
+  r.memory[r.sp] = returnValue;
+}
+
+OP(Enter) {
+  r.ep = r.sp + r.pc->arg;
+  // See `CMa::execute`: the stacks of spawned threads have no guard pages.
+  if (r.ep >= ctx.stackEnd) [[unlikely]] {
+    r.sync(ctx);
+    ctx.virtualMachine.debug();
+    dbg_fail("Stack overflow", r.ep);
+  }
+}
+
+OP(Return) {
+  const Op *returnAddress = ctx.at(r.memory[r.fp]);
+  r.ep = r.memory[r.fp - 2];
+  r.sp = r.fp - 3;
+  r.fp = r.memory[r.sp + 2];
+  r.pc = returnAddress;
+}
+
+OP(TailCall) {
+  int target = r.memory[r.sp];
+  int count = r.pc->arg;
+  std::copy_n(r.memory + r.sp - count, count, r.memory + r.fp - 2 - count);
+  r.sp = r.fp;
+  r.pc = ctx.at(target);
+}
+
+OP(Loadrc) {
+  r.sp += 1;
+  r.memory[r.sp] = r.fp + r.pc->arg;
+}
+
+OP(Loadr) {
+  int addr = r.fp + r.pc->arg;
+  r.sp += 1;
+  r.memory[r.sp] = r.memory[addr];
+}
+
+OP(Storer) { r.memory[r.fp + r.pc->arg] = r.memory[r.sp]; }
+
+OP(Copy) {
+  int count = r.memory[r.sp];
+  bulk::copy(r.memory + r.memory[r.sp - 2], r.memory + r.memory[r.sp - 1],
+             count);
+  r.sp -= 3;
+}
+
+OP(Fill) {
+  int count = r.memory[r.sp];
+  bulk::fill(r.memory + r.memory[r.sp - 2], r.memory[r.sp - 1], count);
+  r.sp -= 3;
+}
+
+OP(Sum) {
+  int count = r.memory[r.sp];
+  r.sp -= 1;
+  r.memory[r.sp] = bulk::sum(r.memory + r.memory[r.sp], count);
+}
+
+OP(Min) {
+  int count = r.memory[r.sp];
+  r.sp -= 1;
+  r.memory[r.sp] = bulk::min(r.memory + r.memory[r.sp], count);
+}
+
+OP(Max) {
+  int count = r.memory[r.sp];
+  r.sp -= 1;
+  r.memory[r.sp] = bulk::max(r.memory + r.memory[r.sp], count);
+}
+
+OP(Dot) {
+  int count = r.memory[r.sp];
+  r.sp -= 2;
+  r.memory[r.sp] = bulk::dot(r.memory + r.memory[r.sp],
+                             r.memory + r.memory[r.sp + 1], count);
+}
+
+OP(Find) {
+  int count = r.memory[r.sp];
+  r.sp -= 2;
+  r.memory[r.sp] =
+      bulk::find(r.memory + r.memory[r.sp], r.memory[r.sp + 1], count);
+}
+
+OP(Cmp) {
+  int count = r.memory[r.sp];
+  r.sp -= 2;
+  r.memory[r.sp] = bulk::compare(r.memory + r.memory[r.sp],
+                                 r.memory + r.memory[r.sp + 1], count);
+}
+
+OP(Spawn) {
+  int function = r.memory[r.sp];
+  r.sp -= 1;
+  r.memory[r.sp] =
+      ctx.virtualMachine.spawn(function, r.memory[r.sp], r.np);
+}
+
+OP(Join) { r.memory[r.sp] = ctx.virtualMachine.join(r.memory[r.sp]); }
+
+OP(Cas) {
+  int desired = r.memory[r.sp];
+  int expected = r.memory[r.sp - 1];
+  r.sp -= 2;
+  std::atomic_ref<int>(r.memory[r.memory[r.sp]])
+      .compare_exchange_strong(expected, desired);
+  r.memory[r.sp] = expected;
+}
+
+OP(FetchAdd) {
+  int value = r.memory[r.sp];
+  r.sp -= 1;
+  r.memory[r.sp] =
+      std::atomic_ref<int>(r.memory[r.memory[r.sp]]).fetch_add(value);
+}
+
+OP(CallNative) { ctx.virtualMachine.callNative(r.pc->arg, r.sp, r.fp); }
+
+OP(Print) {
+  int x = r.memory[r.sp];
+  r.sp -= 1;
+  std::println(ctx.virtualMachine.getOutFile(), "{}", x);
+}
+
+#undef OP
+
+/**
+ * @brief The quickened form of `T`, with the argument `Arg` built in rather
+ * than read from `r.pc`, as in `CMa::execute`.
+ */
+template <Instr::Type T, int Arg>
+[[gnu::always_inline]] inline void applyQuickened(Registers &r) {
+  if constexpr (T == Instr::Load) {
+    int dest = r.memory[r.sp];
+    for (int i = 0; i < Arg; ++i) {
+      r.memory[r.sp + i] = r.memory[dest + i];
+    }
+    r.sp += Arg - 1;
+  } else if constexpr (T == Instr::Store) {
+    int dest = r.memory[r.sp];
+    for (int i = 0; i < Arg; ++i) {
+      r.memory[dest + i] = r.memory[r.sp - Arg + i];
+    }
+    r.sp -= 1;
+  } else if constexpr (T == Instr::Pop) {
+    r.sp -= Arg;
+  } else if constexpr (T == Instr::Loadr) {
+    r.sp += 1;
+    r.memory[r.sp] = r.memory[r.fp + Arg];
+  } else if constexpr (T == Instr::Storer) {
+    r.memory[r.fp + Arg] = r.memory[r.sp];
+  } else {
+    static_assert(T != T, "No quickened form of this instruction");
+  }
+}
+
+template <Instr::Type T>
+[[gnu::always_inline]] inline void step(Registers &r, Context &ctx) {
+  apply<T>(r, ctx);
+  if constexpr (!transfersControl(T)) {
+    r.pc += 1;
+  }
+}
+
+#define DISPATCH(r)                                                            \
+  [[clang::musttail]] return r.pc->handler(r.pc, r.memory, r.sp, r.fp, r.ep,   \
+                                           r.np, ctx);
+
+template <Instr::Type T>
+auto handle(const Op *pc, int *memory, int sp, int fp, int ep, int np,
+            Context &ctx) -> int {
+  Registers r = {pc, memory, sp, fp, ep, np};
+  step<T>(r, ctx);
+  DISPATCH(r)
+}
+
+template <Instr::Type T, int Arg>
+auto handleQuickened(const Op *pc, int *memory, int sp, int fp, int ep, int np,
+                     Context &ctx) -> int {
+  Registers r = {pc, memory, sp, fp, ep, np};
+  applyQuickened<T, Arg>(r);
+  r.pc += 1;
+  DISPATCH(r)
+}
+
+/**
+ * @brief Executes a superinstruction, i.e. all of its parts in one handler.
+ * @details The parts other than the first are still in the following slots,
+ * so each part finds its argument at `r.pc` as usual.
+ */
+template <Instr::Type... Parts>
+auto handleFused(const Op *pc, int *memory, int sp, int fp, int ep, int np,
+                 Context &ctx) -> int {
+  static constexpr std::array parts = {Parts...};
+  static_assert(std::ranges::none_of(parts.begin(), parts.end() - 1,
+                                     transfersControl),
+                "only the last part of a superinstruction may jump");
+  Registers r = {pc, memory, sp, fp, ep, np};
+  (step<Parts>(r, ctx), ...);
+  DISPATCH(r)
+}
+
+/// Handles both `halt` and running off the end of the program.
+auto doHalt(const Op *pc, int *memory, int sp, int fp, int ep, int np,
+            Context &ctx) -> int {
+  Registers r = {pc, memory, sp, fp, ep, np};
+  r.sync(ctx);
+  return memory[0];
+}
+
+/// Handles the `trap` of a breakpoint: stops like `halt`, where the
+/// interpreter can go on.
+auto doTrap(const Op *pc, int *memory, int sp, int fp, int ep, int np,
+            Context &ctx) -> int {
+  Registers r = {pc, memory, sp, fp, ep, np};
+  r.sync(ctx);
+  ctx.virtualMachine.execute({Instr::Trap, 0});
+  return memory[0];
+}
+
+/// The handler of every slot that the tiered engine has not promoted: hands
+/// the registers back to the interpreter.
+auto doLeave(const Op *pc, int *memory, int sp, int fp, int ep, int np,
+             Context &ctx) -> int {
+  ctx.virtualMachine.setRegisters({.programCounter = ctx.addressOf(pc),
+                                   .stackPointer = sp,
+                                   .framePointer = fp,
+                                   .extremePointer = ep,
+                                   .newPointer = np});
+  ctx.hasLeft = true;
+  return memory[0];
+}
+
+#undef DISPATCH
+
+auto makeDispatchTable() -> std::array<Handler *, Instr::typeCount> {
+  using enum Instr::Type;
+  return common::checkedArray<Handler *, Instr::typeCount>({
+#define CMA_SUPERINSTRUCTION(name, ...) {name, handleFused<__VA_ARGS__>},
+#include "lib/CMaSuperinstructions.inc"
+#undef CMA_SUPERINSTRUCTION
+      {Instr::Debug, handle<Instr::Debug>},
+      {Instr::Loadc, handle<Instr::Loadc>},
+      {Instr::Add, handle<Instr::Add>},
+      {Instr::Sub, handle<Instr::Sub>},
+      {Instr::Mul, handle<Instr::Mul>},
+      {Instr::Div, handle<Instr::Div>},
+      {Instr::Mod, handle<Instr::Mod>},
+      {Instr::And, handle<Instr::And>},
+      {Instr::Or, handle<Instr::Or>},
+      {Instr::Xor, handle<Instr::Xor>},
+      {Instr::Eq, handle<Instr::Eq>},
+      {Instr::Neq, handle<Instr::Neq>},
+      {Instr::Le, handle<Instr::Le>},
+      {Instr::Leq, handle<Instr::Leq>},
+      {Instr::Gr, handle<Instr::Gr>},
+      {Instr::Geq, handle<Instr::Geq>},
+      {Instr::Not, handle<Instr::Not>},
+      {Instr::Neg, handle<Instr::Neg>},
+      {Instr::Load, handle<Instr::Load>},
+      {Instr::Store, handle<Instr::Store>},
+      {Instr::Loada, handle<Instr::Loada>},
+      {Instr::Storea, handle<Instr::Storea>},
+      {Instr::Pop, handle<Instr::Pop>},
+      {Instr::Jump, handle<Instr::Jump>},
+      {Instr::Jumpz, handle<Instr::Jumpz>},
+      {Instr::Jumpi, handle<Instr::Jumpi>},
+      {Instr::Dup, handle<Instr::Dup>},
+      {Instr::Alloc, handle<Instr::Alloc>},
+      {Instr::New, handle<Instr::New>},
+      {Instr::Free, handle<Instr::Free>},
+      {Instr::Mark, handle<Instr::Mark>},
+      {Instr::Call, handle<Instr::Call>},
+      {Instr::Slide, handle<Instr::Slide>},
+      {Instr::Enter, handle<Instr::Enter>},
+      {Instr::Return, handle<Instr::Return>},
+      {Instr::TailCall, handle<Instr::TailCall>},
+      {Instr::Loadrc, handle<Instr::Loadrc>},
+      {Instr::Loadr, handle<Instr::Loadr>},
+      {Instr::Storer, handle<Instr::Storer>},
+      {Instr::Copy, handle<Instr::Copy>},
+      {Instr::Fill, handle<Instr::Fill>},
+      {Instr::Sum, handle<Instr::Sum>},
+      {Instr::Min, handle<Instr::Min>},
+      {Instr::Max, handle<Instr::Max>},
+      {Instr::Dot, handle<Instr::Dot>},
+      {Instr::Find, handle<Instr::Find>},
+      {Instr::Cmp, handle<Instr::Cmp>},
+      {Instr::Spawn, handle<Instr::Spawn>},
+      {Instr::Join, handle<Instr::Join>},
+      {Instr::Cas, handle<Instr::Cas>},
+      {Instr::FetchAdd, handle<Instr::FetchAdd>},
+      {Instr::CallNative, handle<Instr::CallNative>},
+      {Instr::Trap, doTrap},
+      {Instr::Halt, doHalt},
+      {Instr::Print, handle<Instr::Print>},
+#define CMA_QUICKENED(name, base, arg) {name, handleQuickened<base, arg>},
+#include "lib/CMaQuickened.inc"
+#undef CMA_QUICKENED
+  });
+}
+
+std::array dispatchTable = makeDispatchTable();
+
+/**
+ * @brief Translates the instructions into threaded code.
+ * @details A final `halt` is appended so that running off the end of the
+ * program needs no extra check; static jump targets beyond the end are
+ * redirected to it.
+ */
+auto translate(std::span<Instr> instructions) -> std::vector<Op> {
+  auto end = static_cast<int>(instructions.size());
+  std::vector<Op> code = {};
+  code.reserve(instructions.size() + 1);
+  for (Instr i : instructions) {
+    Instr::Type base = Instr::baseType(i.type);
+    bool isStaticJump = base == Instr::Jump || base == Instr::Jumpz;
+    int arg = isStaticJump && (i.arg < 0 || i.arg > end) ? end : i.arg;
+    code.push_back({dispatchTable.at(i.type), arg});
+  }
+  code.push_back({doHalt, 0});
+  return code;
+}
+
+/// Calls of a function before the tiered engine promotes it.
+constexpr std::uint32_t hotCalls = 1000;
+/// Iterations of a loop before the tiered engine promotes its function.
+constexpr std::uint32_t hotLoops = 1000;
+
+/**
+ * @brief The functions of a program for the tiered engine: the ranges
+ * between the entry of the program and the statically called addresses.
+ */
+class FunctionRanges {
+  std::vector<int> entries = {0};
+
+public:
+  explicit FunctionRanges(std::span<const Instr> instructions) {
+    auto end = static_cast<int>(instructions.size());
+    for (int i = 1; i < end; ++i) {
+      Instr::Type t = Instr::baseType(instructions[i].type);
+      Instr previous = instructions[i - 1];
+      bool isStaticCall = (t == Instr::Call || t == Instr::TailCall ||
+                           t == Instr::Spawn) &&
+                          previous.type == Instr::Loadc &&
+                          0 <= previous.arg && previous.arg < end;
+      if (isStaticCall) {
+        entries.push_back(previous.arg);
+      }
+    }
+    std::ranges::sort(entries);
+    auto [first, last] = std::ranges::unique(entries);
+    entries.erase(first, last);
+    entries.push_back(end);
+  }
+
+  [[nodiscard]] auto count() const -> std::size_t { return entries.size() - 1; }
+
+  /// The function that contains `address`.
+  [[nodiscard]] auto functionOf(int address) const -> std::size_t {
+    auto next = std::ranges::upper_bound(entries, address);
+    return static_cast<std::size_t>(next - entries.begin()) - 1;
+  }
+
+  [[nodiscard]] auto start(std::size_t function) const -> int {
+    return entries[function];
+  }
+  [[nodiscard]] auto end(std::size_t function) const -> int {
+    return entries[function + 1];
+  }
+};
+
+} // namespace
+
+template <> auto CMa::runThreaded() -> int {
+  std::vector<Op> code = translate(instructions);
+  Context ctx = {
+      .virtualMachine = *this,
+      .code = code.data(),
+      .size = instructions.size(),
+      .heap = heap,
+      .stackEnd = stackEnd,
+  };
+  const Op *start = ctx.at(programCounter);
+  return start->handler(start, memory.data(), stackPointer, framePointer,
+                        extremePointer, newPointer, ctx);
+}
+
+template <> auto CMa::runTiered() -> int {
+  auto size = static_cast<int>(instructions.size());
+  std::vector<Op> code = translate(instructions);
+  std::vector<Handler *> promoted = {};
+  for (int i = 0; i < size; ++i) {
+    promoted.push_back(code[i].handler);
+    code[i].handler = doLeave;
+  }
+  Context ctx = {
+      .virtualMachine = *this,
+      .code = code.data(),
+      .size = instructions.size(),
+      .heap = heap,
+      .stackEnd = stackEnd,
+  };
+
+  FunctionRanges functions(instructions);
+  std::vector<std::uint32_t> calls(functions.count());
+  std::vector<std::uint32_t> backEdges(instructions.size());
+  auto promote = [&](int address) {
+    std::size_t function = functions.functionOf(address);
+    for (int i = functions.start(function); i < functions.end(function);
+         ++i) {
+      code[i].handler = promoted[i];
+    }
+  };
+
+  while (0 <= programCounter && programCounter < size) {
+    const Op *op = &code[programCounter];
+    if (op->handler != doLeave) {
+      // Frames look the same in both tiers, so this is also how a loop
+      // that got hot is replaced on the stack.
+      ctx.hasLeft = false;
+      int result = op->handler(op, memory.data(), stackPointer, framePointer,
+                               extremePointer, newPointer, ctx);
+      if (!ctx.hasLeft) {
+        return result;
+      }
+      continue;
+    }
+
+    int from = programCounter;
+    Instr::Type t = Instr::baseType(instructions[from].type);
+    step();
+    if (programCounter < 0 || programCounter >= size) {
+      break;
+    }
+    // Superinstructions may end in a jump, so back edges are recognised by
+    // where they go rather than by their type.
+    bool isCall = t == Instr::Call || t == Instr::TailCall;
+    bool isBackEdge = !isCall && t != Instr::Return && programCounter <= from;
+    if (isCall && ++calls[functions.functionOf(programCounter)] == hotCalls) {
+      promote(programCounter);
+    } else if (isBackEdge && ++backEdges[programCounter] == hotLoops) {
+      promote(programCounter);
+    }
+  }
+  return memory[0];
+}
+
+} // namespace vm::cma
@@ -0,0 +1,85 @@
+#ifndef TUM_I2_VM_LIB_CMA_THREADS
+#define TUM_I2_VM_LIB_CMA_THREADS
+
+#include "lib/Error.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace vm::cma {
+
+/// The cells of the stack of each thread that `spawn` starts.
+constexpr int threadStackCells = 1 << 16;
+
+/**
+ * @brief The threads started by the `spawn` instructions of one program.
+ * @details Each thread runs a machine of its own, which shares memory and
+ * heap with the one that started it. Threads are numbered from 1 in the
+ * order they were started; the destructor waits for those that were not
+ * joined.
+ * @tparam Machine The `BasicCMa` the threads run.
+ */
+template <typename Machine> class ThreadGroup {
+  struct Thread {
+    std::unique_ptr<Machine> machine;
+    /// The address of the thread's stack, a block of the heap.
+    int stack;
+    bool isJoined = false;
+    std::thread thread = {};
+  };
+
+  std::mutex mutex = {};
+  /// A deque, so that threads stay in place while others are started.
+  std::deque<Thread> threads = {};
+
+public:
+  ThreadGroup() = default;
+  ThreadGroup(const ThreadGroup &) = delete;
+  auto operator=(const ThreadGroup &) -> ThreadGroup & = delete;
+
+  ~ThreadGroup() {
+    for (Thread &t : threads) {
+      if (t.thread.joinable()) {
+        t.thread.join();
+      }
+    }
+  }
+
+  /**
+   * @brief Runs `machine` in a new thread.
+   * @return The number of the thread.
+   */
+  auto start(std::unique_ptr<Machine> machine, int stack) -> int {
+    std::scoped_lock lock(mutex);
+    Thread &t = threads.emplace_back(std::move(machine), stack);
+    t.thread = std::thread([m = t.machine.get()] { m->run(); });
+    return static_cast<int>(threads.size());
+  }
+
+  /**
+   * @brief Waits for a thread to end.
+   * @param id The number `start` returned; every thread is joined once.
+   * @return The address of the thread's stack.
+   */
+  auto join(std::int64_t id) -> int {
+    Thread *t = nullptr;
+    {
+      std::scoped_lock lock(mutex);
+      bool isThread = 0 < id && static_cast<std::size_t>(id) <= threads.size();
+      dbg_assert(isThread, "join of a thread that spawn did not return", id);
+      t = &threads[id - 1];
+      dbg_assert(!t->isJoined, "join of a thread that was joined already", id);
+      t->isJoined = true;
+    }
+    t->thread.join();
+    return t->stack;
+  }
+};
+
+} // namespace vm::cma
+
+#endif
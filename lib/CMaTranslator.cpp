@@ -0,0 +1,569 @@
+#include "lib/CMaTranslator.hpp"
+#include "lib/CMachine.hpp"
+#include "lib/Error.hpp"
+
+#include <cstddef>
+#include <cstdio>
+#include <print>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace vm::cma {
+
+namespace {
+
+// The runtime of a translated program: the memory and the instructions that
+// are not worth inlining. Kept in sync with `CMa::debug` and `CMa::execute`.
+constexpr std::string_view runtime = R"(
+int memory[memorySize];
+
+// Two's complement arithmetic, like the interpreter on the host.
+[[maybe_unused]] auto add(int a, int b) -> int {
+  return static_cast<int>(static_cast<unsigned>(a) + static_cast<unsigned>(b));
+}
+
+[[maybe_unused]] auto sub(int a, int b) -> int {
+  return static_cast<int>(static_cast<unsigned>(a) - static_cast<unsigned>(b));
+}
+
+[[maybe_unused]] auto mul(int a, int b) -> int {
+  return static_cast<int>(static_cast<unsigned>(a) * static_cast<unsigned>(b));
+}
+
+[[maybe_unused]] void debug(int pc, int sp, int fp, int ep, int np) {
+  std::printf("CMa state: SP = %d, PC = %d, FP = %d, EP = %d, NP = %d\n", sp,
+              pc, fp, ep, np);
+  constexpr int maxStackCount = 10;
+  int start = (sp > maxStackCount ? sp : maxStackCount) - maxStackCount;
+  std::printf("    stack: ");
+  if (start > 0) {
+    std::printf("...   ");
+  }
+  for (int i = start; i <= sp; ++i) {
+    std::printf("%d   ", memory[i]);
+  }
+  std::printf("<- top\n");
+}
+
+// The bulk memory instructions of lib/CMaBulk.hpp, as loops for the compiler
+// to vectorize.
+[[maybe_unused]] void fill(int dest, int value, int count) {
+  for (int i = 0; i < count; ++i) {
+    memory[dest + i] = value;
+  }
+}
+
+[[maybe_unused]] auto sum(int address, int count) -> int {
+  unsigned result = 0;
+  for (int i = 0; i < count; ++i) {
+    result += static_cast<unsigned>(memory[address + i]);
+  }
+  return static_cast<int>(result);
+}
+
+[[maybe_unused]] auto min(int address, int count) -> int {
+  int result = std::numeric_limits<int>::max();
+  for (int i = 0; i < count; ++i) {
+    result = std::min(result, memory[address + i]);
+  }
+  return result;
+}
+
+[[maybe_unused]] auto max(int address, int count) -> int {
+  int result = std::numeric_limits<int>::min();
+  for (int i = 0; i < count; ++i) {
+    result = std::max(result, memory[address + i]);
+  }
+  return result;
+}
+
+[[maybe_unused]] auto dot(int left, int right, int count) -> int {
+  unsigned result = 0;
+  for (int i = 0; i < count; ++i) {
+    result += static_cast<unsigned>(memory[left + i]) *
+              static_cast<unsigned>(memory[right + i]);
+  }
+  return static_cast<int>(result);
+}
+
+[[maybe_unused]] auto find(int address, int value, int count) -> int {
+  for (int i = 0; i < count; ++i) {
+    if (memory[address + i] == value) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+[[maybe_unused]] auto compare(int left, int right, int count) -> int {
+  for (int i = 0; i < count; ++i) {
+    int a = memory[left + i];
+    int b = memory[right + i];
+    if (a != b) {
+      return a < b ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+// The interpreter traps on the guard pages above the stack instead.
+[[noreturn, maybe_unused]] void stackOverflow() {
+  std::fflush(stdout);
+  std::fprintf(stderr, "Stack overflow\n");
+  std::exit(EXIT_FAILURE);
+}
+
+// `new` and `free`, with the allocator of lib/CMaHeap.hpp (see
+// `heapSource`).
+vm::cma::Heap heap(memory, heapStart, memorySize);
+
+[[maybe_unused]] auto allocate(int &np, int size) -> int {
+  return heap.allocate(np, size);
+}
+
+[[maybe_unused]] void release(int np, int address) {
+  heap.release(np, address);
+}
+
+[[noreturn, maybe_unused]] void notAnEntryPoint(int pc) {
+  std::fflush(stdout);
+  std::fprintf(stderr,
+               "Computed jump to instruction %d, which is no entry point of "
+               "the translation (see cma-aot --all-entries)\n",
+               pc);
+  std::exit(EXIT_FAILURE);
+}
+
+auto run() -> int {
+  [[maybe_unused]] int pc = 0;
+  [[maybe_unused]] int sp = -1;
+  [[maybe_unused]] int fp = -1;
+  [[maybe_unused]] int ep = -1;
+  [[maybe_unused]] int np = memorySize - 1;
+)";
+
+// lib/CMaHeap.hpp as it was when the library was built (see CMakeLists.txt),
+// so that translated programs allocate exactly like the interpreter. It only
+// declares how to fail on a bad `free`.
+constexpr std::string_view heapSource =
+#include "generated/CMaHeapSource.inc"
+    ;
+
+constexpr std::string_view invalidFree = R"(
+[[noreturn]] void vm::cma::HeapClasses::invalidFree(std::int64_t address) {
+  std::fflush(stdout);
+  std::fprintf(stderr,
+               "free of an address that new did not return or that is free: "
+               "%lld\n",
+               static_cast<long long>(address));
+  std::exit(EXIT_FAILURE);
+}
+)";
+
+class Translator {
+  FILE *out;
+  std::span<const Instr> instructions;
+  EntryPoints entries;
+  /// The interpreter's default layout, so that `new` returns the same
+  /// addresses; the guard costs only address space here too. A static array
+  /// has no guard pages, though, so `enter` checks for overflow explicitly.
+  MemoryLayout layout = {};
+
+  auto end() const -> int { return static_cast<int>(instructions.size()); }
+
+  auto label(int target) const -> std::string {
+    if (target < 0 || target >= end()) {
+      return "end";
+    }
+    return "i" + std::to_string(target);
+  }
+
+  void binary(std::string_view expression) {
+    std::println(out, "  sp -= 1;");
+    std::println(out, "  memory[sp] = {};", expression);
+  }
+
+  /// Replaces the three topmost cells with `function` applied to them.
+  void ternary(std::string_view function) {
+    std::println(out, "  sp -= 2;");
+    std::println(out, "  memory[sp] = {}(memory[sp], memory[sp + 1], "
+                      "memory[sp + 2]);",
+                 function);
+  }
+
+  void emit(int index, Instr instruction) {
+    int arg = instruction.arg;
+    switch (Instr::baseType(instruction.type)) {
+    case Instr::Debug: {
+      std::println(out, "  debug({}, sp, fp, ep, np);", index + 1);
+    } break;
+
+    case Instr::Loadc: std::println(out, "  memory[++sp] = {};", arg); break;
+
+    case Instr::Add: binary("add(memory[sp], memory[sp + 1])"); break;
+    case Instr::Sub: binary("sub(memory[sp], memory[sp + 1])"); break;
+    case Instr::Mul: binary("mul(memory[sp], memory[sp + 1])"); break;
+    case Instr::Div: binary("memory[sp] / memory[sp + 1]"); break;
+    case Instr::Mod: binary("memory[sp] % memory[sp + 1]"); break;
+    case Instr::And: binary("memory[sp] && memory[sp + 1]"); break;
+    case Instr::Or: binary("memory[sp] || memory[sp + 1]"); break;
+    case Instr::Xor:
+      binary("(memory[sp] != 0) ^ (memory[sp + 1] != 0)");
+      break;
+    case Instr::Eq: binary("memory[sp] == memory[sp + 1]"); break;
+    case Instr::Neq: binary("memory[sp] != memory[sp + 1]"); break;
+    case Instr::Le: binary("memory[sp] < memory[sp + 1]"); break;
+    case Instr::Leq: binary("memory[sp] <= memory[sp + 1]"); break;
+    case Instr::Gr: binary("memory[sp] > memory[sp + 1]"); break;
+    case Instr::Geq: binary("memory[sp] >= memory[sp + 1]"); break;
+
+    case Instr::Not: std::println(out, "  memory[sp] = !memory[sp];"); break;
+    case Instr::Neg:
+      std::println(out, "  memory[sp] = sub(0, memory[sp]);");
+      break;
+
+    case Instr::Load: {
+      if (arg == 1) {
+        std::println(out, "  memory[sp] = memory[memory[sp]];");
+        break;
+      }
+      std::println(out, "  {{");
+      std::println(out, "    int dest = memory[sp];");
+      std::println(out, "    for (int i = 0; i < {}; ++i) {{", arg);
+      std::println(out, "      memory[sp + i] = memory[dest + i];");
+      std::println(out, "    }}");
+      std::println(out, "    sp += {};", arg - 1);
+      std::println(out, "  }}");
+    } break;
+
+    case Instr::Store: {
+      if (arg == 1) {
+        std::println(out, "  memory[memory[sp]] = memory[sp - 1];");
+        std::println(out, "  sp -= 1;");
+        break;
+      }
+      std::println(out, "  {{");
+      std::println(out, "    int dest = memory[sp];");
+      std::println(out, "    for (int i = 0; i < {}; ++i) {{", arg);
+      std::println(out, "      memory[dest + i] = memory[sp - {} + i];", arg);
+      std::println(out, "    }}");
+      std::println(out, "    sp -= 1;");
+      std::println(out, "  }}");
+    } break;
+
+    case Instr::Loada: {
+      std::println(out, "  sp += 1;");
+      std::println(out, "  memory[sp] = memory[{}];", arg);
+    } break;
+
+    case Instr::Storea:
+      std::println(out, "  memory[{}] = memory[sp];", arg);
+      break;
+
+    case Instr::Pop: std::println(out, "  sp -= {};", arg); break;
+
+    case Instr::Dup: {
+      std::println(out, "  sp += 1;");
+      std::println(out, "  memory[sp] = memory[sp - 1];");
+    } break;
+
+    case Instr::Jump: std::println(out, "  goto {};", label(arg)); break;
+
+    case Instr::Jumpz: {
+      std::println(out, "  if (memory[sp--] == 0) {{");
+      std::println(out, "    goto {};", label(arg));
+      std::println(out, "  }}");
+    } break;
+
+    case Instr::Jumpi: {
+      std::println(out, "  pc = add({}, memory[sp--]);", arg);
+      std::println(out, "  goto dispatch;");
+    } break;
+
+    case Instr::Alloc: {
+      std::println(out, "  sp += {};", arg);
+      std::println(out, "  if (sp >= stackCells) {{");
+      std::println(out, "    stackOverflow();");
+      std::println(out, "  }}");
+    } break;
+
+    case Instr::New:
+      std::println(out, "  memory[sp] = allocate(np, memory[sp]);");
+      break;
+
+    case Instr::Free: std::println(out, "  release(np, memory[sp--]);"); break;
+
+    case Instr::Mark: {
+      std::println(out, "  memory[sp + 1] = ep;");
+      std::println(out, "  memory[sp + 2] = fp;");
+      std::println(out, "  sp += 2;");
+    } break;
+
+    case Instr::Call: {
+      // `loadc f; call` that nobody jumps into calls a known function.
+      bool isDirect = index > 0 && !entries.isLabel[index] &&
+                      instructions[index - 1].type == Instr::Loadc;
+      if (!isDirect) {
+        std::println(out, "  pc = memory[sp];");
+      }
+      std::println(out, "  memory[sp] = {};", index + 1);
+      std::println(out, "  fp = sp;");
+      if (isDirect) {
+        std::println(out, "  goto {};", label(instructions[index - 1].arg));
+      } else {
+        std::println(out, "  goto dispatch;");
+      }
+    } break;
+
+    case Instr::Slide: {
+      if (arg == 0) {
+        break;
+      }
+      std::println(out, "  memory[sp - {}] = memory[sp];", arg);
+      std::println(out, "  sp -= {};", arg);
+    } break;
+
+    case Instr::Enter: {
+      std::println(out, "  ep = sp + {};", arg);
+      std::println(out, "  if (ep >= stackCells) {{");
+      std::println(out, "    stackOverflow();");
+      std::println(out, "  }}");
+    } break;
+
+    case Instr::Return: {
+      std::println(out, "  pc = memory[fp];");
+      std::println(out, "  ep = memory[fp - 2];");
+      std::println(out, "  sp = fp - 3;");
+      std::println(out, "  fp = memory[sp + 2];");
+      std::println(out, "  goto dispatch;");
+    } break;
+
+    case Instr::TailCall: {
+      bool isDirect = index > 0 && !entries.isLabel[index] &&
+                      instructions[index - 1].type == Instr::Loadc;
+      if (!isDirect) {
+        std::println(out, "  pc = memory[sp];");
+      }
+      std::println(out, "  for (int i = 0; i < {}; ++i) {{", arg);
+      std::println(out, "    memory[fp - {} + i] = memory[sp - {} + i];",
+                   arg + 2, arg);
+      std::println(out, "  }}");
+      std::println(out, "  sp = fp;");
+      if (isDirect) {
+        std::println(out, "  goto {};", label(instructions[index - 1].arg));
+      } else {
+        std::println(out, "  goto dispatch;");
+      }
+    } break;
+
+    case Instr::Loadrc: {
+      std::println(out, "  sp += 1;");
+      std::println(out, "  memory[sp] = fp + {};", arg);
+    } break;
+
+    case Instr::Loadr: {
+      std::println(out, "  sp += 1;");
+      std::println(out, "  memory[sp] = memory[fp + {}];", arg);
+    } break;
+
+    case Instr::Storer:
+      std::println(out, "  memory[fp + {}] = memory[sp];", arg);
+      break;
+
+    case Instr::Copy: {
+      std::println(out, "  if (memory[sp] > 0) {{");
+      std::println(out, "    std::memmove(&memory[memory[sp - 2]], "
+                        "&memory[memory[sp - 1]],");
+      std::println(out, "                 memory[sp] * sizeof(int));");
+      std::println(out, "  }}");
+      std::println(out, "  sp -= 3;");
+    } break;
+
+    case Instr::Fill: {
+      std::println(out,
+                   "  fill(memory[sp - 2], memory[sp - 1], memory[sp]);");
+      std::println(out, "  sp -= 3;");
+    } break;
+
+    case Instr::Sum: binary("sum(memory[sp], memory[sp + 1])"); break;
+    case Instr::Min: binary("min(memory[sp], memory[sp + 1])"); break;
+    case Instr::Max: binary("max(memory[sp], memory[sp + 1])"); break;
+
+    case Instr::Dot: ternary("dot"); break;
+    case Instr::Find: ternary("find"); break;
+    case Instr::Cmp: ternary("compare"); break;
+
+    case Instr::Spawn:
+    case Instr::Join:
+      dbg_fail("cma-aot cannot translate programs with threads", index);
+
+    case Instr::CallNative:
+      // The functions are only registered with the machine that runs it.
+      dbg_fail("cma-aot cannot translate calls of native functions", index);
+
+    case Instr::Cas: {
+      // Translated programs have a single thread.
+      std::println(out, "  sp -= 2;");
+      std::println(out, "  if (memory[memory[sp]] == memory[sp + 1]) {{");
+      std::println(out, "    memory[memory[sp]] = memory[sp + 2];");
+      std::println(out, "    memory[sp] = memory[sp + 1];");
+      std::println(out, "  }} else {{");
+      std::println(out, "    memory[sp] = memory[memory[sp]];");
+      std::println(out, "  }}");
+    } break;
+
+    case Instr::FetchAdd: {
+      std::println(out, "  sp -= 1;");
+      std::println(out, "  {{");
+      std::println(out, "    int old = memory[memory[sp]];");
+      std::println(out, "    memory[memory[sp]] = add(old, memory[sp + 1]);");
+      std::println(out, "    memory[sp] = old;");
+      std::println(out, "  }}");
+    } break;
+
+    case Instr::Halt: std::println(out, "  goto end;"); break;
+
+    case Instr::Print:
+      std::println(out, "  std::printf(\"%d\\n\", memory[sp--]);");
+      break;
+
+    default: dbg_fail("Bad instruction", instruction.type, instruction.arg);
+    }
+  }
+
+  void comment(int index, Instr instruction) {
+    std::print(out, "  // {}: {}", index, Instr::toString(instruction.type));
+    Instr::Type base = Instr::baseType(instruction.type);
+    if (Instr::hasMandatoryArg(base) ||
+        (Instr::hasOptionalArg(base) && instruction.arg != 1)) {
+      std::print(out, " {}", instruction.arg);
+    }
+    std::println(out);
+  }
+
+  void dispatch() {
+    std::println(out, "dispatch:");
+    std::println(out, "  switch (pc) {{");
+    for (int i = 0; i < end(); ++i) {
+      if (entries.isDynamic[i]) {
+        std::println(out, "  case {}: goto i{};", i, i);
+      }
+    }
+    std::println(out, "  default: break;");
+    std::println(out, "  }}");
+    std::println(out, "  if (0 <= pc && pc < {}) {{", end());
+    std::println(out, "    notAnEntryPoint(pc);");
+    std::println(out, "  }}");
+  }
+
+public:
+  Translator(FILE *out, std::span<const Instr> instructions, bool allDynamic)
+      : out{out}, instructions{instructions},
+        entries{findEntryPoints(instructions, allDynamic)} {}
+
+  void translate(std::string_view source) {
+    std::println(out, "// Translated from {} by cma-aot.", source);
+    std::println(out);
+    std::println(out, "#include <algorithm>");
+    std::println(out, "#include <cstdint>");
+    std::println(out, "#include <cstdio>");
+    std::println(out, "#include <cstdlib>");
+    std::println(out, "#include <cstring>");
+    std::println(out, "#include <limits>");
+    std::print(out, "{}{}", heapSource, invalidFree);
+    std::println(out);
+    std::println(out, "namespace {{");
+    std::println(out);
+    std::println(out, "constexpr int stackCells = {};", layout.stackCells);
+    std::println(out, "constexpr int heapStart = {};", layout.heapStart());
+    std::println(out, "constexpr int memorySize = {};", layout.size());
+    std::print(out, "{}", runtime);
+    for (int i = 0; i < end(); ++i) {
+      if (entries.isLabel[i]) {
+        std::println(out, "i{}:", i);
+      }
+      comment(i, instructions[i]);
+      emit(i, instructions[i]);
+    }
+    std::println(out, "  goto end;");
+    if (entries.hasComputedJumps) {
+      dispatch();
+    }
+    std::println(out, "end:");
+    std::println(out, "  return memory[0];");
+    std::println(out, "}}");
+    std::println(out);
+    std::println(out, "}} // namespace");
+    std::println(out);
+    std::println(out, "auto main() -> int {{ return run(); }}");
+  }
+};
+
+} // namespace
+
+auto findEntryPoints(std::span<const Instr> instructions, bool allDynamic)
+    -> EntryPoints {
+  std::size_t n = instructions.size();
+  EntryPoints entries = {.isLabel = std::vector<bool>(n),
+                         .isDynamic = std::vector<bool>(n, allDynamic)};
+  auto isInProgram = [&](int target) {
+    return 0 <= target && static_cast<std::size_t>(target) < n;
+  };
+
+  for (std::size_t i = 0; i < n; ++i) {
+    Instr instruction = instructions[i];
+    switch (Instr::baseType(instruction.type)) {
+    case Instr::Jump:
+    case Instr::Jumpz: {
+      if (isInProgram(instruction.arg)) {
+        entries.isLabel[instruction.arg] = true;
+      }
+    } break;
+    case Instr::Jumpi: {
+      entries.hasComputedJumps = true;
+      // The table of `jump`s that the index selects from.
+      for (int target = instruction.arg; isInProgram(target); ++target) {
+        entries.isDynamic[target] = true;
+        if (Instr::baseType(instructions[target].type) != Instr::Jump) {
+          break;
+        }
+      }
+    } break;
+    case Instr::Call: {
+      entries.hasComputedJumps = true;
+      if (i + 1 < n) {
+        entries.isDynamic[i + 1] = true;
+      }
+    } break;
+    case Instr::Return:
+    case Instr::TailCall: entries.hasComputedJumps = true; break;
+    default: break;
+    }
+  }
+
+  if (!entries.hasComputedJumps) {
+    entries.isDynamic.assign(n, false);
+  } else {
+    // Code addresses enter the stack as constants.
+    for (Instr instruction : instructions) {
+      if (instruction.type == Instr::Loadc && isInProgram(instruction.arg)) {
+        entries.isDynamic[instruction.arg] = true;
+      }
+    }
+  }
+  for (std::size_t i = 0; i < n; ++i) {
+    if (entries.isDynamic[i]) {
+      entries.isLabel[i] = true;
+    }
+  }
+  return entries;
+}
+
+void translateToCpp(FILE *out, std::span<const Instr> instructions,
+                    std::string_view source, bool allDynamic) {
+  Translator(out, instructions, allDynamic).translate(source);
+}
+
+} // namespace vm::cma
@@ -0,0 +1,51 @@
+#ifndef TUM_I2_VM_LIB_CMA_TRANSLATOR
+#define TUM_I2_VM_LIB_CMA_TRANSLATOR
+
+#include "lib/CMachine.hpp"
+
+#include <cstdio>
+#include <span>
+#include <string_view>
+#include <vector>
+
+namespace vm::cma {
+
+/**
+ * @brief Where control can arrive in a translated program.
+ * @details Static jump targets become labels. Computed targets (`call`,
+ * `return`, `jumpi`) go through a `switch` over the *dynamic* entries, which
+ * are: the instruction after each `call`, every `loadc` immediate that names
+ * an instruction (function addresses) and the jump tables behind `jumpi`. Code
+ * between entries is straight-line code for the C++ compiler.
+ */
+struct EntryPoints {
+  std::vector<bool> isLabel = {};
+  std::vector<bool> isDynamic = {};
+  bool hasComputedJumps = false;
+};
+
+/**
+ * @brief Finds the entry points of a program.
+ * @param instructions The program.
+ * @param allDynamic Makes every instruction a dynamic entry, for programs that
+ * compute code addresses in other ways than the above.
+ */
+auto findEntryPoints(std::span<const Instr> instructions, bool allDynamic)
+    -> EntryPoints;
+
+/**
+ * @brief Writes a self-contained C++ translation unit that runs the program.
+ * @details Its `main` prints the same output and returns the same exit code
+ * (`memory[0]`) as `CMa::run()`. A computed jump to an instruction that is
+ * not an entry point aborts the program.
+ * @param out Where to write the translation unit.
+ * @param instructions The program.
+ * @param source The name of the program, for the header comment.
+ * @param allDynamic See `findEntryPoints`.
+ */
+void translateToCpp(FILE *out, std::span<const Instr> instructions,
+                    std::string_view source, bool allDynamic = false);
+
+} // namespace vm::cma
+
+#endif
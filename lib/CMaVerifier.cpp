@@ -0,0 +1,521 @@
+#include "lib/CMaVerifier.hpp"
+#include "lib/CMachine.hpp"
+#include "lib/Error.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <optional>
+#include <print>
+#include <span>
+#include <vector>
+
+namespace vm::cma {
+
+auto stackEffect(Instr instruction, std::span<const StackEffect> natives)
+    -> StackEffect {
+  int arg = instruction.arg;
+  switch (Instr::baseType(instruction.type)) {
+  case Instr::Debug:
+  case Instr::Jump:
+  case Instr::Enter:
+  case Instr::Return:
+  case Instr::Trap:
+  case Instr::Halt: return {.pops = 0, .pushes = 0};
+
+  case Instr::Loadc:
+  case Instr::Loada:
+  case Instr::Loadrc:
+  case Instr::Loadr: return {.pops = 0, .pushes = 1};
+
+  case Instr::Add:
+  case Instr::Sub:
+  case Instr::Mul:
+  case Instr::Div:
+  case Instr::Mod:
+  case Instr::And:
+  case Instr::Or:
+  case Instr::Xor:
+  case Instr::Eq:
+  case Instr::Neq:
+  case Instr::Le:
+  case Instr::Leq:
+  case Instr::Gr:
+  case Instr::Geq: return {.pops = 2, .pushes = 1};
+
+  case Instr::Not:
+  case Instr::Neg:
+  case Instr::Storea:
+  case Instr::Storer:
+  case Instr::New:
+  case Instr::Call: return {.pops = 1, .pushes = 1};
+
+  case Instr::Jumpz:
+  case Instr::Jumpi:
+  case Instr::Free:
+  case Instr::Print: return {.pops = 1, .pushes = 0};
+
+  case Instr::Copy:
+  case Instr::Fill: return {.pops = 3, .pushes = 0};
+  case Instr::Sum:
+  case Instr::Min:
+  case Instr::Max: return {.pops = 2, .pushes = 1};
+  case Instr::Dot:
+  case Instr::Find:
+  case Instr::Cmp:
+  case Instr::Cas: return {.pops = 3, .pushes = 1};
+  case Instr::Spawn:
+  case Instr::FetchAdd: return {.pops = 2, .pushes = 1};
+  case Instr::Join: return {.pops = 1, .pushes = 1};
+  case Instr::CallNative:
+    if (arg < 0 || static_cast<std::size_t>(arg) >= natives.size()) {
+      return {.pops = 0, .pushes = 0};
+    }
+    return natives[static_cast<std::size_t>(arg)];
+
+  case Instr::Dup: return {.pops = 1, .pushes = 2};
+  case Instr::Mark: return {.pops = 0, .pushes = 2};
+  case Instr::Alloc: return {.pops = 0, .pushes = arg};
+  case Instr::Pop: return {.pops = arg, .pushes = 0};
+  case Instr::Load: return {.pops = 1, .pushes = arg};
+  case Instr::Store: return {.pops = arg + 1, .pushes = arg};
+  case Instr::Slide: return {.pops = arg + 1, .pushes = 1};
+  case Instr::TailCall: return {.pops = arg + 1, .pushes = 0};
+
+  default: dbg_fail("Bad instruction", instruction.type, instruction.arg);
+  }
+}
+
+void Range::include(int low, int high) {
+  if (high < low) {
+    return;
+  }
+  if (isEmpty()) {
+    lowest = low;
+    highest = high;
+  } else {
+    lowest = std::min(lowest, low);
+    highest = std::max(highest, high);
+  }
+}
+
+void Range::include(Range other) { include(other.lowest, other.highest); }
+
+void Verification::report() const {
+  for (Problem p : problems) {
+    std::println(stderr, "{:5}: {}", p.position, p.message);
+  }
+}
+
+namespace {
+
+/// Whether instructions of type `t` access memory through addresses on the
+/// stack, which `checkAddress` checks.
+auto readsAddresses(Instr::Type t) -> bool {
+  return t == Instr::Load || t == Instr::Store || t == Instr::Copy ||
+         t == Instr::Fill || t == Instr::Sum || t == Instr::Min ||
+         t == Instr::Max || t == Instr::Dot || t == Instr::Find ||
+         t == Instr::Cmp || t == Instr::Cas || t == Instr::FetchAdd;
+}
+
+auto transfersControl(Instr::Type t) -> bool {
+  return t == Instr::Jump || t == Instr::Jumpz || t == Instr::Jumpi ||
+         t == Instr::Call || t == Instr::Return || t == Instr::TailCall ||
+         t == Instr::Halt;
+}
+
+class Verifier {
+  std::span<const Instr> instructions;
+  std::size_t memorySize;
+  std::span<const StackEffect> natives;
+  Verification result = {};
+
+  std::vector<std::optional<FrameState>> states = {};
+  std::vector<std::size_t> worklist = {};
+
+  auto size() const -> std::size_t { return instructions.size(); }
+
+  auto typeAt(std::size_t i) const -> Instr::Type {
+    return Instr::baseType(instructions[i].type);
+  }
+
+  void problem(std::size_t position, std::string_view message) {
+    result.problems.push_back({position, message});
+  }
+
+  /// The function called by the `call`, `tailcall` or `spawn` at `i`, if it
+  /// is known statically.
+  auto callTarget(std::size_t i) const -> std::optional<std::size_t> {
+    if (i == 0 || typeAt(i - 1) != Instr::Loadc || result.isLeader[i]) {
+      return std::nullopt;
+    }
+    auto target = static_cast<std::size_t>(instructions[i - 1].arg);
+    if (target >= size()) {
+      return std::nullopt;
+    }
+    return target;
+  }
+
+  void markLeader(std::size_t i) {
+    if (i < size()) {
+      result.isLeader[i] = true;
+    }
+  }
+
+  void findLeaders() {
+    result.isLeader.assign(size(), false);
+    markLeader(0);
+    for (std::size_t i = 0; i < size(); ++i) {
+      Instr instruction = instructions[i];
+      Instr::Type t = typeAt(i);
+      if (t == Instr::Jump || t == Instr::Jumpz || t == Instr::Jumpi) {
+        markLeader(static_cast<std::size_t>(instruction.arg));
+      }
+      if (transfersControl(t)) {
+        markLeader(i + 1);
+      }
+    }
+    // Call targets depend on which `loadc`s start a block, so they come last.
+    for (std::size_t i = 0; i < size(); ++i) {
+      if (typeAt(i) == Instr::Call || typeAt(i) == Instr::TailCall ||
+          typeAt(i) == Instr::Spawn) {
+        if (auto target = callTarget(i)) {
+          markLeader(*target);
+        }
+      }
+    }
+  }
+
+  /// Computes blocks and bounds, relative to the entry of each block.
+  void computeBlocks() {
+    result.bounds.assign(size(), {});
+    std::vector<int> heights(size());
+    std::vector<Range> touched(size());
+
+    for (std::size_t start = 0; start < size();) {
+      std::size_t end = start + 1;
+      while (end < size() && !result.isLeader[end]) {
+        end += 1;
+      }
+
+      int height = 0;
+      for (std::size_t i = start; i < end; ++i) {
+        Instr instruction = instructions[i];
+        auto [pops, pushes] = stackEffect(instruction, natives);
+        heights[i] = height;
+        if (pops > 0) {
+          touched[i].include(height - pops + 1, height);
+        }
+        if (pushes > 0) {
+          touched[i].include(height - pops + 1, height - pops + pushes);
+        }
+
+        Bounds &b = result.bounds[i];
+        switch (typeAt(i)) {
+        case Instr::Loadr:
+        case Instr::Storer: b.frame.include(instruction.arg, instruction.arg);
+          break;
+        case Instr::Loada:
+        case Instr::Storea: b.global.include(instruction.arg, instruction.arg);
+          break;
+        case Instr::Return: b.frame.include(-2, 0); break;
+        case Instr::TailCall:
+          b.frame.include(-2 - instruction.arg, -3);
+          break;
+        default: break;
+        }
+        height += pushes - pops;
+      }
+
+      // Accumulate from the back, so every instruction knows the rest of its
+      // block; the stack is re-based on the stack pointer at each entry.
+      Range rest = {};
+      for (std::size_t i = end; i-- > start;) {
+        rest.include(touched[i]);
+        Bounds &b = result.bounds[i];
+        if (i + 1 < end) {
+          b.frame.include(result.bounds[i + 1].frame);
+          b.global.include(result.bounds[i + 1].global);
+        }
+        if (!rest.isEmpty()) {
+          b.stack = {.lowest = rest.lowest - heights[i],
+                     .highest = rest.highest - heights[i]};
+        }
+      }
+
+      int effect = height;
+      if (typeAt(end - 1) == Instr::Call) {
+        effect -= 3;
+      }
+      result.blocks.push_back({.start = start,
+                               .end = end,
+                               .effect = effect,
+                               .bounds = result.bounds[start]});
+      start = end;
+    }
+  }
+
+  void propagate(std::size_t from, std::size_t to, FrameState state) {
+    if (to >= size()) {
+      return;
+    }
+    if (!states[to]) {
+      states[to] = state;
+      worklist.push_back(to);
+    } else if (*states[to] != state) {
+      problem(from, "inconsistent stack height at jump target");
+    }
+  }
+
+  void propagateJump(std::size_t from, int target, FrameState state) {
+    auto to = static_cast<std::size_t>(target);
+    if (target < 0 || to > size()) {
+      problem(from, "jump target outside of the program");
+    } else {
+      propagate(from, to, state);
+    }
+  }
+
+  void checkArguments(std::size_t i, FrameState state) {
+    Instr instruction = instructions[i];
+    int arg = instruction.arg;
+    switch (typeAt(i)) {
+    case Instr::Alloc:
+    case Instr::Pop:
+    case Instr::Slide:
+    case Instr::Load:
+    case Instr::Store:
+    case Instr::Enter:
+      if (arg < 0) {
+        problem(i, "negative count");
+      }
+      break;
+    case Instr::Loada:
+    case Instr::Storea:
+      if (arg < 0 || static_cast<std::size_t>(arg) >= memorySize) {
+        problem(i, "address outside of memory");
+      }
+      break;
+    case Instr::Loadr:
+    case Instr::Storer:
+      if (state.bound && arg > *state.bound) {
+        problem(i, "local variable outside of the frame");
+      }
+      break;
+    case Instr::CallNative:
+      if (arg < 0 || static_cast<std::size_t>(arg) >= natives.size()) {
+        problem(i, "call of an unknown native function");
+      }
+      break;
+    default: break;
+    }
+  }
+
+  void visit(std::size_t i) {
+    FrameState state = *states[i];
+    Instr instruction = instructions[i];
+    Instr::Type t = typeAt(i);
+    auto [pops, pushes] = stackEffect(instruction, natives);
+
+    checkArguments(i, state);
+    if (state.height - pops < 0) {
+      problem(i, "stack underflow");
+      return;
+    }
+
+    FrameState next = {.height = state.height - pops + pushes,
+                       .bound = state.bound};
+    if (t == Instr::Enter) {
+      if (state.height > instruction.arg) {
+        problem(i, "stack higher than the frame of enter");
+      }
+      next.bound = instruction.arg;
+    }
+    if (next.height > state.height) {
+      if (!next.bound) {
+        problem(i, "stack grows before enter");
+      } else if (next.height > *next.bound) {
+        problem(i, "stack grows beyond the frame of enter");
+      }
+    }
+
+    switch (t) {
+    case Instr::Halt:
+    case Instr::Return: break;
+
+    case Instr::TailCall: {
+      auto target = callTarget(i);
+      if (!target) {
+        problem(i, "call of an unknown function");
+        break;
+      }
+      propagate(i, *target, {.height = 0, .bound = std::nullopt});
+    } break;
+
+    case Instr::Spawn: {
+      // The thread starts in a frame of its own, like a call.
+      auto target = callTarget(i);
+      if (!target) {
+        problem(i, "spawn of an unknown function");
+        break;
+      }
+      propagate(i, *target, {.height = 0, .bound = std::nullopt});
+      propagate(i, i + 1, next);
+    } break;
+
+    case Instr::Jump: propagateJump(i, instruction.arg, next); break;
+
+    case Instr::Jumpz: {
+      propagateJump(i, instruction.arg, next);
+      propagate(i, i + 1, next);
+    } break;
+
+    case Instr::Jumpi: {
+      auto table = static_cast<std::size_t>(instruction.arg);
+      if (instruction.arg < 0 || table >= size() ||
+          typeAt(table) != Instr::Jump) {
+        problem(i, "jumpi without a jump table");
+        break;
+      }
+      for (std::size_t j = table; j < size() && typeAt(j) == Instr::Jump;
+           ++j) {
+        propagate(i, j, next);
+      }
+    } break;
+
+    case Instr::Call: {
+      auto target = callTarget(i);
+      if (!target) {
+        problem(i, "call of an unknown function");
+        break;
+      }
+      propagate(i, *target, {.height = 0, .bound = std::nullopt});
+      next.height -= 3;
+      if (next.height < 0) {
+        problem(i, "call without mark");
+        break;
+      }
+      propagate(i, i + 1, next);
+    } break;
+
+    default: propagate(i, i + 1, next);
+    }
+  }
+
+  void computeStates() {
+    states.assign(size(), std::nullopt);
+    if (size() == 0) {
+      return;
+    }
+    states[0] = FrameState{.height = 0, .bound = std::nullopt};
+    worklist.push_back(0);
+    while (!worklist.empty()) {
+      std::size_t i = worklist.back();
+      worklist.pop_back();
+      visit(i);
+    }
+  }
+
+public:
+  Verifier(std::span<const Instr> instructions, std::size_t memorySize,
+           std::span<const StackEffect> natives)
+      : instructions{instructions}, memorySize{memorySize}, natives{natives} {}
+
+  auto run() -> Verification {
+    findLeaders();
+    computeBlocks();
+    computeStates();
+    result.states = std::move(states);
+    return std::move(result);
+  }
+};
+
+} // namespace
+
+auto verify(std::span<const Instr> instructions, std::size_t memorySize,
+            std::span<const StackEffect> natives) -> Verification {
+  return Verifier(instructions, memorySize, natives).run();
+}
+
+template <> void CMa::checkBounds(const Bounds &bounds) {
+  auto inMemory = [&](Range r, int base, int limit) {
+    return r.isEmpty() || (base + r.lowest >= 0 && base + r.highest < limit);
+  };
+  auto memorySize = static_cast<int>(memory.size());
+  if (!inMemory(bounds.stack, stackPointer, stackEnd) ||
+      !inMemory(bounds.frame, framePointer, memorySize) ||
+      !inMemory(bounds.global, 0, memorySize)) {
+    debug();
+    dbg_fail("Out of bounds memory access", bounds.stack.lowest,
+             bounds.stack.highest, bounds.frame.lowest, bounds.frame.highest,
+             bounds.global.lowest, bounds.global.highest);
+  }
+}
+
+template <> void CMa::checkAddress(Instr instruction) {
+  auto check = [&](int address, int count) {
+    if (count > 0 &&
+        (address < 0 || count > static_cast<int>(memory.size()) - address)) {
+      debug();
+      dbg_fail("Out of bounds memory access", address, count);
+    }
+  };
+  int *top = memory.data() + stackPointer;
+  switch (Instr::baseType(instruction.type)) {
+  case Instr::Load:
+  case Instr::Store: check(top[0], instruction.arg); break;
+  // The count is on top, the addresses below it.
+  case Instr::Copy:
+  case Instr::Dot:
+  case Instr::Cmp:
+    check(top[-2], top[0]);
+    check(top[-1], top[0]);
+    break;
+  case Instr::Fill:
+  case Instr::Find: check(top[-2], top[0]); break;
+  case Instr::Sum:
+  case Instr::Min:
+  case Instr::Max: check(top[-1], top[0]); break;
+  // The address is below the operands.
+  case Instr::Cas: check(top[-2], 1); break;
+  case Instr::FetchAdd: check(top[-1], 1); break;
+  default: break;
+  }
+}
+
+template <>
+auto CMa::runChecked(const Verification &verification) -> int {
+  enum Check : std::uint8_t { None = 0, Block = 1, Address = 2 };
+  std::vector<std::uint8_t> checks(instructions.size(), None);
+  for (std::size_t i = 0; i < instructions.size(); ++i) {
+    Instr::Type t = Instr::baseType(instructions[i].type);
+    if (verification.isLeader[i]) {
+      checks[i] |= Block;
+    }
+    if (readsAddresses(t)) {
+      checks[i] |= Address;
+    }
+  }
+
+  // Blocks are entered either at their leader or, by calls, returns and
+  // computed jumps, anywhere; the bounds cover the rest of the block.
+  // Like `Context::at` of the threaded engine, a jump before the start of
+  // the program leaves it.
+  bool jumped = true;
+  while (0 <= programCounter && programCounter < std::ssize(instructions)) {
+    auto pc = static_cast<std::size_t>(programCounter);
+    std::uint8_t check = checks[pc];
+    if (jumped || (check & Block) != 0) [[unlikely]] {
+      checkBounds(verification.bounds[pc]);
+    }
+    if ((check & Address) != 0) {
+      checkAddress(instructions[pc]);
+    }
+    step();
+    jumped = programCounter != static_cast<int>(pc) + 1;
+  }
+  return memory[0];
+}
+
+} // namespace vm::cma
@@ -0,0 +1,114 @@
+#ifndef TUM_I2_VM_LIB_CMA_VERIFIER
+#define TUM_I2_VM_LIB_CMA_VERIFIER
+
+#include "lib/CMachine.hpp"
+
+#include <cstddef>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
+
+namespace vm::cma {
+
+/**
+ * @brief Computes the stack effect of an instruction.
+ * @param instruction The instruction, superinstructions count as their first
+ * part.
+ * @param natives The stack effects of the functions `callnative` can call;
+ * unknown ones count as changing nothing.
+ */
+auto stackEffect(Instr instruction, std::span<const StackEffect> natives = {})
+    -> StackEffect;
+
+/**
+ * @brief An inclusive range of memory cells, relative to some register.
+ */
+struct Range {
+  int lowest = 1;
+  int highest = 0;
+
+  [[nodiscard]] auto isEmpty() const -> bool { return highest < lowest; }
+  void include(int low, int high);
+  void include(Range other);
+};
+
+/**
+ * @brief The memory cells that the rest of a basic block can touch.
+ * @details `stack` is relative to the stack pointer, `frame` to the frame
+ * pointer and `global` are absolute addresses. Cells addressed through the
+ * stack (`load`, `store`) cannot be known before they execute.
+ */
+struct Bounds {
+  Range stack = {};
+  Range frame = {};
+  Range global = {};
+};
+
+struct BasicBlock {
+  std::size_t start;
+  std::size_t end;
+  /// Net change of the stack pointer (calls count as returned).
+  int effect;
+  Bounds bounds;
+};
+
+/**
+ * @brief The stack before an instruction, relative to its frame.
+ */
+struct FrameState {
+  /// The stack pointer minus the frame pointer.
+  int height;
+  /// The argument of the dominating `enter`, if any.
+  std::optional<int> bound;
+
+  auto operator==(const FrameState &) const -> bool = default;
+};
+
+struct Problem {
+  std::size_t position;
+  std::string_view message;
+};
+
+/**
+ * @brief The result of verifying a CMa program.
+ */
+struct Verification {
+  std::vector<BasicBlock> blocks = {};
+  /// For each instruction: the bounds of the remainder of its block.
+  std::vector<Bounds> bounds = {};
+  std::vector<bool> isLeader = {};
+  /// For each instruction: its frame state, if it is reachable.
+  std::vector<std::optional<FrameState>> states = {};
+  std::vector<Problem> problems = {};
+
+  /**
+   * @brief Whether no problem was found in the program.
+   * @details For a verified program, every reachable instruction has the
+   * same stack height relative to the frame on every path, no function pops
+   * its own frame, the stack never grows beyond the bound of the dominating
+   * `enter`, all static jump targets lie in the program, all calls target a
+   * known function and all `loada`/`storea` addresses lie in memory. That
+   * is not a proof that it stays in bounds: the addresses that `load`,
+   * `store` and the bulk and atomic instructions take from the stack, and
+   * the targets of `jumpi`, are only known when they execute.
+   */
+  [[nodiscard]] auto isVerified() const -> bool { return problems.empty(); }
+
+  /// Prints the problems to stderr.
+  void report() const;
+};
+
+/**
+ * @brief Verifies a CMa program.
+ * @param instructions The program.
+ * @param memorySize The number of cells of the machine's memory.
+ * @param natives The stack effects of the functions `callnative` can call,
+ * see `CMa::nativeEffects`.
+ */
+auto verify(std::span<const Instr> instructions, std::size_t memorySize,
+            std::span<const StackEffect> natives = {}) -> Verification;
+
+} // namespace vm::cma
+
+#endif
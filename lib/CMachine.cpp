@@ -1,35 +1,37 @@
 #include "lib/CMachine.hpp"
+#include "lib/CMaCore.hpp"
+#include "lib/CMaOptimizer.hpp"
+#include "lib/CMaParser.hpp"
+#include "lib/CMaVerifier.hpp"
 #include "lib/Common.hpp"
 #include "lib/Error.hpp"
+#include "lib/LittleEndian.hpp"
 
-#include "CMachine.hpp"
 #include <algorithm>
 #include <array>
-#include <cctype>
-#include <charconv>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <iterator>
+#include <functional>
 #include <limits>
+#include <memory>
 #include <print>
 #include <span>
-#include <string>
 #include <string_view>
-#include <unordered_map>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
 namespace vm::cma {
 
-static_assert(vm::common::VirtualMachine<CMa>);
-
 void Instr::print(std::span<Instr> instructions) {
   std::println(stderr, "{} instructions", instructions.size());
   for (Instr i : instructions) {
     std::print(stderr, "{}", Instr::toString(i.type));
-    bool hasArg = Instr::hasMandatoryArg(i.type) ||
-                  (Instr::hasOptionalArg(i.type) && i.arg != 1);
+    Instr::Type base = Instr::baseType(i.type);
+    bool hasArg = Instr::hasMandatoryArg(base) ||
+                  (Instr::hasOptionalArg(base) && i.arg != 1);
     if (hasArg) {
       std::print(stderr, "\t{}", i.arg);
     }
@@ -37,501 +39,752 @@ void Instr::print(std::span<Instr> instructions) {
   }
 }
 
-void CMa::step() {
-  Instr instruction = instructions[programCounter];
+template <typename Policy> void BasicCMa<Policy>::step() {
+  Instruction instruction = instructions[programCounter];
+  if constexpr (Policy::traced) {
+    trace(instruction);
+  }
+  if constexpr (Policy::profiled) {
+    profile.counts[instruction.type] += 1;
+  }
+  if constexpr (Policy::recorded) {
+    accessLog.enter(programCounter);
+  }
   programCounter += 1;
   execute(instruction);
 }
 
-auto CMa::run() -> int {
-  while (programCounter < std::ssize(instructions)) {
-    step();
-  }
-  return memory[0];
-}
-
-void CMa::execute(Instr instruction) {
-  switch (instruction.type) {
-  case Instr::Debug: {
-    debug();
-  } break;
-
-  case Instr::Loadc: {
-    stackPointer += 1;
-    memory[stackPointer] = instruction.arg;
-  } break;
-
-  case Instr::Add: {
-    stackPointer -= 1;
-    memory[stackPointer] += memory[stackPointer + 1];
-  } break;
-
-  case Instr::Sub: {
-    stackPointer -= 1;
-    memory[stackPointer] -= memory[stackPointer + 1];
-  } break;
-
-  case Instr::Mul: {
-    stackPointer -= 1;
-    memory[stackPointer] *= memory[stackPointer + 1];
-  } break;
-
-  case Instr::Div: {
-    stackPointer -= 1;
-    memory[stackPointer] /= memory[stackPointer + 1];
-  } break;
-
-  case Instr::Mod: {
-    stackPointer -= 1;
-    memory[stackPointer] %= memory[stackPointer + 1];
-  } break;
-
-  case Instr::And: {
-    stackPointer -= 1;
-    memory[stackPointer] = memory[stackPointer] && memory[stackPointer + 1];
-  } break;
-
-  case Instr::Or: {
-    stackPointer -= 1;
-    memory[stackPointer] = memory[stackPointer] || memory[stackPointer + 1];
-  } break;
-
-  case Instr::Xor: {
-    stackPointer -= 1;
-    // Weird non-C semantics: logical exclusive or.
-    memory[stackPointer] =
-        (memory[stackPointer] != 0) ^ (memory[stackPointer + 1] != 0);
-  } break;
-
-  case Instr::Eq: {
-    stackPointer -= 1;
-    memory[stackPointer] = memory[stackPointer] == memory[stackPointer + 1];
-  } break;
-
-  case Instr::Neq: {
-    stackPointer -= 1;
-    memory[stackPointer] = memory[stackPointer] != memory[stackPointer + 1];
-  } break;
-
-  case Instr::Gr: {
-    stackPointer -= 1;
-    memory[stackPointer] = memory[stackPointer] > memory[stackPointer + 1];
-  } break;
-
-  case Instr::Geq: {
-    stackPointer -= 1;
-    memory[stackPointer] = memory[stackPointer] >= memory[stackPointer + 1];
-  } break;
-
-  case Instr::Le: {
-    stackPointer -= 1;
-    memory[stackPointer] = memory[stackPointer] < memory[stackPointer + 1];
-  } break;
-
-  case Instr::Leq: {
-    stackPointer -= 1;
-    memory[stackPointer] = memory[stackPointer] <= memory[stackPointer + 1];
-  } break;
-
-  case Instr::Neg: {
-    memory[stackPointer] = -memory[stackPointer];
-  } break;
-
-  case Instr::Not: {
-    memory[stackPointer] = !memory[stackPointer];
-  } break;
-
-  case Instr::Load: {
-    int dest = memory[stackPointer];
-    int count = instruction.arg;
-    for (int i = 0; i < count; ++i) {
-      memory[stackPointer + i] = memory[dest + i];
-    }
-    stackPointer += count - 1;
-  } break;
-
-  case Instr::Store: {
-    int dest = memory[stackPointer];
-    int count = instruction.arg;
-    for (int i = 0; i < count; ++i) {
-      memory[dest + i] = memory[stackPointer - count + i];
-    }
-    stackPointer -= 1;
-  } break;
-
-  case Instr::Loada: {
-    stackPointer += 1;
-    memory[stackPointer] = memory[instruction.arg];
-  } break;
-
-  case Instr::Storea: {
-    memory[instruction.arg] = memory[stackPointer];
-  } break;
-
-  case Instr::Pop: {
-    stackPointer -= instruction.arg;
-  } break;
-
-  case Instr::Dup: {
-    stackPointer += 1;
-    memory[stackPointer] = memory[stackPointer - 1];
-  } break;
-
-  case Instr::Jump: {
-    programCounter = instruction.arg;
-  } break;
-
-  case Instr::Jumpz: {
-    if (memory[stackPointer] == 0) {
-      programCounter = instruction.arg;
-    }
-    stackPointer -= 1;
-  } break;
-
-  case Instr::Jumpi: {
-    programCounter = instruction.arg + memory[stackPointer];
-    stackPointer -= 1;
-  } break;
-
-  case Instr::Alloc: {
-    stackPointer += instruction.arg;
-  } break;
-
-  case Instr::New: {
-    if (newPointer - memory[stackPointer] <= extremePointer) {
-      memory[stackPointer] = 0;
-    } else {
-      newPointer -= memory[stackPointer];
-      memory[stackPointer] = newPointer;
-    }
-  } break;
-
-  case Instr::Mark: {
-    memory[stackPointer + 1] = extremePointer;
-    memory[stackPointer + 2] = framePointer;
-    stackPointer += 2;
-  } break;
-
-  case Instr::Call: {
-    int returnAddr = memory[stackPointer];
-    memory[stackPointer] = programCounter;
-    framePointer = stackPointer;
-    programCounter = returnAddr;
-  } break;
-
-  case Instr::Slide: {
-    int returnValue = memory[stackPointer];
-    stackPointer -= instruction.arg;
-    memory[stackPointer] = returnValue;
-  } break;
-
-  case Instr::Enter: {
-    extremePointer = stackPointer + instruction.arg;
-    if (extremePointer >= newPointer) {
-      debug();
-      dbg_fail("Stack overflow");
+namespace {
+
+/// How far a single instruction can move the stack or reach beyond it.
+template <typename Instruction>
+auto maxStride(std::span<const Instruction> instructions) -> std::size_t {
+  std::size_t stride = 0;
+  for (Instruction i : instructions) {
+    switch (Instr::baseType(i.type)) {
+    case Instr::Load:
+    case Instr::Store:
+    case Instr::Pop:
+    case Instr::Alloc:
+    case Instr::Slide:
+    case Instr::TailCall:
+    case Instr::Loadr:
+    case Instr::Storer: {
+      auto arg = static_cast<std::int64_t>(i.arg);
+      stride = std::max(stride, static_cast<std::size_t>(std::abs(arg)));
+    } break;
+    default: break;
     }
+  }
+  return stride;
+}
 
-  } break;
+constexpr std::array<char, 4> checkpointMagic = {'C', 'M', 'A', 'S'};
+constexpr std::uint32_t checkpointVersion = 2;
+
+/// The start of a checkpoint (see `BasicCMa::checkpoint`), followed by the
+/// state of the heap, the cells of the stack and those of the heap.
+struct CheckpointHeader {
+  std::array<char, 4> magic;
+  std::uint32_t version;
+  std::uint32_t cellSize;
+  std::uint64_t programHash;
+  std::uint64_t stackCells;
+  std::uint64_t guardCells;
+  std::uint64_t heapCells;
+  Registers registers;
+  /// The stack cells saved, from address 0 on.
+  std::uint64_t stackEnd;
+  /// The first heap cell saved; the heap is saved up to its top.
+  std::uint64_t heapBottom;
+};
 
-  case Instr::Loadrc: {
-    stackPointer += 1;
-    memory[stackPointer] = framePointer + instruction.arg;
-  } break;
+// Registers and free lists are saved as 32-bit fields.
+static_assert(sizeof(int) == sizeof(std::int32_t));
+
+/// Writes the fields of a header one by one, in little-endian order.
+auto writeHeader(FILE *out, const CheckpointHeader &header) -> bool {
+  using common::writeLittleEndian;
+  const Registers &r = header.registers;
+  std::array<int, 5> registers = {r.programCounter, r.stackPointer,
+                                  r.framePointer, r.extremePointer,
+                                  r.newPointer};
+  return writeLittleEndian(out, header.magic.data(), header.magic.size()) &&
+         writeLittleEndian(out, header.version) &&
+         writeLittleEndian(out, header.cellSize) &&
+         writeLittleEndian(out, header.programHash) &&
+         writeLittleEndian(out, header.stackCells) &&
+         writeLittleEndian(out, header.guardCells) &&
+         writeLittleEndian(out, header.heapCells) &&
+         writeLittleEndian(out, registers.data(), registers.size()) &&
+         writeLittleEndian(out, header.stackEnd) &&
+         writeLittleEndian(out, header.heapBottom);
+}
 
-  case Instr::Loadr: {
-    int addr = framePointer + instruction.arg;
-    stackPointer += 1;
-    memory[stackPointer] = memory[addr];
-  } break;
+auto readHeader(FILE *in, CheckpointHeader &header) -> bool {
+  using common::readLittleEndian;
+  std::array<int, 5> registers = {};
+  bool isRead =
+      readLittleEndian(in, header.magic.data(), header.magic.size()) &&
+      readLittleEndian(in, header.version) &&
+      readLittleEndian(in, header.cellSize) &&
+      readLittleEndian(in, header.programHash) &&
+      readLittleEndian(in, header.stackCells) &&
+      readLittleEndian(in, header.guardCells) &&
+      readLittleEndian(in, header.heapCells) &&
+      readLittleEndian(in, registers.data(), registers.size()) &&
+      readLittleEndian(in, header.stackEnd) &&
+      readLittleEndian(in, header.heapBottom);
+  auto [pc, sp, fp, ep, np] = registers;
+  header.registers = {.programCounter = pc,
+                      .stackPointer = sp,
+                      .framePointer = fp,
+                      .extremePointer = ep,
+                      .newPointer = np};
+  return isRead;
+}
 
-  case Instr::Storer: {
-    int addr = framePointer + instruction.arg;
-    memory[addr] = memory[stackPointer];
-  } break;
+/// Writes the free lists and the statistics of the heap after the header.
+template <typename State>
+auto writeHeapState(FILE *out, const State &state) -> bool {
+  using common::writeSize;
+  const HeapStats &stats = state.stats;
+  return common::writeLittleEndian(out, state.freeLists.data(),
+                                   state.freeLists.size()) &&
+         writeSize(out, stats.liveBlocks) && writeSize(out, stats.liveBytes) &&
+         writeSize(out, stats.freeBytes) &&
+         writeSize(out, stats.peakLiveBytes);
+}
 
-  case Instr::Return: {
-    programCounter = memory[framePointer];
-    extremePointer = memory[framePointer - 2];
-    if (extremePointer >= newPointer) {
-      debug();
-      dbg_fail("Stack overflow");
-    }
-    stackPointer = framePointer - 3;
-    framePointer = memory[stackPointer + 2];
-  } break;
+template <typename State> auto readHeapState(FILE *in, State &state) -> bool {
+  using common::readSize;
+  HeapStats &stats = state.stats;
+  return common::readLittleEndian(in, state.freeLists.data(),
+                                  state.freeLists.size()) &&
+         readSize(in, stats.liveBlocks) && readSize(in, stats.liveBytes) &&
+         readSize(in, stats.freeBytes) && readSize(in, stats.peakLiveBytes);
+}
 
-  case Instr::Halt: {
-    programCounter = std::numeric_limits<int>::max();
-  } break;
+/// The FNV-1a hash of a program, the same whether it is quickened or not.
+template <typename Instruction>
+auto programHash(std::span<const Instruction> instructions) -> std::uint64_t {
+  std::uint64_t hash = 14695981039346656037U;
+  auto add = [&](std::uint64_t value) {
+    hash = (hash ^ value) * 1099511628211U;
+  };
+  for (Instruction i : instructions) {
+    add(Instr::baseType(i.type));
+    add(static_cast<std::uint64_t>(i.arg));
+  }
+  return hash;
+}
 
-  case Instr::Print: {
-    auto x = memory[stackPointer];
-    stackPointer -= 1;
-    std::println(out, "{}", x);
-  } break;
+} // namespace
 
-  default:
-    dbg_fail("Bad instruction", instruction.type, instruction.arg);
+template <typename Policy> void BasicCMa<Policy>::checkStride() const {
+  // Then no single access reaches past a guard page (but see `MemoryLayout`
+  // for what the guards do not catch).
+  std::size_t guardCells = memory.getLayout().guardCells;
+  std::size_t stride = maxStride<Instruction>(instructions);
+  dbg_assert(stride < guardCells,
+             "An instruction reaches beyond the guard pages of the memory",
+             stride, guardCells);
+}
+
+template <typename Policy> auto BasicCMa<Policy>::run() -> int {
+  checkStride();
+  if constexpr (std::is_same_v<Policy, CMaPolicy<>>) {
+    switch (engine) {
+    case Engine::Switch: break;
+    case Engine::Threaded: return runThreaded();
+    case Engine::Checked:
+      return runChecked(
+          verify(instructions, memory.size(), nativeEffects()));
+    case Engine::Safe: {
+      Verification verification =
+          verify(instructions, memory.size(), nativeEffects());
+      if (verification.isVerified()) {
+        return runThreaded();
+      }
+      return runChecked(verification);
+    }
+    case Engine::Jit: return runJit();
+    case Engine::Compact: return runCompact();
+    case Engine::Tiered: return runTiered();
+    }
+  } else {
+    dbg_assert_eq(engine, Engine::Switch,
+                  "Only the default CMa configuration has other engines");
   }
+  while (programCounter < std::ssize(instructions)) {
+    step();
+  }
+  return static_cast<int>(memory[0]);
 }
 
-void CMa::debug() {
-  std::println(out, "CMa state: SP = {}, PC = {}, FP = {}, EP = {}, NP = {}",
-               stackPointer, programCounter, framePointer, extremePointer,
-               newPointer);
-  constexpr int maxStackCount = 10;
-  int start = std::max(maxStackCount, stackPointer) - maxStackCount;
-  std::print(out, "    stack: ");
-  if (start > 0) {
-    std::print(out, "...   ");
+template <typename Policy>
+auto BasicCMa<Policy>::cell(std::int64_t address,
+                            [[maybe_unused]] Access access) -> Word & {
+  if constexpr (Policy::checked) {
+    if (address < 0 || address >= std::ssize(memory)) [[unlikely]] {
+      debug();
+      dbg_fail("Out of bounds memory access", address, programCounter - 1);
+    }
   }
-  for (int i = start; i <= stackPointer; ++i) {
-    std::print(out, "{}   ", memory[i]);
+  if constexpr (Policy::recorded) {
+    accessLog.record(address, access);
   }
-  std::println(out, "<- top");
+  return memory[address];
 }
 
-auto Instr::hasMandatoryArg(Type t) -> bool {
-  return t == Instr::Loadc || t == Instr::Loada || t == Instr::Storea ||
-         t == Instr::Jump || t == Instr::Jumpi || t == Instr::Jumpz ||
-         t == Instr::Alloc || t == Instr::Enter || t == Instr::Slide ||
-         t == Instr::Loadrc || t == Instr::Loadr || t == Instr::Storer;
+template <typename Policy>
+auto BasicCMa<Policy>::cells(std::int64_t address, Word count,
+                             [[maybe_unused]] Access access) -> Word * {
+  if (count <= 0) {
+    return memory.data();
+  }
+  if constexpr (Policy::checked) {
+    if (address < 0 || count > std::ssize(memory) - address) [[unlikely]] {
+      debug();
+      dbg_fail("Out of bounds memory access", address, count,
+               programCounter - 1);
+    }
+  }
+  if constexpr (Policy::recorded) {
+    for (std::int64_t i = address; i < address + count; ++i) {
+      accessLog.record(i, access);
+    }
+  }
+  return memory.data() + address;
 }
 
-auto Instr::hasOptionalArg(Type t) -> bool {
-  return t == Instr::Pop || t == Instr::Load || t == Instr::Store;
+template <typename Policy>
+auto BasicCMa<Policy>::globalsEnd(std::span<const Instruction> program)
+    -> std::int64_t {
+  std::int64_t end = 0;
+  for (Instruction i : program) {
+    Instr::Type t = Instr::baseType(i.type);
+    if (t == Instr::Loada || t == Instr::Storea) {
+      end = std::max(end, static_cast<std::int64_t>(i.arg) + 1);
+    }
+  }
+  return end;
 }
 
-auto Instr::toString(Instr ::Type enumValue) -> std::string_view {
-  constexpr std::array names = {
-      "debug", "loadc",  "add",    "sub",   "mul",    "div",    "mod",  "and",
-      "or",    "xor",    "eq",     "neq",   "le",     "leq",    "gr",   "geq",
-      "not",   "neg",    "load",   "store", "loada",  "storea", "pop",  "jump",
-      "jumpz", "jumpi",  "dup",    "alloc", "new",    "mark",   "call", "slide",
-      "enter", "return", "loadrc", "loadr", "storer", "halt",   "print"};
-  auto index = static_cast<std::size_t>(enumValue);
-  dbg_assert(0 <= index && index < names.size(), "Bad enum tag for Instr::Type",
-             enumValue);
-  return names[index];
+template <typename Policy>
+void BasicCMa<Policy>::trace(Instruction instruction) {
+  std::print(stderr, "{:6}  {:<8}", programCounter,
+             Instr::toString(instruction.type));
+  if (Instr::hasMandatoryArg(Instr::baseType(instruction.type)) ||
+      Instr::hasOptionalArg(Instr::baseType(instruction.type))) {
+    std::print(stderr, " {:<8}", instruction.arg);
+  } else {
+    std::print(stderr, " {:<8}", "");
+  }
+  std::print(stderr, "SP = {}, FP = {}, EP = {}, NP = {}", stackPointer,
+             framePointer, extremePointer, newPointer);
+  if (stackPointer >= 0) {
+    std::print(stderr, ", top = {}", cell(stackPointer));
+  }
+  std::println(stderr);
 }
 
-auto Instr ::fromString(std::string_view name) -> Instr::Type {
-  static const std::unordered_map<std::string_view, Instr::Type> names = {
-      {"debug", Type::Debug},   {"loadc", Type::Loadc},
-      {"add", Type::Add},       {"sub", Type::Sub},
-      {"mul", Type::Mul},       {"div", Type::Div},
-      {"mod", Type::Mod},       {"and", Type::And},
-      {"or", Type::Or},         {"xor", Type::Xor},
-      {"eq", Type::Eq},         {"neq", Type::Neq},
-      {"le", Type::Le},         {"leq", Type::Leq},
-      {"gr", Type::Gr},         {"geq", Type::Geq},
-      {"not", Type::Not},       {"neg", Type::Neg},
-      {"load", Type::Load},     {"store", Type::Store},
-      {"loada", Type::Loada},   {"storea", Type::Storea},
-      {"pop", Type::Pop},       {"jump", Type::Jump},
-      {"jumpz", Type::Jumpz},   {"jumpi", Type::Jumpi},
-      {"dup", Type::Dup},       {"alloc", Type::Alloc},
-      {"new", Type::New},       {"mark", Type::Mark},
-      {"call", Type::Call},     {"slide", Type::Slide},
-      {"enter", Type::Enter},   {"return", Type::Return},
-      {"loadrc", Type::Loadrc}, {"loadr", Type::Loadr},
-      {"storer", Type::Storer}, {"halt", Type::Halt},
-      {"print", Type::Print}};
-  std::string canonical = {};
-  std::ranges::transform(name, std::back_inserter(canonical),
-                         [](unsigned char c) { return std::tolower(c); });
-  auto iter = names.find(canonical);
-  dbg_assert_neq(iter, names.end(), "Bad enum name for Instr::Type", name,
-                 canonical);
-  return iter->second;
+template <typename Policy> void BasicCMa<Policy>::print(Word value) {
+  std::println(out, "{}", value);
 }
 
-namespace {
+template <typename Policy>
+void BasicCMa<Policy>::execute(Instruction instruction) {
+  if (!CMaCore::execute(*this, instruction)) [[unlikely]] {
+    dbg_fail("Bad instruction", instruction.type, instruction.arg);
+  }
+}
 
-class Parser {
-  std::string_view text;
-  std::size_t position = 0;
-  std::int32_t instr_number = 0;
-  std::vector<Instr> instructions = {};
-  std::unordered_map<std::string_view, std::int32_t> jumpLabels = {};
+template <typename Policy>
+auto BasicCMa<Policy>::spawn(Word function, Word argument, int &newPointer)
+    -> Word {
+  if (threads == nullptr) {
+    // The first thread: nobody else uses the heap yet.
+    heap.share(newPointer);
+    ownThreads = std::make_unique<ThreadGroup<BasicCMa>>();
+    threads = ownThreads.get();
+  }
+  int stack = heap.allocate(newPointer, threadStackCells);
+  if (stack == 0) {
+    return 0;
+  }
+  // The frame of `loadc argument; mark; loadc function; call`.
+  memory[stack] = argument;
+  memory[stack + 1] = -1;
+  memory[stack + 2] = -1;
+  memory[stack + 3] = static_cast<Word>(std::ssize(instructions));
+  Registers registers = {.programCounter = static_cast<int>(function),
+                         .stackPointer = stack + 3,
+                         .framePointer = stack + 3,
+                         .extremePointer = stack + 3,
+                         .newPointer = newPointer};
+  std::unique_ptr<BasicCMa> thread(
+      new BasicCMa(*this, registers, stack + threadStackCells));
+  return threads->start(std::move(thread), stack);
+}
 
-  enum class Mode : std::uint8_t { GatherLabels, EmitInstructions };
-  Mode mode = Mode::GatherLabels;
+template <typename Policy> auto BasicCMa<Policy>::join(Word thread) -> Word {
+  dbg_assert_neq(threads, nullptr, "join without spawn", thread);
+  int stack = threads->join(thread);
+  Word result = memory[stack];
+  heap.release(newPointer, stack);
+  return result;
+}
 
-  auto atEnd() -> bool { return position >= text.size(); }
-  auto peek() -> char { return atEnd() ? '\0' : text[position]; }
+template <typename Policy>
+auto BasicCMa<Policy>::registerNative(NativeFunction<Word> native) -> int {
+  dbg_assert(native.effect.pops >= 0 && native.effect.pushes >= 0,
+             "Negative stack effect of a native function", native.effect.pops,
+             native.effect.pushes);
+  natives.push_back(std::move(native));
+  return static_cast<int>(natives.size()) - 1;
+}
 
-  auto advance() -> char {
-    char c = peek();
-    position++;
-    return c;
+template <typename Policy>
+auto BasicCMa<Policy>::nativeEffects() const -> std::vector<StackEffect> {
+  std::vector<StackEffect> effects = {};
+  effects.reserve(natives.size());
+  for (const NativeFunction<Word> &native : natives) {
+    effects.push_back(native.effect);
   }
+  return effects;
+}
+
+template <typename Policy>
+void BasicCMa<Policy>::callNative(Word index, int &stackPointer,
+                                  int framePointer) {
+  dbg_assert(0 <= index && index < std::ssize(natives),
+             "Call of an unknown native function", index);
+  const NativeFunction<Word> &native = natives[static_cast<std::size_t>(index)];
+  int expected = stackPointer - native.effect.pops + native.effect.pushes;
+  native.function(std::span<Word>(memory.data(), memory.size()), stackPointer,
+                  framePointer);
+  dbg_assert_eq(stackPointer, expected,
+                "Native function left the stack at the wrong height", index);
+}
 
-  void consume(char c) {
-    if (peek() != c) {
-      dbg_fail("Expected different char", peek());
+template <typename Policy>
+auto BasicCMa<Policy>::coversBreakpoint(int start, Instruction instruction)
+    -> bool {
+  auto partCount =
+      static_cast<int>(Instr::fusedParts(instruction.type).size());
+  for (int i = start + 1; i < start + partCount; ++i) {
+    if (breakpoints.contains(i)) {
+      return true;
     }
-    advance();
   }
+  return false;
+}
 
-  void skipComments() {
-    consume('/');
-    consume('/');
-    while (peek() != '\n' && !atEnd()) {
-      advance();
+template <typename Policy>
+void BasicCMa<Policy>::splitAround(int address) {
+  int first = std::max(address - static_cast<int>(Instr::maxFusedParts), 0);
+  int last = std::min(address + static_cast<int>(Instr::maxFusedParts),
+                      static_cast<int>(std::ssize(instructions)));
+  for (int start = first; start < last; ++start) {
+    auto split = splitSuperinstructions.find(start);
+    if (split != splitSuperinstructions.end()) {
+      if (!coversBreakpoint(start, split->second)) {
+        // The slot may have got a breakpoint itself in the meantime.
+        auto breakpoint = breakpoints.find(start);
+        (breakpoint == breakpoints.end() ? instructions[start]
+                                         : breakpoint->second) = split->second;
+        splitSuperinstructions.erase(split);
+      }
+    } else if (coversBreakpoint(start, instructions[start])) {
+      splitSuperinstructions.emplace(start, instructions[start]);
+      instructions[start].type = Instr::baseType(instructions[start].type);
     }
-    consume('\n');
   }
+}
 
-  auto isBlank(char c) -> bool {
-    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+template <typename Policy>
+void BasicCMa<Policy>::setBreakpoint(int address) {
+  dbg_assert(0 <= address && address < std::ssize(instructions),
+             "Breakpoint outside the program", address);
+  if (!breakpoints.contains(address)) {
+    breakpoints.emplace(address, instructions[address]);
+    instructions[address] = {Instr::Trap, 0};
+    splitAround(address);
   }
+}
 
-  auto isNumeric(char c) -> bool { return ('0' <= c && c <= '9') || c == '-'; }
+template <typename Policy>
+void BasicCMa<Policy>::clearBreakpoint(int address) {
+  auto breakpoint = breakpoints.find(address);
+  dbg_assert(breakpoint != breakpoints.end(), "No breakpoint to clear",
+             address);
+  instructions[address] = breakpoint->second;
+  breakpoints.erase(breakpoint);
+  splitAround(address);
+}
 
-  auto isIdentStart(char c) -> bool {
-    return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_';
+template <typename Policy> void BasicCMa<Policy>::singleStep() {
+  if (stoppedAt >= 0) {
+    programCounter = stoppedAt;
+    stoppedAt = -1;
   }
-
-  auto isIdentPart(char c) -> bool { return isIdentStart(c) || isNumeric(c); }
-
-  void skipWhiteSpace() {
-    while (isBlank(peek()) && !atEnd()) {
-      advance();
-    }
+  int address = programCounter;
+  auto breakpoint = breakpoints.find(address);
+  if (breakpoint == breakpoints.end()) {
+    step();
+  } else {
+    // Step the real instruction, and keep it if it was quickened.
+    instructions[address] = breakpoint->second;
+    step();
+    breakpoint->second = instructions[address];
+    instructions[address] = {Instr::Trap, 0};
   }
+}
 
-  void skip() {
-    while (!atEnd()) {
-      if (peek() == '/') {
-        skipComments();
-      } else if (isBlank(peek())) {
-        skipWhiteSpace();
-      } else {
-        break;
-      }
-    }
+template <typename Policy> auto BasicCMa<Policy>::resume() -> bool {
+  if (stoppedAt >= 0) {
+    singleStep();
   }
-
-  auto consumeColon() -> bool {
-    skip();
-    bool hasColon = peek() == ':';
-    if (hasColon) {
-      consume(':');
-    }
-    skip();
-    return hasColon;
+  while (programCounter < std::ssize(instructions)) {
+    step();
   }
-
-  auto readWord() -> std::string_view {
-    skip();
-    std::size_t start = position;
-    while (isIdentPart(peek()) && !atEnd()) {
-      advance();
-    }
-    auto w = text.substr(start, position - start);
-    skip();
-    return w;
+  if (stoppedAt < 0) {
+    return false;
   }
+  programCounter = stoppedAt;
+  return true;
+}
 
-  auto readNumber() -> std::int32_t {
-    skip();
-    std::size_t start = position;
-    if (peek() == '-' || peek() == '+') {
-      advance();
+template <typename Policy>
+void BasicCMa<Policy>::restart(std::span<Instruction> program) {
+  ownThreads = nullptr;
+  threads = nullptr;
+  // The caller may have freed the last program already.
+  bool isSameProgram = program.data() == instructions.data() &&
+                       program.size() == instructions.size();
+  if (isSameProgram) {
+    for (auto [address, instruction] : breakpoints) {
+      instructions[address] = instruction;
     }
-    while (isNumeric(peek()) && !atEnd()) {
-      advance();
+    for (auto [address, instruction] : splitSuperinstructions) {
+      instructions[address] = instruction;
     }
-    auto literal = text.substr(start, position - start);
-    skip();
-
-    std::int32_t value;
-    auto result = std::from_chars(literal.begin(), literal.end(), value);
-    dbg_assert_eq(result.ptr, literal.end(), "Could not parse full number",
-                  literal);
-    return value;
   }
+  breakpoints.clear();
+  splitSuperinstructions.clear();
+  stoppedAt = -1;
+  heap.reset();
+  profile = {};
+  instructions = program;
+  if constexpr (Policy::recorded) {
+    accessLog.clear(globalsEnd(instructions));
+  }
+  setRegisters({.programCounter = 0,
+                .stackPointer = -1,
+                .framePointer = -1,
+                .extremePointer = -1,
+                .newPointer = static_cast<int>(memory.size()) - 1});
+}
 
-  void registerLabel(std::string_view name) {
-    if (mode == Mode::GatherLabels) {
-      jumpLabels.insert({name, instr_number});
-    }
+template <typename Policy>
+auto BasicCMa<Policy>::mapData(std::string_view path, int address,
+                               bool isWritable) -> std::size_t {
+  dbg_assert(address >= 0, "Data at a negative address", path, address);
+  return memory.mapFile(path, static_cast<std::size_t>(address), isWritable);
+}
+
+template <typename Policy>
+auto BasicCMa<Policy>::runFor(std::int64_t steps) -> bool {
+  checkStride();
+  for (; steps > 0 && programCounter < std::ssize(instructions); --steps) {
+    step();
   }
+  return programCounter < std::ssize(instructions);
+}
 
-  void handleInstruction(Instr::Type t, std::int32_t arg = 1) {
-    if (mode == Mode::EmitInstructions) {
-      instructions.push_back({t, arg});
-    }
-    instr_number += 1;
+template <typename Policy> void BasicCMa<Policy>::checkpoint(FILE *out) {
+  dbg_assert_eq(threads, nullptr,
+                "Cannot checkpoint a machine that started threads");
+  dbg_assert(breakpoints.empty() && stoppedAt < 0,
+             "Cannot checkpoint a machine with breakpoints");
+  dbg_assert(!memory.hasFiles(),
+             "Cannot checkpoint a machine with mapped data");
+
+  // The stack pages the kernel has seen, and at least the live cells.
+  const MemoryLayout &layout = memory.getLayout();
+  std::size_t stackEnd = std::max(
+      {memory.touchedStackCells(), static_cast<std::size_t>(stackPointer + 1),
+       static_cast<std::size_t>(extremePointer + 1)});
+  stackEnd = std::min(stackEnd, layout.stackCells);
+  auto heapBottom = static_cast<std::size_t>(newPointer);
+  CheckpointHeader header = {
+      .magic = checkpointMagic,
+      .version = checkpointVersion,
+      .cellSize = sizeof(Word),
+      .programHash = programHash<Instruction>(instructions),
+      .stackCells = layout.stackCells,
+      .guardCells = layout.guardCells,
+      .heapCells = layout.heapCells,
+      .registers = getRegisters(),
+      .stackEnd = stackEnd,
+      .heapBottom = heapBottom};
+  typename BasicHeap<Word>::State heapState = heap.getState();
+  std::size_t heapCells = memory.size() - heapBottom;
+  bool isWritten =
+      writeHeader(out, header) && writeHeapState(out, heapState) &&
+      common::writeLittleEndian(out, memory.data(), stackEnd) &&
+      common::writeLittleEndian(out, memory.data() + heapBottom, heapCells);
+  dbg_assert(isWritten, "Cannot write checkpoint");
+}
+
+template <typename Policy> void BasicCMa<Policy>::restore(FILE *in) {
+  CheckpointHeader header = {};
+  bool isCheckpoint = readHeader(in, header) && header.magic == checkpointMagic;
+  dbg_assert(isCheckpoint, "Not a CMa checkpoint");
+  dbg_assert_eq(header.version, checkpointVersion,
+                "Unsupported checkpoint version", header.version);
+  dbg_assert_eq(header.cellSize, sizeof(Word),
+                "Checkpoint of a machine with other cells", header.cellSize);
+  dbg_assert_eq(header.programHash, programHash<Instruction>(instructions),
+                "Checkpoint of another program");
+  const MemoryLayout &layout = memory.getLayout();
+  bool isSameLayout = header.stackCells == layout.stackCells &&
+                      header.guardCells == layout.guardCells &&
+                      header.heapCells == layout.heapCells;
+  dbg_assert(isSameLayout, "Checkpoint of a machine with another memory layout",
+             header.stackCells, header.heapCells);
+  bool isInMemory = header.stackEnd <= layout.stackCells &&
+                    layout.heapStart() <= header.heapBottom &&
+                    header.heapBottom <= memory.size();
+  dbg_assert(isInMemory, "Corrupt checkpoint", header.stackEnd,
+             header.heapBottom);
+
+  typename BasicHeap<Word>::State heapState = {};
+  std::size_t heapCells = memory.size() - header.heapBottom;
+  bool isComplete =
+      readHeapState(in, heapState) &&
+      common::readLittleEndian(in, memory.data(), header.stackEnd) &&
+      common::readLittleEndian(in, memory.data() + header.heapBottom,
+                               heapCells);
+  dbg_assert(isComplete, "Truncated checkpoint");
+  heap.setState(heapState, static_cast<int>(header.heapBottom));
+  setRegisters(header.registers);
+}
+
+template <typename Policy>
+void BasicCMa<Policy>::reset(std::span<Instruction> program) {
+  // Wait for the threads before looking at what they wrote.
+  ownThreads = nullptr;
+  memory.unmapFiles();
+  memory.clear(static_cast<std::size_t>(heap.lowestBlock(newPointer)));
+  restart(program);
+}
+
+template <typename Policy> void BasicCMa<Policy>::releaseMemory() {
+  ownThreads = nullptr;
+  memory.unmapFiles();
+  memory.discard();
+  restart({});
+}
+
+template <typename Policy>
+auto BasicCMa<Policy>::getStack() -> std::span<const Word> {
+  // Spawned threads have their stack in the heap.
+  bool isThread = threads != nullptr && ownThreads == nullptr;
+  int bottom = isThread ? stackEnd - threadStackCells : 0;
+  return {memory.data() + bottom,
+          static_cast<std::size_t>(std::max(stackPointer + 1 - bottom, 0))};
+}
+
+template <typename Policy> void BasicCMa<Policy>::debug() {
+  std::println(out, "CMa state: SP = {}, PC = {}, FP = {}, EP = {}, NP = {}",
+               stackPointer, programCounter, framePointer, extremePointer,
+               newPointer);
+  constexpr int maxStackCount = 10;
+  int start = std::max(maxStackCount, stackPointer) - maxStackCount;
+  std::print(out, "    stack: ");
+  if (start > 0) {
+    std::print(out, "...   ");
   }
+  for (int i = start; i <= stackPointer; ++i) {
+    std::print(out, "{}   ", memory[i]);
+  }
+  std::println(out, "<- top");
+}
 
-  void handleInstruction(Instr::Type t, std::string_view label) {
-    if (mode == Mode::EmitInstructions) {
-      std::int32_t address = jumpLabels.at(label);
-      instructions.push_back({t, address});
+void ExecutionProfile::print(FILE *out) const {
+  std::vector<std::pair<std::uint64_t, Instr::Type>> executed = {};
+  for (std::size_t t = 0; t < counts.size(); ++t) {
+    if (counts[t] != 0) {
+      executed.emplace_back(counts[t], static_cast<Instr::Type>(t));
     }
-    instr_number += 1;
   }
+  std::ranges::sort(executed, std::greater{});
+  for (auto [count, type] : executed) {
+    std::println(out, "{:>12}  {}", count, Instr::toString(type));
+  }
+}
 
-  void parseInstruction(std::string_view word) {
-    Instr::Type instructionType = Instr::fromString(word);
+#define CMA_INSTANTIATE(checked, traced, profiled, word, recorded)             \
+  template class BasicCMa<                                                     \
+      CMaPolicy<checked, traced, profiled, word, recorded>>;                   \
+  static_assert(                                                               \
+      common::VirtualMachine<                                                  \
+          BasicCMa<CMaPolicy<checked, traced, profiled, word, recorded>>>);
+CMA_POLICIES(CMA_INSTANTIATE)
+#undef CMA_INSTANTIATE
+
+auto Instr::fusedParts(Type t) -> std::span<const Type> {
+  switch (t) {
+#define CMA_SUPERINSTRUCTION(name, ...)                                        \
+  case name: {                                                                 \
+    static constexpr std::array parts = {__VA_ARGS__};                         \
+    return parts;                                                              \
+  }
+#include "lib/CMaSuperinstructions.inc"
+#undef CMA_SUPERINSTRUCTION
+  default: return {};
+  }
+}
 
-    if (Instr::hasMandatoryArg(instructionType)) {
-      if (isIdentStart(peek())) {
-        handleInstruction(instructionType, readWord());
-      } else if (isNumeric(peek())) {
-        handleInstruction(instructionType, readNumber());
-      } else {
-        dbg_fail("bad char", peek());
-      }
-    } else if (Instr::hasOptionalArg(instructionType)) {
-      if (isNumeric(peek())) {
-        handleInstruction(instructionType, readNumber());
-      } else {
-        handleInstruction(instructionType);
-      }
-    } else {
-      handleInstruction(instructionType);
-    }
+auto Instr::baseType(Type t) -> Type {
+  switch (t) {
+#define CMA_QUICKENED(name, base, arg)                                         \
+  case name: return base;
+#include "lib/CMaQuickened.inc"
+#undef CMA_QUICKENED
+  default: break;
   }
+  auto parts = fusedParts(t);
+  return parts.empty() ? t : parts.front();
+}
 
-  void consumeWord() {
-    auto word = readWord();
-    if (consumeColon()) {
-      registerLabel(word);
-    } else {
-      parseInstruction(word);
-    }
+auto Instr::toString(Instr ::Type enumValue) -> std::string_view {
+  switch (enumValue) {
+#define CMA_SUPERINSTRUCTION(name, ...)                                        \
+  case name: return #name;
+#include "lib/CMaSuperinstructions.inc"
+#undef CMA_SUPERINSTRUCTION
+#define CMA_QUICKENED(name, ...)                                               \
+  case name: return #name;
+#include "lib/CMaQuickened.inc"
+#undef CMA_QUICKENED
+  default: break;
   }
+  auto index = static_cast<std::size_t>(enumValue);
+  dbg_assert(0 <= index && index < names.size(), "Bad enum tag for Instr::Type",
+             enumValue);
+  return names[index];
+}
 
-  void walk(Mode m) {
-    mode = m;
-    position = 0;
-    instr_number = 0;
-    instructions.clear();
+auto ProgramLoader::loadInstructions(std::string_view text)
+    -> std::vector<Instr> {
+  return ProgramParser(text).parse();
+}
 
-    for (skip(); !atEnd(); skip()) {
-      consumeWord();
-    }
-  }
+template <typename Arg>
+auto ProgramLoader::loadInstructions(std::string_view text)
+    -> std::vector<InstrFor<Arg>> {
+  return BasicProgramParser<Arg>(text).parse();
+}
 
-public:
-  explicit Parser(std::string_view text) : text{text} {}
+template auto ProgramLoader::loadInstructions<int>(std::string_view text)
+    -> std::vector<Instr>;
+template auto
+ProgramLoader::loadInstructions<std::int64_t>(std::string_view text)
+    -> std::vector<WideInstr<std::int64_t>>;
+
+auto ProgramLoader::loadInstructions(std::string_view text,
+                                     OptimizationReport &report)
+    -> std::vector<Instr> {
+  ProgramParser parser(text);
+  std::vector<Instr> instructions = parser.parse();
+  report = optimize(instructions, parser.labelArguments());
+  return instructions;
+}
 
-  auto parse() -> std::vector<Instr> {
-    walk(Mode::GatherLabels);
-    walk(Mode::EmitInstructions);
+auto ProgramLoader::loadSymbols(std::string_view text)
+    -> std::vector<common::Symbol> {
+  return ProgramParser(text).symbols();
+}
 
-    return std::move(instructions);
+namespace {
+
+template <typename Instruction>
+auto quickenAll(std::span<Instruction> instructions) -> std::size_t {
+  struct Quickening {
+    Instr::Type base;
+    int arg;
+    Instr::Type quickened;
+  };
+  static constexpr std::array quickenings = {
+#define CMA_QUICKENED(name, base, arg)                                         \
+  Quickening{Instr::base, arg, Instr::name},
+#include "lib/CMaQuickened.inc"
+#undef CMA_QUICKENED
+  };
+
+  std::size_t quickened = 0;
+  for (Instruction &instruction : instructions) {
+    for (Quickening q : quickenings) {
+      if (instruction.type == q.base && instruction.arg == q.arg) {
+        instruction.type = q.quickened;
+        quickened += 1;
+        break;
+      }
+    }
   }
-};
+  return quickened;
+}
+
+} // namespace
 
-}; // namespace
+auto ProgramLoader::quicken(std::span<Instr> instructions) -> std::size_t {
+  return quickenAll(instructions);
+}
+
+auto ProgramLoader::quicken(std::span<WideInstr<std::int64_t>> instructions)
+    -> std::size_t {
+  return quickenAll(instructions);
+}
 
-auto CMa::loadInstructions(std::string_view text) -> std::vector<Instr> {
-  return Parser(text).parse();
+auto ProgramLoader::fuseSuperinstructions(std::span<Instr> instructions)
+    -> std::size_t {
+  static constexpr std::array superinstructions = {
+#define CMA_SUPERINSTRUCTION(name, ...) Instr::name,
+#include "lib/CMaSuperinstructions.inc"
+#undef CMA_SUPERINSTRUCTION
+      Instr::Print};
+
+  auto matches = [&](std::size_t start, std::span<const Instr::Type> parts) {
+    if (start + parts.size() > instructions.size()) {
+      return false;
+    }
+    for (std::size_t i = 0; i < parts.size(); ++i) {
+      // Later slots have not been rewritten yet, so they still hold
+      // plain instructions.
+      if (instructions[start + i].type != parts[i]) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  std::size_t fused = 0;
+  for (std::size_t i = 0; i < instructions.size(); ++i) {
+    // Superinstructions may overlap: a jump into the middle of one lands on
+    // the next fused slot instead of a plain instruction.
+    for (Instr::Type t : std::span(superinstructions).first(
+             Instr::superinstructionCount)) {
+      if (matches(i, Instr::fusedParts(t))) {
+        instructions[i].type = t;
+        fused += 1;
+        break;
+      }
+    }
+  }
+  return fused;
 }
 
 } // namespace vm::cma
@@ -1,10 +1,26 @@
 #ifndef TUM_I2_VM_LIB_C_MACHINE
 #define TUM_I2_VM_LIB_C_MACHINE
 
+#include "lib/CMaHeap.hpp"
+#include "lib/CMaLocality.hpp"
+#include "lib/CMaMemory.hpp"
+#include "lib/CMaThreads.hpp"
+#include "lib/Common.hpp"
+#include "lib/Error.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <functional>
+#include <initializer_list>
+#include <limits>
+#include <memory>
 #include <span>
 #include <string_view>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
 namespace vm::cma {
@@ -49,21 +65,85 @@ struct Instr {
     // Introduced in Storage Allocation for Variables
     Alloc,
     New,
+    Free,
     // Funktions
     Mark,
     Call,
     Slide,
     Enter,
     Return,
+    // Tail calls, which reuse the current frame
+    TailCall,
     // Local Variables
     Loadrc,
     Loadr,
     Storer,
+    // Bulk memory, on ranges of cells (see lib/CMaBulk.hpp)
+    Copy,
+    Fill,
+    Sum,
+    Min,
+    Max,
+    Dot,
+    Find,
+    Cmp,
+    // Threads and atomics
+    Spawn,
+    Join,
+    Cas,
+    FetchAdd,
+    // Calls of host functions (see `CMa::registerNative`)
+    CallNative,
+    // Breakpoints, patched in by the debugger (not part of program text)
+    Trap,
     // Whole Programs
     Halt,
-    Print
+    Print,
+    // Superinstructions, fused from the most frequent sequences of the above
+#define CMA_SUPERINSTRUCTION(name, ...) name,
+#include "lib/CMaSuperinstructions.inc"
+#undef CMA_SUPERINSTRUCTION
+    // Quickened instructions, with their argument built in
+#define CMA_QUICKENED(name, ...) name,
+#include "lib/CMaQuickened.inc"
+#undef CMA_QUICKENED
   };
 
+#define CMA_SUPERINSTRUCTION(name, ...) +1
+  static constexpr std::size_t superinstructionCount = 0
+#include "lib/CMaSuperinstructions.inc"
+      ;
+#undef CMA_SUPERINSTRUCTION
+
+#define CMA_SUPERINSTRUCTION(name, ...)                                        \
+  , std::initializer_list<Type>{__VA_ARGS__}.size()
+  /// The most instructions any superinstruction was fused from.
+  static constexpr std::size_t maxFusedParts = std::max({std::size_t{1}
+#include "lib/CMaSuperinstructions.inc"
+  });
+#undef CMA_SUPERINSTRUCTION
+
+#define CMA_QUICKENED(name, ...) +1
+  static constexpr std::size_t quickenedCount = 0
+#include "lib/CMaQuickened.inc"
+      ;
+#undef CMA_QUICKENED
+
+  /// Number of instruction types, i.e. the size of a dispatch table.
+  static constexpr std::size_t typeCount =
+      Print + 1 + superinstructionCount + quickenedCount;
+
+  /// The names of the plain instruction types, in the order of `Type`.
+  static constexpr std::array<std::string_view, Print + 1> names = {
+      "debug", "loadc",  "add",    "sub",   "mul",    "div",    "mod",  "and",
+      "or",    "xor",    "eq",     "neq",   "le",     "leq",    "gr",   "geq",
+      "not",   "neg",    "load",   "store", "loada",  "storea", "pop",  "jump",
+      "jumpz", "jumpi",  "dup",    "alloc", "new",    "free",   "mark", "call",
+      "slide", "enter",  "return", "tailcall", "loadrc", "loadr", "storer",
+      "copy",  "fill",   "sum",    "min",   "max",    "dot",    "find", "cmp",
+      "spawn", "join",   "cas",    "fetchadd", "callnative", "trap", "halt",
+      "print"};
+
   /**
    * @brief Converts an instruction type to its string representation.
    * @param enumValue The instruction type.
@@ -73,10 +153,11 @@ struct Instr {
 
   /**
    * @brief Converts a string to its corresponding instruction type.
+   * @details Case insensitive. Usable in constant evaluation.
    * @param name The string representation of the instruction.
    * @return The corresponding instruction type.
    */
-  static auto fromString(std::string_view name) -> Type;
+  static constexpr auto fromString(std::string_view name) -> Type;
 
   /**
    * @brief Checks if an instruction type requires a mandatory argument.
@@ -84,7 +165,7 @@ struct Instr {
    * @return True if the instruction requires a mandatory argument, false
    * otherwise.
    */
-  static auto hasMandatoryArg(Type t) -> bool;
+  static constexpr auto hasMandatoryArg(Type t) -> bool;
 
   /**
    * @brief Checks if an instruction type allows an optional argument.
@@ -92,7 +173,25 @@ struct Instr {
    * @return True if the instruction allows an optional argument, false
    * otherwise.
    */
-  static auto hasOptionalArg(Type t) -> bool;
+  static constexpr auto hasOptionalArg(Type t) -> bool;
+
+  /**
+   * @brief The instructions a superinstruction was fused from.
+   * @param t The instruction type.
+   * @return The parts, or an empty span if `t` is not a superinstruction.
+   */
+  static auto fusedParts(Type t) -> std::span<const Type>;
+
+  /**
+   * @brief The plain instruction type that a (possibly fused or quickened)
+   * instruction stands for in its own slot.
+   * @details A superinstruction replaces only the first of the instructions
+   * it was fused from, the others stay in place. An engine that does not know
+   * about superinstructions may therefore execute the first part and carry on
+   * with the next slot. Quickened instructions keep their argument, so they
+   * can run as their base type.
+   */
+  static auto baseType(Type t) -> Type;
 
   /**
    * @brief Prints a list of instructions to stderr.
@@ -104,32 +203,590 @@ struct Instr {
   int arg;
 };
 
-class CMa {
+/**
+ * @brief An instruction with an argument of type `Arg`, for machines whose
+ * cells are wider than the `int` argument of an `Instr`: their `loadc` can
+ * push any cell value, at twice the size of the code.
+ */
+template <typename Arg> struct WideInstr {
+  Instr::Type type;
+  Arg arg;
+};
+
+/// The instructions of a machine with cells of type `Word`.
+template <typename Word>
+using InstrFor = std::conditional_t<(sizeof(Word) > sizeof(int)),
+                                    WideInstr<Word>, Instr>;
+
+constexpr auto Instr::fromString(std::string_view name) -> Type {
+  auto isSame = [](char c, char lower) {
+    return ('A' <= c && c <= 'Z' ? c - 'A' + 'a' : c) == lower;
+  };
+  for (std::size_t t = 0; t < names.size(); ++t) {
+    // Traps are patched in by the debugger, never written.
+    if (t != Trap && std::ranges::equal(name, names[t], isSame)) {
+      return static_cast<Type>(t);
+    }
+  }
+  dbg_fail("Bad enum name for Instr::Type", name);
+}
+
+constexpr auto Instr::hasMandatoryArg(Type t) -> bool {
+  return t == Instr::Loadc || t == Instr::Loada || t == Instr::Storea ||
+         t == Instr::Jump || t == Instr::Jumpi || t == Instr::Jumpz ||
+         t == Instr::Alloc || t == Instr::Enter || t == Instr::Slide ||
+         t == Instr::Loadrc || t == Instr::Loadr || t == Instr::Storer ||
+         t == Instr::TailCall || t == Instr::CallNative;
+}
+
+constexpr auto Instr::hasOptionalArg(Type t) -> bool {
+  return t == Instr::Pop || t == Instr::Load || t == Instr::Store;
+}
+
+/**
+ * @brief The execution strategies a CMa can use for `run()`.
+ */
+enum class Engine : std::uint8_t {
+  /// The `switch` based reference interpreter in `CMa::execute`.
+  Switch,
+  /// Direct-threaded, tail-calling handlers (see lib/CMaThreaded.cpp).
+  Threaded,
+  /// The reference interpreter with one bounds check per basic block (see
+  /// lib/CMaVerifier.hpp).
+  Checked,
+  /// Verifies the program first: verified programs run `Threaded`, all
+  /// others `Checked`.
+  Safe,
+  /// Compiles the program to native code (see lib/CMaJit.cpp); `Threaded` on
+  /// architectures other than x86-64.
+  Jit,
+  /// Runs a dense byte encoding of the program (see lib/CMaCompact.hpp).
+  Compact,
+  /// Starts in the reference interpreter and moves functions that are
+  /// called often or loop long to `Threaded` code, even while they run.
+  Tiered
+};
+
+/**
+ * @brief The compile-time configuration of a `BasicCMa`.
+ * @details Every knob that is off costs nothing: the code for it is not part
+ * of that instantiation of `execute`.
+ * @tparam IsChecked Whether every memory access is bounds checked.
+ * @tparam IsTraced Whether every step is printed to stderr.
+ * @tparam IsProfiled Whether the executed instructions are counted.
+ * @tparam WordType The type of a memory cell, and of the arguments of the
+ * instructions (see `InstrFor`).
+ * @tparam IsRecorded Whether every memory access goes into an `AccessLog`.
+ */
+template <bool IsChecked = false, bool IsTraced = false,
+          bool IsProfiled = false, typename WordType = int,
+          bool IsRecorded = false>
+struct CMaPolicy {
+  static constexpr bool checked = IsChecked;
+  static constexpr bool traced = IsTraced;
+  static constexpr bool profiled = IsProfiled;
+  using Word = WordType;
+  static constexpr bool recorded = IsRecorded;
+};
+
+/**
+ * @brief How often each instruction type was executed.
+ */
+struct ExecutionProfile {
+  std::array<std::uint64_t, Instr::typeCount> counts = {};
+
+  /// Prints the executed instruction types, most frequent first.
+  void print(FILE *out) const;
+};
+
+struct Verification;
+struct Bounds;
+struct OptimizationReport;
+
+/**
+ * @brief A snapshot of the CMa registers.
+ */
+struct Registers {
+  int programCounter;
+  int stackPointer;
+  int framePointer;
+  int extremePointer;
+  int newPointer;
+};
+
+/**
+ * @brief How an instruction uses the stack: it needs `pops` values on the
+ * stack, which it replaces with `pushes` values.
+ * @details For `call` this is only the view from inside the caller's block;
+ * after the callee returns, the call and its `mark` are gone (net -3).
+ */
+struct StackEffect {
+  int pops;
+  int pushes;
+};
+
+/**
+ * @brief A host function that `callnative` calls.
+ * @details It gets the whole memory, the stack pointer and the frame
+ * pointer, and works on the cells in place: it reads its arguments from the
+ * top of the stack and replaces them with its results, moving the stack
+ * pointer as `effect` says.
+ */
+template <typename Word> struct NativeFunction {
+  std::function<void(std::span<Word> memory, int &stackPointer,
+                     int framePointer)>
+      function;
+  StackEffect effect;
+};
+
+/**
+ * @brief Loading and rewriting of CMa programs, which does not depend on the
+ * configuration of the machine that runs them.
+ */
+class ProgramLoader {
+public:
+  /**
+   * @brief Loads instructions from a textual representation into a CMa
+   * instance.
+   * @param text The textual representation of instructions.
+   * @return A CMa instance with the loaded instructions.
+   */
+  static auto loadInstructions(std::string_view text) -> std::vector<Instr>;
+
+  /**
+   * @brief Loads instructions with arguments of type `Arg`, e.g. for a
+   * machine with 64-bit cells.
+   * @param text The textual representation of instructions.
+   * @return The instructions, as `InstrFor<Arg>`.
+   */
+  template <typename Arg>
+  static auto loadInstructions(std::string_view text)
+      -> std::vector<InstrFor<Arg>>;
+
+  /**
+   * @brief Loads instructions and optimizes them (see lib/CMaOptimizer.hpp).
+   * @param text The textual representation of instructions.
+   * @param report Set to what the optimizer did, including where the
+   * instructions of `text` ended up.
+   * @return The optimized instructions.
+   */
+  static auto loadInstructions(std::string_view text,
+                               OptimizationReport &report)
+      -> std::vector<Instr>;
+
+  /**
+   * @brief Collects the labels of a program in textual representation.
+   * @param text The textual representation of instructions.
+   * @return The labels with the index of the instruction they name.
+   */
+  static auto loadSymbols(std::string_view text)
+      -> std::vector<common::Symbol>;
+
+  /**
+   * @brief Replaces the first instruction of every sequence listed in
+   * lib/CMaSuperinstructions.inc with the matching superinstruction.
+   * @details The remaining instructions of the sequence are left in place,
+   * so jump targets stay valid and no labels have to be remapped.
+   * @param instructions The program to rewrite in place.
+   * @return The number of superinstructions introduced.
+   */
+  static auto fuseSuperinstructions(std::span<Instr> instructions)
+      -> std::size_t;
+
+  /**
+   * @brief Replaces plain instructions whose argument has an instruction of
+   * its own in lib/CMaQuickened.inc with that instruction.
+   * @details Only changes how fast the program runs: the argument stays in
+   * place. Superinstructions are left alone, so fuse them first.
+   * @param instructions The program to rewrite in place.
+   * @return The number of instructions quickened.
+   */
+  static auto quicken(std::span<Instr> instructions) -> std::size_t;
+  static auto quicken(std::span<WideInstr<std::int64_t>> instructions)
+      -> std::size_t;
+};
+
+struct CMaCore;
+
+/**
+ * @brief The CMa, specialized at compile time for a `CMaPolicy`.
+ * @details The engines other than `Engine::Switch` exist only for the
+ * default policy, i.e. for `CMa`.
+ */
+template <typename Policy = CMaPolicy<>>
+class BasicCMa : public ProgramLoader {
+public:
+  using Word = typename Policy::Word;
+  /// `Instr`, or a `WideInstr` if the cells are wider than its argument.
+  using Instruction = InstrFor<Word>;
+
 private:
-  std::span<Instr> instructions;
-  int programCounter = 0;
+  friend CMaCore;
+
+  struct NoProfile {};
+  struct NoAccessLog {};
 
-  static constexpr int memorySize = 1 << 20;
+  std::span<Instruction> instructions;
+  Engine engine = Engine::Switch;
+  int programCounter = 0;
 
-  std::vector<int> memory = std::vector<int>(memorySize);
+  BasicMemory<Word> memory;
   int stackPointer = -1;
   int framePointer = -1;
   int extremePointer = -1;
-  int newPointer = memorySize - 1;
+  int newPointer = static_cast<int>(memory.size()) - 1;
+  /// One past the end of the stack of this thread.
+  int stackEnd = static_cast<int>(memory.getLayout().stackCells);
+  /// `new` and `free`; `new` fails rather than allocate below the heap.
+  BasicHeap<Word> ownHeap = BasicHeap<Word>(
+      memory.data(), static_cast<int>(memory.getLayout().heapStart()),
+      static_cast<int>(memory.size()));
+  /// The heap of the program, which all its threads share.
+  BasicHeap<Word> &heap = ownHeap;
+  [[no_unique_address]] std::conditional_t<Policy::profiled, ExecutionProfile,
+                                           NoProfile> profile = {};
+  [[no_unique_address]] std::conditional_t<Policy::recorded, AccessLog,
+                                           NoAccessLog> accessLog =
+      makeAccessLog();
 
   FILE *out;
 
+  /// The instructions that the traps of the breakpoints replaced.
+  std::unordered_map<int, Instruction> breakpoints = {};
+  /// The superinstructions that were split back into their first part,
+  /// because a breakpoint lies in one of their later parts: an engine runs
+  /// those without looking at their slots, so it would miss the trap.
+  std::unordered_map<int, Instruction> splitSuperinstructions = {};
+  /// The address of the breakpoint that stopped the program, or -1 once it
+  /// goes on.
+  int stoppedAt = -1;
+
+  /// The threads of the program, once the first one was spawned; only the
+  /// machine that runs the program owns them.
+  std::unique_ptr<ThreadGroup<BasicCMa>> ownThreads = nullptr;
+  ThreadGroup<BasicCMa> *threads = nullptr;
+
+  /// The host functions that `callnative` calls, by number.
+  std::vector<NativeFunction<Word>> natives = {};
+
 private:
+  /// Whether a breakpoint lies in a later part of `instruction` at `start`.
+  auto coversBreakpoint(int start, Instruction instruction) -> bool;
+
+  /// Splits the superinstructions that cover a breakpoint near `address`,
+  /// and fuses those again that no longer do.
+  void splitAround(int address);
+
   /**
-   * @brief Prints the current state of the virtual machine for debugging.
+   * @brief Runs the program with the direct-threaded engine.
+   * @return Exit status of the virtual machine.
    */
-  void debug();
+  auto runThreaded() -> int;
+
+  /**
+   * @brief Compiles the program to native code and runs it.
+   * @return Exit status of the virtual machine.
+   */
+  auto runJit() -> int;
+
+  /**
+   * @brief Runs the program from its `CompactCode`.
+   * @return Exit status of the virtual machine.
+   */
+  auto runCompact() -> int;
+
+  /**
+   * @brief Runs the program in the interpreter, promoting hot functions to
+   * threaded code.
+   * @return Exit status of the virtual machine.
+   */
+  auto runTiered() -> int;
+
+  /**
+   * @brief Runs the program with bounds checks at the entry of each block.
+   * @param verification The verifier's result for the instructions.
+   * @return Exit status of the virtual machine.
+   */
+  auto runChecked(const Verification &verification) -> int;
+
+  /**
+   * @brief Fails if the cells of a block entered now are out of bounds.
+   */
+  void checkBounds(const Bounds &bounds);
+
+  /**
+   * @brief Fails if the instruction accesses memory out of bounds through
+   * an address on the stack.
+   */
+  void checkAddress(Instr instruction);
+
+  /// Prints `value` to the output of the program, as `print` does.
+  void print(Word value);
+
+  /// Stops like `halt`, as `trap` does; `resume` knows where.
+  void trap() {
+    stoppedAt = programCounter - 1;
+    programCounter = std::numeric_limits<int>::max();
+  }
+
+  /// Fails if `pointer` is past the end of the stack.
+  void checkStack(int pointer) {
+    if (pointer >= stackEnd) [[unlikely]] {
+      debug();
+      dbg_fail("Stack overflow", pointer, programCounter - 1);
+    }
+  }
+
+  /**
+   * @brief The cell at `address`, bounds checked and recorded as `access`
+   * if the policy says so.
+   */
+  auto cell(std::int64_t address, Access access = Access::Read) -> Word &;
+
+  /**
+   * @brief The `count` cells from `address` on, for the bulk memory
+   * instructions; bounds checked and recorded if the policy says so.
+   */
+  auto cells(std::int64_t address, Word count, Access access = Access::Read)
+      -> Word *;
+
+  /**
+   * @brief One past the highest cell that `loada` or `storea` address in
+   * `program`, i.e. the end of its globals.
+   */
+  static auto globalsEnd(std::span<const Instruction> program)
+      -> std::int64_t;
+
+  /**
+   * @brief Fails unless the guard pages stop every instruction of the
+   * program that leaves the stack.
+   */
+  void checkStride() const;
+
+  auto makeAccessLog(std::size_t capacity = AccessLog::defaultCapacity) {
+    if constexpr (Policy::recorded) {
+      return AccessLog(sizeof(Word), globalsEnd(instructions),
+                       static_cast<std::int64_t>(
+                           memory.getLayout().heapStart()),
+                       capacity);
+    } else {
+      return NoAccessLog{};
+    }
+  }
+
+  /**
+   * @brief Prints the instruction about to be executed and the registers.
+   */
+  void trace(Instruction instruction);
+
+  /**
+   * @brief Sets everything but the memory up as if `program` was just
+   * loaded.
+   */
+  void restart(std::span<Instruction> program);
+
+  /**
+   * @brief A thread of `parent`, with its memory, heap and threads.
+   */
+  BasicCMa(BasicCMa &parent, Registers registers, int stackEnd)
+      : instructions{parent.instructions}, engine{parent.engine},
+        memory{parent.memory.share()}, stackEnd{stackEnd}, heap{parent.heap},
+        // Only the thread that runs the program is recorded.
+        accessLog{makeAccessLog(1)}, out{parent.out}, threads{parent.threads},
+        natives{parent.natives} {
+    setRegisters(registers);
+  }
 
 public:
-  explicit CMa(std::span<Instr> instructions)
+  explicit BasicCMa(std::span<Instruction> instructions)
       : instructions{instructions}, out{stdout} {}
-  CMa(std::span<Instr> instructions, FILE *out)
+  BasicCMa(std::span<Instruction> instructions, FILE *out)
       : instructions{instructions}, out{out} {}
+  BasicCMa(std::span<Instruction> instructions, FILE *out, Engine engine,
+           MemoryLayout layout = {})
+      : instructions{instructions}, engine{engine}, memory{layout}, out{out} {}
+
+  auto getOutFile() -> FILE * { return out; }
+  auto getMemory() -> BasicMemory<Word> & { return memory; }
+  auto getHeapStats() const -> const HeapStats & { return heap.getStats(); }
+
+  auto getProfile() const -> const ExecutionProfile &
+    requires Policy::profiled
+  {
+    return profile;
+  }
+
+  /// The memory accesses of the program, the last ones if there were many.
+  auto getAccessLog() const -> const AccessLog &
+    requires Policy::recorded
+  {
+    return accessLog;
+  }
+
+  auto getRegisters() const -> Registers {
+    return {.programCounter = programCounter,
+            .stackPointer = stackPointer,
+            .framePointer = framePointer,
+            .extremePointer = extremePointer,
+            .newPointer = newPointer};
+  }
+
+  void setRegisters(Registers r) {
+    programCounter = r.programCounter;
+    stackPointer = r.stackPointer;
+    framePointer = r.framePointer;
+    extremePointer = r.extremePointer;
+    newPointer = r.newPointer;
+  }
+
+  /**
+   * @brief Prints the current state of the virtual machine for debugging.
+   */
+  void debug();
+
+  /**
+   * @brief Stops the program before it executes the instruction at
+   * `address`.
+   * @details The instruction is replaced with a `trap` until the breakpoint
+   * is cleared, so the program pays nothing for breakpoints elsewhere.
+   * Superinstructions that cover the address run their parts one by one
+   * until then. Every engine stops at a breakpoint like at `halt`, and
+   * `resume` and `singleStep` then go on from it with the reference
+   * interpreter. Spawned threads that reach a breakpoint just end.
+   */
+  void setBreakpoint(int address);
+
+  /**
+   * @brief Puts back the instruction of a breakpoint.
+   */
+  void clearBreakpoint(int address);
+
+  /**
+   * @brief Runs the reference interpreter until the next breakpoint or the
+   * end of the program, starting with the breakpoint the program stopped
+   * at, if any.
+   * @return Whether the program stopped at a breakpoint, with the program
+   * counter at it.
+   */
+  auto resume() -> bool;
+
+  /**
+   * @brief Executes the next instruction, even if it has a breakpoint, or
+   * the one the program stopped at.
+   */
+  void singleStep();
+
+  /**
+   * @brief The stack of the current thread, bottom first; `debug()` prints
+   * its top.
+   */
+  auto getStack() -> std::span<const Word>;
+
+  /**
+   * @brief Starts a thread that calls `function` with `argument`, as `spawn`
+   * does.
+   * @details The thread gets a stack of `threadStackCells` cells from the
+   * heap. Its frame looks like that of a call, with a return address past the
+   * end of the program, so the thread ends when the function returns (or at
+   * `halt`). Its result is the argument cell, which the function overwrites
+   * like any other return value.
+   * @param newPointer The new pointer of the calling thread.
+   * @return The number of the thread, or 0 if there is no memory for it.
+   */
+  auto spawn(Word function, Word argument, int &newPointer) -> Word;
+
+  /**
+   * @brief Waits for a thread started by `spawn` and frees its stack.
+   * @return The result of the thread.
+   */
+  auto join(Word thread) -> Word;
+
+  /**
+   * @brief Makes a host function callable from the program, as `callnative`
+   * with the returned number.
+   * @details Hot kernels (sorting, hashing, parsing) can so run as C++ while
+   * the control logic stays in the program. The function works on the
+   * memory in place; only its effect on the stack is checked, and the
+   * verifier relies on it.
+   * @return The number of the function, counting up from 0.
+   */
+  auto registerNative(NativeFunction<Word> native) -> int;
+
+  /**
+   * @brief The stack effects of the registered host functions, by number,
+   * for `verify`.
+   */
+  auto nativeEffects() const -> std::vector<StackEffect>;
+
+  /**
+   * @brief Calls the host function `index`, as `callnative` does.
+   * @param stackPointer The stack pointer of the calling thread, which the
+   * function moves.
+   * @param framePointer The frame pointer of the calling thread.
+   */
+  void callNative(Word index, int &stackPointer, int framePointer);
+
+  /**
+   * @brief Makes a binary file of cells (32-bit words for `CMa`) the memory
+   * from `address` on, without reading or copying it.
+   * @details The file is mapped into the memory (see
+   * `MemoryMapping::mapFile`), so `load` and `loada` read it where it is and
+   * only the pages they touch come from disk. `address` must be a multiple
+   * of the cells in a page. `reset` and `releaseMemory` unmap the file.
+   * @param isWritable Whether the program may write to the cells, which
+   * leaves the file unchanged (copy-on-write); otherwise it may only read
+   * them.
+   * @return The number of cells in the file.
+   */
+  auto mapData(std::string_view path, int address, bool isWritable = false)
+      -> std::size_t;
+
+  /**
+   * @brief Makes the machine as good as new for another program, keeping
+   * its memory mapped and its pages warm.
+   * @details Waits for the threads of the last program and forgets its
+   * breakpoints; their traps are only taken out again if `program` is the
+   * same span, since the last one may be gone already. Only the cells the
+   * last program may have written are zeroed: the heap below its high-water
+   * mark (the lowest new pointer) and the stack pages that are in memory,
+   * which the kernel tracks for free, so the engines pay nothing for it.
+   * Stack pages above those are given back to the kernel, in case they were
+   * swapped out.
+   */
+  void reset(std::span<Instruction> program);
+
+  /**
+   * @brief Like `reset` to an empty program, but gives the pages of the
+   * memory back to the kernel instead of zeroing them: for machines that
+   * stay idle for a while.
+   */
+  void releaseMemory();
+
+  /**
+   * @brief Saves the state of the machine, so that `restore` continues the
+   * program from here, after a restart or on another host.
+   * @details The checkpoint holds the registers, the free lists of the heap,
+   * a hash of the program and the cells the program may have written: the
+   * stack up to the highest page it touched and the heap below its
+   * high-water mark. All of them are saved as little-endian fields of fixed
+   * width. Machines with threads, breakpoints or mapped data cannot be
+   * saved.
+   */
+  void checkpoint(FILE *out);
+
+  /**
+   * @brief Continues from a checkpoint of the same program, on a machine
+   * with the same cells and memory layout that has not run yet (or was
+   * `reset`).
+   */
+  void restore(FILE *in);
+
+  /**
+   * @brief Runs the reference interpreter for at most `steps` instructions,
+   * e.g. to take checkpoints in between.
+   * @return Whether the program has not ended yet.
+   */
+  auto runFor(std::int64_t steps) -> bool;
 
   /**
    * @brief Executes a single instruction and advances the program counter.
@@ -146,17 +803,48 @@ public:
    * @brief Executes a single instruction based on its type.
    * @param instruction The instruction to execute.
    */
-  void execute(Instr instruction);
-
-  /**
-   * @brief Loads instructions from a textual representation into a CMa
-   * instance.
-   * @param text The textual representation of instructions.
-   * @return A CMa instance with the loaded instructions.
-   */
-  static auto loadInstructions(std::string_view text) -> std::vector<Instr>;
+  void execute(Instruction instruction);
 };
 
+/// The CMa as it is usually run: unchecked, untraced and with `int` cells.
+using CMa = BasicCMa<>;
+
+// Only the default configuration has the other engines.
+template <> auto CMa::runThreaded() -> int;
+template <> auto CMa::runJit() -> int;
+template <> auto CMa::runCompact() -> int;
+template <> auto CMa::runTiered() -> int;
+template <> auto CMa::runChecked(const Verification &verification) -> int;
+template <> void CMa::checkBounds(const Bounds &bounds);
+template <> void CMa::checkAddress(Instr instruction);
+
+// The instantiations `cma` chooses from (see lib/CMachine.cpp).
+#define CMA_POLICIES(X)                                                        \
+  X(false, false, false, int, false)                                           \
+  X(false, false, true, int, false)                                            \
+  X(false, true, false, int, false)                                            \
+  X(false, true, true, int, false)                                             \
+  X(true, false, false, int, false)                                            \
+  X(true, false, true, int, false)                                             \
+  X(true, true, false, int, false)                                             \
+  X(true, true, true, int, false)                                              \
+  X(false, false, false, std::int64_t, false)                                  \
+  X(false, false, true, std::int64_t, false)                                   \
+  X(false, true, false, std::int64_t, false)                                   \
+  X(false, true, true, std::int64_t, false)                                    \
+  X(true, false, false, std::int64_t, false)                                   \
+  X(true, false, true, std::int64_t, false)                                    \
+  X(true, true, false, std::int64_t, false)                                    \
+  X(true, true, true, std::int64_t, false)                                     \
+  X(false, false, false, int, true)                                            \
+  X(false, false, false, std::int64_t, true)
+
+#define CMA_EXTERN_TEMPLATE(checked, traced, profiled, word, recorded)         \
+  extern template class BasicCMa<                                              \
+      CMaPolicy<checked, traced, profiled, word, recorded>>;
+CMA_POLICIES(CMA_EXTERN_TEMPLATE)
+#undef CMA_EXTERN_TEMPLATE
+
 } // namespace vm::cma
 
 #endif
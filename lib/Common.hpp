@@ -1,9 +1,16 @@
 #ifndef TUM_I2_VM_LIB_COMMON
 #define TUM_I2_VM_LIB_COMMON
 
+#include "lib/Error.hpp"
+
+#include <algorithm>
+#include <array>
 #include <concepts>
+#include <cstddef>
+#include <initializer_list>
 #include <string>
 #include <string_view>
+#include <utility>
 
 namespace vm::common {
 
@@ -16,6 +23,14 @@ concept VirtualMachine = requires(VM vm, std::string_view text) {
   { vm.run() } -> std::same_as<int>;
 };
 
+/**
+ * @brief A label of a program and the address it stands for.
+ */
+struct Symbol {
+  std::string_view name;
+  std::size_t address;
+};
+
 /**
  * @brief Loads the entire contents of a file into a string
  * @param name the file's path
@@ -23,6 +38,36 @@ concept VirtualMachine = requires(VM vm, std::string_view text) {
  */
 auto readFile(std::string_view name) -> std::string;
 
+/**
+ * @brief Builds an array from (index, value) pairs, checking that every
+ * index is set exactly once.
+ * @details Used for the dispatch tables of the threaded interpreters, where
+ * a forgotten or duplicated entry would otherwise only show up at runtime.
+ */
+template <typename T, std::size_t N>
+constexpr auto
+checkedArray(std::initializer_list<std::pair<std::size_t, T>> init)
+    -> std::array<T, N> {
+  dbg_assert_eq(N, init.size(), "wrong number of elements", N, init.size());
+
+  std::array<bool, N> isSet = {};
+  std::array<T, N> arr = {};
+
+  std::ranges::fill(isSet, false);
+
+  for (auto [index, value] : init) {
+    dbg_assert(!isSet.at(index), "double index", index);
+    isSet[index] = true;
+    arr[index] = value;
+  }
+
+  for (std::size_t i = 0; i < N; ++i) {
+    dbg_assert(isSet.at(i), "unset element");
+  }
+
+  return arr;
+}
+
 } // namespace vm::common
 
 #endif
@@ -0,0 +1,280 @@
+#include "lib/Image.hpp"
+#include "lib/CMachine.hpp"
+#include "lib/Common.hpp"
+#include "lib/Error.hpp"
+#include "lib/MaMachine.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <print>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace vm::image {
+
+namespace {
+
+constexpr std::uint32_t mamaTypeCount = mama::Instr::Slide + 1;
+
+/// The FNV-1a hash of the names of `typeCount` instruction types, in the
+/// order of their numbers.
+template <typename Type, typename ToString>
+auto hashInstructionSet(std::uint32_t typeCount, ToString toString)
+    -> std::uint64_t {
+  std::uint64_t hash = 14695981039346656037U;
+  auto add = [&](std::string_view name) {
+    for (char c : name) {
+      hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211U;
+    }
+    // Separates the names.
+    hash = (hash ^ 0xffU) * 1099511628211U;
+  };
+  for (std::uint32_t t = 0; t < typeCount; ++t) {
+    add(toString(static_cast<Type>(t)));
+  }
+  return hash;
+}
+
+auto cmaInstructionSet() -> std::uint64_t {
+  using cma::Instr;
+  return hashInstructionSet<Instr::Type>(
+      Instr::typeCount, [](Instr::Type t) { return Instr::toString(t); });
+}
+
+auto mamaInstructionSet() -> std::uint64_t {
+  using mama::Instr::Type;
+  return hashInstructionSet<Type>(
+      mamaTypeCount, [](Type t) { return mama::Instr::toString(t); });
+}
+
+/// The size in bytes of `count` units of `unitSize` bytes, which must fit
+/// into 64 bits.
+auto sectionSize(std::uint64_t count, std::uint64_t unitSize)
+    -> std::uint64_t {
+  dbg_assert(unitSize == 0 || count <= UINT64_MAX / unitSize,
+             "Image section too large", count, unitSize);
+  return count * unitSize;
+}
+
+auto alignUp(std::uint64_t offset) -> std::uint64_t {
+  return (offset + sectionAlignment - 1) / sectionAlignment * sectionAlignment;
+}
+
+void writeBytes(FILE *out, std::span<const std::byte> bytes) {
+  std::size_t written = std::fwrite(bytes.data(), 1, bytes.size(), out);
+  dbg_assert_eq(written, bytes.size(), "Cannot write image");
+}
+
+void writePadding(FILE *out, std::uint64_t &position, std::uint64_t target) {
+  for (; position < target; ++position) {
+    std::fputc(0, out);
+  }
+}
+
+template <typename T>
+auto bytesOf(const T &value) -> std::span<const std::byte> {
+  return std::as_bytes(std::span(&value, 1));
+}
+
+/**
+ * @brief Writes header, code, symbols and strings.
+ * @param code The code, already in its in-memory layout.
+ */
+void writeSections(FILE *out, Header header, std::span<const std::byte> code,
+                   std::span<const common::Symbol> symbols) {
+  std::vector sorted(symbols.begin(), symbols.end());
+  std::ranges::sort(sorted, {}, [](const common::Symbol &s) {
+    return std::pair(s.address, s.name);
+  });
+
+  std::string strings = {};
+  std::vector<SymbolEntry> entries = {};
+  for (const common::Symbol &symbol : sorted) {
+    entries.push_back(
+        {.address = symbol.address,
+         .nameOffset = static_cast<std::uint32_t>(strings.size()),
+         .nameSize = static_cast<std::uint32_t>(symbol.name.size())});
+    strings += symbol.name;
+  }
+
+  header.codeOffset = alignUp(sizeof(Header));
+  header.symbolOffset = alignUp(header.codeOffset + code.size());
+  header.symbolCount = entries.size();
+  header.stringOffset =
+      alignUp(header.symbolOffset + entries.size() * sizeof(SymbolEntry));
+  header.stringSize = strings.size();
+
+  std::uint64_t position = 0;
+  writeBytes(out, bytesOf(header));
+  position += sizeof(header);
+  writePadding(out, position, header.codeOffset);
+  writeBytes(out, code);
+  position += code.size();
+  writePadding(out, position, header.symbolOffset);
+  writeBytes(out, std::as_bytes(std::span(entries)));
+  position += entries.size() * sizeof(SymbolEntry);
+  writePadding(out, position, header.stringOffset);
+  writeBytes(out, std::as_bytes(std::span(strings)));
+}
+
+auto makeHeader(Machine machine, std::uint32_t typeCount,
+                std::uint64_t instructionSetHash, std::uint32_t unitSize,
+                std::uint64_t codeUnits) -> Header {
+  Header header = {};
+  header.magic = magic;
+  header.byteOrder = byteOrderMark;
+  header.version = version;
+  header.machine = machine;
+  header.typeCount = typeCount;
+  header.instructionSetHash = instructionSetHash;
+  header.unitSize = unitSize;
+  header.codeUnits = codeUnits;
+  return header;
+}
+
+} // namespace
+
+MappedFile::MappedFile(std::string_view path) {
+  std::string name(path);
+  int fd = open(name.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::println(stderr, "Cannot open file: {}", path);
+    std::exit(EXIT_FAILURE);
+  }
+  struct stat info = {};
+  dbg_assert_eq(fstat(fd, &info), 0, "Cannot stat file", path);
+  size = static_cast<std::size_t>(info.st_size);
+  if (size > 0) {
+    void *mapping =
+        mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    dbg_assert_neq(mapping, MAP_FAILED, "Cannot map file", path);
+    start = static_cast<std::byte *>(mapping);
+  }
+  close(fd);
+}
+
+MappedFile::~MappedFile() {
+  if (start != nullptr) {
+    munmap(start, size);
+  }
+}
+
+auto isImage(std::span<const std::byte> bytes) -> bool {
+  return bytes.size() >= magic.size() &&
+         std::memcmp(bytes.data(), magic.data(), magic.size()) == 0;
+}
+
+Image::Image(std::span<std::byte> file) : file{file} {
+  dbg_assert(isImage(file) && file.size() >= sizeof(Header), "Not an image");
+  dbg_assert_eq(reinterpret_cast<std::uintptr_t>(file.data()) %
+                    alignof(Header),
+                0, "Image is not aligned in memory");
+  header = reinterpret_cast<const Header *>(file.data());
+  dbg_assert_eq(header->byteOrder, byteOrderMark,
+                "Image was written with a different byte order");
+  dbg_assert_eq(header->version, version, "Unsupported image version",
+                header->version, version);
+  // Check the bounds of all sections once.
+  section(header->codeOffset,
+          sectionSize(header->codeUnits, header->unitSize));
+  section(header->symbolOffset,
+          sectionSize(header->symbolCount, sizeof(SymbolEntry)));
+  section(header->stringOffset, header->stringSize);
+}
+
+auto Image::section(std::uint64_t offset, std::uint64_t size) const
+    -> std::span<std::byte> {
+  dbg_assert(offset % sectionAlignment == 0 && offset <= file.size() &&
+                 size <= file.size() - offset,
+             "Image section out of bounds", offset, size, file.size());
+  return file.subspan(offset, size);
+}
+
+auto Image::symbols() const -> std::vector<common::Symbol> {
+  auto entries = section(header->symbolOffset,
+                         sectionSize(header->symbolCount, sizeof(SymbolEntry)));
+  auto strings = section(header->stringOffset, header->stringSize);
+  std::vector<common::Symbol> symbols = {};
+  for (std::size_t i = 0; i < header->symbolCount; ++i) {
+    SymbolEntry entry = {};
+    std::memcpy(&entry, entries.data() + i * sizeof(entry), sizeof(entry));
+    dbg_assert(entry.nameOffset + std::uint64_t{entry.nameSize} <=
+                   strings.size(),
+               "Symbol name out of bounds", i);
+    std::string_view name(
+        reinterpret_cast<const char *>(strings.data()) + entry.nameOffset,
+        entry.nameSize);
+    symbols.push_back({.name = name, .address = entry.address});
+  }
+  return symbols;
+}
+
+auto Image::cmaCode() const -> std::span<cma::Instr> {
+  dbg_assert(header->machine == Machine::CMa, "Not a CMa image");
+  dbg_assert(header->typeCount == cma::Instr::typeCount &&
+                 header->instructionSetHash == cmaInstructionSet(),
+             "Image was written for a different CMa instruction set");
+  dbg_assert_eq(header->unitSize, sizeof(cma::Instr),
+                "Image was written with a different instruction layout");
+  auto code = section(header->codeOffset,
+                      sectionSize(header->codeUnits, sizeof(cma::Instr)));
+  std::span<cma::Instr> instructions = {
+      reinterpret_cast<cma::Instr *>(code.data()), header->codeUnits};
+  // The engines index tables with the type, so it is checked once here.
+  auto bad = std::ranges::find_if(instructions, [](cma::Instr i) {
+    return static_cast<std::size_t>(i.type) >= cma::Instr::typeCount;
+  });
+  dbg_assert(bad == instructions.end(), "Bad instruction in image",
+             bad - instructions.begin());
+  return instructions;
+}
+
+auto Image::mamaCode() const -> std::span<mama::Instr::Byte> {
+  dbg_assert(header->machine == Machine::MaMa, "Not a MaMa image");
+  dbg_assert(header->typeCount == mamaTypeCount &&
+                 header->instructionSetHash == mamaInstructionSet(),
+             "Image was written for a different MaMa instruction set");
+  dbg_assert_eq(header->unitSize, sizeof(mama::Instr::Byte),
+                "Image was written with a different instruction layout");
+  auto code = section(header->codeOffset, header->codeUnits);
+  return {reinterpret_cast<mama::Instr::Byte *>(code.data()),
+          header->codeUnits};
+}
+
+void writeImage(FILE *out, std::span<const cma::Instr> instructions,
+                std::span<const common::Symbol> symbols) {
+  // Copied field by field, so that the padding is written as zeros.
+  std::vector<std::byte> code(instructions.size() * sizeof(cma::Instr));
+  for (std::size_t i = 0; i < instructions.size(); ++i) {
+    std::byte *unit = code.data() + i * sizeof(cma::Instr);
+    std::memcpy(unit + offsetof(cma::Instr, type), &instructions[i].type,
+                sizeof(cma::Instr::Type));
+    std::memcpy(unit + offsetof(cma::Instr, arg), &instructions[i].arg,
+                sizeof(int));
+  }
+  Header header =
+      makeHeader(Machine::CMa, cma::Instr::typeCount, cmaInstructionSet(),
+                 sizeof(cma::Instr), instructions.size());
+  writeSections(out, header, code, symbols);
+}
+
+void writeImage(FILE *out, std::span<const mama::Instr::Byte> code,
+                std::span<const common::Symbol> symbols) {
+  Header header =
+      makeHeader(Machine::MaMa, mamaTypeCount, mamaInstructionSet(),
+                 sizeof(mama::Instr::Byte), code.size());
+  writeSections(out, header, std::as_bytes(code), symbols);
+}
+
+} // namespace vm::image
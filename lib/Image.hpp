@@ -0,0 +1,138 @@
+#ifndef TUM_I2_VM_LIB_IMAGE
+#define TUM_I2_VM_LIB_IMAGE
+
+#include "lib/CMachine.hpp"
+#include "lib/Common.hpp"
+#include "lib/MaMachine.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <span>
+#include <string_view>
+#include <vector>
+
+// A binary program image holds the decoded code of a machine, so that the
+// CLIs can map it and run it in place instead of parsing text.
+//
+//   Header        fixed size, see below
+//   code          the CMa `Instr` array or the MaMa `Instr::Byte` stream
+//   symbols       `SymbolEntry` records, sorted by address
+//   strings       the symbol names, not NUL-terminated
+//
+// Every section starts at a multiple of `sectionAlignment`. The format is
+// that of the host (byte order, `sizeof(Instr)`, numbering of instructions);
+// the header records enough of it to reject images built elsewhere.
+
+namespace vm::image {
+
+enum class Machine : std::uint8_t { CMa = 1, MaMa = 2 };
+
+inline constexpr std::array<char, 8> magic = {'V', 'M', 'I', 'M',
+                                              'A', 'G', 'E', '\0'};
+inline constexpr std::uint16_t version = 2;
+inline constexpr std::uint32_t byteOrderMark = 0x01020304;
+inline constexpr std::size_t sectionAlignment = 16;
+
+struct Header {
+  std::array<char, 8> magic;
+  std::uint32_t byteOrder;
+  std::uint16_t version;
+  Machine machine;
+  std::uint8_t reserved;
+  /// Number of instruction types of the machine that wrote the image.
+  std::uint32_t typeCount;
+  /// Size of one unit of code (`sizeof(Instr)` or `sizeof(Instr::Byte)`).
+  std::uint32_t unitSize;
+  /// A hash of the instruction types in the order of their numbers, so that
+  /// images of a build that numbers them differently are rejected.
+  std::uint64_t instructionSetHash;
+  std::uint64_t codeOffset;
+  std::uint64_t codeUnits;
+  std::uint64_t symbolOffset;
+  std::uint64_t symbolCount;
+  std::uint64_t stringOffset;
+  std::uint64_t stringSize;
+};
+
+struct SymbolEntry {
+  std::uint64_t address;
+  std::uint32_t nameOffset;
+  std::uint32_t nameSize;
+};
+
+/**
+ * @brief A file mapped into memory as a private, copy-on-write mapping.
+ * @details Pages are only read from disk when touched, and only copied when
+ * written to (e.g. by `CMa::setBreakpoint`).
+ */
+class MappedFile {
+  std::byte *start = nullptr;
+  std::size_t size = 0;
+
+public:
+  /// Maps the file, or fails with a message if it cannot be opened.
+  explicit MappedFile(std::string_view path);
+  MappedFile(const MappedFile &) = delete;
+  auto operator=(const MappedFile &) -> MappedFile & = delete;
+  ~MappedFile();
+
+  [[nodiscard]] auto bytes() const -> std::span<std::byte> {
+    return {start, size};
+  }
+
+  [[nodiscard]] auto text() const -> std::string_view {
+    return {reinterpret_cast<const char *>(start), size};
+  }
+};
+
+/**
+ * @brief A validated view of an image in memory.
+ */
+class Image {
+  std::span<std::byte> file;
+  const Header *header;
+
+  /// The bytes of a section, which must lie in the file.
+  auto section(std::uint64_t offset, std::uint64_t size) const
+      -> std::span<std::byte>;
+
+public:
+  /// Checks the header and the bounds of all sections.
+  explicit Image(std::span<std::byte> file);
+
+  [[nodiscard]] auto getHeader() const -> const Header & { return *header; }
+  [[nodiscard]] auto machine() const -> Machine { return header->machine; }
+
+  /// The symbols, whose names point into the image.
+  [[nodiscard]] auto symbols() const -> std::vector<common::Symbol>;
+
+  /// The code of a CMa image, in place; fails for other images and for
+  /// unknown instruction types.
+  [[nodiscard]] auto cmaCode() const -> std::span<cma::Instr>;
+
+  /// The code of a MaMa image, in place; fails for other images.
+  [[nodiscard]] auto mamaCode() const -> std::span<mama::Instr::Byte>;
+};
+
+/**
+ * @brief Whether the bytes start like an image (as opposed to program text).
+ */
+auto isImage(std::span<const std::byte> bytes) -> bool;
+
+/**
+ * @brief Writes an image of a CMa program.
+ */
+void writeImage(FILE *out, std::span<const cma::Instr> instructions,
+                std::span<const common::Symbol> symbols);
+
+/**
+ * @brief Writes an image of a MaMa program.
+ */
+void writeImage(FILE *out, std::span<const mama::Instr::Byte> code,
+                std::span<const common::Symbol> symbols);
+
+} // namespace vm::image
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef TUM_I2_VM_LIB_LITTLE_ENDIAN
+#define TUM_I2_VM_LIB_LITTLE_ENDIAN
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+// Integers in files that other hosts read back (e.g. checkpoints) are saved
+// as little-endian fields of a fixed width, whatever the byte order of the
+// host. On little-endian hosts the arrays are written and read as they are.
+
+namespace vm::common {
+
+/**
+ * @brief Writes `count` values as little-endian fields of `sizeof(T)` bytes.
+ * @return Whether all of them were written.
+ */
+template <std::integral T>
+auto writeLittleEndian(FILE *out, const T *values, std::size_t count)
+    -> bool {
+  if constexpr (std::endian::native == std::endian::little) {
+    return count == 0 || std::fwrite(values, sizeof(T), count, out) == count;
+  } else {
+    // Swapped in chunks, so that large arrays need no copy.
+    std::array<T, 1024> chunk = {};
+    for (std::size_t done = 0; done < count;) {
+      std::size_t size = std::min(chunk.size(), count - done);
+      std::transform(values + done, values + done + size, chunk.begin(),
+                     [](T value) { return std::byteswap(value); });
+      if (std::fwrite(chunk.data(), sizeof(T), size, out) != size) {
+        return false;
+      }
+      done += size;
+    }
+    return true;
+  }
+}
+
+template <std::integral T> auto writeLittleEndian(FILE *out, T value) -> bool {
+  return writeLittleEndian(out, &value, 1);
+}
+
+/// A `std::size_t`, as 64 bits on every host.
+inline auto writeSize(FILE *out, std::size_t value) -> bool {
+  return writeLittleEndian(out, static_cast<std::uint64_t>(value));
+}
+
+/**
+ * @brief Reads `count` values written by `writeLittleEndian`.
+ * @return Whether all of them were there.
+ */
+template <std::integral T>
+auto readLittleEndian(FILE *in, T *values, std::size_t count) -> bool {
+  if (count != 0 && std::fread(values, sizeof(T), count, in) != count) {
+    return false;
+  }
+  if constexpr (std::endian::native != std::endian::little) {
+    std::transform(values, values + count, values,
+                   [](T value) { return std::byteswap(value); });
+  }
+  return true;
+}
+
+template <std::integral T> auto readLittleEndian(FILE *in, T &value) -> bool {
+  return readLittleEndian(in, &value, 1);
+}
+
+/// A `std::size_t` written by `writeSize`; fails if it does not fit.
+inline auto readSize(FILE *in, std::size_t &value) -> bool {
+  std::uint64_t wide = 0;
+  if (!readLittleEndian(in, wide) || wide > SIZE_MAX) {
+    return false;
+  }
+  value = static_cast<std::size_t>(wide);
+  return true;
+}
+
+} // namespace vm::common
+
+#endif
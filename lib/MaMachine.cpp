@@ -1,5 +1,7 @@
 #include "lib/MaMachine.hpp"
+#include "lib/Common.hpp"
 #include "lib/Error.hpp"
+#include "lib/LittleEndian.hpp"
 #include "lib/Parser.hpp"
 
 #include <algorithm>
@@ -10,12 +12,13 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
-#include <initializer_list>
 #include <iterator>
+#include <limits>
 #include <print>
 #include <span>
 #include <string>
 #include <string_view>
+#include <type_traits>
 #include <unordered_map>
 #include <utility>
 #include <variant>
@@ -23,34 +26,6 @@
 
 namespace vm::mama {
 
-namespace {
-
-template <typename T, std::size_t N>
-constexpr auto
-checkedArray(std::initializer_list<std::pair<std::size_t, T>> init)
-    -> std::array<T, N> {
-  dbg_assert_eq(N, init.size(), "wrong number of elements", N, init.size());
-
-  std::array<bool, N> isSet = {};
-  std::array<T, N> arr = {};
-
-  std::ranges::fill(isSet, false);
-
-  for (auto [index, value] : init) {
-    dbg_assert(!isSet.at(index), "double index", index);
-    isSet[index] = true;
-    arr[index] = value;
-  }
-
-  for (std::size_t i = 0; i < N; ++i) {
-    dbg_assert(isSet.at(i), "unset element");
-  }
-
-  return arr;
-}
-
-} // namespace
-
 namespace Instr {
 
 auto toString(Type enumValue) -> std::string_view {
@@ -132,9 +107,9 @@ void print(std::span<Byte> code) {
 
 void MaMa::debug() {}
 
-auto MaMa::createNew(HeapValue &&v) -> HeapValue * {
-  heap.push_front(v);
-  return &heap.front();
+auto MaMa::createNew(HeapValue &&v) -> std::size_t {
+  heap.push_back(std::move(v));
+  return heap.size() - 1;
 }
 
 namespace {
@@ -144,6 +119,8 @@ struct RegisterBank {
   MaMa::BasicValue *stackPointer;
   MaMa::BasicValue *framePointer;
   MaMa::BasicValue *globalPointer;
+  /// How many instructions may still run before the dispatch loop stops.
+  std::int64_t steps;
 
   MaMa &virtualMachine;
 };
@@ -151,6 +128,7 @@ struct RegisterBank {
 static_assert(sizeof(RegisterBank) <= 8 * sizeof(void *),
               "With gnu::regcall we have at least 8 registers to our disposal");
 
+auto stop(RegisterBank r) -> int;
 auto doDebug(RegisterBank r) -> int;
 auto doPrint(RegisterBank r) -> int;
 auto doLoadc(RegisterBank r) -> int;
@@ -184,7 +162,7 @@ auto doPushglob(RegisterBank r) -> int;
 auto doSlide(RegisterBank r) -> int;
 
 using InstrFn = int(RegisterBank);
-std::array dispatchTable = checkedArray<InstrFn *, 28>(
+std::array dispatchTable = common::checkedArray<InstrFn *, 28>(
     {{Instr::Debug, doDebug},     {Instr::Print, doPrint},
      {Instr::Loadc, doLoadc},     {Instr::Dup, doDup},
      {Instr::Add, doAdd},         {Instr::Sub, doSub},
@@ -202,6 +180,10 @@ std::array dispatchTable = checkedArray<InstrFn *, 28>(
 
 #define DISPATCH_NEXT                                                          \
   {                                                                            \
+    if (r.steps == 0) [[unlikely]] {                                           \
+      [[clang::musttail]] return stop(r);                                      \
+    }                                                                          \
+    r.steps -= 1;                                                              \
     auto next = dispatchTable[r.codePointer->instruction];                     \
     r.codePointer += 1;                                                        \
     [[clang::musttail]] return next(r);                                        \
@@ -216,6 +198,23 @@ template <typename T>
   return immediate;
 }
 
+/// The safe point of the dispatch loop: saves the registers in the machine and
+/// returns, so that it can be saved or continued.
+auto stop(RegisterBank r) -> int {
+  MaMa &vm = r.virtualMachine;
+  vm.setRegisters({
+      .codePointer =
+          static_cast<std::size_t>(r.codePointer - vm.getCodeStart()),
+      .stackPointer =
+          static_cast<std::size_t>(r.stackPointer - vm.getStackStart()),
+      .framePointer =
+          static_cast<std::size_t>(r.framePointer - vm.getStackStart()),
+      .globalPointer =
+          static_cast<std::size_t>(r.globalPointer - vm.getGlobalStart()),
+  });
+  return 0;
+}
+
 auto doDebug(RegisterBank r) -> int {
   r.virtualMachine.debug();
   DISPATCH_NEXT
@@ -341,7 +340,8 @@ auto doNeg(RegisterBank r) -> int {
 
 auto doHalt(RegisterBank r) -> int {
   auto exitCode = static_cast<int>(r.stackPointer->value);
-  return exitCode;
+  r.virtualMachine.halt(exitCode);
+  [[clang::musttail]] return stop(r);
 }
 
 auto doJump(RegisterBank r) -> int {
@@ -363,8 +363,7 @@ auto doJumpz(RegisterBank r) -> int {
 auto doGetbasic(RegisterBank r) -> int {
   auto x = *r.stackPointer;
   r.stackPointer -= 1;
-  auto *heapPointer = std::bit_cast<MaMa::HeapValue *>(x);
-  auto &object = *heapPointer;
+  auto &object = r.virtualMachine.getHeapValue(x.size);
 
   if (!std::holds_alternative<MaMa::BasicValue>(object)) {
     dbg_fail("Bad Object Tag", object.index());
@@ -379,8 +378,7 @@ auto doGetbasic(RegisterBank r) -> int {
 
 auto doMkbasic(RegisterBank r) -> int {
   auto x = *r.stackPointer;
-  r.stackPointer -= 1;
-  r.virtualMachine.createNew(x);
+  r.stackPointer->size = r.virtualMachine.createNew(x);
 
   DISPATCH_NEXT
 }
@@ -417,15 +415,235 @@ auto startDispatching(RegisterBank r) -> int { DISPATCH_NEXT }
 } // namespace
 
 auto MaMa::run() -> int {
+  while (runFor(std::numeric_limits<std::int64_t>::max())) {
+  }
+  return *exitStatus;
+}
+
+auto MaMa::runFor(std::int64_t steps) -> bool {
+  if (exitStatus.has_value()) {
+    return false;
+  }
   RegisterBank r = {
-      .codePointer = this->instructions.data(),
-      .stackPointer = this->stack.data(),
-      .framePointer = this->stack.data(),
-      .globalPointer = this->gloabls.data(),
+      .codePointer = this->instructions.data() + registers.codePointer,
+      .stackPointer = this->stack.data() + registers.stackPointer,
+      .framePointer = this->stack.data() + registers.framePointer,
+      .globalPointer = this->gloabls.data() + registers.globalPointer,
+      .steps = steps,
       .virtualMachine = *this,
   };
 
-  return startDispatching(r);
+  startDispatching(r);
+  return !exitStatus.has_value();
+}
+
+namespace {
+
+constexpr std::array<char, 4> checkpointMagic = {'M', 'A', 'M', 'S'};
+constexpr std::uint32_t checkpointVersion = 2;
+
+/// The start of a checkpoint (see `MaMa::checkpoint`), followed by the stack
+/// cells, the globals and the heap objects.
+struct CheckpointHeader {
+  std::array<char, 4> magic;
+  std::uint32_t version;
+  std::uint64_t programHash;
+  MaMa::Registers registers;
+  /// The stack cells saved, from the bottom up to the stack pointer.
+  std::uint64_t stackCells;
+  std::uint64_t globalCells;
+  std::uint64_t heapObjects;
+};
+
+/// The FNV-1a hash of the bytes of a program.
+auto programHash(std::span<const Instr::Byte> code) -> std::uint64_t {
+  std::uint64_t hash = 14695981039346656037U;
+  for (Instr::Byte byte : code) {
+    hash = (hash ^ static_cast<std::uint64_t>(byte.data)) * 1099511628211U;
+  }
+  return hash;
+}
+
+/// Writes the fields of a header one by one, in little-endian order.
+auto writeHeader(FILE *out, const CheckpointHeader &header) -> bool {
+  using common::writeLittleEndian;
+  using common::writeSize;
+  const MaMa::Registers &r = header.registers;
+  return writeLittleEndian(out, header.magic.data(), header.magic.size()) &&
+         writeLittleEndian(out, header.version) &&
+         writeLittleEndian(out, header.programHash) &&
+         writeSize(out, r.codePointer) && writeSize(out, r.stackPointer) &&
+         writeSize(out, r.framePointer) && writeSize(out, r.globalPointer) &&
+         writeLittleEndian(out, header.stackCells) &&
+         writeLittleEndian(out, header.globalCells) &&
+         writeLittleEndian(out, header.heapObjects);
+}
+
+auto readHeader(FILE *in, CheckpointHeader &header) -> bool {
+  using common::readLittleEndian;
+  using common::readSize;
+  MaMa::Registers &r = header.registers;
+  return readLittleEndian(in, header.magic.data(), header.magic.size()) &&
+         readLittleEndian(in, header.version) &&
+         readLittleEndian(in, header.programHash) &&
+         readSize(in, r.codePointer) && readSize(in, r.stackPointer) &&
+         readSize(in, r.framePointer) && readSize(in, r.globalPointer) &&
+         readLittleEndian(in, header.stackCells) &&
+         readLittleEndian(in, header.globalCells) &&
+         readLittleEndian(in, header.heapObjects);
+}
+
+// A value is saved as the 64 bits of its `value` member, whether it holds a
+// number or the offset of a heap object.
+static_assert(sizeof(MaMa::BasicValue) == sizeof(std::int64_t));
+
+auto writeValues(FILE *out, const MaMa::BasicValue *values, std::size_t count)
+    -> bool {
+  if constexpr (std::endian::native == std::endian::little) {
+    return count == 0 ||
+           std::fwrite(values, sizeof(*values), count, out) == count;
+  } else {
+    return std::all_of(values, values + count, [&](MaMa::BasicValue value) {
+      return common::writeLittleEndian(out, value.value);
+    });
+  }
+}
+
+auto readValues(FILE *in, MaMa::BasicValue *values, std::size_t count)
+    -> bool {
+  if constexpr (std::endian::native == std::endian::little) {
+    return count == 0 ||
+           std::fread(values, sizeof(*values), count, in) == count;
+  } else {
+    return std::all_of(values, values + count, [&](MaMa::BasicValue &value) {
+      return common::readLittleEndian(in, value.value);
+    });
+  }
+}
+
+/// Writes the tag of a heap object, followed by its fields (and the length
+/// of a vector before its elements). Offsets stay as they are.
+auto writeHeapValue(FILE *out, const MaMa::HeapValue &value) -> bool {
+  using common::writeSize;
+  auto tag = static_cast<std::uint64_t>(value.index());
+  return common::writeLittleEndian(out, tag) &&
+         std::visit(
+             [&](const auto &object) {
+               using T = std::remove_cvref_t<decltype(object)>;
+               if constexpr (std::is_same_v<T, MaMa::BasicValue>) {
+                 return writeValues(out, &object, 1);
+               } else if constexpr (std::is_same_v<T, MaMa::Closure>) {
+                 return writeSize(out, object.codePointer) &&
+                        writeSize(out, object.globalPointer);
+               } else if constexpr (std::is_same_v<T, MaMa::Function>) {
+                 return writeSize(out, object.codePointer) &&
+                        writeSize(out, object.argumentPointer) &&
+                        writeSize(out, object.globalPointer);
+               } else {
+                 return writeSize(out, object.size()) &&
+                        writeValues(out, object.data(), object.size());
+               }
+             },
+             value);
+}
+
+template <typename T>
+auto readHeapObject(FILE *in, MaMa::HeapValue &value) -> bool {
+  using common::readSize;
+  T object = {};
+  bool isRead = false;
+  if constexpr (std::is_same_v<T, MaMa::BasicValue>) {
+    isRead = readValues(in, &object, 1);
+  } else if constexpr (std::is_same_v<T, MaMa::Closure>) {
+    isRead = readSize(in, object.codePointer) &&
+             readSize(in, object.globalPointer);
+  } else if constexpr (std::is_same_v<T, MaMa::Function>) {
+    isRead = readSize(in, object.codePointer) &&
+             readSize(in, object.argumentPointer) &&
+             readSize(in, object.globalPointer);
+  } else {
+    std::size_t size = 0;
+    isRead = readSize(in, size);
+    if (isRead) {
+      object.resize(size);
+      isRead = readValues(in, object.data(), object.size());
+    }
+  }
+  value = std::move(object);
+  return isRead;
+}
+
+/// Reads a heap object written by `writeHeapValue`.
+auto readHeapValue(FILE *in, MaMa::HeapValue &value) -> bool {
+  std::uint64_t tag = 0;
+  if (!common::readLittleEndian(in, tag)) {
+    return false;
+  }
+  bool isRead = false;
+  [&]<std::size_t... I>(std::index_sequence<I...>) {
+    using Value = MaMa::HeapValue;
+    ((tag == I
+          ? void(isRead =
+                     readHeapObject<std::variant_alternative_t<I, Value>>(
+                         in, value))
+          : void()),
+     ...);
+  }(std::make_index_sequence<std::variant_size_v<MaMa::HeapValue>>());
+  return isRead;
+}
+
+} // namespace
+
+void MaMa::checkpoint(FILE *out) {
+  dbg_assert(!exitStatus.has_value(),
+             "Cannot checkpoint a machine that halted");
+  dbg_assert(registers.stackPointer < stack.size(),
+             "Stack pointer out of the stack", registers.stackPointer);
+  CheckpointHeader header = {.magic = checkpointMagic,
+                             .version = checkpointVersion,
+                             .programHash = programHash(instructions),
+                             .registers = registers,
+                             .stackCells = registers.stackPointer + 1,
+                             .globalCells = gloabls.size(),
+                             .heapObjects = heap.size()};
+  bool isWritten =
+      writeHeader(out, header) &&
+      writeValues(out, stack.data(), header.stackCells) &&
+      writeValues(out, gloabls.data(), gloabls.size()) &&
+      std::ranges::all_of(heap, [&](const HeapValue &value) {
+        return writeHeapValue(out, value);
+      });
+  dbg_assert(isWritten, "Cannot write checkpoint");
+}
+
+void MaMa::restore(FILE *in) {
+  CheckpointHeader header = {};
+  bool isCheckpoint = readHeader(in, header) && header.magic == checkpointMagic;
+  dbg_assert(isCheckpoint, "Not a MaMa checkpoint");
+  dbg_assert_eq(header.version, checkpointVersion,
+                "Unsupported checkpoint version", header.version);
+  dbg_assert_eq(header.programHash, programHash(instructions),
+                "Checkpoint of another program");
+  const Registers &saved = header.registers;
+  bool isInMachine = header.stackCells == saved.stackPointer + 1 &&
+                     header.stackCells <= stack.size() &&
+                     saved.framePointer < header.stackCells &&
+                     saved.codePointer <= instructions.size() &&
+                     saved.globalPointer <= header.globalCells;
+  dbg_assert(isInMachine, "Corrupt checkpoint", saved.stackPointer,
+             saved.codePointer);
+
+  gloabls.resize(header.globalCells);
+  heap.resize(header.heapObjects);
+  bool isComplete =
+      readValues(in, stack.data(), header.stackCells) &&
+      readValues(in, gloabls.data(), gloabls.size()) &&
+      std::ranges::all_of(heap, [&](HeapValue &value) {
+        return readHeapValue(in, value);
+      });
+  dbg_assert(isComplete, "Truncated checkpoint");
+  registers = saved;
+  exitStatus = std::nullopt;
 }
 
 namespace {
@@ -459,4 +677,10 @@ auto MaMa::loadInstructions(std::string_view text) -> std::vector<Instr::Byte> {
   return code;
 }
 
+auto MaMa::loadSymbols(std::string_view text) -> std::vector<common::Symbol> {
+  MaMaParser parser(text);
+  parser.parse();
+  return parser.symbols();
+}
+
 } // namespace vm::mama
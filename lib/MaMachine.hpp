@@ -1,10 +1,12 @@
 #ifndef TUM_I2_VM_LIB_MAMA
 #define TUM_I2_VM_LIB_MAMA
 
+#include "lib/Common.hpp"
+
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
-#include <forward_list>
+#include <optional>
 #include <span>
 #include <string_view>
 #include <variant>
@@ -82,13 +84,28 @@ public:
   using HeapValue =
       std::variant<BasicValue, Closure, Function, std::vector<BasicValue>>;
 
+  /// The registers while the machine is stopped, as offsets into the code,
+  /// the stack and the globals.
+  struct Registers {
+    std::size_t codePointer;
+    std::size_t stackPointer;
+    std::size_t framePointer;
+    std::size_t globalPointer;
+  };
+
 private:
   std::span<Instr::Byte> instructions;
 
   static constexpr std::size_t initialStackSize = 1 << 10;
   std::vector<BasicValue> stack = std::vector<BasicValue>(initialStackSize);
   std::vector<BasicValue> gloabls = {};
-  std::forward_list<HeapValue> heap = {};
+  /// Objects are referred to by their offset in the heap (in
+  /// `BasicValue::size`), so that the stack can be saved as it is.
+  std::vector<HeapValue> heap = {};
+
+  Registers registers = {};
+  /// Set once the program halted.
+  std::optional<int> exitStatus = {};
 
   FILE *out;
 
@@ -99,20 +116,54 @@ public:
       : instructions{instructions}, out{out} {}
 
   /**
-   * @brief Runs the virtual machine until all instructions are executed.
+   * @brief Runs the virtual machine until the program halts, from where it
+   * stopped (see `runFor`).
    * @return Exit status of the virtual machine.
    */
   auto run() -> int;
 
+  /**
+   * @brief Runs the program for at most `steps` instructions, e.g. to take
+   * checkpoints in between.
+   * @return Whether the program has not halted yet.
+   */
+  auto runFor(std::int64_t steps) -> bool;
+
+  /**
+   * @brief Saves the state of the machine, so that `restore` continues the
+   * program from here, after a restart or on another host.
+   * @details The checkpoint holds the registers, a hash of the program, the
+   * live part of the stack, the globals and the heap objects. All of them
+   * are saved as little-endian 64-bit fields.
+   */
+  void checkpoint(FILE *out);
+
+  /**
+   * @brief Continues from a checkpoint of the same program, on a machine that
+   * has not run yet.
+   */
+  void restore(FILE *in);
+
+  auto getRegisters() const -> Registers { return registers; }
+  void setRegisters(Registers r) { registers = r; }
+
+  /// The exit status of the program, once it halted.
+  auto getExitStatus() const -> std::optional<int> { return exitStatus; }
+  void halt(int status) { exitStatus = status; }
+
   auto getOutFile() -> FILE * { return out; }
   auto getCodeStart() -> Instr::Byte * { return instructions.data(); }
+  auto getStackStart() -> BasicValue * { return stack.data(); }
+  auto getGlobalStart() -> BasicValue * { return gloabls.data(); }
 
   /**
    * @brief Prints the current state of the virtual machine for debugging.
    */
   void debug();
 
-  auto createNew(HeapValue &&v) -> HeapValue *;
+  /// Allocates `v` on the heap and returns its offset.
+  auto createNew(HeapValue &&v) -> std::size_t;
+  auto getHeapValue(std::size_t offset) -> HeapValue & { return heap[offset]; }
 
   /**
    * @brief Loads instructions from a textual representation into a CMa
@@ -122,6 +173,14 @@ public:
    */
   static auto loadInstructions(std::string_view text)
       -> std::vector<Instr::Byte>;
+
+  /**
+   * @brief Collects the labels of a program in textual representation.
+   * @param text The textual representation of instructions.
+   * @return The labels with the code offset they name.
+   */
+  static auto loadSymbols(std::string_view text)
+      -> std::vector<common::Symbol>;
 };
 
 } // namespace vm::mama
@@ -1,6 +1,7 @@
 #ifndef TUM_I2_VM_LIB_PARSER
 #define TUM_I2_VM_LIB_PARSER
 
+#include "lib/Common.hpp"
 #include "lib/Error.hpp"
 
 #include <algorithm>
@@ -159,6 +160,15 @@ public:
     this->runParse();
     return std::move(code);
   }
+
+  /// The labels found by `parse()`.
+  auto symbols() const -> std::vector<common::Symbol> {
+    std::vector<common::Symbol> symbols = {};
+    for (auto [name, address] : jumpLabels) {
+      symbols.push_back({.name = name, .address = address});
+    }
+    return symbols;
+  }
 };
 
 } // namespace vm::parser
@@ -1,29 +1,54 @@
 #include <cstddef>
 #include <gtest/gtest.h>
 
+#include "lib/CMaBulk.hpp"
+#include "lib/CMaCompact.hpp"
+#include "lib/CMaConstant.hpp"
+#include "lib/CMaNatives.hpp"
+#include "lib/CMaOptimizer.hpp"
+#include "lib/CMaPool.hpp"
+#include "lib/CMaTranslator.hpp"
+#include "lib/CMaVerifier.hpp"
 #include "lib/CMachine.hpp"
 #include "lib/Error.hpp"
+#include "lib/Image.hpp"
 
+#include <algorithm>
+#include <climits>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <numeric>
+#include <span>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <vector>
 
 using namespace vm::cma;
 
 namespace {
 
-auto runWithExitCode(std::string_view text) -> int {
+auto runWithExitCode(std::string_view text, Engine engine,
+                     bool fuse = false) -> int {
   auto instructions = CMa::loadInstructions(text);
-  auto vm = CMa(instructions);
+  if (fuse) {
+    EXPECT_GT(CMa::fuseSuperinstructions(instructions), 0);
+  }
+  auto vm = CMa(instructions, stdout, engine);
   return vm.run();
 }
 
-auto run(std::string_view text) -> std::string {
-  auto instructions = CMa::loadInstructions(text);
+template <typename Policy = CMaPolicy<>>
+auto run(std::string_view text, Engine engine, MemoryLayout layout = {})
+    -> std::string {
+  auto instructions =
+      CMa::loadInstructions<typename BasicCMa<Policy>::Word>(text);
 
   FILE *f = std::tmpfile();
   dbg_assert_neq(f, nullptr, "could not open file");
-  auto vm = CMa(instructions, f);
+  auto vm = BasicCMa<Policy>(instructions, f, engine, layout);
   vm.run();
 
   std::fseek(f, 0, SEEK_END);
@@ -41,11 +66,20 @@ auto run(std::string_view text) -> std::string {
   return output;
 }
 
+/// Every program is run on each of the engines, which must agree.
+class CMaTest : public testing::TestWithParam<Engine> {};
+
 } // namespace
 
-TEST(CMa, empty) { ASSERT_EQ(run("halt"), ""); }
+INSTANTIATE_TEST_CASE_P(Engines, CMaTest,
+                        testing::Values(Engine::Switch, Engine::Threaded,
+                                        Engine::Checked, Engine::Safe,
+                                        Engine::Jit, Engine::Compact,
+                                        Engine::Tiered));
 
-TEST(CMa, count) {
+TEST_P(CMaTest, empty) { ASSERT_EQ(run("halt", GetParam()), ""); }
+
+TEST_P(CMaTest, count) {
   std::string_view expected = "9\n8\n7\n6\n5\n4\n3\n2\n1\n0\n";
   std::string_view program = R"(
         loadc 10
@@ -58,10 +92,42 @@ TEST(CMa, count) {
         jump loop 
   end:  halt
   )";
-  ASSERT_EQ(run(program), expected);
+  ASSERT_EQ(run(program, GetParam()), expected);
+}
+
+TEST_P(CMaTest, wrapsAround) {
+  std::string_view program = R"(
+        loadc 2147483647
+        loadc 1
+        add
+        print
+        loadc -2147483648
+        neg
+        print
+        loadc 65536
+        dup
+        mul
+        print
+        halt
+  )";
+  ASSERT_EQ(run(program, GetParam()), "-2147483648\n-2147483648\n0\n");
+}
+
+TEST_P(CMaTest, reachesFarCells) {
+  // 4 * 600000000 bytes are beyond a 32-bit displacement.
+  std::string_view program = R"(
+        loadc 7
+        storea 600000000
+        pop
+        loada 600000000
+        print
+        halt
+  )";
+  MemoryLayout layout = {.heapCells = 600000100};
+  ASSERT_EQ(run(program, GetParam(), layout), "7\n");
 }
 
-TEST(CMa, switch) {
+TEST_P(CMaTest, switch) {
   std::string_view program = R"(
           loadc 2        
           dup
@@ -86,10 +152,10 @@ TEST(CMa, switch) {
 
       D: halt 
   )";
-  ASSERT_EQ(run(program), "2\n");
+  ASSERT_EQ(run(program, GetParam()), "2\n");
 }
 
-TEST(CMa, while) {
+TEST_P(CMaTest, while) {
   std::string_view program = R"(
           loadc 1000 
           loadc 0 
@@ -107,10 +173,10 @@ TEST(CMa, while) {
           print 
           halt
   )";
-  ASSERT_EQ(run(program), "1000\n");
+  ASSERT_EQ(run(program, GetParam()), "1000\n");
 }
 
-TEST(CMa, if) {
+TEST_P(CMaTest, if) {
   std::string_view program = R"(
           loadc 1 
           loadc 10 
@@ -122,10 +188,10 @@ TEST(CMa, if) {
           print 
           halt 
   )";
-  ASSERT_EQ(run(program), "1\n");
+  ASSERT_EQ(run(program, GetParam()), "1\n");
 }
 
-TEST(CMa, new) {
+TEST_P(CMaTest, new) {
   std::string_view program = R"(
          loadc 100 
          new 
@@ -138,11 +204,71 @@ TEST(CMa, new) {
          print 
          halt 
   )";
-  ASSERT_EQ(run(program), "11\n");
+  ASSERT_EQ(run(program, GetParam()), "11\n");
+}
+
+constexpr MemoryLayout smallLayout = {
+    .stackCells = 1024, .guardCells = 1024, .heapCells = 1024};
+
+TEST_P(CMaTest, newFailsAtHeapBoundary) {
+  std::string_view program = R"(
+         loadc 2000 
+         new 
+         print 
+         loadc 500 
+         new 
+         loadc 0 
+         neq 
+         print 
+         halt 
+  )";
+  // The heap is rounded up to at least one page (1024 cells).
+  ASSERT_EQ(run(program, GetParam(), smallLayout), "0\n1\n");
+}
+
+TEST_P(CMaTest, freeReusesBlocks) {
+  // 1000 blocks of 100 cells would not fit into the heap without `free`.
+  std::string_view program = R"(
+         alloc 2 
+         loadc 1000 
+         storea 0 
+         pop 
+     L:  loada 0 
+         jumpz E 
+         loadc 100 
+         new 
+         dup 
+         loadc 0 
+         eq 
+         loada 1 
+         add 
+         storea 1 
+         pop 
+         free 
+         loada 0 
+         loadc 1 
+         sub 
+         storea 0 
+         pop 
+         jump L 
+     E:  loada 1 
+         print 
+         halt 
+  )";
+  ASSERT_EQ(run(program, GetParam(), smallLayout), "0\n");
 }
 
-TEST(CMa, factorialFull) {
+TEST_P(CMaTest, allocFailsAtStackBoundary) {
+  // Each `alloc` moves the stack pointer past the guard without touching it.
   std::string_view program = R"(
+     L:  alloc 1500 
+         jump L 
+  )";
+  EXPECT_EXIT((void)run(program, GetParam(), smallLayout),
+              testing::ExitedWithCode(EXIT_FAILURE), "");
+}
+
+constexpr std::string_view factorialProgram = R"(
           enter 4 
           alloc 1 
           mark 
@@ -180,5 +306,1310 @@ TEST(CMa, factorialFull) {
           storer -3 
           return 
   )";
-  ASSERT_EQ(runWithExitCode(program), 120);
+
+TEST_P(CMaTest, factorialFull) {
+  ASSERT_EQ(runWithExitCode(factorialProgram, GetParam()), 120);
+}
+
+TEST_P(CMaTest, optimizedFactorial) {
+  OptimizationReport report = {};
+  auto instructions = CMa::loadInstructions(factorialProgram, report);
+  ASSERT_LT(report.after, report.before);
+  if (GetParam() != Engine::Switch) {
+    CMa::fuseSuperinstructions(instructions);
+  }
+  ASSERT_EQ(CMa(instructions, stdout, GetParam()).run(), 120);
+}
+
+TEST_P(CMaTest, tailCallsReuseTheFrame) {
+  std::string_view program = R"(
+          enter 5 
+          loadc 0 
+          loadc 100000 
+          mark 
+          loadc _count 
+          call 
+          slide 1 
+          halt 
+  _count: enter 5 
+          loadr -3 
+          jumpz D 
+          loadr -4 
+          loadc 1 
+          add 
+          loadr -3 
+          loadc 1 
+          sub 
+          mark 
+          loadc _count 
+          call 
+          slide 1 
+          storer -3 
+          return 
+      D:  loadr -4 
+          storer -3 
+          return 
+  )";
+  OptimizationReport report = {};
+  auto instructions = CMa::loadInstructions(program, report);
+  ASSERT_EQ(report.tailCalls, 1);
+  // 100000 frames would not fit.
+  MemoryLayout layout = {.stackCells = 4096, .guardCells = 4096,
+                         .heapCells = 4096};
+  ASSERT_EQ(CMa(instructions, stdout, GetParam(), layout).run(), 100000);
+}
+
+TEST_P(CMaTest, hotLoopsAndCalls) {
+  // Long enough for the tiered engine to promote both functions, the loop
+  // of main while it runs.
+  std::string_view program = R"(
+          enter 4 
+          alloc 2 
+          loadc 0 
+          storer 1 
+          loadc 0 
+          storer 2 
+      L:  loadr 1 
+          loadc 5000 
+          le 
+          jumpz E 
+          loadr 2 
+          alloc 1 
+          loadr 1 
+          mark 
+          loadc _mod7 
+          call 
+          slide 1 
+          add 
+          storer 2 
+          pop 
+          loadr 1 
+          loadc 1 
+          add 
+          storer 1 
+          pop 
+          jump L 
+      E:  loadr 2 
+          storea 0 
+          halt 
+  _mod7:  enter 2 
+          loadr -3 
+          loadc 7 
+          mod 
+          storer -3 
+          return 
+  )";
+  auto instructions = CMa::loadInstructions(program);
+  ASSERT_EQ(CMa(instructions, stdout, GetParam()).run(), 14995);
+}
+
+TEST_P(CMaTest, bulkMemory) {
+  // a = [3] * 20 with a[5] = -4 and a[12] = 9; b is a copy of a before.
+  std::string_view program = R"(
+          enter 12 
+          loadc 20 
+          new 
+          loadc 20 
+          new 
+          loadr 1 
+          loadc 3 
+          loadc 20 
+          fill 
+          loadr 2 
+          loadr 1 
+          loadc 20 
+          copy 
+          loadc -4 
+          loadr 1 
+          loadc 5 
+          add 
+          store 
+          pop 
+          loadc 9 
+          loadr 1 
+          loadc 12 
+          add 
+          store 
+          pop 
+          loadr 1 
+          loadc 20 
+          sum 
+          print 
+          loadr 1 
+          loadc 20 
+          min 
+          print 
+          loadr 1 
+          loadc 20 
+          max 
+          print 
+          loadr 1 
+          loadr 2 
+          loadc 20 
+          dot 
+          print 
+          loadr 1 
+          loadc 9 
+          loadc 20 
+          find 
+          print 
+          loadr 1 
+          loadr 2 
+          loadc 20 
+          cmp 
+          print 
+          loadr 2 
+          loadr 2 
+          loadc 20 
+          cmp 
+          print 
+          halt 
+  )";
+  ASSERT_EQ(run(program, GetParam()), "59\n-4\n9\n177\n12\n-1\n0\n");
+}
+
+TEST_P(CMaTest, threads) {
+  // Three workers add to a shared counter in cell 1 (cell 0 is the exit
+  // code); each returns twice its argument.
+  std::string_view program = R"(
+          enter 9 
+          alloc 2 
+          loadc 1 
+          loadc _worker 
+          spawn 
+          loadc 2 
+          loadc _worker 
+          spawn 
+          loadc 3 
+          loadc _worker 
+          spawn 
+          loadr 3 
+          join 
+          loadr 4 
+          join 
+          add 
+          loadr 5 
+          join 
+          add 
+          print 
+          loada 1 
+          print 
+          loadc 1 
+          loadc 6000 
+          loadc 7 
+          cas 
+          print 
+          loadc 1 
+          loadc 1 
+          loadc 8 
+          cas 
+          print 
+          loada 1 
+          print 
+          halt 
+  _worker: enter 4 
+          alloc 1 
+          loadc 1000 
+          storer 1 
+          pop 
+      W:  loadr 1 
+          jumpz D 
+          loadc 1 
+          loadr -3 
+          fetchadd 
+          pop 
+          loadr 1 
+          loadc 1 
+          sub 
+          storer 1 
+          pop 
+          jump W 
+      D:  loadr -3 
+          loadc 2 
+          mul 
+          storer -3 
+          return 
+  )";
+  ASSERT_TRUE(verify(CMa::loadInstructions(program), MemoryLayout{}.size())
+                  .isVerified());
+  ASSERT_EQ(run(program, GetParam()), "12\n6000\n6000\n7\n7\n");
+}
+
+TEST_P(CMaTest, threadStackOverflow) {
+  // The stack of the thread is a heap block without guard pages.
+  std::string_view program = R"(
+          enter 4 
+          loadc 0 
+          loadc _deep 
+          spawn 
+          join 
+          print 
+          halt 
+  _deep:  enter 4 
+          mark 
+          loadc _deep 
+          call 
+          return 
+  )";
+  EXPECT_EXIT((void)run(program, GetParam()),
+              testing::ExitedWithCode(EXIT_FAILURE), "");
+}
+
+TEST_P(CMaTest, nativeFunctions) {
+  // Sorts the cells 1 to 3 with the standard `sort`, then lets a native of
+  // its own turn them into a number.
+  std::string_view program = R"(
+          enter 8
+          alloc 4
+          loadc 3
+          storea 1
+          loadc 1
+          storea 2
+          loadc 2
+          storea 3
+          pop 3
+          loadc 1
+          loadc 3
+          callnative 0
+          loada 1
+          loada 2
+          loada 3
+          callnative 3
+          storea 0
+          halt
+  )";
+  auto digits = [](std::span<int> memory, int &sp, int /*fp*/) {
+    sp -= 2;
+    memory[sp] = memory[sp] * 100 + memory[sp + 1] * 10 + memory[sp + 2];
+  };
+  auto instructions = CMa::loadInstructions(program);
+  auto vm = CMa(instructions, stdout, GetParam());
+  for (auto &native : standardNatives<int>()) {
+    vm.registerNative(std::move(native));
+  }
+  ASSERT_EQ(vm.registerNative({.function = digits,
+                               .effect = {.pops = 3, .pushes = 1}}),
+            3);
+  ASSERT_TRUE(verify(instructions, MemoryLayout{}.size(), vm.nativeEffects())
+                  .isVerified());
+  ASSERT_FALSE(verify(instructions, MemoryLayout{}.size()).isVerified());
+  ASSERT_EQ(vm.run(), 123);
+}
+
+TEST(CMaNatives, hashAndParse) {
+  // "-42" and "42", one character per cell.
+  auto instructions = CMa::loadInstructions(R"(
+          alloc 8
+          loadc 45
+          storea 1
+          loadc 52
+          storea 2
+          storea 5
+          loadc 50
+          storea 3
+          storea 6
+          pop 3
+          loadc 1
+          loadc 3
+          callnative 2
+          storea 0
+          loadc 2
+          loadc 2
+          callnative 1
+          storea 7
+          loadc 5
+          loadc 2
+          callnative 1
+          storea 8
+          halt
+  )");
+  auto vm = CMa(instructions, stdout);
+  for (auto &native : standardNatives<int>()) {
+    vm.registerNative(std::move(native));
+  }
+  ASSERT_EQ(vm.run(), -42);
+  ASSERT_EQ(vm.getMemory()[7], vm.getMemory()[8]);
+  ASSERT_NE(vm.getMemory()[7], 0);
+}
+
+TEST_P(CMaTest, superinstructions) {
+  ASSERT_EQ(runWithExitCode(factorialProgram, GetParam(), true), 120);
+}
+
+TEST(CMaCompact, encodesDensely) {
+  auto instructions = CMa::loadInstructions(R"(
+          loadc 1000 
+          jumpz E 
+          loadc -3 
+          pop 
+          mark 
+          loadc 0 
+          call 
+      E:  halt 
+  )");
+  auto code = CompactCode(instructions);
+  ASSERT_EQ(code.size(), instructions.size());
+  // 5 + 5 + 2 + 2 + 1 + 2 + 2 + 1, and the final `halt`.
+  ASSERT_EQ(code.byteSize(), 21);
+  for (std::size_t i = 0; i < instructions.size(); ++i) {
+    Instr decoded = code.decode(code.offsetOf(static_cast<int>(i)));
+    ASSERT_EQ(decoded.type, instructions[i].type);
+    if (decoded.type != Instr::Call &&
+        CompactCode::hasArgument(decoded.type)) {
+      ASSERT_EQ(decoded.arg, instructions[i].arg);
+    }
+    ASSERT_EQ(code.addressOf(code.offsetOf(static_cast<int>(i))), i);
+  }
+  // `call` pushes the address of the next instruction.
+  ASSERT_EQ(code.decode(code.offsetOf(6)).arg, 7);
+  ASSERT_EQ(code.offsetOf(-1), code.offsetOf(100));
+}
+
+TEST_P(CMaTest, quickenedFactorial) {
+  auto instructions = CMa::loadInstructions(factorialProgram);
+  if (GetParam() != Engine::Switch) {
+    CMa::fuseSuperinstructions(instructions);
+  }
+  ASSERT_GT(CMa::quicken(instructions), 0);
+  ASSERT_EQ(CMa(instructions, stdout, GetParam()).run(), 120);
+}
+
+TEST(CMaQuickening, keepsSemantics) {
+  std::string_view program = R"(
+          enter 8 
+          loadc 11 
+          loadc 22 
+          loadc 33 
+          storer 1 
+          storer 2 
+          storer -3 
+          loadr 1 
+          loadr 2 
+          loadr 3 
+          loadr -3 
+          loadr -4 
+          loadc 2 
+          store 
+          loadc 2 
+          load 
+          loadc 2 
+          load 2 
+          pop 
+          pop 3 
+          print 
+          print 
+          print 
+          halt 
+  )";
+  auto plain = CMa::loadInstructions(program);
+  auto quickened = plain;
+  ASSERT_EQ(CMa::quicken(quickened), 11);
+  ASSERT_EQ(quickened[4].type, Instr::Storer1);
+  ASSERT_EQ(Instr::baseType(quickened[4].type), Instr::Storer);
+  ASSERT_EQ(quickened[4].arg, 1);
+  // `load 2` has no quickened form.
+  ASSERT_EQ(quickened[17].type, Instr::Load);
+
+  auto output = [](std::vector<Instr> instructions) {
+    FILE *f = std::tmpfile();
+    // The frame lies below address 0 otherwise.
+    BasicCMa<CMaPolicy<true>> vm(instructions, f);
+    vm.setRegisters({.programCounter = 0,
+                     .stackPointer = 10,
+                     .framePointer = 10,
+                     .extremePointer = 10,
+                     .newPointer = 1000});
+    vm.run();
+    std::string text(static_cast<std::size_t>(std::ftell(f)), '\0');
+    std::rewind(f);
+    std::fread(text.data(), 1, text.size(), f);
+    std::fclose(f);
+    return text;
+  };
+  ASSERT_EQ(output(quickened), output(plain));
+  ASSERT_EQ(output(plain), "33\n33\n33\n");
+}
+
+TEST(CMaDebugger, breakpoints) {
+  auto instructions = CMa::loadInstructions(factorialProgram);
+  auto symbols = CMa::loadSymbols(factorialProgram);
+  auto fac =
+      std::ranges::find(symbols, "_fac", &vm::common::Symbol::name)->address;
+  CMa vm(instructions);
+  vm.setBreakpoint(static_cast<int>(fac));
+  ASSERT_EQ(instructions[fac].type, Instr::Trap);
+
+  // The argument of each call, until the breakpoint is cleared.
+  std::vector<int> arguments = {};
+  while (vm.resume()) {
+    Registers r = vm.getRegisters();
+    ASSERT_EQ(r.programCounter, fac);
+    arguments.push_back(vm.getStack()[r.framePointer - 3]);
+    vm.singleStep();
+    ASSERT_EQ(vm.getRegisters().programCounter, fac + 1);
+    ASSERT_EQ(vm.getRegisters().extremePointer, r.stackPointer + 5);
+    if (arguments.size() == 3) {
+      vm.clearBreakpoint(static_cast<int>(fac));
+    }
+  }
+  ASSERT_EQ(arguments, (std::vector{5, 4, 3}));
+  ASSERT_EQ(instructions[fac].type, Instr::Enter);
+  ASSERT_EQ(vm.getMemory()[0], 120);
+}
+
+TEST_P(CMaTest, stopsAtBreakpoints) {
+  auto instructions = CMa::loadInstructions(factorialProgram);
+  auto symbols = CMa::loadSymbols(factorialProgram);
+  auto fac =
+      std::ranges::find(symbols, "_fac", &vm::common::Symbol::name)->address;
+  CMa vm(instructions, stdout, GetParam());
+  vm.setBreakpoint(static_cast<int>(fac));
+  vm.run();
+  int hits = 1;
+  while (vm.resume()) {
+    hits += 1;
+  }
+  ASSERT_EQ(hits, 6);
+  ASSERT_EQ(vm.getMemory()[0], 120);
+}
+
+TEST_P(CMaTest, stopsAtBreakpointsInSuperinstructions) {
+  auto count = [&](std::vector<Instr> &instructions, int address) {
+    CMa vm(instructions, stdout, GetParam());
+    vm.setBreakpoint(address);
+    vm.run();
+    int hits = 1;
+    while (vm.resume()) {
+      hits += 1;
+    }
+    EXPECT_EQ(vm.getMemory()[0], 120);
+    vm.clearBreakpoint(address);
+    return hits;
+  };
+  auto plain = CMa::loadInstructions(factorialProgram);
+  auto fused = plain;
+  ASSERT_GT(CMa::fuseSuperinstructions(fused), 0);
+  auto original = fused;
+  for (std::size_t i = 0; i < fused.size(); ++i) {
+    // The second part of each superinstruction.
+    if (Instr::fusedParts(fused[i].type).size() > 1) {
+      auto inside = static_cast<int>(i) + 1;
+      ASSERT_EQ(count(fused, inside), count(plain, inside)) << inside;
+      ASSERT_EQ(fused[i].type, original[i].type);
+    }
+  }
+}
+
+TEST(CMaReset, clearsWhatTheProgramWrote) {
+  auto instructions = CMa::loadInstructions(R"(
+          loadc 7 
+          storea 5000 
+          pop 
+          loadc 3 
+          new 
+          storea 0 
+          pop 
+          loadc 9 
+          loada 0 
+          store 
+          pop 
+          halt 
+  )");
+  CMa vm(instructions);
+  int block = vm.run();
+  ASSERT_EQ(vm.getMemory()[5000], 7);
+  ASSERT_EQ(vm.getMemory()[block], 9);
+
+  vm.reset(instructions);
+  ASSERT_EQ(vm.getRegisters().stackPointer, -1);
+  ASSERT_EQ(vm.getMemory()[0], 0);
+  ASSERT_EQ(vm.getMemory()[5000], 0);
+  ASSERT_EQ(vm.getMemory()[block], 0);
+  ASSERT_EQ(vm.run(), block);
+  ASSERT_EQ(vm.getHeapStats().liveBlocks, 1);
+
+  vm.releaseMemory();
+  ASSERT_EQ(vm.getMemory()[5000], 0);
+  auto factorial = CMa::loadInstructions(factorialProgram);
+  vm.reset(factorial);
+  ASSERT_EQ(vm.run(), 120);
+}
+
+TEST(CMaReset, takesOutTrapsOnlyFromTheSameProgram) {
+  auto instructions = CMa::loadInstructions(factorialProgram);
+  CMa vm(instructions);
+  vm.setBreakpoint(3);
+  vm.reset(instructions);
+  ASSERT_EQ(vm.run(), 120);
+
+  // The last program might be gone, so it is not written to.
+  vm.setBreakpoint(3);
+  auto other = CMa::loadInstructions("loadc 5 storea 0 halt");
+  vm.reset(other);
+  ASSERT_EQ(instructions[3].type, Instr::Trap);
+  ASSERT_EQ(vm.run(), 5);
+}
+
+TEST(CMaCheckpoint, resumesWhereItStopped) {
+  // Sums 1..1000 through a heap block that is freed in every iteration.
+  std::string_view program = R"(
+          alloc 3
+          loadc 1000
+          storea 0
+          pop
+      L:  loada 0
+          jumpz E
+          loadc 100
+          new
+          storea 1
+          pop
+          loada 0
+          loada 1
+          store
+          pop
+          loada 2
+          loada 1
+          load
+          add
+          storea 2
+          pop
+          loada 1
+          free
+          loada 0
+          loadc 1
+          sub
+          storea 0
+          pop
+          jump L
+      E:  loada 2
+          storea 0
+          halt
+  )";
+  auto instructions = CMa::loadInstructions(program);
+  CMa vm(instructions);
+  ASSERT_TRUE(vm.runFor(10000));
+  FILE *f = std::tmpfile();
+  dbg_assert_neq(f, nullptr, "could not open file");
+  vm.checkpoint(f);
+  Registers stopped = vm.getRegisters();
+  ASSERT_FALSE(vm.runFor(std::numeric_limits<std::int64_t>::max()));
+  ASSERT_EQ(vm.getMemory()[0], 500500);
+
+  // A new machine, quickened unlike the first one.
+  auto resumed = CMa::loadInstructions(program);
+  CMa::quicken(resumed);
+  CMa copy(resumed);
+  std::rewind(f);
+  copy.restore(f);
+  std::fclose(f);
+  ASSERT_EQ(copy.getRegisters().programCounter, stopped.programCounter);
+  ASSERT_EQ(copy.getRegisters().stackPointer, stopped.stackPointer);
+  ASSERT_EQ(copy.getRegisters().newPointer, stopped.newPointer);
+  ASSERT_EQ(copy.run(), 500500);
+  ASSERT_EQ(copy.getHeapStats().liveBlocks, 0);
+  ASSERT_EQ(copy.getHeapStats().peakLiveBytes,
+            vm.getHeapStats().peakLiveBytes);
+  ASSERT_EQ(copy.getHeapStats().freeBytes, vm.getHeapStats().freeBytes);
+}
+
+TEST(CMaCheckpoint, savesLittleEndianFields) {
+  auto instructions = CMa::loadInstructions(R"(
+          loadc 16909060
+          loadc 1
+          add
+          halt
+  )");
+  CMa vm(instructions);
+  ASSERT_TRUE(vm.runFor(1));
+  FILE *f = std::tmpfile();
+  dbg_assert_neq(f, nullptr, "could not open file");
+  vm.checkpoint(f);
+  std::vector<unsigned char> bytes(std::ftell(f));
+  std::rewind(f);
+  ASSERT_EQ(std::fread(bytes.data(), 1, bytes.size(), f), bytes.size());
+  std::fclose(f);
+
+  // Magic, version 2, 4-byte cells, ..., the program counter at byte 44.
+  ASSERT_GE(bytes.size(), 48);
+  EXPECT_EQ(std::string(bytes.begin(), bytes.begin() + 4), "CMAS");
+  EXPECT_EQ(std::vector(bytes.begin() + 4, bytes.begin() + 12),
+            std::vector<unsigned char>({2, 0, 0, 0, 4, 0, 0, 0}));
+  EXPECT_EQ(std::vector(bytes.begin() + 44, bytes.begin() + 48),
+            std::vector<unsigned char>({1, 0, 0, 0}));
+  std::vector<unsigned char> cell = {4, 3, 2, 1};
+  EXPECT_NE(std::search(bytes.begin(), bytes.end(), cell.begin(), cell.end()),
+            bytes.end());
+
+  FILE *copied = std::tmpfile();
+  dbg_assert_neq(copied, nullptr, "could not open file");
+  std::fwrite(bytes.data(), 1, bytes.size(), copied);
+  std::rewind(copied);
+  CMa copy(instructions);
+  copy.restore(copied);
+  std::fclose(copied);
+  ASSERT_EQ(copy.run(), 16909061);
+}
+
+TEST(CMaData, mapsFilesIntoMemory) {
+  std::vector<int> words(1000);
+  std::iota(words.begin(), words.end(), 0);
+  FILE *f = std::tmpfile();
+  dbg_assert_neq(f, nullptr, "could not open file");
+  std::fwrite(words.data(), sizeof(int), words.size(), f);
+  std::fflush(f);
+  std::string path = "/proc/self/fd/" + std::to_string(fileno(f));
+
+  auto instructions = CMa::loadInstructions(R"(
+          loadc 1048576 
+          loadc 1000 
+          sum 
+          loada 1048999 
+          add 
+          halt 
+  )");
+  CMa vm(instructions);
+  ASSERT_EQ(vm.mapData(path, 1 << 20), words.size());
+  ASSERT_EQ(vm.run(), 499500 + 423);
+
+  // Writes stay in the machine.
+  auto writes = CMa::loadInstructions(R"(
+          loadc 7 
+          storea 1048576 
+          loada 1048577 
+          add 
+          halt 
+  )");
+  vm.reset(writes);
+  ASSERT_EQ(vm.getMemory()[1 << 20], 0);
+  vm.mapData(path, 1 << 20, true);
+  ASSERT_EQ(vm.run(), 8);
+  int first = -1;
+  std::rewind(f);
+  ASSERT_EQ(std::fread(&first, sizeof(int), 1, f), 1);
+  ASSERT_EQ(first, 0);
+  std::fclose(f);
+}
+
+TEST(CMaPool, reusesMachinesAcrossThreads) {
+  for (bool releasesIdle : {false, true}) {
+    CMaPool pool(stdout, Engine::Threaded, {}, releasesIdle);
+    std::vector<std::thread> threads = {};
+    for (int t = 0; t < 4; ++t) {
+      threads.emplace_back([&] {
+        auto instructions = CMa::loadInstructions(factorialProgram);
+        for (int i = 0; i < 25; ++i) {
+          auto vm = pool.acquire(instructions);
+          EXPECT_EQ(vm->run(), 120);
+        }
+      });
+    }
+    for (std::thread &thread : threads) {
+      thread.join();
+    }
+    ASSERT_GE(pool.idleCount(), 1);
+    ASSERT_LE(pool.idleCount(), 4);
+  }
+}
+
+TEST(CMaPool, returnsMachinesOnMoveAssignment) {
+  CMaPool pool(stdout, Engine::Switch);
+  auto instructions = CMa::loadInstructions(factorialProgram);
+  auto first = pool.acquire(instructions);
+  auto second = pool.acquire(instructions);
+  CMa *kept = &*second;
+  first = std::move(second);
+  ASSERT_EQ(pool.idleCount(), 1);
+  ASSERT_EQ(&*first, kept);
+  ASSERT_EQ(first->run(), 120);
+}
+
+constexpr auto squaresProgram = constantProgram<R"(
+          alloc 2 
+          loadc 8 
+          new 
+          storea 0 
+          pop 
+          loadc 0 
+          storea 1 
+          pop 
+    L:    loada 1 
+          loadc 8 
+          le 
+          jumpz E 
+          loada 1 
+          loada 1 
+          mul 
+          loada 0 
+          loada 1 
+          add 
+          store 
+          pop 
+          loada 1 
+          loadc 1 
+          add 
+          storea 1 
+          pop 
+          jump L 
+    E:    halt 
+  )">();
+
+/// The first squares, computed by the compiler.
+constexpr auto squares = [] {
+  ConstantCMa<> vm(squaresProgram);
+  int table = vm.run();
+  std::array<int, 8> cells = {};
+  std::ranges::copy_n(vm.getMemory().begin() + table, cells.size(),
+                      cells.begin());
+  return cells;
+}();
+
+static_assert(squaresProgram.size() == 27);
+static_assert(squares == std::array{0, 1, 4, 9, 16, 25, 36, 49});
+
+TEST(CMaConstant, agreesWithTheInterpreter) {
+  constexpr std::string_view program = R"(
+          loadc 5 
+          new 
+          dup 
+          loadc 7 
+          loadc 5 
+          fill 
+          loadc 5 
+          sum 
+          loadc 2 
+          loadc -3 
+          mul 
+          add 
+          storea 0 
+          halt 
+  )";
+  auto instructions = CMa::loadInstructions(program);
+  ConstantCMa<> constant(instructions);
+  ASSERT_EQ(constant.run(), 29);
+  ASSERT_EQ(constant.run(), CMa(instructions).run());
+
+  auto factorial = CMa::loadInstructions(factorialProgram);
+  ASSERT_EQ(ConstantCMa<>(factorial).run(), 120);
+}
+
+TEST(CMaConstant, sharesTheSemanticsOfTheInterpreter) {
+  // Overflow wraps around in both, and both check `alloc`.
+  constexpr std::string_view program = R"(
+          loadc 2000000000 
+          dup 
+          add 
+          loadc -2147483648 
+          neg 
+          add 
+          storea 0 
+          halt 
+  )";
+  auto instructions = CMa::loadInstructions(program);
+  ASSERT_EQ(ConstantCMa<>(instructions).run(), CMa(instructions).run());
+  auto alloc = CMa::loadInstructions("alloc 5000 halt");
+  EXPECT_EXIT((void)ConstantCMa<>(alloc).run(),
+              testing::ExitedWithCode(EXIT_FAILURE), "");
+}
+
+TEST(CMaPolicy, wideWords) {
+  std::string_view program = R"(
+          loadc 2000000000 
+          dup 
+          add 
+          print 
+          halt 
+  )";
+  using Wide = CMaPolicy<false, false, false, std::int64_t>;
+  ASSERT_EQ(run<Wide>(program, Engine::Switch), "4000000000\n");
+  auto factorial = CMa::loadInstructions(factorialProgram);
+  ASSERT_EQ(BasicCMa<CMaPolicy<true>>(factorial).run(), 120);
+
+  // Constants as wide as the cells, from the same interpreter.
+  auto wideFactorial = CMa::loadInstructions<std::int64_t>(factorialProgram);
+  ASSERT_EQ(CMa::quicken(wideFactorial), CMa::quicken(factorial));
+  ASSERT_EQ(BasicCMa<Wide>(wideFactorial).run(), 120);
+  ASSERT_EQ(run<Wide>(R"(
+          loadc 9000000000000000000 
+          loadc -9223372036854775808 
+          add 
+          print 
+          halt 
+  )",
+                      Engine::Switch),
+            "-223372036854775808\n");
+}
+
+TEST(CMaBulk, kernelsMatchLoops) {
+  // Every length up to a few vectors, so that every tail is covered.
+  std::vector<int> left = {};
+  for (int i = 0; i < 40; ++i) {
+    left.push_back((i * 37 + 11) % 23 - 11);
+  }
+  for (int count = 0; count <= 40; ++count) {
+    std::vector<int> right(left.begin(), left.begin() + count);
+    int sum = 0;
+    int min = INT_MAX;
+    int max = INT_MIN;
+    int dot = 0;
+    for (int x : right) {
+      sum += x;
+      min = std::min(min, x);
+      max = std::max(max, x);
+      dot += x * x;
+    }
+    EXPECT_EQ(bulk::sum(left.data(), count), sum);
+    EXPECT_EQ(bulk::min(left.data(), count), min);
+    EXPECT_EQ(bulk::max(left.data(), count), max);
+    EXPECT_EQ(bulk::dot(left.data(), right.data(), count), dot);
+    EXPECT_EQ(bulk::compare(left.data(), right.data(), count), 0);
+    if (count > 0) {
+      right.back() += 1;
+      EXPECT_EQ(bulk::compare(left.data(), right.data(), count), -1);
+      auto found = std::ranges::find(right, right.back() - 1);
+      int index = static_cast<int>(found - right.begin());
+      EXPECT_EQ(bulk::find(right.data(), right.back() - 1, count),
+                found == right.end() ? -1 : index);
+    }
+    bulk::fill(right.data(), 7, count);
+    EXPECT_EQ(std::ranges::count(right, 7), count);
+  }
+  std::vector<std::int64_t> wide = {1, 2, 3};
+  EXPECT_EQ(bulk::sum(wide.data(), 3), 6);
+}
+
+TEST(CMaPolicy, countsInstructions) {
+  auto instructions = CMa::loadInstructions(R"(
+          loadc 3 
+      L:  loadc 1 
+          sub 
+          dup 
+          jumpz E 
+          jump L 
+      E:  halt 
+  )");
+  auto vm = BasicCMa<CMaPolicy<false, false, true>>(instructions);
+  vm.run();
+  const auto &counts = vm.getProfile().counts;
+  ASSERT_EQ(counts[Instr::Loadc], 4);
+  ASSERT_EQ(counts[Instr::Jumpz], 3);
+  ASSERT_EQ(counts[Instr::Jump], 2);
+  ASSERT_EQ(counts[Instr::Halt], 1);
+}
+
+TEST(CMaLocality, recordsAndAnalyzes) {
+  // Cell 0 is a global that holds a heap block, which is then written.
+  auto instructions = CMa::loadInstructions(R"(
+          alloc 1
+          loadc 1
+          new
+          storea 0
+          pop
+          loadc 9
+          loada 0
+          store
+          pop
+          halt
+  )");
+  auto vm = BasicCMa<CMaPolicy<false, false, false, int, true>>(instructions);
+  vm.run();
+  const AccessLog &log = vm.getAccessLog();
+  ASSERT_EQ(log.recorded(), 11);
+
+  auto report = analyzeLocality(log, {});
+  const auto &stack = report.regions[static_cast<int>(Region::Stack)];
+  const auto &globals = report.regions[static_cast<int>(Region::Global)];
+  const auto &heap = report.regions[static_cast<int>(Region::Heap)];
+  ASSERT_EQ(report.all.accesses, 11);
+  ASSERT_EQ(report.all.writes, 6);
+  ASSERT_EQ(stack.accesses, 8);
+  ASSERT_EQ(stack.writes, 4);
+  ASSERT_EQ(globals.accesses, 2);
+  ASSERT_EQ(globals.writes, 1);
+  ASSERT_EQ(heap.accesses, 1);
+  ASSERT_EQ(heap.writes, 1);
+  // One line for the stack and the globals, one for the heap block.
+  ASSERT_EQ(report.coldAccesses, 2);
+  ASSERT_EQ(report.all.l1Misses, 2);
+  ASSERT_EQ(report.hotRanges.size(), 2);
+  ASSERT_EQ(report.hotRanges.front().function, "<start>");
+  ASSERT_EQ(report.hotRanges.front().start, 0);
+  ASSERT_EQ(report.hotRanges.front().counts.accesses, 10);
+
+  // The store into the heap, by the instruction at 7.
+  MemoryAccess last = log.accesses().back();
+  ASSERT_EQ(last.instruction(), 7);
+  ASSERT_EQ(last.region(), Region::Heap);
+  ASSERT_TRUE(last.isWrite());
+}
+
+TEST(CMaLocality, keepsTheLastAccesses) {
+  AccessLog log(4, 1, 200, 4);
+  for (int address = 0; address < 6; ++address) {
+    log.enter(address);
+    log.record(address * 50, Access::Read);
+  }
+  std::string path = testing::TempDir() + "cma-locality.log";
+  FILE *f = std::fopen(path.c_str(), "wb");
+  dbg_assert_neq(f, nullptr, "could not open file");
+  log.save(f);
+  std::fclose(f);
+  AccessLog loaded = AccessLog::load(path);
+  std::remove(path.c_str());
+
+  ASSERT_EQ(loaded.recorded(), 6);
+  for (const AccessLog *l : {&log, &loaded}) {
+    auto accesses = l->accesses();
+    ASSERT_EQ(accesses.size(), 4);
+    for (int i = 0; i < 4; ++i) {
+      EXPECT_EQ(accesses[i].instruction(), i + 2);
+      EXPECT_EQ(accesses[i].address, (i + 2) * 50);
+    }
+    // Cell 0 is the only global, and the heap starts at 200.
+    EXPECT_EQ(accesses[1].region(), Region::Stack);
+    EXPECT_EQ(accesses[2].region(), Region::Heap);
+  }
+}
+
+TEST(CMaOptimizer, foldsThreadsAndRemoves) {
+  std::string_view program = R"(
+          loadc 2 
+          loadc 3 
+          mul 
+          loadc 1 
+          neg 
+          add 
+          dup 
+          pop 
+          loadc 1 
+          jumpz L 
+          jump M 
+          loadc 99 
+          print 
+      M:  jump E 
+      L:  loadc 7 
+          print 
+      E:  print 
+          halt 
+  )";
+  OptimizationReport report = {};
+  auto instructions = CMa::loadInstructions(program, report);
+  ASSERT_EQ(instructions.size(), 3);
+  ASSERT_EQ(instructions[0].type, Instr::Loadc);
+  ASSERT_EQ(instructions[0].arg, 5);
+  ASSERT_EQ(instructions[1].type, Instr::Print);
+  ASSERT_EQ(instructions[2].type, Instr::Halt);
+  ASSERT_EQ(report.before, 18);
+  ASSERT_EQ(report.unreachable, 5);
+  // `E` (16) is now the `print`.
+  ASSERT_EQ(report.addressMap[16], 1);
+}
+
+TEST(CMaOptimizer, remapsFunctionAddresses) {
+  std::string_view program = R"(
+          jump S 
+          loadc 1 
+          print 
+      S:  alloc 1 
+          mark 
+          loadc F 
+          call 
+          halt 
+      F:  enter 1 
+          loadc 42 
+          storer -3 
+          return 
+  )";
+  OptimizationReport report = {};
+  auto instructions = CMa::loadInstructions(program, report);
+  ASSERT_EQ(report.unreachable, 2);
+  ASSERT_EQ(instructions[2].arg, report.addressMap[8]);
+  ASSERT_EQ(CMa(instructions).run(), 42);
+}
+
+TEST(CMaOptimizer, inlinesLeafFunctions) {
+  std::string_view program = R"(
+          enter 4 
+          alloc 1 
+          mark 
+          loadc _main 
+          call 
+          slide 0 
+          halt 
+  _abs:   enter 2 
+          loadr -3 
+          loadc 0 
+          le 
+          jumpz A 
+          loadr -3 
+          neg 
+          storer -3 
+          return 
+      A:  return 
+  _sq:    enter 3 
+          alloc 1 
+          loadr -3 
+          loadr -3 
+          mul 
+          storer 1 
+          pop 
+          loadr 1 
+          storer -3 
+          return 
+  _main:  enter 6 
+          alloc 1 
+          loadc 7 
+          storer 1 
+          pop 
+          loadc -5 
+          mark 
+          loadc _abs 
+          call 
+          loadr 1 
+          mark 
+          loadc _sq 
+          call 
+          add 
+          storer -3 
+          return 
+  )";
+  OptimizationReport report = {};
+  auto instructions = CMa::loadInstructions(program, report);
+  ASSERT_EQ(report.inlined, 2);
+  // Only the call of `_main` is left, and nothing of `_abs` and `_sq`.
+  ASSERT_EQ(std::ranges::count(instructions, Instr::Call, &Instr::type), 1);
+  ASSERT_LT(report.after, report.before);
+  ASSERT_EQ(verify(instructions, 1024).isVerified(), true);
+  ASSERT_EQ(CMa(instructions).run(), 54);
+}
+
+TEST(CMaOptimizer, remapsNumericCallTargets) {
+  // `resources/factorial.cvm` with the addresses of its functions in place
+  // of their labels.
+  std::string_view program = R"(
+          enter 4 
+          alloc 1 
+          mark 
+          loadc 28 
+          call 
+          slide 0 
+          halt 
+          enter 5 
+          loadr -3 
+          loadc 0 
+          leq 
+          jumpz A 
+          loadc 1 
+          storer -3 
+          return 
+          jump B 
+      A:  loadr -3 
+          loadr -3 
+          loadc 1 
+          sub 
+          mark 
+          loadc 7 
+          call 
+          slide 0 
+          mul 
+          storer -3 
+          return 
+      B:  return 
+          enter 4 
+          loadc 5 
+          mark 
+          loadc 7 
+          call 
+          slide 0 
+          storer -3 
+          return 
+  )";
+  OptimizationReport report = {};
+  auto instructions = CMa::loadInstructions(program, report);
+  ASSERT_FALSE(report.computedCall);
+  ASSERT_LT(report.after, report.before);
+  ASSERT_EQ(CMa(instructions).run(), 120);
+}
+
+TEST(CMaOptimizer, leavesComputedCallsAlone) {
+  std::string_view program = R"(
+          alloc 1 
+          mark 
+          loadc F 
+          loadc 0 
+          add 
+          call 
+          halt 
+          loadc 99 
+      F:  enter 1 
+          loadc 42 
+          storer -3 
+          return 
+  )";
+  OptimizationReport report = {};
+  auto instructions = CMa::loadInstructions(program, report);
+  ASSERT_EQ(report.computedCall, 5);
+  ASSERT_EQ(report.after, report.before);
+  ASSERT_EQ(CMa(instructions).run(), 42);
+}
+
+TEST(CMaHeap, sizeClassesAndStats) {
+  std::vector<int> memory(4096);
+  int newPointer = 4095;
+  auto heap = Heap(memory.data(), 1, 4096);
+
+  int small = heap.allocate(newPointer, 3);
+  int large = heap.allocate(newPointer, 100);
+  ASSERT_EQ(small, 4092);
+  // 101 cells are rounded up to a block of 128.
+  ASSERT_EQ(large, 4092 - 128);
+  ASSERT_EQ(heap.getStats().liveBytes, (4 + 128) * sizeof(int));
+
+  heap.release(newPointer, small);
+  heap.release(newPointer, large);
+  ASSERT_EQ(heap.getStats().liveBlocks, 0);
+  ASSERT_EQ(heap.getStats().fragmentation(), 1.0);
+  // Blocks are reused from the free list of their class.
+  ASSERT_EQ(heap.allocate(newPointer, 120), large);
+  ASSERT_EQ(heap.allocate(newPointer, 3), small);
+  ASSERT_EQ(heap.getStats().freeBytes, 0);
+  ASSERT_EQ(heap.getStats().peakLiveBytes, (4 + 128) * sizeof(int));
+  ASSERT_EQ(heap.allocate(newPointer, 5000), 0);
+}
+
+TEST(CMaHeap, rejectsFreesOfOtherAddresses) {
+  std::vector<int> memory(4096);
+  int newPointer = 4095;
+  auto heap = Heap(memory.data(), 1, 4096);
+  int block = heap.allocate(newPointer, 100);
+
+  // The cell before an interior address looks like the header of a block.
+  memory[block + 9] = 10;
+  EXPECT_EXIT(heap.release(newPointer, block + 10),
+              testing::ExitedWithCode(EXIT_FAILURE), "");
+  heap.release(newPointer, block);
+  memory[block - 1] = 128;
+  EXPECT_EXIT(heap.release(newPointer, block),
+              testing::ExitedWithCode(EXIT_FAILURE), "");
+}
+
+TEST(CMaVerifier, acceptsFunctions) {
+  auto instructions = CMa::loadInstructions(factorialProgram);
+  auto verification = verify(instructions, 1 << 20);
+  ASSERT_TRUE(verification.isVerified());
+  // Calls end blocks, and the dead `jump B` after `return` is a block too.
+  ASSERT_EQ(verification.blocks.size(), 10);
+}
+
+TEST(CMaVerifier, rejectsGrowthBeyondEnter) {
+  auto instructions = CMa::loadInstructions("enter 1 loadc 1 loadc 2 halt");
+  auto verification = verify(instructions, 1 << 20);
+  ASSERT_FALSE(verification.isVerified());
+  ASSERT_EQ(verification.problems.front().position, 2);
+}
+
+TEST(CMaVerifier, rejectsBadAddresses) {
+  auto instructions = CMa::loadInstructions("enter 1 loada 2000000 jump 10");
+  auto verification = verify(instructions, 1 << 20);
+  ASSERT_EQ(verification.problems.size(), 2);
+}
+
+TEST(CMaVerifier, rejectsInconsistentStacks) {
+  auto instructions = CMa::loadInstructions(R"(
+          enter 2
+          loadc 0
+          jumpz A
+          loadc 1
+      A:  halt
+  )");
+  ASSERT_FALSE(verify(instructions, 1 << 20).isVerified());
+}
+
+TEST(CMaVerifier, checkedStopsAtJumpsBeforeTheProgram) {
+  // `jumpi` to -5: unverified, so only the checked engine may run it.
+  std::string_view program = "loadc 7 storea 0 loadc -10 jumpi 5 halt";
+  ASSERT_FALSE(verify(CMa::loadInstructions(program), 1 << 20).isVerified());
+  ASSERT_EQ(runWithExitCode(program, Engine::Checked), 7);
+}
+
+TEST(CMaVerifier, checkedChecksAtomicAddresses) {
+  // Far outside of the memory and its guard pages.
+  EXPECT_EXIT(runWithExitCode("loadc -2000000000 loadc 0 loadc 1 cas halt",
+                              Engine::Checked),
+              testing::ExitedWithCode(EXIT_FAILURE), "");
+  EXPECT_EXIT(runWithExitCode("loadc 2000000000 loadc 1 fetchadd halt",
+                              Engine::Checked),
+              testing::ExitedWithCode(EXIT_FAILURE), "");
+}
+
+TEST(CMaTranslator, entryPoints) {
+  auto instructions = CMa::loadInstructions(factorialProgram);
+  auto entries = findEntryPoints(instructions, false);
+  ASSERT_TRUE(entries.hasComputedJumps);
+  // Return sites and functions can be reached by computed jumps ...
+  for (int i : {5, 23, 33, 7, 28}) {
+    EXPECT_TRUE(entries.isDynamic[i]) << i;
+  }
+  // ... the targets of `jumpz` only statically.
+  ASSERT_TRUE(entries.isLabel[16]);
+  ASSERT_FALSE(entries.isDynamic[16]);
+}
+
+TEST(CMaTranslator, directCalls) {
+  auto instructions = CMa::loadInstructions(factorialProgram);
+  FILE *f = std::tmpfile();
+  dbg_assert_neq(f, nullptr, "could not open file");
+  translateToCpp(f, instructions, "factorial.cvm");
+
+  std::string output(std::ftell(f), '\0');
+  std::rewind(f);
+  std::fread(output.data(), 1, output.size(), f);
+  std::fclose(f);
+
+  // `loadc _main; call` jumps straight to `_main`.
+  ASSERT_NE(output.find("  fp = sp;\n  goto i28;"), std::string::npos);
+  ASSERT_NE(output.find("auto main() -> int"), std::string::npos);
+  // The heap is the interpreter's.
+  ASSERT_NE(output.find("template <typename Word> class BasicHeap"),
+            std::string::npos);
+}
+
+TEST(CMaImage, roundTrip) {
+  auto instructions = CMa::loadInstructions(factorialProgram);
+  auto symbols = CMa::loadSymbols(factorialProgram);
+  FILE *f = std::tmpfile();
+  dbg_assert_neq(f, nullptr, "could not open file");
+  vm::image::writeImage(f, instructions, symbols);
+
+  // Images are read in place, so they need the alignment of a mapping.
+  std::vector<std::uint64_t> buffer((std::ftell(f) + 7) / 8);
+  std::rewind(f);
+  std::fread(buffer.data(), 1, buffer.size() * 8, f);
+  std::fclose(f);
+  auto bytes = std::as_writable_bytes(std::span(buffer));
+  ASSERT_TRUE(vm::image::isImage(bytes));
+
+  vm::image::Image image(bytes);
+  std::span code = image.cmaCode();
+  ASSERT_EQ(code.size(), instructions.size());
+  for (std::size_t i = 0; i < code.size(); ++i) {
+    EXPECT_EQ(code[i].type, instructions[i].type);
+    EXPECT_EQ(code[i].arg, instructions[i].arg);
+  }
+  ASSERT_EQ(image.symbols().size(), symbols.size());
+  // Sorted by address: `_fac` comes before `_main`.
+  ASSERT_EQ(image.symbols().front().name, "_fac");
+  ASSERT_EQ(image.symbols().front().address, 7);
+  ASSERT_EQ(CMa(code).run(), 120);
+
+  // Images of another numbering of the instructions do not decode.
+  auto *header = reinterpret_cast<vm::image::Header *>(bytes.data());
+  header->instructionSetHash += 1;
+  EXPECT_EXIT((void)vm::image::Image(bytes).cmaCode(),
+              testing::ExitedWithCode(EXIT_FAILURE), "");
+
+  // Nor do those with an instruction type the machine does not know.
+  header->instructionSetHash -= 1;
+  code[3].type = static_cast<Instr::Type>(Instr::typeCount);
+  EXPECT_EXIT((void)vm::image::Image(bytes).cmaCode(),
+              testing::ExitedWithCode(EXIT_FAILURE), "");
 }
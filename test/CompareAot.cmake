@@ -0,0 +1,17 @@
+# Runs PROGRAM with CMA and its translation AOT (see `cma_aot_test` in
+# CMakeLists.txt), which must agree on their output and exit code.
+execute_process(COMMAND "${CMA}" "${PROGRAM}"
+    OUTPUT_VARIABLE expectedOutput
+    RESULT_VARIABLE expectedExit)
+execute_process(COMMAND "${AOT}"
+    OUTPUT_VARIABLE actualOutput
+    RESULT_VARIABLE actualExit)
+
+if(NOT actualOutput STREQUAL expectedOutput)
+    message(FATAL_ERROR "${AOT} printed\n${actualOutput}\n"
+                        "but cma printed\n${expectedOutput}")
+endif()
+if(NOT actualExit STREQUAL expectedExit)
+    message(FATAL_ERROR "${AOT} exited with ${actualExit}, "
+                        "but cma with ${expectedExit}")
+endif()
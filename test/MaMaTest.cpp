@@ -2,23 +2,19 @@
 #include <string_view>
 
 #include "lib/Error.hpp"
+#include "lib/Image.hpp"
 #include "lib/MaMachine.hpp"
 
+#include <cstdint>
 #include <cstdio>
+#include <span>
 #include <string>
+#include <vector>
 
 namespace {
 
-auto run(std::string_view text) -> std::string {
-  using vm::mama::MaMa;
-
-  auto instructions = MaMa::loadInstructions(text);
-
-  FILE *f = std::tmpfile();
-  dbg_assert_neq(f, nullptr, "could not open file");
-  auto vm = MaMa(instructions, f);
-  vm.run();
-
+/// Everything written to `f`, which it closes.
+auto contents(FILE *f) -> std::string {
   std::fseek(f, 0, SEEK_END);
   std::size_t size = std::ftell(f);
   std::fseek(f, 0, SEEK_SET);
@@ -34,6 +30,19 @@ auto run(std::string_view text) -> std::string {
   return output;
 }
 
+auto run(std::string_view text) -> std::string {
+  using vm::mama::MaMa;
+
+  auto instructions = MaMa::loadInstructions(text);
+
+  FILE *f = std::tmpfile();
+  dbg_assert_neq(f, nullptr, "could not open file");
+  auto vm = MaMa(instructions, f);
+  vm.run();
+
+  return contents(f);
+}
+
 } // namespace
 
 TEST(MaMa, empty) { ASSERT_EQ(run("halt"), ""); }
@@ -60,3 +69,122 @@ TEST(MaMa, Loop) {
   )";
   ASSERT_EQ(run(prog), "9\n8\n7\n6\n5\n4\n3\n2\n1\n0\n");
 }
+
+TEST(MaMa, ImageRoundTrip) {
+  using vm::mama::MaMa;
+  std::string_view prog = "loadc 1 L: jumpz E loadc 0 jump L E: halt";
+  auto code = MaMa::loadInstructions(prog);
+  FILE *f = std::tmpfile();
+  dbg_assert_neq(f, nullptr, "could not open file");
+  vm::image::writeImage(f, code, MaMa::loadSymbols(prog));
+
+  std::vector<std::uint64_t> buffer((std::ftell(f) + 7) / 8);
+  std::rewind(f);
+  std::fread(buffer.data(), 1, buffer.size() * 8, f);
+  std::fclose(f);
+
+  vm::image::Image image(std::as_writable_bytes(std::span(buffer)));
+  std::span mapped = image.mamaCode();
+  ASSERT_EQ(mapped.size(), code.size());
+  for (std::size_t i = 0; i < code.size(); ++i) {
+    EXPECT_EQ(mapped[i].data, code[i].data);
+  }
+  auto symbols = image.symbols();
+  ASSERT_EQ(symbols.size(), 2);
+  ASSERT_EQ(symbols[0].name, "L");
+  ASSERT_EQ(symbols[0].address, 9);
+  ASSERT_EQ(symbols[1].name, "E");
+}
+
+TEST(MaMa, ResumesFromCheckpoint) {
+  using vm::mama::MaMa;
+  // Counts down with a boxed value below the counter, then unboxes it.
+  std::string_view prog = R"(
+      loadc 7
+      mkbasic
+      loadc 10
+   L: loadc 1
+      sub
+      dup
+      jumpz E
+      jump L
+   E: pushloc 1
+      getbasic
+      dup
+      print
+      halt
+  )";
+  auto instructions = MaMa::loadInstructions(prog);
+  FILE *out = std::tmpfile();
+  dbg_assert_neq(out, nullptr, "could not open file");
+  auto vm = MaMa(instructions, out);
+  ASSERT_TRUE(vm.runFor(20));
+  ASSERT_EQ(vm.getRegisters().stackPointer, 2);
+
+  FILE *f = std::tmpfile();
+  dbg_assert_neq(f, nullptr, "could not open file");
+  vm.checkpoint(f);
+  MaMa::Registers stopped = vm.getRegisters();
+  ASSERT_EQ(vm.run(), 7);
+  ASSERT_FALSE(vm.runFor(1));
+  ASSERT_EQ(contents(out), "7\n");
+
+  // A machine with a copy of the program, so no pointer carries over.
+  auto copied = MaMa::loadInstructions(prog);
+  FILE *copyOut = std::tmpfile();
+  dbg_assert_neq(copyOut, nullptr, "could not open file");
+  auto copy = MaMa(copied, copyOut);
+  std::rewind(f);
+  copy.restore(f);
+  std::fclose(f);
+  ASSERT_EQ(copy.getRegisters().codePointer, stopped.codePointer);
+  ASSERT_EQ(copy.getRegisters().stackPointer, stopped.stackPointer);
+  ASSERT_EQ(copy.run(), 7);
+  ASSERT_EQ(contents(copyOut), "7\n");
+}
+
+TEST(MaMa, SavesLittleEndianFields) {
+  using vm::mama::MaMa;
+  std::string_view prog = R"(
+      loadc 258
+      mkbasic
+      getbasic
+      dup
+      print
+      halt
+  )";
+  auto instructions = MaMa::loadInstructions(prog);
+  FILE *out = std::tmpfile();
+  dbg_assert_neq(out, nullptr, "could not open file");
+  auto vm = MaMa(instructions, out);
+  ASSERT_TRUE(vm.runFor(2));
+  FILE *f = std::tmpfile();
+  dbg_assert_neq(f, nullptr, "could not open file");
+  vm.checkpoint(f);
+  std::size_t codePointer = vm.getRegisters().codePointer;
+  std::string bytes = contents(f);
+
+  // Magic, version 2, the program hash, then the code pointer in 8 bytes.
+  ASSERT_GE(bytes.size(), 24);
+  EXPECT_EQ(bytes.substr(0, 8), std::string("MAMS\2\0\0\0", 8));
+  for (std::size_t i = 0; i < 8; ++i) {
+    EXPECT_EQ(static_cast<unsigned char>(bytes[16 + i]),
+              (codePointer >> (8 * i)) & 0xFF);
+  }
+  // The boxed value, after the tag of a basic value.
+  std::string boxed("\0\0\0\0\0\0\0\0\2\1\0\0\0\0\0\0", 16);
+  EXPECT_NE(bytes.find(boxed), std::string::npos);
+
+  FILE *copied = std::tmpfile();
+  dbg_assert_neq(copied, nullptr, "could not open file");
+  std::fwrite(bytes.data(), 1, bytes.size(), copied);
+  std::rewind(copied);
+  FILE *copyOut = std::tmpfile();
+  dbg_assert_neq(copyOut, nullptr, "could not open file");
+  auto copy = MaMa(instructions, copyOut);
+  copy.restore(copied);
+  std::fclose(copied);
+  ASSERT_EQ(copy.run(), 258);
+  ASSERT_EQ(contents(copyOut), "258\n");
+  std::fclose(out);
+}
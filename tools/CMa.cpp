@@ -1,41 +1,430 @@
+#include "lib/CMaMemory.hpp"
+#include "lib/CMaNatives.hpp"
+#include "lib/CMaOptimizer.hpp"
+#include "lib/CMaVerifier.hpp"
 #include "lib/CMachine.hpp"
 #include "lib/Common.hpp"
+#include "lib/Image.hpp"
 
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <climits>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <print>
+#include <span>
 #include <string>
 #include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <variant>
 #include <vector>
 
 namespace {
 
-void wrongUsage(std::string_view program_name) {
-  std::println(stderr, "{} <FILE> – Run the file’s VM-instructions",
+[[noreturn]] void wrongUsage(std::string_view program_name) {
+  std::println(stderr,
+               "{} [--engine=switch|threaded|checked|safe|jit|compact|tiered] "
+               "[-O] [--verify] "
+               "[--assemble=IMAGE] [--stack=CELLS] [--heap=CELLS] "
+               "[--heap-stats] [--bounds-check] [--trace] [--count] "
+               "[--word=32|64] [--record=LOG] [--checkpoint=FILE] "
+               "[--checkpoint-every=SECONDS] [--resume=FILE] "
+               "[--break=LABEL]... [--data=DATA@ADDRESS]... "
+               "[--data-cow=DATA@ADDRESS]... <FILE> – "
+               "Run the file’s VM-instructions (program text or image)",
                program_name);
   std::exit(EXIT_FAILURE);
 }
 
-auto run(std::string_view filename) -> int {
-  using vm::cma::CMa;
-  using vm::common::readFile;
+/// A file of cells to map into the memory (see `vm::cma::BasicCMa::mapData`).
+struct DataFile {
+  std::string_view path;
+  int address;
+  bool isWritable;
+};
+
+struct Options {
+  std::string_view filename;
+  vm::cma::Engine engine = vm::cma::Engine::Switch;
+  bool verifyOnly = false;
+  bool optimize = false;
+  std::string_view imageFile = {};
+  vm::cma::MemoryLayout layout = {};
+  bool heapStats = false;
+  // Select the configuration of the machine (see `vm::cma::CMaPolicy`).
+  bool boundsCheck = false;
+  bool trace = false;
+  bool count = false;
+  bool wideWords = false;
+  /// Where to save the memory accesses, for `cma-locality`.
+  std::string_view recordFile = {};
+  /// Where to save the state of the machine while it runs, and how often.
+  std::string_view checkpointFile = {};
+  std::size_t checkpointSeconds = 600;
+  /// A checkpoint to continue from.
+  std::string_view resumeFile = {};
+  /// Labels to stop at, printing the state of the machine.
+  std::vector<std::string_view> breakpoints = {};
+  std::vector<DataFile> data = {};
+};
+
+auto parseSize(std::string_view program_name, std::string_view text)
+    -> std::size_t {
+  std::size_t value = 0;
+  auto [end, error] = std::from_chars(text.begin(), text.end(), value);
+  if (text.empty() || error != std::errc{} || end != text.end()) {
+    wrongUsage(program_name);
+  }
+  return value;
+}
+
+auto parseDataFile(std::string_view program_name, std::string_view text,
+                   bool isWritable) -> DataFile {
+  std::size_t at = text.rfind('@');
+  if (at == std::string_view::npos || at == 0) {
+    wrongUsage(program_name);
+  }
+  std::size_t address = parseSize(program_name, text.substr(at + 1));
+  if (address > static_cast<std::size_t>(INT_MAX)) {
+    wrongUsage(program_name);
+  }
+  return {.path = text.substr(0, at),
+          .address = static_cast<int>(address),
+          .isWritable = isWritable};
+}
+
+auto parseOptions(int argc, char const *argv[]) -> Options {
+  using vm::cma::Engine;
+  Options options = {};
+  bool hasFile = false;
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    if (arg == "--engine=switch") {
+      options.engine = Engine::Switch;
+    } else if (arg == "--engine=threaded") {
+      options.engine = Engine::Threaded;
+    } else if (arg == "--engine=checked") {
+      options.engine = Engine::Checked;
+    } else if (arg == "--engine=safe") {
+      options.engine = Engine::Safe;
+    } else if (arg == "--engine=jit") {
+      options.engine = Engine::Jit;
+    } else if (arg == "--engine=compact") {
+      options.engine = Engine::Compact;
+    } else if (arg == "--engine=tiered") {
+      options.engine = Engine::Tiered;
+    } else if (arg == "-O") {
+      options.optimize = true;
+    } else if (arg == "--verify") {
+      options.verifyOnly = true;
+    } else if (arg.starts_with("--assemble=")) {
+      options.imageFile = arg.substr(11);
+    } else if (arg.starts_with("--stack=")) {
+      options.layout.stackCells = parseSize(argv[0], arg.substr(8));
+    } else if (arg.starts_with("--heap=")) {
+      options.layout.heapCells = parseSize(argv[0], arg.substr(7));
+    } else if (arg == "--heap-stats") {
+      options.heapStats = true;
+    } else if (arg == "--bounds-check") {
+      options.boundsCheck = true;
+    } else if (arg == "--trace") {
+      options.trace = true;
+    } else if (arg == "--count") {
+      options.count = true;
+    } else if (arg == "--word=32") {
+      options.wideWords = false;
+    } else if (arg == "--word=64") {
+      options.wideWords = true;
+    } else if (arg.starts_with("--record=")) {
+      options.recordFile = arg.substr(9);
+    } else if (arg.starts_with("--checkpoint=")) {
+      options.checkpointFile = arg.substr(13);
+    } else if (arg.starts_with("--checkpoint-every=")) {
+      options.checkpointSeconds = parseSize(argv[0], arg.substr(19));
+    } else if (arg.starts_with("--resume=")) {
+      options.resumeFile = arg.substr(9);
+    } else if (arg.starts_with("--break=")) {
+      options.breakpoints.push_back(arg.substr(8));
+    } else if (arg.starts_with("--data=")) {
+      options.data.push_back(parseDataFile(argv[0], arg.substr(7), false));
+    } else if (arg.starts_with("--data-cow=")) {
+      options.data.push_back(parseDataFile(argv[0], arg.substr(11), true));
+    } else if (!arg.starts_with("--") && !hasFile) {
+      options.filename = arg;
+      hasFile = true;
+    } else {
+      wrongUsage(argv[0]);
+    }
+  }
+  // Checkpoints are taken between the steps of the interpreter, of a
+  // machine without breakpoints or mapped files.
+  bool isCheckpointed =
+      !options.checkpointFile.empty() || !options.resumeFile.empty();
+  bool isRestorable =
+      !isCheckpointed || (options.breakpoints.empty() && options.data.empty());
+  bool isDefaultPolicy = !options.boundsCheck && !options.trace &&
+                         !options.count && !options.wideWords &&
+                         options.recordFile.empty() && !isCheckpointed;
+  // Breakpoints stop the interpreter only.
+  bool isInterpreted = isDefaultPolicy && options.breakpoints.empty();
+  // Recording has no checked, traced or profiled instantiations.
+  bool isRecordedAlone = options.recordFile.empty() ||
+                         (!options.boundsCheck && !options.trace &&
+                          !options.count);
+  if (!hasFile || (!isInterpreted && options.engine != Engine::Switch) ||
+      !isRecordedAlone || !isRestorable) {
+    wrongUsage(argv[0]);
+  }
+  return options;
+}
+
+auto assemble(std::string_view imageFile,
+              std::span<const vm::cma::Instr> instructions,
+              const std::vector<vm::common::Symbol> &symbols) -> int {
+  FILE *out = std::fopen(std::string(imageFile).c_str(), "wb");
+  if (out == nullptr) {
+    std::println(stderr, "Cannot open file: {}", imageFile);
+    return EXIT_FAILURE;
+  }
+  // Stored as `run` would rewrite them, so that images run as they are.
+  std::vector<vm::cma::Instr> code(instructions.begin(), instructions.end());
+  vm::cma::CMa::fuseSuperinstructions(code);
+  vm::cma::CMa::quicken(code);
+  vm::image::writeImage(out, code, symbols);
+  std::fclose(out);
+  return EXIT_SUCCESS;
+}
+
+/// Set when the process is asked to terminate, to stop at a checkpoint.
+volatile std::sig_atomic_t isTerminating = 0;
+
+void requestCheckpoint(int /*signal*/) { isTerminating = 1; }
+
+/// Saves a checkpoint of `machine`, replacing `path` only once it is
+/// complete.
+template <typename Machine>
+auto saveCheckpoint(Machine &machine, std::string_view path) -> bool {
+  // What the program printed so far is not part of the checkpoint.
+  std::fflush(machine.getOutFile());
+  std::string partial = std::string(path) + ".partial";
+  FILE *out = std::fopen(partial.c_str(), "wb");
+  if (out == nullptr) {
+    std::println(stderr, "Cannot open file: {}", partial);
+    return false;
+  }
+  machine.checkpoint(out);
+  bool isSaved = std::fclose(out) == 0 &&
+                 std::rename(partial.c_str(), std::string(path).c_str()) == 0;
+  if (!isSaved) {
+    std::println(stderr, "Cannot write checkpoint: {}", path);
+  }
+  return isSaved;
+}
 
-  const std::string text = readFile(filename);
+/// Runs the program, saving a checkpoint every `checkpointSeconds` and once
+/// more when the process gets SIGTERM, after which it stops. The checkpoint
+/// is removed when the program ends.
+template <typename Machine>
+auto runWithCheckpoints(Machine &machine, const Options &options) -> int {
+  using Clock = std::chrono::steady_clock;
+  constexpr std::int64_t stepsPerSlice = std::int64_t{1} << 20;
+  std::signal(SIGTERM, requestCheckpoint);
+  auto interval = std::chrono::seconds(
+      static_cast<std::int64_t>(options.checkpointSeconds));
+  auto next = Clock::now() + interval;
+  while (machine.runFor(stepsPerSlice)) {
+    if (isTerminating == 0 && Clock::now() < next) {
+      continue;
+    }
+    if (!saveCheckpoint(machine, options.checkpointFile)) {
+      return EXIT_FAILURE;
+    }
+    if (isTerminating != 0) {
+      std::println(stderr, "Stopped at checkpoint {}", options.checkpointFile);
+      return EXIT_FAILURE;
+    }
+    next = Clock::now() + interval;
+  }
+  std::remove(std::string(options.checkpointFile).c_str());
+  return static_cast<int>(machine.getMemory()[0]);
+}
 
-  std::vector instructions = CMa::loadInstructions(text);
-  auto machine = CMa(instructions, stdout);
-  int exit = machine.run();
+template <typename Policy>
+auto runMachine(
+    std::span<typename vm::cma::BasicCMa<Policy>::Instruction> instructions,
+    const Options &options, std::span<const int> breakpoints) -> int {
+  auto machine = vm::cma::BasicCMa<Policy>(instructions, stdout,
+                                           options.engine, options.layout);
+  for (DataFile data : options.data) {
+    machine.mapData(data.path, data.address, data.isWritable);
+  }
+  for (auto &native : vm::cma::standardNatives<typename Policy::Word>()) {
+    machine.registerNative(std::move(native));
+  }
+  if (!options.resumeFile.empty()) {
+    FILE *in = std::fopen(std::string(options.resumeFile).c_str(), "rb");
+    if (in == nullptr) {
+      std::println(stderr, "Cannot open file: {}", options.resumeFile);
+      return EXIT_FAILURE;
+    }
+    machine.restore(in);
+    std::fclose(in);
+  }
+  int exit = 0;
+  if (!options.checkpointFile.empty()) {
+    exit = runWithCheckpoints(machine, options);
+  } else if (breakpoints.empty()) {
+    exit = machine.run();
+  } else {
+    for (int address : breakpoints) {
+      machine.setBreakpoint(address);
+    }
+    while (machine.resume()) {
+      machine.debug();
+    }
+    exit = static_cast<int>(machine.getMemory()[0]);
+  }
+  std::fflush(stdout);
+  if constexpr (Policy::profiled) {
+    machine.getProfile().print(stderr);
+  }
+  if (options.heapStats) {
+    machine.getHeapStats().print(stderr);
+  }
+  if constexpr (Policy::recorded) {
+    FILE *log = std::fopen(std::string(options.recordFile).c_str(), "wb");
+    if (log == nullptr) {
+      std::println(stderr, "Cannot open file: {}", options.recordFile);
+      return EXIT_FAILURE;
+    }
+    machine.getAccessLog().save(log);
+    std::fclose(log);
+  }
   return exit;
 }
 
+/// Runs the instantiation of `BasicCMa` with cells of type `Word` that the
+/// options ask for.
+template <typename Word>
+auto runSelected(std::span<vm::cma::InstrFor<Word>> instructions,
+                 const Options &options, std::span<const int> breakpoints)
+    -> int {
+  if (!options.recordFile.empty()) {
+    using Policy = vm::cma::CMaPolicy<false, false, false, Word, true>;
+    return runMachine<Policy>(instructions, options, breakpoints);
+  }
+  using Flag = std::variant<std::false_type, std::true_type>;
+  auto flag = [](bool value) -> Flag {
+    return value ? Flag{std::true_type{}} : Flag{std::false_type{}};
+  };
+  return std::visit(
+      [&](auto checked, auto traced, auto profiled) {
+        using Policy = vm::cma::CMaPolicy<checked, traced, profiled, Word>;
+        return runMachine<Policy>(instructions, options, breakpoints);
+      },
+      flag(options.boundsCheck), flag(options.trace), flag(options.count));
+}
+
+auto run(const Options &options) -> int {
+  using vm::cma::CMa;
+  using vm::cma::Instr;
+  using vm::image::Image;
+
+  // Images are executed in place, text is parsed.
+  const vm::image::MappedFile file(options.filename);
+  bool isImage = vm::image::isImage(file.bytes());
+  // With 64-bit cells, `loadc` constants may not fit into an `Instr`, so the
+  // text is parsed for the machine (below) unless it is needed before.
+  bool isParsedWide = options.wideWords && !isImage && !options.optimize &&
+                      options.imageFile.empty() && !options.verifyOnly;
+  std::vector<Instr> parsed = {};
+  std::span<Instr> instructions = {};
+  vm::cma::OptimizationReport report = {};
+  if (isImage) {
+    // Images no longer know which constants are code addresses.
+    if (options.optimize) {
+      std::println(stderr, "-O needs program text, not an image");
+      return EXIT_FAILURE;
+    }
+    instructions = Image(file.bytes()).cmaCode();
+  } else if (options.optimize) {
+    parsed = CMa::loadInstructions(file.text(), report);
+    instructions = parsed;
+    report.print(stderr);
+  } else if (!isParsedWide) {
+    parsed = CMa::loadInstructions(file.text());
+    instructions = parsed;
+  }
+
+  auto symbols = [&] {
+    auto symbols = isImage ? Image(file.bytes()).symbols()
+                           : CMa::loadSymbols(file.text());
+    if (options.optimize) {
+      for (vm::common::Symbol &symbol : symbols) {
+        symbol.address = report.addressMap[symbol.address];
+      }
+    }
+    return symbols;
+  };
+  if (!options.imageFile.empty()) {
+    return assemble(options.imageFile, instructions, symbols());
+  }
+  if (options.verifyOnly) {
+    std::vector<vm::cma::StackEffect> natives = {};
+    for (const auto &native : vm::cma::standardNatives<int>()) {
+      natives.push_back(native.effect);
+    }
+    auto verification =
+        vm::cma::verify(instructions, options.layout.size(), natives);
+    verification.report();
+    return verification.isVerified() ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  std::vector<int> breakpoints = {};
+  if (!options.breakpoints.empty()) {
+    auto known = symbols();
+    for (std::string_view label : options.breakpoints) {
+      auto symbol = std::ranges::find(known, label, &vm::common::Symbol::name);
+      if (symbol == known.end()) {
+        std::println(stderr, "Unknown label: {}", label);
+        return EXIT_FAILURE;
+      }
+      breakpoints.push_back(static_cast<int>(symbol->address));
+    }
+  }
+  if (options.wideWords) {
+    std::vector<vm::cma::WideInstr<std::int64_t>> wide = {};
+    if (isParsedWide) {
+      wide = CMa::loadInstructions<std::int64_t>(file.text());
+    } else {
+      for (Instr instruction : instructions) {
+        wide.push_back({instruction.type, instruction.arg});
+      }
+    }
+    CMa::quicken(wide);
+    return runSelected<std::int64_t>(wide, options, breakpoints);
+  }
+  // Images are stored fused and quickened (see `assemble`); rewriting them
+  // would copy every page of the mapping.
+  if (!isImage) {
+    if (options.engine != vm::cma::Engine::Switch) {
+      CMa::fuseSuperinstructions(instructions);
+    }
+    CMa::quicken(instructions);
+  }
+  return runSelected<int>(instructions, options, breakpoints);
+}
+
 } // namespace
 
 auto main(int argc, char const *argv[]) -> int {
   try {
-    if (argc != 2) {
-      wrongUsage(argv[0]);
-    }
-    std::string_view filename = argv[1];
-    return run(filename);
+    return run(parseOptions(argc, argv));
   } catch (...) {
     return EXIT_FAILURE;
   }
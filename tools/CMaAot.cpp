@@ -0,0 +1,82 @@
+#include "lib/CMaTranslator.hpp"
+#include "lib/CMachine.hpp"
+#include "lib/Common.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <print>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+
+[[noreturn]] void wrongUsage(std::string_view program_name) {
+  std::println(stderr,
+               "{} [--all-entries] [-o FILE] <FILE> – Translate the file’s "
+               "VM-instructions to C++",
+               program_name);
+  std::exit(EXIT_FAILURE);
+}
+
+struct Options {
+  std::string_view filename;
+  std::string_view output = {};
+  bool allEntries = false;
+};
+
+auto parseOptions(int argc, char const *argv[]) -> Options {
+  Options options = {};
+  bool hasFile = false;
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    if (arg == "--all-entries") {
+      options.allEntries = true;
+    } else if (arg == "-o" && i + 1 < argc) {
+      options.output = argv[++i];
+    } else if (!arg.starts_with("-") && !hasFile) {
+      options.filename = arg;
+      hasFile = true;
+    } else {
+      wrongUsage(argv[0]);
+    }
+  }
+  if (!hasFile) {
+    wrongUsage(argv[0]);
+  }
+  return options;
+}
+
+auto run(const Options &options) -> int {
+  using vm::cma::CMa;
+  using vm::common::readFile;
+
+  const std::string text = readFile(options.filename);
+  std::vector instructions = CMa::loadInstructions(text);
+
+  FILE *out = stdout;
+  if (!options.output.empty()) {
+    out = std::fopen(std::string(options.output).c_str(), "w");
+    if (out == nullptr) {
+      std::println(stderr, "Cannot open file: {}", options.output);
+      return EXIT_FAILURE;
+    }
+  }
+  std::string_view source =
+      options.filename.substr(options.filename.rfind('/') + 1);
+  vm::cma::translateToCpp(out, instructions, source, options.allEntries);
+  if (out != stdout) {
+    std::fclose(out);
+  }
+  return EXIT_SUCCESS;
+}
+
+} // namespace
+
+auto main(int argc, char const *argv[]) -> int {
+  try {
+    return run(parseOptions(argc, argv));
+  } catch (...) {
+    return EXIT_FAILURE;
+  }
+}
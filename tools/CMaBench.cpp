@@ -0,0 +1,167 @@
+#include "lib/CMachine.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <format>
+#include <print>
+#include <string>
+#include <string_view>
+
+// Compares the 32-bit and the 64-bit cells of the CMa on working sets that
+// fit into the L1 cache up to ones that only fit into memory.
+//
+// The benchmark program fills an array of cells and then sums it up a few
+// times, once visiting every cell and once only every 16th. With 4-byte cells
+// the sequential sweep reads 16 cells per cache line instead of 8, and the
+// strided one touches one line per access instead of two. The instructions of
+// the 64-bit machine are twice as large as well, which only shows in the
+// instruction cache. Both run on the reference interpreter, the only engine
+// that supports 64-bit cells.
+
+namespace {
+
+using vm::cma::BasicCMa;
+using vm::cma::CMa;
+using vm::cma::CMaPolicy;
+
+using NarrowCMa = BasicCMa<CMaPolicy<>>;
+using WideCMa = BasicCMa<CMaPolicy<false, false, false, std::int64_t>>;
+
+[[noreturn]] void wrongUsage(std::string_view program_name) {
+  std::println(stderr,
+               "{} [--accesses=N] [--max-cells=N] – Compare the 32-bit and "
+               "the 64-bit cells of the CMa on growing working sets",
+               program_name);
+  std::exit(EXIT_FAILURE);
+}
+
+struct Options {
+  /// How many cells each measurement reads at least.
+  std::int64_t accesses = std::int64_t{1} << 24;
+  /// The largest working set, in cells.
+  std::int64_t maxCells = std::int64_t{1} << 23;
+};
+
+auto parseNumber(std::string_view program_name, std::string_view text)
+    -> std::int64_t {
+  char *end = nullptr;
+  std::string copy(text);
+  std::int64_t value = std::strtoll(copy.c_str(), &end, 10);
+  if (copy.empty() || *end != '\0' || value <= 0) {
+    wrongUsage(program_name);
+  }
+  return value;
+}
+
+auto parseOptions(int argc, char const *argv[]) -> Options {
+  Options options = {};
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    if (arg.starts_with("--accesses=")) {
+      options.accesses = parseNumber(argv[0], arg.substr(11));
+    } else if (arg.starts_with("--max-cells=")) {
+      options.maxCells = parseNumber(argv[0], arg.substr(12));
+    } else {
+      wrongUsage(argv[0]);
+    }
+  }
+  return options;
+}
+
+/**
+ * @brief A program that fills `cells` cells and then sums every `stride`th of
+ * them `passes` times.
+ * @details The array starts at address 0, the sum and the remaining passes
+ * live right behind it. The index is kept on the stack.
+ */
+auto sweepProgram(std::int64_t cells, std::int64_t stride,
+                  std::int64_t passes) -> std::string {
+  std::int64_t sum = cells;
+  std::int64_t passesLeft = cells + 1;
+  return std::format(R"(
+    alloc {5}
+    loadc {3}
+    storea {2}
+    pop
+    loadc 0
+  fill:
+    dup
+    loadc {0}
+    le
+    jumpz pass
+    dup
+    dup
+    store
+    pop
+    loadc 1
+    add
+    jump fill
+  pass:
+    pop
+    loada {2}
+    jumpz done
+    loada {2}
+    loadc 1
+    sub
+    storea {2}
+    pop
+    loadc 0
+  sweep:
+    dup
+    loadc {0}
+    le
+    jumpz pass
+    dup
+    load
+    loada {1}
+    add
+    storea {1}
+    pop
+    loadc {4}
+    add
+    jump sweep
+  done:
+    halt
+  )",
+                     cells, sum, passesLeft, passes, stride, cells + 2);
+}
+
+/// Nanoseconds per read cell of the `sweepProgram` with these arguments.
+template <typename Machine>
+auto measure(std::int64_t cells, std::int64_t stride, std::int64_t passes)
+    -> double {
+  using Word = typename Machine::Word;
+  auto instructions =
+      CMa::loadInstructions<Word>(sweepProgram(cells, stride, passes));
+  Machine machine(instructions, stdout);
+  auto start = std::chrono::steady_clock::now();
+  machine.run();
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  std::int64_t reads = passes * ((cells + stride - 1) / stride);
+  return std::chrono::duration<double, std::nano>(elapsed).count() /
+         static_cast<double>(reads);
+}
+
+} // namespace
+
+auto main(int argc, char const *argv[]) -> int {
+  Options options = parseOptions(argc, argv);
+
+  std::println("{:>12} {:>7} {:>14} {:>14} {:>14} {:>14}", "cells",
+               "stride", "32-bit KiB", "32-bit ns", "64-bit KiB",
+               "64-bit ns");
+  for (std::int64_t cells = 4096; cells <= options.maxCells; cells *= 4) {
+    for (std::int64_t stride : {1, 16}) {
+      std::int64_t reads = (cells + stride - 1) / stride;
+      std::int64_t passes = std::max<std::int64_t>(4, options.accesses / reads);
+      double narrow = measure<NarrowCMa>(cells, stride, passes);
+      double wide = measure<WideCMa>(cells, stride, passes);
+      std::println("{:>12} {:>7} {:>14} {:>14.2f} {:>14} {:>14.2f}", cells,
+                   stride, cells * 4 / 1024, narrow, cells * 8 / 1024, wide);
+    }
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,102 @@
+#include "lib/CMaLocality.hpp"
+#include "lib/CMachine.hpp"
+#include "lib/Common.hpp"
+#include "lib/Image.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <print>
+#include <string_view>
+#include <vector>
+
+// Analyzes the memory accesses that `cma --record=LOG` saved: how far apart
+// the uses of a cache line are, how often a simulated L1 (32 KiB, 8 ways)
+// and L2 (1 MiB, 16 ways) cache would miss, for the stack, the globals and
+// the heap, and which pages of cells each function accessed the most.
+// Functions are the labels of the program that start with `enter`.
+
+namespace {
+
+[[noreturn]] void wrongUsage(std::string_view program_name) {
+  std::println(stderr,
+               "{} [--hot=N] <LOG> <FILE> – Analyze the memory accesses "
+               "that `cma --record=LOG FILE` recorded",
+               program_name);
+  std::exit(EXIT_FAILURE);
+}
+
+struct Options {
+  std::string_view log = {};
+  std::string_view program = {};
+  std::size_t hotRanges = 3;
+};
+
+auto parseOptions(int argc, char const *argv[]) -> Options {
+  Options options = {};
+  std::vector<std::string_view> files = {};
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    if (arg.starts_with("--hot=")) {
+      char *end = nullptr;
+      std::string_view number = arg.substr(6);
+      options.hotRanges = std::strtoull(number.data(), &end, 10);
+      if (number.empty() || *end != '\0') {
+        wrongUsage(argv[0]);
+      }
+    } else if (!arg.starts_with("-")) {
+      files.push_back(arg);
+    } else {
+      wrongUsage(argv[0]);
+    }
+  }
+  if (files.size() != 2) {
+    wrongUsage(argv[0]);
+  }
+  options.log = files[0];
+  options.program = files[1];
+  return options;
+}
+
+/// The labels of the program (text or image) in `file` that name an
+/// `enter`, by address.
+auto functionsOf(const vm::image::MappedFile &file)
+    -> std::vector<vm::common::Symbol> {
+  using vm::cma::CMa;
+  using vm::cma::Instr;
+  bool isImage = vm::image::isImage(file.bytes());
+  std::vector<vm::common::Symbol> symbols = {};
+  std::vector<Instr::Type> types = {};
+  if (isImage) {
+    vm::image::Image image(file.bytes());
+    symbols = image.symbols();
+    for (Instr instruction : image.cmaCode()) {
+      types.push_back(Instr::baseType(instruction.type));
+    }
+  } else {
+    symbols = CMa::loadSymbols(file.text());
+    for (auto instruction : CMa::loadInstructions<std::int64_t>(file.text())) {
+      types.push_back(Instr::baseType(instruction.type));
+    }
+  }
+  std::erase_if(symbols, [&](const vm::common::Symbol &symbol) {
+    return symbol.address >= types.size() ||
+           types[symbol.address] != Instr::Enter;
+  });
+  std::ranges::sort(symbols, {}, &vm::common::Symbol::address);
+  return symbols;
+}
+
+} // namespace
+
+auto main(int argc, char const *argv[]) -> int {
+  Options options = parseOptions(argc, argv);
+  auto log = vm::cma::AccessLog::load(options.log);
+  const vm::image::MappedFile program(options.program);
+  auto functions = functionsOf(program);
+  vm::cma::analyzeLocality(log, functions, {.bytes = 32 << 10, .ways = 8},
+                           {.bytes = 1 << 20, .ways = 16}, options.hotRanges)
+      .print(stdout);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,249 @@
+#include "lib/CMachine.hpp"
+#include "lib/Common.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <print>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Derives the superinstructions of the CMa from a training corpus.
+//
+// Every program is run on the reference interpreter to count how often each
+// instruction is executed. Each statically adjacent bi- and trigram is then
+// weighted with the number of times it ran start to end, which is bounded by
+// the least executed of its instructions. A superinstruction of n parts saves
+// n - 1 dispatches per execution.
+//
+// `CMa::fuseSuperinstructions` rewrites each slot with the first listed
+// superinstruction that matches there, so the list is built greedily: the
+// next entry is the n-gram that saves the most dispatches in the slots that
+// no earlier entry claimed yet. The result is written out as
+// lib/CMaSuperinstructions.inc.
+
+namespace {
+
+using vm::cma::CMa;
+using vm::cma::Instr;
+
+using Ngram = std::vector<Instr::Type>;
+
+/// The n-grams starting in one instruction slot, with their executions.
+using Site = std::vector<std::pair<Ngram, std::int64_t>>;
+
+[[noreturn]] void wrongUsage(std::string_view program_name) {
+  std::println(stderr,
+               "{} [--top=N] [--steps=N] [-o FILE] <FILE>... – Derive "
+               "superinstructions from the programs' n-gram counts",
+               program_name);
+  std::exit(EXIT_FAILURE);
+}
+
+struct Options {
+  std::vector<std::string_view> corpus = {};
+  std::size_t top = 8;
+  std::int64_t steps = 10'000'000;
+  std::string_view output = {};
+};
+
+auto parseNumber(std::string_view program_name, std::string_view text)
+    -> std::int64_t {
+  char *end = nullptr;
+  std::string copy(text);
+  std::int64_t value = std::strtoll(copy.c_str(), &end, 10);
+  if (copy.empty() || *end != '\0' || value < 0) {
+    wrongUsage(program_name);
+  }
+  return value;
+}
+
+auto parseOptions(int argc, char const *argv[]) -> Options {
+  Options options = {};
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    if (arg.starts_with("--top=")) {
+      options.top = parseNumber(argv[0], arg.substr(6));
+    } else if (arg.starts_with("--steps=")) {
+      options.steps = parseNumber(argv[0], arg.substr(8));
+    } else if (arg == "-o" && i + 1 < argc) {
+      options.output = argv[++i];
+    } else if (!arg.starts_with("-")) {
+      options.corpus.push_back(arg);
+    } else {
+      wrongUsage(argv[0]);
+    }
+  }
+  if (options.corpus.empty()) {
+    wrongUsage(argv[0]);
+  }
+  return options;
+}
+
+auto transfersControl(Instr::Type t) -> bool {
+  return t == Instr::Jump || t == Instr::Jumpz || t == Instr::Jumpi ||
+         t == Instr::Call || t == Instr::Return || t == Instr::TailCall;
+}
+
+/// Instructions that need a handler of their own in the threaded engine.
+auto isFusable(Instr::Type t) -> bool {
+  return t != Instr::Halt && t != Instr::Debug;
+}
+
+/**
+ * @brief Runs the program and counts how often each instruction executes.
+ * @details Programs that do not terminate are cut off after `steps`.
+ */
+auto executionCounts(std::span<Instr> instructions, std::int64_t steps,
+                     FILE *sink) -> std::vector<std::int64_t> {
+  std::vector<std::int64_t> counts(instructions.size());
+  auto machine = CMa(instructions, sink);
+  for (std::int64_t i = 0; i < steps; ++i) {
+    auto pc = static_cast<std::size_t>(machine.getRegisters().programCounter);
+    if (pc >= instructions.size()) {
+      break;
+    }
+    counts[pc] += 1;
+    machine.step();
+  }
+  return counts;
+}
+
+void collectSites(std::span<const Instr> instructions,
+                  std::span<const std::int64_t> counts,
+                  std::vector<Site> &sites) {
+  constexpr std::size_t maxLength = 3;
+  for (std::size_t start = 0; start < instructions.size(); ++start) {
+    Site site = {};
+    Ngram ngram = {};
+    std::int64_t executed = counts[start];
+    for (std::size_t i = start;
+         i < instructions.size() && ngram.size() < maxLength; ++i) {
+      Instr::Type t = instructions[i].type;
+      if (!isFusable(t)) {
+        break;
+      }
+      ngram.push_back(t);
+      executed = std::min(executed, counts[i]);
+      if (ngram.size() >= 2 && executed > 0) {
+        site.emplace_back(ngram, executed);
+      }
+      if (transfersControl(t)) {
+        break;
+      }
+    }
+    if (!site.empty()) {
+      sites.push_back(std::move(site));
+    }
+  }
+}
+
+/// Greedily picks the n-grams with the highest marginal savings.
+auto selectSuperinstructions(std::vector<Site> sites, std::size_t top)
+    -> std::vector<std::pair<std::int64_t, Ngram>> {
+  std::vector<std::pair<std::int64_t, Ngram>> selected = {};
+  while (selected.size() < top) {
+    std::map<Ngram, std::int64_t> savings = {};
+    for (const Site &site : sites) {
+      for (const auto &[ngram, executed] : site) {
+        savings[ngram] +=
+            executed * static_cast<std::int64_t>(ngram.size() - 1);
+      }
+    }
+    auto best = std::ranges::max_element(
+        savings, {}, [](const auto &entry) { return entry.second; });
+    if (best == savings.end()) {
+      break;
+    }
+    selected.emplace_back(best->second, best->first);
+    // Slots where the new entry matches are taken.
+    std::erase_if(sites, [&](const Site &site) {
+      return std::ranges::any_of(
+          site, [&](const auto &entry) { return entry.first == best->first; });
+    });
+  }
+  return selected;
+}
+
+auto nameOf(const Ngram &ngram) -> std::string {
+  std::string name = {};
+  for (Instr::Type t : ngram) {
+    std::string part(Instr::toString(t));
+    part.front() = static_cast<char>(std::toupper(part.front()));
+    name += part;
+  }
+  return name;
+}
+
+auto partsOf(const Ngram &ngram) -> std::string {
+  std::string parts = {};
+  for (Instr::Type t : ngram) {
+    parts += ", ";
+    parts += nameOf({t});
+  }
+  return parts;
+}
+
+void writeSuperinstructions(
+    FILE *out, const Options &options,
+    const std::vector<std::pair<std::int64_t, Ngram>> &selected) {
+  std::println(out, "// Superinstructions of the CMa as an X-macro list:");
+  std::println(out, "//   CMA_SUPERINSTRUCTION(Name, Part, Part, ...)");
+  std::println(out, "// Generated by `cma-profile`; regenerate with `make "
+                    "superinstructions`.");
+  std::println(out, "// In order of dispatches saved on the training corpus:");
+  for (std::string_view program : options.corpus) {
+    std::println(out, "//   {}", program.substr(program.rfind('/') + 1));
+  }
+  std::println(out);
+  for (const auto &[saved, ngram] : selected) {
+    std::println(out, "CMA_SUPERINSTRUCTION({}{}) // {}", nameOf(ngram),
+                 partsOf(ngram), saved);
+  }
+}
+
+auto run(const Options &options) -> int {
+  using vm::common::readFile;
+
+  FILE *sink = std::fopen("/dev/null", "w");
+  std::vector<Site> sites = {};
+  for (std::string_view filename : options.corpus) {
+    const std::string text = readFile(filename);
+    std::vector instructions = CMa::loadInstructions(text);
+    std::vector counts = executionCounts(instructions, options.steps, sink);
+    collectSites(instructions, counts, sites);
+  }
+  std::fclose(sink);
+
+  FILE *out = stdout;
+  if (!options.output.empty()) {
+    out = std::fopen(std::string(options.output).c_str(), "w");
+    if (out == nullptr) {
+      std::println(stderr, "Cannot open file: {}", options.output);
+      return EXIT_FAILURE;
+    }
+  }
+  writeSuperinstructions(out, options,
+                         selectSuperinstructions(sites, options.top));
+  if (out != stdout) {
+    std::fclose(out);
+  }
+  return EXIT_SUCCESS;
+}
+
+} // namespace
+
+auto main(int argc, char const *argv[]) -> int {
+  try {
+    return run(parseOptions(argc, argv));
+  } catch (...) {
+    return EXIT_FAILURE;
+  }
+}
@@ -1,29 +1,179 @@
 #include "lib/Common.hpp"
+#include "lib/Image.hpp"
 #include "lib/MaMachine.hpp"
 
+#include <charconv>
+#include <chrono>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <print>
+#include <span>
 #include <string>
 #include <string_view>
+#include <system_error>
 #include <vector>
 
 namespace {
 
-void wrongUsage(std::string_view program_name) {
-  std::println(stderr, "{} <FILE> – Run the file’s VM-instructions",
+[[noreturn]] void wrongUsage(std::string_view program_name) {
+  std::println(stderr,
+               "{} [--assemble=IMAGE] [--checkpoint=FILE] "
+               "[--checkpoint-every=SECONDS] [--resume=FILE] <FILE> – "
+               "Run the file’s VM-instructions (program text or image)",
                program_name);
   std::exit(EXIT_FAILURE);
 }
 
-auto run(std::string_view filename) -> int {
-  using vm::common::readFile;
+struct Options {
+  std::string_view filename;
+  std::string_view imageFile = {};
+  /// Where to save the state of the machine while it runs, and how often.
+  std::string_view checkpointFile = {};
+  std::size_t checkpointSeconds = 600;
+  /// A checkpoint to continue from.
+  std::string_view resumeFile = {};
+};
+
+auto parseSize(std::string_view program_name, std::string_view text)
+    -> std::size_t {
+  std::size_t value = 0;
+  auto [end, error] = std::from_chars(text.begin(), text.end(), value);
+  if (text.empty() || error != std::errc{} || end != text.end()) {
+    wrongUsage(program_name);
+  }
+  return value;
+}
+
+auto parseOptions(int argc, char const *argv[]) -> Options {
+  Options options = {};
+  bool hasFile = false;
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    if (arg.starts_with("--assemble=")) {
+      options.imageFile = arg.substr(11);
+    } else if (arg.starts_with("--checkpoint=")) {
+      options.checkpointFile = arg.substr(13);
+    } else if (arg.starts_with("--checkpoint-every=")) {
+      options.checkpointSeconds = parseSize(argv[0], arg.substr(19));
+    } else if (arg.starts_with("--resume=")) {
+      options.resumeFile = arg.substr(9);
+    } else if (!arg.starts_with("--") && !hasFile) {
+      options.filename = arg;
+      hasFile = true;
+    } else {
+      wrongUsage(argv[0]);
+    }
+  }
+  if (!hasFile) {
+    wrongUsage(argv[0]);
+  }
+  return options;
+}
+
+auto assemble(std::string_view imageFile,
+              std::span<const vm::mama::Instr::Byte> code,
+              const std::vector<vm::common::Symbol> &symbols) -> int {
+  FILE *out = std::fopen(std::string(imageFile).c_str(), "wb");
+  if (out == nullptr) {
+    std::println(stderr, "Cannot open file: {}", imageFile);
+    return EXIT_FAILURE;
+  }
+  vm::image::writeImage(out, code, symbols);
+  std::fclose(out);
+  return EXIT_SUCCESS;
+}
+
+/// Set when the process is asked to terminate, to stop at a checkpoint.
+volatile std::sig_atomic_t isTerminating = 0;
+
+void requestCheckpoint(int /*signal*/) { isTerminating = 1; }
+
+/// Saves a checkpoint of `machine`, replacing `path` only once it is
+/// complete.
+auto saveCheckpoint(vm::mama::MaMa &machine, std::string_view path) -> bool {
+  // What the program printed so far is not part of the checkpoint.
+  std::fflush(machine.getOutFile());
+  std::string partial = std::string(path) + ".partial";
+  FILE *out = std::fopen(partial.c_str(), "wb");
+  if (out == nullptr) {
+    std::println(stderr, "Cannot open file: {}", partial);
+    return false;
+  }
+  machine.checkpoint(out);
+  bool isSaved = std::fclose(out) == 0 &&
+                 std::rename(partial.c_str(), std::string(path).c_str()) == 0;
+  if (!isSaved) {
+    std::println(stderr, "Cannot write checkpoint: {}", path);
+  }
+  return isSaved;
+}
+
+/// Runs the program, saving a checkpoint every `checkpointSeconds` and once
+/// more when the process gets SIGTERM, after which it stops. The checkpoint
+/// is removed when the program ends.
+auto runWithCheckpoints(vm::mama::MaMa &machine, const Options &options)
+    -> int {
+  using Clock = std::chrono::steady_clock;
+  constexpr std::int64_t stepsPerSlice = std::int64_t{1} << 20;
+  std::signal(SIGTERM, requestCheckpoint);
+  auto interval = std::chrono::seconds(
+      static_cast<std::int64_t>(options.checkpointSeconds));
+  auto next = Clock::now() + interval;
+  while (machine.runFor(stepsPerSlice)) {
+    if (isTerminating == 0 && Clock::now() < next) {
+      continue;
+    }
+    if (!saveCheckpoint(machine, options.checkpointFile)) {
+      return EXIT_FAILURE;
+    }
+    if (isTerminating != 0) {
+      std::println(stderr, "Stopped at checkpoint {}", options.checkpointFile);
+      return EXIT_FAILURE;
+    }
+    next = Clock::now() + interval;
+  }
+  std::remove(std::string(options.checkpointFile).c_str());
+  return *machine.getExitStatus();
+}
+
+auto run(const Options &options) -> int {
+  using vm::image::Image;
   using vm::mama::MaMa;
 
-  const std::string text = readFile(filename);
+  // Images are executed in place, text is parsed.
+  const vm::image::MappedFile file(options.filename);
+  bool isImage = vm::image::isImage(file.bytes());
+  std::vector<vm::mama::Instr::Byte> parsed = {};
+  std::span<vm::mama::Instr::Byte> instructions = {};
+  if (isImage) {
+    instructions = Image(file.bytes()).mamaCode();
+  } else {
+    parsed = MaMa::loadInstructions(file.text());
+    instructions = parsed;
+  }
 
-  std::vector instructions = MaMa::loadInstructions(text);
+  if (!options.imageFile.empty()) {
+    auto symbols = isImage ? Image(file.bytes()).symbols()
+                           : MaMa::loadSymbols(file.text());
+    return assemble(options.imageFile, instructions, symbols);
+  }
   auto machine = MaMa(instructions, stdout);
-  int exit = machine.run();
+  if (!options.resumeFile.empty()) {
+    FILE *in = std::fopen(std::string(options.resumeFile).c_str(), "rb");
+    if (in == nullptr) {
+      std::println(stderr, "Cannot open file: {}", options.resumeFile);
+      return EXIT_FAILURE;
+    }
+    machine.restore(in);
+    std::fclose(in);
+  }
+  int exit = options.checkpointFile.empty()
+                 ? machine.run()
+                 : runWithCheckpoints(machine, options);
+  std::fflush(stdout);
   return exit;
 }
 
@@ -31,11 +181,7 @@ auto run(std::string_view filename) -> int {
 
 auto main(int argc, char const *argv[]) -> int {
   try {
-    if (argc != 2) {
-      wrongUsage(argv[0]);
-    }
-    std::string_view filename = argv[1];
-    run(filename);
+    return run(parseOptions(argc, argv));
   } catch (...) {
     return EXIT_FAILURE;
   }